@@ -0,0 +1,96 @@
+#include "aead_engine.h"
+#include "crypto.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using securefs::AeadBackend;
+
+namespace
+{
+// Each iteration processes a batch of blocks as large as a typical FUSE write.
+constexpr size_t kBatchSize = 128 << 10;
+constexpr size_t kIvSize = 12;
+constexpr size_t kAadSize = 32;
+
+template <bool Encrypt>
+void benchmark_aes_gcm(benchmark::State& state)
+{
+    auto backend = static_cast<AeadBackend>(state.range(0));
+    auto block_size = static_cast<size_t>(state.range(1));
+    state.SetLabel(securefs::stringify(backend));
+    if (!securefs::is_aead_backend_supported(backend))
+    {
+        state.SkipWithError("Not supported by this CPU");
+        return;
+    }
+
+    byte key[32];
+    securefs::generate_random(key, sizeof(key));
+    auto engine = securefs::make_aes_gcm_engine(key, sizeof(key), kIvSize, backend);
+
+    size_t count = std::max<size_t>(1, kBatchSize / block_size);
+    std::vector<byte> plaintext(count * block_size), ciphertext(plaintext.size());
+    std::vector<byte> ivs(count * kIvSize), aad(count * kAadSize);
+    std::vector<byte> macs(count * securefs::AeadEngine::MAC_SIZE);
+    securefs::generate_random(plaintext.data(), plaintext.size());
+    securefs::generate_random(ivs.data(), ivs.size());
+    securefs::generate_random(aad.data(), aad.size());
+
+    std::vector<securefs::GCMMessage> encryptions, decryptions;
+    for (size_t i = 0; i < count; ++i)
+    {
+        encryptions.push_back({ivs.data() + i * kIvSize,
+                               aad.data() + i * kAadSize,
+                               kAadSize,
+                               plaintext.data() + i * block_size,
+                               ciphertext.data() + i * block_size,
+                               block_size,
+                               macs.data() + i * securefs::AeadEngine::MAC_SIZE});
+        decryptions.push_back(encryptions.back());
+        decryptions.back().input = ciphertext.data() + i * block_size;
+        decryptions.back().output = plaintext.data() + i * block_size;
+    }
+    engine->encrypt(encryptions);
+
+    for (auto _ : state)
+    {
+        if (Encrypt)
+        {
+            engine->encrypt(encryptions);
+        }
+        else if (engine->decrypt(decryptions) != count)
+        {
+            state.SkipWithError("Decryption failed to verify");
+            return;
+        }
+        benchmark::ClobberMemory();
+    }
+    auto bytes = static_cast<int64_t>(state.iterations() * plaintext.size());
+    state.SetBytesProcessed(bytes);
+    state.counters["GB"] = benchmark::Counter(static_cast<double>(bytes) / 1e9,
+                                                benchmark::Counter::kIsRate);
+}
+
+void backends_and_block_sizes(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({"backend", "block_size"});
+    for (AeadBackend backend : {AeadBackend::kCryptoPP, AeadBackend::kAesni, AeadBackend::kVaes})
+    {
+        for (int64_t block_size : {256, 1024, 4096, 16384, 65536})
+        {
+            b->Args({static_cast<int64_t>(backend), block_size});
+        }
+    }
+}
+}    // namespace
+
+BENCHMARK_TEMPLATE(benchmark_aes_gcm, true)
+    ->Name("aes_gcm_encrypt")
+    ->Apply(backends_and_block_sizes);
+BENCHMARK_TEMPLATE(benchmark_aes_gcm, false)
+    ->Name("aes_gcm_decrypt")
+    ->Apply(backends_and_block_sizes);
@@ -0,0 +1,64 @@
+#include "crypto.h"
+#include "mystring.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <string>
+
+using securefs::internal::Base32Kernel;
+
+namespace
+{
+template <bool Encode>
+void benchmark_base32(benchmark::State& state)
+{
+    auto kernel = static_cast<Base32Kernel>(state.range(0));
+    auto size = static_cast<size_t>(state.range(1));
+    state.SetLabel(securefs::internal::stringify(kernel));
+    if (!securefs::internal::is_base32_kernel_supported(kernel))
+    {
+        state.SkipWithError("Not supported by this CPU");
+        return;
+    }
+
+    std::string input(size, '\0'), encoded, decoded;
+    securefs::generate_random(&input[0], input.size());
+    securefs::internal::base32_encode(
+        kernel, reinterpret_cast<const byte*>(input.data()), input.size(), encoded);
+    for (auto _ : state)
+    {
+        if (Encode)
+        {
+            securefs::internal::base32_encode(
+                kernel, reinterpret_cast<const byte*>(input.data()), input.size(), encoded);
+            benchmark::DoNotOptimize(encoded.data());
+        }
+        else
+        {
+            securefs::internal::base32_decode(kernel, encoded.data(), encoded.size(), decoded);
+            benchmark::DoNotOptimize(decoded.data());
+        }
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size));
+}
+
+// The sizes of encrypted names, from short ones to the longest that fit in a component.
+void kernels_and_sizes(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({"kernel", "size"});
+    for (Base32Kernel kernel : {Base32Kernel::kReference,
+                                Base32Kernel::kScalar,
+                                Base32Kernel::kSsse3,
+                                Base32Kernel::kAvx2})
+    {
+        for (int64_t size : {24, 48, 96, 158})
+        {
+            b->Args({static_cast<int64_t>(kernel), size});
+        }
+    }
+}
+}    // namespace
+
+BENCHMARK_TEMPLATE(benchmark_base32, true)->Name("base32_encode")->Apply(kernels_and_sizes);
+BENCHMARK_TEMPLATE(benchmark_base32, false)->Name("base32_decode")->Apply(kernels_and_sizes);
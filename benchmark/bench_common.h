@@ -0,0 +1,68 @@
+#pragma once
+
+#include "platform.h"
+#include "streams.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace securefs::bench
+{
+// Keeps the cost of the underlying storage out of the stream benchmarks.
+class MemoryStream final : public StreamBase
+{
+private:
+    std::vector<unsigned char> m_buffer;
+
+public:
+    length_type read(void* output, offset_type offset, length_type length) override
+    {
+        if (offset >= m_buffer.size())
+        {
+            return 0;
+        }
+        auto read_sz = std::min<length_type>(length, m_buffer.size() - offset);
+        memcpy(output, m_buffer.data() + offset, read_sz);
+        return read_sz;
+    }
+
+    void write(const void* input, offset_type offset, length_type length) override
+    {
+        if (offset + length > m_buffer.size())
+        {
+            m_buffer.resize(offset + length);
+        }
+        memcpy(m_buffer.data() + offset, input, length);
+    }
+
+    length_type size() const override { return m_buffer.size(); }
+
+    void flush() override {}
+
+    void resize(length_type size) override { m_buffer.resize(size); }
+
+    bool is_sparse() const noexcept override { return false; }
+};
+
+// A directory under the current one for benchmarks that need real files, removed with everything
+// in it on destruction.
+class TempDirectory
+{
+public:
+    TempDirectory() : m_path(OSService::temp_name("securefs-bench-", ".tmp"))
+    {
+        OSService::get_default().ensure_directory(m_path, 0755);
+    }
+
+    ~TempDirectory() { OSService::get_default().remove_recursively_nothrow(m_path); }
+
+    DISABLE_COPY_MOVE(TempDirectory)
+
+    const std::string& path() const noexcept { return m_path; }
+
+private:
+    std::string m_path;
+};
+}    // namespace securefs::bench
@@ -0,0 +1,127 @@
+#include "bench_common.h"
+#include "btree_dir.h"
+#include "crypto.h"
+#include "files.h"
+#include "myutils.h"
+#include "mystring.h"
+#include "platform.h"
+
+#include <absl/strings/str_cat.h>
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+// A directory of random names on real files. Building one with a million entries takes a while, so
+// each size is built once and shared by all the benchmarks.
+struct BtreeFixture
+{
+    securefs::bench::TempDirectory temp_dir;
+    securefs::FileKeyCache key_cache;
+    std::unique_ptr<securefs::BtreeDirectory> dir;
+    std::vector<std::string> names;
+
+    explicit BtreeFixture(size_t size)
+    {
+        securefs::key_type key;
+        securefs::generate_random(key.data(), key.size());
+        securefs::OSService service(temp_dir.path());
+        int flags = O_RDWR | O_CREAT | O_EXCL;
+        dir = std::make_unique<securefs::BtreeDirectory>(
+            securefs::Directory::DirNameComparison{&securefs::binary_compare},
+            service.open_file_stream("data", flags, 0644),
+            service.open_file_stream("meta", flags, 0644),
+            key,
+            securefs::id_type{},
+            true,
+            4096,
+            12,
+            0,
+            false,
+            key_cache);
+
+        securefs::FileLockGuard lg(*dir);
+        for (size_t i = 0; i < size; ++i)
+        {
+            byte random[12];
+            securefs::generate_random(random, sizeof(random));
+            names.push_back(securefs::hexify(random, sizeof(random)));
+            dir->add_entry(names.back(), securefs::id_type{}, securefs::FileBase::REGULAR_FILE);
+        }
+        dir->flush();
+    }
+};
+
+BtreeFixture& get_fixture(size_t size)
+{
+    static std::map<size_t, std::unique_ptr<BtreeFixture>> fixtures;
+    auto& fixture = fixtures[size];
+    if (!fixture)
+    {
+        fixture = std::make_unique<BtreeFixture>(size);
+    }
+    return *fixture;
+}
+
+// Each inserted entry is removed again outside of the timing, so that the size stays the same.
+void benchmark_btree_insert(benchmark::State& state)
+{
+    auto& fixture = get_fixture(static_cast<size_t>(state.range(0)));
+    securefs::FileLockGuard lg(*fixture.dir);
+    securefs::id_type id{};
+    int type;
+    size_t counter = 0;
+    for (auto _ : state)
+    {
+        auto name = absl::StrCat("new-", counter++);
+        fixture.dir->add_entry(name, id, securefs::FileBase::REGULAR_FILE);
+        state.PauseTiming();
+        fixture.dir->remove_entry(name, id, type);
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+void benchmark_btree_lookup(benchmark::State& state)
+{
+    auto& fixture = get_fixture(static_cast<size_t>(state.range(0)));
+    securefs::FileLockGuard lg(*fixture.dir);
+    std::mt19937 rng(state.range(0));
+    securefs::id_type id;
+    int type;
+    for (auto _ : state)
+    {
+        const auto& name = fixture.names[rng() % fixture.names.size()];
+        benchmark::DoNotOptimize(fixture.dir->get_entry(name, id, type));
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+void benchmark_btree_iterate(benchmark::State& state)
+{
+    auto& fixture = get_fixture(static_cast<size_t>(state.range(0)));
+    securefs::FileLockGuard lg(*fixture.dir);
+    for (auto _ : state)
+    {
+        size_t count = 0;
+        fixture.dir->iterate_over_entries([&](const std::string&, const securefs::id_type&, int)
+                                          { ++count; });
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * fixture.names.size()));
+}
+}    // namespace
+
+BENCHMARK(benchmark_btree_insert)->ArgName("entries")->RangeMultiplier(10)->Range(1000, 1000000);
+BENCHMARK(benchmark_btree_lookup)->ArgName("entries")->RangeMultiplier(10)->Range(1000, 1000000);
+BENCHMARK(benchmark_btree_iterate)
+    ->ArgName("entries")
+    ->RangeMultiplier(10)
+    ->Range(1000, 1000000)
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,107 @@
+#include "bench_common.h"
+#include "btree_dir.h"
+#include "crypto.h"
+#include "file_table_v2.h"
+#include "files.h"
+#include "lock_guard.h"
+#include "mystring.h"
+#include "platform.h"
+#include "tags.h"
+
+#include <absl/synchronization/mutex.h>
+#include <benchmark/benchmark.h>
+#include <fruit/fruit.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+using securefs::full_format::FileTable;
+
+namespace
+{
+fruit::Component<FileTable> get_table_component(securefs::OSService* root)
+{
+    return fruit::createComponent()
+        .install(securefs::full_format::get_table_io_component, false)
+        .registerProvider<fruit::Annotated<securefs::tReadOnly, bool>()>([]() { return false; })
+        .registerProvider<fruit::Annotated<securefs::tVerify, bool>()>([]() { return true; })
+        .registerProvider<fruit::Annotated<securefs::tStoreTimeWithinFs, bool>()>(
+            []() { return false; })
+        .registerProvider<fruit::Annotated<securefs::tMaxPaddingSize, unsigned>()>(
+            []() { return 0u; })
+        .registerProvider<fruit::Annotated<securefs::tIvSize, unsigned>()>([]() { return 12u; })
+        .registerProvider<fruit::Annotated<securefs::tBlockSize, unsigned>()>(
+            []() { return 4096u; })
+        .registerProvider<fruit::Annotated<securefs::tMasterKey, securefs::key_type>()>(
+            []()
+            {
+                securefs::key_type key;
+                securefs::generate_random(key.data(), key.size());
+                return key;
+            })
+        .bind<securefs::Directory, securefs::BtreeDirectory>()
+        .registerProvider(
+            []() { return securefs::Directory::DirNameComparison{&securefs::binary_compare}; })
+        .bindInstance(*root);
+}
+
+// A table over `size` regular files. Shared by all the threads and runs of the same size.
+struct TableFixture
+{
+    securefs::bench::TempDirectory temp_dir;
+    securefs::OSService root{temp_dir.path()};
+    fruit::Injector<FileTable> injector{get_table_component, &root};
+    std::vector<securefs::id_type> ids;
+
+    explicit TableFixture(size_t size)
+    {
+        auto&& table = injector.get<FileTable&>();
+        for (size_t i = 0; i < size; ++i)
+        {
+            auto holder = table.create_as(securefs::FileBase::REGULAR_FILE);
+            securefs::FileLockGuard lg(*holder);
+            holder->initialize_empty(0644 | S_IFREG, 0, 0);
+            ids.push_back(holder->get_id());
+        }
+    }
+};
+
+TableFixture& get_fixture(size_t size)
+{
+    static absl::Mutex mu;
+    static std::map<size_t, std::unique_ptr<TableFixture>> fixtures;
+    securefs::LockGuard<absl::Mutex> lg(mu);
+    auto& fixture = fixtures[size];
+    if (!fixture)
+    {
+        fixture = std::make_unique<TableFixture>(size);
+    }
+    return *fixture;
+}
+
+// Opens and closes the files in turn. With few files, they all stay in the table's cache of
+// closed files; with many, most opens construct the file from its streams again.
+void benchmark_file_table_churn(benchmark::State& state)
+{
+    auto& fixture = get_fixture(static_cast<size_t>(state.range(0)));
+    auto&& table = fixture.injector.get<FileTable&>();
+    size_t index = static_cast<size_t>(state.thread_index()) * 7919;
+    for (auto _ : state)
+    {
+        const auto& id = fixture.ids[index++ % fixture.ids.size()];
+        auto holder = table.open_as(id, securefs::FileBase::REGULAR_FILE);
+        benchmark::DoNotOptimize(holder.get());
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+}    // namespace
+
+BENCHMARK(benchmark_file_table_churn)
+    ->ArgName("files")
+    ->Arg(16)
+    ->Arg(512)
+    ->Arg(8192)
+    ->ThreadRange(1, 8)
+    ->UseRealTime();
@@ -0,0 +1,93 @@
+#include "crypto.h"
+#include "lite_format.h"
+#include "tags.h"
+
+#include <benchmark/benchmark.h>
+#include <fruit/fruit.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace
+{
+template <bool Encrypt>
+void benchmark_aes_siv(benchmark::State& state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    byte key[64];
+    securefs::generate_random(key, sizeof(key));
+    securefs::AES_SIV siv(key, sizeof(key));
+
+    std::vector<byte> plaintext(size), ciphertext(size);
+    byte iv[securefs::AES_SIV::IV_SIZE];
+    securefs::generate_random(plaintext.data(), plaintext.size());
+    siv.encrypt_and_authenticate(plaintext.data(), size, nullptr, 0, ciphertext.data(), iv);
+    for (auto _ : state)
+    {
+        if (Encrypt)
+        {
+            siv.encrypt_and_authenticate(plaintext.data(), size, nullptr, 0, ciphertext.data(), iv);
+            benchmark::DoNotOptimize(ciphertext.data());
+        }
+        else
+        {
+            benchmark::DoNotOptimize(siv.decrypt_and_verify(
+                ciphertext.data(), size, nullptr, 0, plaintext.data(), iv));
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+
+fruit::Component<securefs::lite_format::NameTranslator> get_translator_component()
+{
+    return fruit::createComponent()
+        .registerProvider(
+            []()
+            {
+                securefs::lite_format::NameNormalizationFlags flags{};
+                flags.long_name_threshold = 128;
+                return flags;
+            })
+        .registerProvider<fruit::Annotated<securefs::tNameMasterKey, securefs::key_type>()>(
+            []()
+            {
+                securefs::key_type key;
+                securefs::generate_random(key.data(), key.size());
+                return key;
+            })
+        .install(securefs::lite_format::get_name_translator_component);
+}
+
+void benchmark_encrypt_full_path(benchmark::State& state)
+{
+    auto depth = static_cast<size_t>(state.range(0));
+    auto component_size = static_cast<size_t>(state.range(1));
+    std::string path;
+    for (size_t i = 0; i < depth; ++i)
+    {
+        path.push_back('/');
+        path.append(component_size, static_cast<char>('a' + i % 26));
+    }
+
+    fruit::Injector<securefs::lite_format::NameTranslator> injector(get_translator_component);
+    auto&& translator = injector.get<securefs::lite_format::NameTranslator&>();
+    std::string encrypted_last_component;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(translator.encrypt_full_path(path, &encrypted_last_component));
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations()));
+}
+}    // namespace
+
+BENCHMARK(benchmark_aes_siv<true>)->ArgName("size")->Arg(8)->Arg(32)->Arg(100)->Arg(255);
+BENCHMARK(benchmark_aes_siv<false>)->ArgName("size")->Arg(8)->Arg(32)->Arg(100)->Arg(255);
+// The last shape has components above the long name threshold.
+BENCHMARK(benchmark_encrypt_full_path)
+    ->ArgNames({"depth", "component"})
+    ->Args({1, 12})
+    ->Args({4, 12})
+    ->Args({16, 12})
+    ->Args({4, 64})
+    ->Args({4, 200});
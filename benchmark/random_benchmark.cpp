@@ -0,0 +1,36 @@
+#include "crypto.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+
+namespace
+{
+// The OS backed generator used for keys, as the baseline of the IV generator.
+void benchmark_generate_random(benchmark::State& state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    byte buffer[64];
+    for (auto _ : state)
+    {
+        securefs::generate_random(buffer, size);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size));
+}
+
+void benchmark_generate_iv(benchmark::State& state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    byte buffer[64];
+    for (auto _ : state)
+    {
+        securefs::generate_iv(buffer, size);
+        benchmark::DoNotOptimize(buffer);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size));
+}
+}    // namespace
+
+BENCHMARK(benchmark_generate_random)->ArgName("size")->Arg(12)->Arg(16)->Arg(32)->ThreadRange(1, 8);
+BENCHMARK(benchmark_generate_iv)->ArgName("size")->Arg(12)->Arg(16)->Arg(32)->ThreadRange(1, 8);
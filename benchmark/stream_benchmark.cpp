@@ -0,0 +1,174 @@
+#include "bench_common.h"
+#include "crypto.h"
+#include "lite_stream.h"
+#include "streams.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+using securefs::length_type;
+using securefs::offset_type;
+
+namespace
+{
+// Each iteration reads or writes as much as a typical FUSE request, cycling through a file that
+// was filled beforehand.
+constexpr size_t kIoSize = 128 << 10;
+constexpr size_t kFileSize = 4 << 20;
+
+std::shared_ptr<securefs::StreamBase> make_lite_stream(unsigned block_size, unsigned iv_size)
+{
+    securefs::key_type key;
+    securefs::generate_random(key.data(), key.size());
+    return std::make_shared<securefs::lite::AESGCMCryptStream>(
+        std::make_shared<securefs::bench::MemoryStream>(), key, block_size, iv_size);
+}
+
+std::shared_ptr<securefs::StreamBase> make_full_stream(unsigned block_size, unsigned iv_size)
+{
+    securefs::key_type key;
+    securefs::id_type id;
+    securefs::generate_random(key.data(), key.size());
+    securefs::generate_random(id.data(), id.size());
+    return securefs::make_cryptstream_aes_gcm(std::make_shared<securefs::bench::MemoryStream>(),
+                                              std::make_shared<securefs::bench::MemoryStream>(),
+                                              key,
+                                              key,
+                                              id,
+                                              true,
+                                              block_size,
+                                              iv_size)
+        .first;
+}
+
+template <bool Write>
+void run_crypt_stream(benchmark::State& state, securefs::StreamBase& stream)
+{
+    std::vector<byte> buffer(kIoSize);
+    securefs::generate_random(buffer.data(), buffer.size());
+    for (size_t offset = 0; offset < kFileSize; offset += kIoSize)
+    {
+        stream.write(buffer.data(), offset, kIoSize);
+    }
+
+    size_t offset = 0;
+    for (auto _ : state)
+    {
+        if (Write)
+        {
+            stream.write(buffer.data(), offset, kIoSize);
+        }
+        else
+        {
+            benchmark::DoNotOptimize(stream.read(buffer.data(), offset, kIoSize));
+        }
+        offset = (offset + kIoSize) % kFileSize;
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * kIoSize));
+}
+
+template <bool Write>
+void benchmark_lite_stream(benchmark::State& state)
+{
+    auto stream = make_lite_stream(static_cast<unsigned>(state.range(0)),
+                                   static_cast<unsigned>(state.range(1)));
+    run_crypt_stream<Write>(state, *stream);
+}
+
+template <bool Write>
+void benchmark_full_stream(benchmark::State& state)
+{
+    auto stream = make_full_stream(static_cast<unsigned>(state.range(0)),
+                                   static_cast<unsigned>(state.range(1)));
+    run_crypt_stream<Write>(state, *stream);
+}
+
+void block_and_iv_sizes(benchmark::internal::Benchmark* b)
+{
+    b->ArgNames({"block", "iv"});
+    for (int block_size : {1024, 4096, 16384})
+    {
+        for (int iv_size : {12, 32})
+        {
+            b->Args({block_size, iv_size});
+        }
+    }
+}
+
+// Only the block arithmetic of `BlockBasedStream`, over blocks that are simply copied.
+class PlainBlockStream final : public securefs::BlockBasedStream
+{
+public:
+    explicit PlainBlockStream(length_type block_size) : BlockBasedStream(block_size) {}
+
+    length_type size() const override { return m_data.size(); }
+    void flush() override {}
+    bool is_sparse() const noexcept override { return false; }
+
+protected:
+    length_type
+    read_multi_blocks(offset_type start_block, offset_type end_block, void* output) override
+    {
+        auto begin = std::min<length_type>(start_block * m_block_size, m_data.size());
+        auto end = std::min<length_type>(end_block * m_block_size, m_data.size());
+        memcpy(output, m_data.data() + begin, end - begin);
+        return end - begin;
+    }
+
+    void write_multi_blocks(offset_type start_block,
+                            offset_type end_block,
+                            offset_type end_residue,
+                            const void* input) override
+    {
+        auto begin = start_block * m_block_size;
+        auto end = end_block * m_block_size + end_residue;
+        if (end > m_data.size())
+        {
+            m_data.resize(end);
+        }
+        memcpy(m_data.data() + begin, input, end - begin);
+    }
+
+    void adjust_logical_size(length_type length) override { m_data.resize(length); }
+
+private:
+    std::vector<byte> m_data;
+};
+
+void benchmark_block_stream_unaligned_write(benchmark::State& state)
+{
+    auto size = static_cast<size_t>(state.range(0));
+    PlainBlockStream stream(4096);
+    std::vector<byte> buffer(std::max(size, kIoSize));
+    securefs::generate_random(buffer.data(), buffer.size());
+    for (size_t offset = 0; offset < kFileSize; offset += kIoSize)
+    {
+        stream.write(buffer.data(), offset, kIoSize);
+    }
+
+    // A stride coprime with the block size, so that every residue of the offset occurs.
+    size_t offset = 17;
+    for (auto _ : state)
+    {
+        stream.write(buffer.data(), offset, size);
+        offset = (offset + 4099) % (kFileSize - size);
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * size));
+}
+}    // namespace
+
+BENCHMARK(benchmark_lite_stream<false>)->Apply(block_and_iv_sizes);
+BENCHMARK(benchmark_lite_stream<true>)->Apply(block_and_iv_sizes);
+BENCHMARK(benchmark_full_stream<false>)->Apply(block_and_iv_sizes);
+BENCHMARK(benchmark_full_stream<true>)->Apply(block_and_iv_sizes);
+BENCHMARK(benchmark_block_stream_unaligned_write)
+    ->ArgName("size")
+    ->Arg(100)
+    ->Arg(1000)
+    ->Arg(5000)
+    ->Arg(65537);
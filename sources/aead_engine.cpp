@@ -0,0 +1,256 @@
+#include "aead_engine.h"
+#include "exceptions.h"
+#include "metrics.h"
+#include "myutils.h"
+
+#include <absl/strings/str_cat.h>
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/secblock.h>
+
+#include <atomic>
+
+namespace securefs
+{
+namespace
+{
+    uint64_t total_size(absl::Span<const GCMMessage> messages) noexcept
+    {
+        uint64_t total = 0;
+        for (const GCMMessage& m : messages)
+        {
+            total += m.size;
+        }
+        return total;
+    }
+
+    // Crypto++ with the largest GHASH tables, for CPUs without carry-less multiplication. With it,
+    // Crypto++ uses the instruction instead and the table size does not matter.
+    class CryptoPPEngine final : public AeadEngine
+    {
+    private:
+        CryptoPP::GCM<CryptoPP::AES, CryptoPP::GCM_64K_Tables>::Encryption m_encryptor;
+        CryptoPP::GCM<CryptoPP::AES, CryptoPP::GCM_64K_Tables>::Decryption m_decryptor;
+        int m_iv_size;
+
+    public:
+        explicit CryptoPPEngine(const byte* key, size_t key_size, size_t iv_size)
+            : m_iv_size(static_cast<int>(iv_size))
+        {
+            // The null iv is only a placeholder; it will replaced during encryption and decryption
+            const byte null_iv[12] = {0};
+            m_encryptor.SetKeyWithIV(key, key_size, null_iv, array_length(null_iv));
+            m_decryptor.SetKeyWithIV(key, key_size, null_iv, array_length(null_iv));
+        }
+
+        AeadBackend backend() const noexcept override { return AeadBackend::kCryptoPP; }
+
+        void encrypt(absl::Span<const GCMMessage> messages) override
+        {
+            metrics::increment(MetricCounter::kBytesEncrypted, total_size(messages));
+            for (const GCMMessage& m : messages)
+            {
+                m_encryptor.EncryptAndAuthenticate(m.output,
+                                                   m.mac,
+                                                   MAC_SIZE,
+                                                   m.iv,
+                                                   m_iv_size,
+                                                   m.aad,
+                                                   m.aad_size,
+                                                   m.input,
+                                                   m.size);
+            }
+        }
+
+        size_t decrypt(absl::Span<const GCMMessage> messages) override
+        {
+            metrics::increment(MetricCounter::kBytesDecrypted, total_size(messages));
+            size_t first_failure = messages.size();
+            for (size_t i = 0; i < messages.size(); ++i)
+            {
+                const GCMMessage& m = messages[i];
+                bool success = m_decryptor.DecryptAndVerify(m.output,
+                                                            m.mac,
+                                                            MAC_SIZE,
+                                                            m.iv,
+                                                            m_iv_size,
+                                                            m.aad,
+                                                            m.aad_size,
+                                                            m.input,
+                                                            m.size);
+                if (!success && first_failure == messages.size())
+                {
+                    first_failure = i;
+                }
+            }
+            return first_failure;
+        }
+    };
+
+    // The multi-lane kernels of `gcm_aesni.h`, which differ only in the register width.
+    template <AeadBackend Backend>
+    class X86Engine final : public AeadEngine
+    {
+    private:
+        aesni_gcm::Key m_key;
+        size_t m_iv_size;
+
+    public:
+        explicit X86Engine(const byte* key, size_t key_size, size_t iv_size) : m_iv_size(iv_size)
+        {
+            aesni_gcm::init_key(m_key, key, key_size);
+        }
+
+        ~X86Engine() override
+        {
+            CryptoPP::SecureWipeBuffer(m_key.round_keys, sizeof(m_key.round_keys));
+            CryptoPP::SecureWipeBuffer(m_key.hash_key, sizeof(m_key.hash_key));
+        }
+
+        AeadBackend backend() const noexcept override { return Backend; }
+
+        void encrypt(absl::Span<const GCMMessage> messages) override
+        {
+            metrics::increment(MetricCounter::kBytesEncrypted, total_size(messages));
+            if (Backend == AeadBackend::kVaes)
+            {
+                vaes_gcm::encrypt(m_key, m_iv_size, messages.data(), messages.size());
+            }
+            else
+            {
+                aesni_gcm::encrypt(m_key, m_iv_size, messages.data(), messages.size());
+            }
+        }
+
+        size_t decrypt(absl::Span<const GCMMessage> messages) override
+        {
+            metrics::increment(MetricCounter::kBytesDecrypted, total_size(messages));
+            if (Backend == AeadBackend::kVaes)
+            {
+                return vaes_gcm::decrypt(m_key, m_iv_size, messages.data(), messages.size());
+            }
+            return aesni_gcm::decrypt(m_key, m_iv_size, messages.data(), messages.size());
+        }
+    };
+
+    AeadBackend fastest_supported_backend() noexcept
+    {
+        static const AeadBackend backend = []()
+        {
+            if (vaes_gcm::is_supported())
+            {
+                return AeadBackend::kVaes;
+            }
+            if (aesni_gcm::is_supported())
+            {
+                return AeadBackend::kAesni;
+            }
+            return AeadBackend::kCryptoPP;
+        }();
+        return backend;
+    }
+
+    std::atomic<AeadBackend> default_backend{AeadBackend::kAuto};
+}    // namespace
+
+const char* stringify(AeadBackend backend)
+{
+    switch (backend)
+    {
+    case AeadBackend::kAuto:
+        return "auto";
+    case AeadBackend::kCryptoPP:
+        return "cryptopp";
+    case AeadBackend::kAesni:
+        return "aesni";
+    case AeadBackend::kVaes:
+        return "vaes";
+    }
+    return "UNKNOWN";
+}
+
+AeadBackend parse_aead_backend(std::string_view name)
+{
+    for (AeadBackend backend :
+         {AeadBackend::kAuto, AeadBackend::kCryptoPP, AeadBackend::kAesni, AeadBackend::kVaes})
+    {
+        if (name == stringify(backend))
+        {
+            return backend;
+        }
+    }
+    throwInvalidArgumentException(absl::StrCat("Unknown AEAD backend ", name));
+}
+
+bool is_aead_backend_supported(AeadBackend backend) noexcept
+{
+    switch (backend)
+    {
+    case AeadBackend::kAuto:
+    case AeadBackend::kCryptoPP:
+        return true;
+    case AeadBackend::kAesni:
+        return aesni_gcm::is_supported();
+    case AeadBackend::kVaes:
+        return vaes_gcm::is_supported();
+    }
+    return false;
+}
+
+std::vector<AeadBackend> supported_aead_backends()
+{
+    std::vector<AeadBackend> result;
+    for (AeadBackend backend : {AeadBackend::kCryptoPP, AeadBackend::kAesni, AeadBackend::kVaes})
+    {
+        if (is_aead_backend_supported(backend))
+        {
+            result.push_back(backend);
+        }
+    }
+    return result;
+}
+
+void set_default_aead_backend(AeadBackend backend)
+{
+    if (!is_aead_backend_supported(backend))
+    {
+        throwInvalidArgumentException(
+            absl::StrCat("The CPU does not support the AEAD backend ", stringify(backend)));
+    }
+    default_backend.store(backend, std::memory_order_relaxed);
+}
+
+AeadBackend get_default_aead_backend() noexcept
+{
+    AeadBackend backend = default_backend.load(std::memory_order_relaxed);
+    return backend == AeadBackend::kAuto ? fastest_supported_backend() : backend;
+}
+
+std::unique_ptr<AeadEngine>
+make_aes_gcm_engine(const void* key, size_t key_size, size_t iv_size, AeadBackend backend)
+{
+    if (key_size != 16 && key_size != 24 && key_size != 32)
+    {
+        throwInvalidArgumentException("Invalid AES key size");
+    }
+    if (backend == AeadBackend::kAuto)
+    {
+        backend = get_default_aead_backend();
+    }
+    if (!is_aead_backend_supported(backend))
+    {
+        throwInvalidArgumentException(
+            absl::StrCat("The CPU does not support the AEAD backend ", stringify(backend)));
+    }
+    auto raw_key = static_cast<const byte*>(key);
+    switch (backend)
+    {
+    case AeadBackend::kAesni:
+        return std::make_unique<X86Engine<AeadBackend::kAesni>>(raw_key, key_size, iv_size);
+    case AeadBackend::kVaes:
+        return std::make_unique<X86Engine<AeadBackend::kVaes>>(raw_key, key_size, iv_size);
+    default:
+        return std::make_unique<CryptoPPEngine>(raw_key, key_size, iv_size);
+    }
+}
+}    // namespace securefs
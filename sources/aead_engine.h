@@ -0,0 +1,62 @@
+#pragma once
+
+#include "gcm_aesni.h"
+
+#include <absl/types/span.h>
+
+#include <memory>
+#include <stddef.h>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+enum class AeadBackend : unsigned char
+{
+    // Resolved to the fastest backend the CPU supports.
+    kAuto = 0,
+    kCryptoPP = 1,
+    kAesni = 2,
+    kVaes = 3,
+};
+
+const char* stringify(AeadBackend backend);
+
+/// Accepts the strings returned by `stringify()`.
+AeadBackend parse_aead_backend(std::string_view name);
+
+bool is_aead_backend_supported(AeadBackend backend) noexcept;
+
+/// The concrete backends usable on this CPU, from the slowest to the fastest.
+std::vector<AeadBackend> supported_aead_backends();
+
+/// The backend of engines created without an explicit one. It should be set at most once at
+/// startup, before any engine is created, and must be supported by the CPU.
+void set_default_aead_backend(AeadBackend backend);
+/// Never returns `kAuto`.
+AeadBackend get_default_aead_backend() noexcept;
+
+/// AES-GCM with 16 byte tags over batches of messages that share one key and IV size, such as the
+/// blocks of a crypt stream. All the backends produce identical output. An engine is not safe to
+/// use from multiple threads concurrently.
+class AeadEngine
+{
+public:
+    static constexpr size_t MAC_SIZE = 16;
+
+    virtual ~AeadEngine() = default;
+
+    virtual AeadBackend backend() const noexcept = 0;
+
+    virtual void encrypt(absl::Span<const GCMMessage> messages) = 0;
+
+    /// Decrypts all the messages even if some fail to verify. Returns the index of the first one
+    /// that fails, or `messages.size()` if all are authentic.
+    virtual size_t decrypt(absl::Span<const GCMMessage> messages) = 0;
+};
+
+std::unique_ptr<AeadEngine> make_aes_gcm_engine(const void* key,
+                                                size_t key_size,
+                                                size_t iv_size,
+                                                AeadBackend backend = AeadBackend::kAuto);
+}    // namespace securefs
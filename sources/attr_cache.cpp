@@ -0,0 +1,156 @@
+#include "attr_cache.h"
+#include "lock_guard.h"
+#include "metrics.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+bool AttrCache::lookup(std::string_view key, fuse_stat* st)
+{
+    if (!enabled())
+    {
+        return false;
+    }
+    LockGuard<absl::Mutex> lg(mu_, false);
+    auto it = entries_.find(key);
+    if (it == entries_.end() || it->second.expiry < absl::Now())
+    {
+        metrics::increment(MetricCounter::kAttrCacheMisses);
+        return false;
+    }
+    *st = it->second.st;
+    metrics::increment(MetricCounter::kAttrCacheHits);
+    return true;
+}
+
+uint64_t AttrCache::begin_fill()
+{
+    LockGuard<absl::Mutex> lg(mu_, false);
+    return generation_;
+}
+
+void AttrCache::fill(uint64_t ticket, std::string key, const fuse_stat& st)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    if ((st.st_mode & S_IFMT) != S_IFDIR && st.st_nlink > 1)
+    {
+        // A mutation through another name could not be matched to this entry.
+        return;
+    }
+    auto expiry = absl::Now() + ttl_;
+    LockGuard<absl::Mutex> lg(mu_);
+    if (ticket != generation_)
+    {
+        return;
+    }
+    if (entries_.size() >= kMaxEntries)
+    {
+        entries_.clear();
+        keys_by_ino_.clear();
+    }
+    erase_key(key);
+    auto& keys = keys_by_ino_[st.st_ino];
+    keys.push_back(key);
+    entries_.insert_or_assign(std::move(key), Entry{st, expiry});
+}
+
+void AttrCache::invalidate(std::string_view key)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(mu_);
+    ++generation_;
+    auto it = entries_.find(key);
+    if (it != entries_.end())
+    {
+        erase_ino(it->second.st.st_ino);
+    }
+}
+
+void AttrCache::invalidate_ino(uint64_t ino)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(mu_);
+    ++generation_;
+    erase_ino(ino);
+}
+
+void AttrCache::invalidate_descendants(std::string_view key)
+{
+    if (!enabled())
+    {
+        return;
+    }
+    std::string prefix = absl::EndsWith(key, "/") ? std::string(key) : absl::StrCat(key, "/");
+    LockGuard<absl::Mutex> lg(mu_);
+    ++generation_;
+    std::vector<std::string> doomed;
+    for (const auto& [k, entry] : entries_)
+    {
+        if (absl::StartsWith(k, prefix))
+        {
+            doomed.push_back(k);
+        }
+    }
+    for (const auto& k : doomed)
+    {
+        erase_key(k);
+    }
+}
+
+void AttrCache::clear()
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    ++generation_;
+    entries_.clear();
+    keys_by_ino_.clear();
+}
+
+void AttrCache::erase_key(const std::string& key)
+{
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+    {
+        return;
+    }
+    auto ino_it = keys_by_ino_.find(it->second.st.st_ino);
+    if (ino_it != keys_by_ino_.end())
+    {
+        auto& keys = ino_it->second;
+        keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+        if (keys.empty())
+        {
+            keys_by_ino_.erase(ino_it);
+        }
+    }
+    entries_.erase(it);
+}
+
+void AttrCache::erase_ino(uint64_t ino)
+{
+    auto it = keys_by_ino_.find(ino);
+    if (it == keys_by_ino_.end())
+    {
+        return;
+    }
+    for (const auto& key : it->second)
+    {
+        entries_.erase(key);
+    }
+    keys_by_ino_.erase(it);
+}
+}    // namespace securefs
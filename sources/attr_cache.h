@@ -0,0 +1,69 @@
+#pragma once
+
+#include "object.h"
+#include "platform.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/inlined_vector.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace securefs
+{
+/// In-daemon cache of the attributes of virtual paths.
+///
+/// Entries expire after `ttl`, but the owner is expected to invalidate them precisely whenever it
+/// mutates a file, either by path or by inode number (for operations on open handles). Files with
+/// multiple hard links are never cached, as a mutation through one name cannot invalidate the
+/// others.
+///
+/// A lookup that misses takes a ticket from `begin_fill()` before retrieving the attributes.
+/// `fill()` discards the result if any invalidation has happened since, so that a concurrent
+/// mutation never leaves stale attributes behind.
+class AttrCache final : public Object
+{
+public:
+    /// The cache is simply cleared when it grows beyond this.
+    static constexpr size_t kMaxEntries = 1 << 16;
+
+    /// A zero `ttl` disables the cache.
+    explicit AttrCache(absl::Duration ttl) : ttl_(ttl) {}
+
+    bool enabled() const noexcept { return ttl_ > absl::ZeroDuration(); }
+
+    bool lookup(std::string_view key, fuse_stat* st);
+    uint64_t begin_fill();
+    void fill(uint64_t ticket, std::string key, const fuse_stat& st);
+
+    /// Drops the entry of `key`, as well as any other entry of the same inode.
+    void invalidate(std::string_view key);
+    void invalidate_ino(uint64_t ino);
+    /// Drops the entries of everything below the directory `key`, but not `key` itself.
+    void invalidate_descendants(std::string_view key);
+    void clear();
+
+private:
+    struct Entry
+    {
+        fuse_stat st;
+        absl::Time expiry;
+    };
+
+    void erase_key(const std::string& key) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void erase_ino(uint64_t ino) ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+private:
+    absl::Duration ttl_;
+
+    absl::Mutex mu_;
+    absl::flat_hash_map<std::string, Entry> entries_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map<uint64_t, absl::InlinedVector<std::string, 1>>
+        keys_by_ino_ ABSL_GUARDED_BY(mu_);
+    uint64_t generation_ ABSL_GUARDED_BY(mu_) = 0;
+};
+}    // namespace securefs
@@ -0,0 +1,553 @@
+#include "exceptions.h"
+#include "mystring.h"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SECUREFS_HAS_X86_BASE32 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SECUREFS_SSSE3_TARGET
+#define SECUREFS_AVX2_TARGET
+#define SECUREFS_SSSE3_INLINE __forceinline
+#define SECUREFS_AVX2_INLINE __forceinline
+#else
+#define SECUREFS_SSSE3_TARGET __attribute__((target("ssse3")))
+#define SECUREFS_AVX2_TARGET __attribute__((target("avx2")))
+#define SECUREFS_SSSE3_INLINE inline __attribute__((target("ssse3"), always_inline))
+#define SECUREFS_AVX2_INLINE inline __attribute__((target("avx2"), always_inline))
+#endif
+#else
+#define SECUREFS_HAS_X86_BASE32 0
+#endif
+
+// Every kernel encodes groups of 5 bytes into 8 symbols, and decodes groups of 8 symbols into 5
+// bytes. The vectorized ones handle as many whole groups as their registers allow, and leave the
+// rest to the scalar kernel, so all of them produce identical output.
+
+namespace securefs
+{
+namespace
+{
+    const char* UPPER_BASE32_ALPHABET = "ABCDEFGHIJKMNPQRSTUVWXYZ23456789";
+    const char* LOWER_BASE32_ALPHABET = "abcdefghijkmnpqrstuvwxyz23456789";
+
+    [[noreturn]] void throw_invalid_base32()
+    {
+        throwInvalidArgumentException("Cannot decode string with base32");
+    }
+
+    // The original implementations, one symbol at a time.
+
+    size_t get_alphabet_index(byte b, byte next, size_t i)
+    {
+        switch (i)
+        {
+        case 0:
+            return (b >> 3) & 31u;
+        case 1:
+            return (b >> 2) & 31u;
+        case 2:
+            return (b >> 1) & 31u;
+        case 3:
+            return b & 31u;
+        case 4:
+            return ((b & 15u) << 1u) | (next >> 7u);
+        case 5:
+            return ((b & 7u) << 2u) | (next >> 6u);
+        case 6:
+            return ((b & 3u) << 3u) | (next >> 5u);
+        case 7:
+            return ((b & 1u) << 4u) | (next >> 4u);
+        }
+        throwInvalidArgumentException("Invalid index within byte");
+    }
+
+    void reference_encode(const byte* input, size_t size, std::string& output)
+    {
+        output.clear();
+        output.reserve((size * 8 + 4) / 5);
+
+        for (size_t bit_index = 0; bit_index < size * 8; bit_index += 5)
+        {
+            size_t byte_index = bit_index / 8, index_within_byte = bit_index % 8;
+            byte b = input[byte_index];
+            byte next = byte_index + 1 < size ? input[byte_index + 1] : 0;
+
+            size_t alphabet_index = get_alphabet_index(b, next, index_within_byte);
+            if (alphabet_index >= 32)
+                throw std::out_of_range("base32_encode encounters internal error");
+
+            output.push_back(UPPER_BASE32_ALPHABET[alphabet_index]);
+        }
+    }
+
+    std::pair<unsigned, unsigned> get_base32_pair(unsigned group, size_t i)
+    {
+        switch (i)
+        {
+        case 0:
+            return std::make_pair(group << 3u, 0);
+        case 1:
+            return std::make_pair(group << 2u, 0);
+        case 2:
+            return std::make_pair(group << 1u, 0);
+        case 3:
+            return std::make_pair(group, 0);
+        case 4:
+            return std::make_pair(group >> 1u, (group & 1u) << 7u);
+        case 5:
+            return std::make_pair(group >> 2u, (group & 3u) << 6u);
+        case 6:
+            return std::make_pair(group >> 3u, (group & 7u) << 5u);
+        case 7:
+            return std::make_pair(group >> 4u, (group & 15u) << 4u);
+        }
+        throwInvalidArgumentException("Invalid index within byte");
+    }
+
+    void reference_decode(const char* input, size_t size, std::string& output)
+    {
+        output.assign(size * 5 / 8, '\0');
+        auto out = (byte*)(output.data());
+
+        for (size_t i = 0; i < size; ++i)
+        {
+            unsigned group;
+            const char* finded = std::strchr(UPPER_BASE32_ALPHABET, input[i]);
+            if (finded)
+                group = unsigned(finded - UPPER_BASE32_ALPHABET);
+            else
+            {
+                finded = std::strchr(LOWER_BASE32_ALPHABET, input[i]);
+                if (finded)
+                {
+                    group = unsigned(finded - LOWER_BASE32_ALPHABET);
+                }
+                else
+                {
+                    throw_invalid_base32();
+                }
+            }
+
+            size_t bit_index = i * 5;
+            size_t byte_index = bit_index / 8, index_within_byte = bit_index % 8;
+            auto p = get_base32_pair(group, index_within_byte);
+            if (byte_index >= output.size())
+                throw std::out_of_range("base32 decode encounters internal error");
+            out[byte_index] |= p.first;
+            if (byte_index + 1 < output.size())
+                out[byte_index + 1] |= p.second;
+        }
+    }
+
+    // Branch-free scalar kernels over 40 bit groups.
+
+    // Maps each character to its value, or to -1 if it is not in the alphabet in either case.
+    constexpr std::array<signed char, 256> make_decoding_table()
+    {
+        std::array<signed char, 256> table{};
+        for (auto& v : table)
+        {
+            v = -1;
+        }
+        const char upper[] = "ABCDEFGHIJKMNPQRSTUVWXYZ23456789";
+        const char lower[] = "abcdefghijkmnpqrstuvwxyz23456789";
+        for (signed char i = 0; i < 32; ++i)
+        {
+            table[static_cast<byte>(upper[i])] = i;
+            table[static_cast<byte>(lower[i])] = i;
+        }
+        return table;
+    }
+
+    constexpr std::array<signed char, 256> kDecodingTable = make_decoding_table();
+
+    void scalar_encode(const byte* input, size_t size, char* output)
+    {
+        for (; size >= 5; size -= 5, input += 5, output += 8)
+        {
+            uint64_t group = (uint64_t(input[0]) << 32u) | (uint64_t(input[1]) << 24u)
+                | (uint64_t(input[2]) << 16u) | (uint64_t(input[3]) << 8u) | input[4];
+            for (unsigned j = 0; j < 8; ++j)
+            {
+                output[j] = UPPER_BASE32_ALPHABET[(group >> (35 - 5 * j)) & 31u];
+            }
+        }
+        if (size > 0)
+        {
+            uint64_t group = 0;
+            for (size_t i = 0; i < size; ++i)
+            {
+                group |= uint64_t(input[i]) << (32 - 8 * i);
+            }
+            for (size_t j = 0; j < (size * 8 + 4) / 5; ++j)
+            {
+                output[j] = UPPER_BASE32_ALPHABET[(group >> (35 - 5 * j)) & 31u];
+            }
+        }
+    }
+
+    void scalar_decode(const char* input, size_t size, byte* output)
+    {
+        int invalid = 0;
+        for (; size >= 8; size -= 8, input += 8, output += 5)
+        {
+            uint64_t group = 0;
+            for (unsigned j = 0; j < 8; ++j)
+            {
+                int value = kDecodingTable[static_cast<byte>(input[j])];
+                invalid |= value;
+                group = (group << 5u) | static_cast<unsigned>(value & 31);
+            }
+            for (unsigned i = 0; i < 5; ++i)
+            {
+                output[i] = static_cast<byte>(group >> (32 - 8 * i));
+            }
+        }
+        uint64_t group = 0;
+        for (size_t j = 0; j < size; ++j)
+        {
+            int value = kDecodingTable[static_cast<byte>(input[j])];
+            invalid |= value;
+            group |= uint64_t(value & 31) << (35 - 5 * j);
+        }
+        for (size_t i = 0; i < size * 5 / 8; ++i)
+        {
+            output[i] = static_cast<byte>(group >> (32 - 8 * i));
+        }
+        if (invalid < 0)
+        {
+            throw_invalid_base32();
+        }
+    }
+
+#if SECUREFS_HAS_X86_BASE32
+    // Each 128 bit lane encodes two groups. For every symbol, a 16 bit word gathers the two bytes
+    // that hold its bits, and a multiplication by a power of two shifts them to the bottom.
+    // Decoding merges adjacent values with multiply-adds, from 5 to 10, 20 and finally 40 bits.
+
+    SECUREFS_SSSE3_INLINE __m128i symbols_from_indices(__m128i indices)
+    {
+        const __m128i low_symbols = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(UPPER_BASE32_ALPHABET));
+        const __m128i high_symbols = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(UPPER_BASE32_ALPHABET + 16));
+        __m128i high = _mm_cmpgt_epi8(indices, _mm_set1_epi8(15));
+        return _mm_or_si128(_mm_andnot_si128(high, _mm_shuffle_epi8(low_symbols, indices)),
+                            _mm_and_si128(high, _mm_shuffle_epi8(high_symbols, indices)));
+    }
+
+    SECUREFS_SSSE3_INLINE __m128i
+    values_from_symbols(__m128i symbols, __m128i& valid_accumulator)
+    {
+        __m128i upper = _mm_and_si128(symbols, _mm_set1_epi8(static_cast<char>(0xdf)));
+        __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(upper, _mm_set1_epi8('A' - 1)),
+                                          _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), upper));
+        __m128i is_excluded = _mm_or_si128(_mm_cmpeq_epi8(upper, _mm_set1_epi8('L')),
+                                           _mm_cmpeq_epi8(upper, _mm_set1_epi8('O')));
+        is_letter = _mm_andnot_si128(is_excluded, is_letter);
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(symbols, _mm_set1_epi8('2' - 1)),
+                                         _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), symbols));
+        // The comparisons yield -1, which skips over the excluded letters.
+        __m128i letter_values = _mm_add_epi8(
+            _mm_sub_epi8(upper, _mm_set1_epi8('A')),
+            _mm_add_epi8(_mm_cmpgt_epi8(upper, _mm_set1_epi8('K')),
+                         _mm_cmpgt_epi8(upper, _mm_set1_epi8('N'))));
+        __m128i digit_values = _mm_sub_epi8(symbols, _mm_set1_epi8('2' - 24));
+        valid_accumulator
+            = _mm_and_si128(valid_accumulator, _mm_or_si128(is_letter, is_digit));
+        return _mm_or_si128(_mm_and_si128(is_letter, letter_values),
+                            _mm_and_si128(is_digit, digit_values));
+    }
+
+    SECUREFS_SSSE3_INLINE __m128i pack_values(__m128i values)
+    {
+        __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi16(0x0120));
+        __m128i quads = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00010400));
+        __m128i groups
+            = _mm_or_si128(_mm_slli_epi64(_mm_and_si128(quads, _mm_set1_epi64x(0xffffffff)), 20),
+                           _mm_srli_epi64(quads, 32));
+        return _mm_shuffle_epi8(
+            groups, _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+    }
+
+    // Returns the number of bytes consumed, a multiple of 10.
+    SECUREFS_SSSE3_TARGET size_t ssse3_encode(const byte* input, size_t size, char* output)
+    {
+        const __m128i first_words
+            = _mm_setr_epi8(1, 0, 1, 0, 2, 1, 2, 1, 3, 2, 4, 3, 4, 3, 5, 4);
+        const __m128i second_words
+            = _mm_setr_epi8(6, 5, 6, 5, 7, 6, 7, 6, 8, 7, 9, 8, 9, 8, 10, 9);
+        const __m128i shifts = _mm_setr_epi16(32, 1024, 128, 4096, 512, 64, 2048, 256);
+        const __m128i mask = _mm_set1_epi16(31);
+
+        size_t consumed = 0;
+        // Each step reads 16 bytes but consumes only 10.
+        for (; size - consumed >= 16; consumed += 10, output += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + consumed));
+            __m128i first = _mm_and_si128(
+                _mm_mulhi_epu16(_mm_shuffle_epi8(bytes, first_words), shifts), mask);
+            __m128i second = _mm_and_si128(
+                _mm_mulhi_epu16(_mm_shuffle_epi8(bytes, second_words), shifts), mask);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output),
+                             symbols_from_indices(_mm_packus_epi16(first, second)));
+        }
+        return consumed;
+    }
+
+    // Returns the number of symbols consumed, a multiple of 16.
+    SECUREFS_SSSE3_TARGET size_t ssse3_decode(const char* input, size_t size, byte* output)
+    {
+        size_t consumed = 0;
+        for (; size - consumed >= 16; consumed += 16, output += 10)
+        {
+            __m128i valid = _mm_set1_epi8(-1);
+            __m128i values = values_from_symbols(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + consumed)), valid);
+            if (_mm_movemask_epi8(valid) != 0xffff)
+            {
+                throw_invalid_base32();
+            }
+            alignas(16) byte packed[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(packed), pack_values(values));
+            memcpy(output, packed, 10);
+        }
+        return consumed;
+    }
+
+    // The same algorithms with two 128 bit lanes, each loaded separately.
+
+    SECUREFS_AVX2_INLINE __m256i broadcast(__m128i v) { return _mm256_broadcastsi128_si256(v); }
+
+    SECUREFS_AVX2_TARGET size_t avx2_encode(const byte* input, size_t size, char* output)
+    {
+        const __m256i first_words = broadcast(
+            _mm_setr_epi8(1, 0, 1, 0, 2, 1, 2, 1, 3, 2, 4, 3, 4, 3, 5, 4));
+        const __m256i second_words = broadcast(
+            _mm_setr_epi8(6, 5, 6, 5, 7, 6, 7, 6, 8, 7, 9, 8, 9, 8, 10, 9));
+        const __m256i shifts
+            = broadcast(_mm_setr_epi16(32, 1024, 128, 4096, 512, 64, 2048, 256));
+        const __m256i mask = _mm256_set1_epi16(31);
+        const __m256i low_symbols = broadcast(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(UPPER_BASE32_ALPHABET)));
+        const __m256i high_symbols = broadcast(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(UPPER_BASE32_ALPHABET + 16)));
+
+        size_t consumed = 0;
+        // Each step reads 26 bytes but consumes only 20.
+        for (; size - consumed >= 26; consumed += 20, output += 32)
+        {
+            __m256i bytes = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + consumed))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + consumed + 10)),
+                1);
+            __m256i first = _mm256_and_si256(
+                _mm256_mulhi_epu16(_mm256_shuffle_epi8(bytes, first_words), shifts), mask);
+            __m256i second = _mm256_and_si256(
+                _mm256_mulhi_epu16(_mm256_shuffle_epi8(bytes, second_words), shifts), mask);
+            __m256i indices = _mm256_packus_epi16(first, second);
+            __m256i high = _mm256_cmpgt_epi8(indices, _mm256_set1_epi8(15));
+            __m256i symbols = _mm256_or_si256(
+                _mm256_andnot_si256(high, _mm256_shuffle_epi8(low_symbols, indices)),
+                _mm256_and_si256(high, _mm256_shuffle_epi8(high_symbols, indices)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(output), symbols);
+        }
+        return consumed;
+    }
+
+    SECUREFS_AVX2_TARGET size_t avx2_decode(const char* input, size_t size, byte* output)
+    {
+        const __m256i case_mask = _mm256_set1_epi8(static_cast<char>(0xdf));
+        const __m256i shuffle = broadcast(
+            _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+
+        size_t consumed = 0;
+        for (; size - consumed >= 32; consumed += 32, output += 20)
+        {
+            __m256i symbols
+                = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + consumed));
+            __m256i upper = _mm256_and_si256(symbols, case_mask);
+            __m256i is_letter
+                = _mm256_and_si256(_mm256_cmpgt_epi8(upper, _mm256_set1_epi8('A' - 1)),
+                                   _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), upper));
+            __m256i is_excluded
+                = _mm256_or_si256(_mm256_cmpeq_epi8(upper, _mm256_set1_epi8('L')),
+                                  _mm256_cmpeq_epi8(upper, _mm256_set1_epi8('O')));
+            is_letter = _mm256_andnot_si256(is_excluded, is_letter);
+            __m256i is_digit
+                = _mm256_and_si256(_mm256_cmpgt_epi8(symbols, _mm256_set1_epi8('2' - 1)),
+                                   _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), symbols));
+            if (_mm256_movemask_epi8(_mm256_or_si256(is_letter, is_digit)) != -1)
+            {
+                throw_invalid_base32();
+            }
+            __m256i letter_values = _mm256_add_epi8(
+                _mm256_sub_epi8(upper, _mm256_set1_epi8('A')),
+                _mm256_add_epi8(_mm256_cmpgt_epi8(upper, _mm256_set1_epi8('K')),
+                                _mm256_cmpgt_epi8(upper, _mm256_set1_epi8('N'))));
+            __m256i digit_values = _mm256_sub_epi8(symbols, _mm256_set1_epi8('2' - 24));
+            __m256i values = _mm256_or_si256(_mm256_and_si256(is_letter, letter_values),
+                                             _mm256_and_si256(is_digit, digit_values));
+
+            __m256i pairs = _mm256_maddubs_epi16(values, _mm256_set1_epi16(0x0120));
+            __m256i quads = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00010400));
+            __m256i groups = _mm256_or_si256(
+                _mm256_slli_epi64(_mm256_and_si256(quads, _mm256_set1_epi64x(0xffffffff)), 20),
+                _mm256_srli_epi64(quads, 32));
+            alignas(32) byte packed[32];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(packed),
+                               _mm256_shuffle_epi8(groups, shuffle));
+            memcpy(output, packed, 10);
+            memcpy(output + 10, packed + 16, 10);
+        }
+        return consumed;
+    }
+
+    bool cpu_supports_ssse3() noexcept
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (static_cast<unsigned>(info[2]) & (1u << 9)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+#endif
+    }
+
+    bool cpu_supports_avx2() noexcept
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        // The OS must save the AVX registers on context switches.
+        if (!(static_cast<unsigned>(info[2]) & (1u << 27)) || (_xgetbv(0) & 6) != 6)
+        {
+            return false;
+        }
+        __cpuidex(info, 7, 0);
+        return (static_cast<unsigned>(info[1]) & (1u << 5)) != 0;
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#else
+    size_t ssse3_encode(const byte*, size_t, char*) { return 0; }
+    size_t ssse3_decode(const char*, size_t, byte*) { return 0; }
+    size_t avx2_encode(const byte*, size_t, char*) { return 0; }
+    size_t avx2_decode(const char*, size_t, byte*) { return 0; }
+    bool cpu_supports_ssse3() noexcept { return false; }
+    bool cpu_supports_avx2() noexcept { return false; }
+#endif
+
+    internal::Base32Kernel fastest_base32_kernel() noexcept
+    {
+        static const internal::Base32Kernel kernel
+            = internal::is_base32_kernel_supported(internal::Base32Kernel::kAvx2)
+            ? internal::Base32Kernel::kAvx2
+            : internal::is_base32_kernel_supported(internal::Base32Kernel::kSsse3)
+            ? internal::Base32Kernel::kSsse3
+            : internal::Base32Kernel::kScalar;
+        return kernel;
+    }
+}    // namespace
+
+namespace internal
+{
+    const char* stringify(Base32Kernel kernel)
+    {
+        switch (kernel)
+        {
+        case Base32Kernel::kReference:
+            return "reference";
+        case Base32Kernel::kScalar:
+            return "scalar";
+        case Base32Kernel::kSsse3:
+            return "ssse3";
+        case Base32Kernel::kAvx2:
+            return "avx2";
+        }
+        return "UNKNOWN";
+    }
+
+    bool is_base32_kernel_supported(Base32Kernel kernel) noexcept
+    {
+        switch (kernel)
+        {
+        case Base32Kernel::kReference:
+        case Base32Kernel::kScalar:
+            return true;
+        case Base32Kernel::kSsse3:
+            return cpu_supports_ssse3();
+        case Base32Kernel::kAvx2:
+            return cpu_supports_ssse3() && cpu_supports_avx2();
+        }
+        return false;
+    }
+
+    void base32_encode(Base32Kernel kernel, const byte* input, size_t size, std::string& output)
+    {
+        if (kernel == Base32Kernel::kReference)
+        {
+            return reference_encode(input, size, output);
+        }
+        output.resize((size * 8 + 4) / 5);
+        char* out = &output[0];
+        size_t consumed = 0;
+        if (kernel == Base32Kernel::kAvx2)
+        {
+            consumed += avx2_encode(input, size, out);
+        }
+        if (kernel == Base32Kernel::kAvx2 || kernel == Base32Kernel::kSsse3)
+        {
+            consumed += ssse3_encode(input + consumed, size - consumed, out + consumed / 5 * 8);
+        }
+        scalar_encode(input + consumed, size - consumed, out + consumed / 5 * 8);
+    }
+
+    void base32_decode(Base32Kernel kernel, const char* input, size_t size, std::string& output)
+    {
+        if (kernel == Base32Kernel::kReference)
+        {
+            return reference_decode(input, size, output);
+        }
+        // No encoding ends with 1, 3 or 6 symbols in its last group.
+        size_t residue = size % 8;
+        if (residue == 1 || residue == 3 || residue == 6)
+        {
+            throw_invalid_base32();
+        }
+        output.resize(size * 5 / 8);
+        auto out = reinterpret_cast<byte*>(&output[0]);
+        size_t consumed = 0;
+        if (kernel == Base32Kernel::kAvx2)
+        {
+            consumed += avx2_decode(input, size, out);
+        }
+        if (kernel == Base32Kernel::kAvx2 || kernel == Base32Kernel::kSsse3)
+        {
+            consumed += ssse3_decode(input + consumed, size - consumed, out + consumed / 8 * 5);
+        }
+        scalar_decode(input + consumed, size - consumed, out + consumed / 8 * 5);
+    }
+}    // namespace internal
+
+void base32_encode(const byte* input, size_t size, std::string& output)
+{
+    internal::base32_encode(fastest_base32_kernel(), input, size, output);
+}
+
+void base32_decode(const char* input, size_t size, std::string& output)
+{
+    internal::base32_decode(fastest_base32_kernel(), input, size, output);
+}
+}    // namespace securefs
@@ -177,7 +177,8 @@ public:
                           ANNOTATED(tBlockSize, unsigned) block_size,
                           ANNOTATED(tIvSize, unsigned) iv_size,
                           ANNOTATED(tMaxPaddingSize, unsigned) max_padding_size,
-                          ANNOTATED(tStoreTimeWithinFs, bool) store_time))
+                          ANNOTATED(tStoreTimeWithinFs, bool) store_time,
+                          FileKeyCache& key_cache))
         : Directory(cmpfn,
                     std::move(data_stream),
                     std::move(meta_stream),
@@ -187,7 +188,8 @@ public:
                     block_size,
                     iv_size,
                     max_padding_size,
-                    store_time)
+                    store_time,
+                    key_cache)
     {
     }
 
@@ -0,0 +1,677 @@
+#include "bulk_transfer.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "myutils.h"
+#include "stat_workaround.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/synchronization/mutex.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    // Directories and files are writable by us while being filled, and get their real modes at
+    // the end.
+    constexpr fuse_mode_t kFillingDirectoryMode = 0700;
+    constexpr fuse_mode_t kFillingFileMode = 0600;
+
+    void check(int rc, std::string_view op_name, const std::string& path)
+    {
+        if (rc < 0)
+        {
+            THROW_POSIX_EXCEPTION(-rc, absl::StrCat(op_name, " ", path));
+        }
+    }
+
+    bool is_unsupported(int rc) { return rc == -ENOTSUP || rc == -ENOSYS; }
+
+    bool same_content(const fuse_stat& a, const fuse_stat& b)
+    {
+        auto ta = get_mtim(a), tb = get_mtim(b);
+        return a.st_size == b.st_size && ta.tv_sec == tb.tv_sec && ta.tv_nsec == tb.tv_nsec;
+    }
+
+    /// An open file of a `Tree`.
+    class TreeFile
+    {
+    public:
+        virtual ~TreeFile() = default;
+        virtual size_t read(char* buffer, size_t size, fuse_off_t offset) = 0;
+        virtual void write(const char* buffer, size_t size, fuse_off_t offset) = 0;
+        /// Closes the file, and then applies the mode and the times of `st`.
+        virtual void finish(const fuse_stat& st) = 0;
+    };
+
+    /// One end of a transfer, a directory tree either outside or in the filesystem of some
+    /// `FuseHighLevelOpsBase`. Paths are relative to the tree, whose root is "". Failures throw,
+    /// except those of xattrs, which return a negative errno like the FUSE operations.
+    class Tree
+    {
+    public:
+        virtual ~Tree() = default;
+
+        /// The full path, for messages.
+        virtual std::string describe(const std::string& path) = 0;
+        /// Returns false if `path` does not exist.
+        virtual bool stat(const std::string& path, fuse_stat* st) = 0;
+        virtual void list(const std::string& dir,
+                          std::vector<std::pair<std::string, fuse_stat>>* entries)
+            = 0;
+        virtual std::string readlink(const std::string& path) = 0;
+        virtual std::unique_ptr<TreeFile> open(const std::string& path) = 0;
+
+        /// Returns false if the directory exists already.
+        virtual bool mkdir(const std::string& path) = 0;
+        virtual void symlink(const std::string& target, const std::string& path) = 0;
+        /// With `truncate`, an existing file is emptied instead of being an error.
+        virtual std::unique_ptr<TreeFile> create(const std::string& path, bool truncate) = 0;
+        virtual void chmod(const std::string& path, fuse_mode_t mode) = 0;
+        virtual void set_attributes(const std::string& path, const fuse_stat& st) = 0;
+
+        virtual int listxattr(const std::string& path, char* list, size_t size) = 0;
+        virtual int
+        getxattr(const std::string& path, const char* name, char* value, size_t size)
+            = 0;
+        virtual int
+        setxattr(const std::string& path, const char* name, const char* value, size_t size)
+            = 0;
+    };
+
+    class OsFile final : public TreeFile
+    {
+    public:
+        OsFile(const OSService& root, std::string path, std::shared_ptr<FileStream> stream)
+            : root_(root), path_(std::move(path)), stream_(std::move(stream))
+        {
+        }
+
+        size_t read(char* buffer, size_t size, fuse_off_t offset) override
+        {
+            return stream_->read(buffer, offset, size);
+        }
+
+        void write(const char* buffer, size_t size, fuse_off_t offset) override
+        {
+            stream_->write(buffer, offset, size);
+        }
+
+        void finish(const fuse_stat& st) override
+        {
+            fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+            stream_->utimens(ts);
+            stream_.reset();
+            root_.chmod(path_, st.st_mode & 07777);
+        }
+
+    private:
+        const OSService& root_;
+        std::string path_;
+        std::shared_ptr<FileStream> stream_;
+    };
+
+    class OsTree final : public Tree
+    {
+    public:
+        explicit OsTree(const std::string& dir) : root_(dir) {}
+
+        std::string describe(const std::string& path) override
+        {
+            return root_.norm_path_narrowed(dot(path));
+        }
+
+        bool stat(const std::string& path, fuse_stat* st) override
+        {
+            return root_.stat(dot(path), st);
+        }
+
+        void list(const std::string& dir,
+                  std::vector<std::pair<std::string, fuse_stat>>* entries) override
+        {
+            auto traverser = root_.create_traverser(dot(dir), true);
+            std::string name;
+            fuse_stat st{};
+            while (traverser->next(&name, &st))
+            {
+                if (name != "." && name != "..")
+                {
+                    entries->emplace_back(std::move(name), st);
+                }
+            }
+        }
+
+        std::string readlink(const std::string& path) override
+        {
+            std::string target(4096, '\0');
+            target.resize(root_.readlink(path, target.data(), target.size()));
+            return target;
+        }
+
+        std::unique_ptr<TreeFile> open(const std::string& path) override
+        {
+            return std::make_unique<OsFile>(
+                root_, path, root_.open_file_stream(path, O_RDONLY, 0));
+        }
+
+        bool mkdir(const std::string& path) override
+        {
+            fuse_stat st{};
+            if (root_.stat(dot(path), &st))
+            {
+                return false;
+            }
+            root_.mkdir(path, kFillingDirectoryMode);
+            return true;
+        }
+
+        void symlink(const std::string& target, const std::string& path) override
+        {
+            root_.symlink(target, path);
+        }
+
+        std::unique_ptr<TreeFile> create(const std::string& path, bool truncate) override
+        {
+            return std::make_unique<OsFile>(
+                root_,
+                path,
+                root_.open_file_stream(path,
+                                       O_WRONLY | O_CREAT | (truncate ? O_TRUNC : O_EXCL),
+                                       kFillingFileMode));
+        }
+
+        void chmod(const std::string& path, fuse_mode_t mode) override
+        {
+            root_.chmod(dot(path), mode);
+        }
+
+        void set_attributes(const std::string& path, const fuse_stat& st) override
+        {
+            fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+            root_.chmod(dot(path), st.st_mode & 07777);
+            root_.utimens(dot(path), ts);
+        }
+
+        int listxattr(const std::string& path, char* list, size_t size) override
+        {
+            return static_cast<int>(root_.listxattr(dot(path).c_str(), list, size));
+        }
+
+        int getxattr(const std::string& path, const char* name, char* value, size_t size) override
+        {
+            return static_cast<int>(root_.getxattr(dot(path).c_str(), name, value, size));
+        }
+
+        int setxattr(const std::string& path,
+                     const char* name,
+                     const char* value,
+                     size_t size) override
+        {
+            return root_.setxattr(dot(path).c_str(), name, const_cast<char*>(value), size, 0);
+        }
+
+    private:
+        static std::string dot(const std::string& path) { return path.empty() ? "." : path; }
+
+    private:
+        OSService root_;
+    };
+
+    class OpsFile final : public TreeFile
+    {
+    public:
+        OpsFile(FuseHighLevelOpsBase& ops,
+                std::string path,
+                const fuse_file_info& info,
+                const fuse_context& ctx)
+            : ops_(ops), path_(std::move(path)), info_(info), ctx_(ctx)
+        {
+        }
+
+        ~OpsFile() override
+        {
+            if (open_)
+            {
+                ops_.vrelease(path_.c_str(), &info_, &ctx_);
+            }
+        }
+
+        size_t read(char* buffer, size_t size, fuse_off_t offset) override
+        {
+            int rc = ops_.vread(path_.c_str(), buffer, size, offset, &info_, &ctx_);
+            check(rc, "read", path_);
+            return rc;
+        }
+
+        void write(const char* buffer, size_t size, fuse_off_t offset) override
+        {
+            while (size > 0)
+            {
+                int rc = ops_.vwrite(path_.c_str(), buffer, size, offset, &info_, &ctx_);
+                check(rc, "write", path_);
+                buffer += rc;
+                size -= rc;
+                offset += rc;
+            }
+        }
+
+        void finish(const fuse_stat& st) override
+        {
+            // Closing may still write, so the times are set afterwards.
+            open_ = false;
+            check(ops_.vrelease(path_.c_str(), &info_, &ctx_), "release", path_);
+            fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+            check(ops_.vchmod(path_.c_str(), st.st_mode & 07777, &ctx_), "chmod", path_);
+            check(ops_.vutimens(path_.c_str(), ts, &ctx_), "utimens", path_);
+        }
+
+    private:
+        FuseHighLevelOpsBase& ops_;
+        std::string path_;
+        fuse_file_info info_;
+        const fuse_context& ctx_;
+        bool open_ = true;
+    };
+
+    class OpsTree final : public Tree
+    {
+    public:
+        OpsTree(FuseHighLevelOpsBase& ops, std::string base) : ops_(ops), base_(std::move(base))
+        {
+            ctx_.uid = OSService::getuid();
+            ctx_.gid = OSService::getgid();
+        }
+
+        std::string describe(const std::string& path) override { return full(path); }
+
+        bool stat(const std::string& path, fuse_stat* st) override
+        {
+            int rc = ops_.vgetattr(full(path).c_str(), st, &ctx_);
+            if (rc == -ENOENT)
+            {
+                return false;
+            }
+            check(rc, "getattr", full(path));
+            return true;
+        }
+
+        void list(const std::string& dir,
+                  std::vector<std::pair<std::string, fuse_stat>>* entries) override
+        {
+            std::string path = full(dir);
+            std::vector<std::string> names;
+            fuse_file_info info{};
+            check(ops_.vopendir(path.c_str(), &info, &ctx_), "opendir", path);
+            {
+                DEFER(ops_.vreleasedir(path.c_str(), &info, &ctx_));
+                check(ops_.vreaddir(
+                          path.c_str(),
+                          &names,
+                          [](void* buf, const char* name, const fuse_stat*, fuse_off_t)
+                          {
+                              static_cast<std::vector<std::string>*>(buf)->emplace_back(name);
+                              return 0;
+                          },
+                          0,
+                          &info,
+                          &ctx_),
+                      "readdir",
+                      path);
+            }
+            for (std::string& name : names)
+            {
+                fuse_stat st{};
+                // Entries removed meanwhile are skipped.
+                if (name != "." && name != ".." && stat(ParallelWalk::join(dir, name), &st))
+                {
+                    entries->emplace_back(std::move(name), st);
+                }
+            }
+        }
+
+        std::string readlink(const std::string& path) override
+        {
+            std::string target(4096, '\0');
+            check(ops_.vreadlink(full(path).c_str(), target.data(), target.size(), &ctx_),
+                  "readlink",
+                  full(path));
+            target.resize(strlen(target.c_str()));
+            return target;
+        }
+
+        std::unique_ptr<TreeFile> open(const std::string& path) override
+        {
+            fuse_file_info info{};
+            info.flags = O_RDONLY;
+            check(ops_.vopen(full(path).c_str(), &info, &ctx_), "open", full(path));
+            return std::make_unique<OpsFile>(ops_, full(path), info, ctx_);
+        }
+
+        bool mkdir(const std::string& path) override
+        {
+            int rc = ops_.vmkdir(full(path).c_str(), kFillingDirectoryMode, &ctx_);
+            if (rc == -EEXIST)
+            {
+                return false;
+            }
+            check(rc, "mkdir", full(path));
+            return true;
+        }
+
+        void symlink(const std::string& target, const std::string& path) override
+        {
+            check(ops_.vsymlink(target.c_str(), full(path).c_str(), &ctx_), "symlink", full(path));
+        }
+
+        std::unique_ptr<TreeFile> create(const std::string& path, bool truncate) override
+        {
+            fuse_file_info info{};
+            info.flags = O_RDWR;
+            int rc = ops_.vcreate(full(path).c_str(), kFillingFileMode, &info, &ctx_);
+            if (rc == -EEXIST && truncate)
+            {
+                info.flags = O_RDWR | O_TRUNC;
+                rc = ops_.vopen(full(path).c_str(), &info, &ctx_);
+            }
+            check(rc, "create", full(path));
+            return std::make_unique<OpsFile>(ops_, full(path), info, ctx_);
+        }
+
+        void chmod(const std::string& path, fuse_mode_t mode) override
+        {
+            check(ops_.vchmod(full(path).c_str(), mode, &ctx_), "chmod", full(path));
+        }
+
+        void set_attributes(const std::string& path, const fuse_stat& st) override
+        {
+            fuse_timespec ts[2] = {get_atim(st), get_mtim(st)};
+            check(ops_.vchmod(full(path).c_str(), st.st_mode & 07777, &ctx_), "chmod", full(path));
+            check(ops_.vutimens(full(path).c_str(), ts, &ctx_), "utimens", full(path));
+        }
+
+        int listxattr(const std::string& path, char* list, size_t size) override
+        {
+            return ops_.vlistxattr(full(path).c_str(), list, size, &ctx_);
+        }
+
+        int getxattr(const std::string& path, const char* name, char* value, size_t size) override
+        {
+            return ops_.vgetxattr(full(path).c_str(), name, value, size, 0, &ctx_);
+        }
+
+        int setxattr(const std::string& path,
+                     const char* name,
+                     const char* value,
+                     size_t size) override
+        {
+            return ops_.vsetxattr(full(path).c_str(), name, value, size, 0, 0, &ctx_);
+        }
+
+    private:
+        std::string full(const std::string& path) const
+        {
+            return path.empty() ? base_ : ParallelWalk::join(base_, path);
+        }
+
+    private:
+        FuseHighLevelOpsBase& ops_;
+        std::string base_;
+        fuse_context ctx_{};
+    };
+
+    class Transfer
+    {
+    public:
+        Transfer(Tree& source, Tree& dest, const TransferOptions& options)
+            : source_(source), dest_(dest), options_(options), walk_(options.walk)
+        {
+            if (options_.chunk_size == 0)
+            {
+                throwInvalidArgumentException("The chunk size must be positive");
+            }
+        }
+
+        WalkReport run()
+        {
+            fuse_stat st{};
+            if (!source_.stat("", &st) || (st.st_mode & S_IFMT) != S_IFDIR)
+            {
+                throw_runtime_error(absl::StrCat(source_.describe(""), " is not a directory"));
+            }
+            if (dest_.mkdir(""))
+            {
+                add_directory("", st);
+            }
+            else if (options_.resume)
+            {
+                resume_directory("", st);
+            }
+            walk_.submit(dest_.describe(""), [this]() { copy_directory(""); });
+            walk_.wait();
+
+            // The directories get their attributes last, the deepest first, so that none loses
+            // the permissions needed for its subdirectories too early.
+            LockGuard<absl::Mutex> lg(mu_);
+            std::sort(directories_.begin(),
+                      directories_.end(),
+                      [](const auto& a, const auto& b)
+                      {
+                          return std::count(a.first.begin(), a.first.end(), '/')
+                              > std::count(b.first.begin(), b.first.end(), '/');
+                      });
+            for (const auto& [path, st] : directories_)
+            {
+                try
+                {
+                    dest_.set_attributes(path, st);
+                }
+                catch (const std::exception& e)
+                {
+                    walk_.add_problem(absl::StrCat(dest_.describe(path), ": ", e.what()));
+                }
+            }
+            return walk_.report();
+        }
+
+    private:
+        void add_directory(std::string path, const fuse_stat& st)
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            directories_.emplace_back(std::move(path), st);
+        }
+
+        // The earlier transfer may have given the directory its final mode already, which may
+        // not let its entries be created or rewritten.
+        void resume_directory(const std::string& path, const fuse_stat& st)
+        {
+            dest_.chmod(path, kFillingDirectoryMode);
+            add_directory(path, st);
+        }
+
+        void copy_directory(const std::string& dir)
+        {
+            std::vector<std::pair<std::string, fuse_stat>> entries;
+            source_.list(dir, &entries);
+            for (const auto& [name, st] : entries)
+            {
+                std::string path = ParallelWalk::join(dir, name);
+                std::string subject = dest_.describe(path);
+                switch (st.st_mode & S_IFMT)
+                {
+                case S_IFDIR:
+                    if (dest_.mkdir(path))
+                    {
+                        add_directory(path, st);
+                    }
+                    else if (options_.resume)
+                    {
+                        resume_directory(path, st);
+                    }
+                    else
+                    {
+                        walk_.add_problem(absl::StrCat(subject, ": already exists"));
+                        break;
+                    }
+                    walk_.submit(std::move(subject), [this, path]() { copy_directory(path); });
+                    break;
+                case S_IFREG:
+                    walk_.submit(std::move(subject),
+                                 [this, path, st = st]() { copy_file(path, st); });
+                    break;
+                case S_IFLNK:
+                    walk_.submit(std::move(subject), [this, path]() { copy_symlink(path); });
+                    break;
+                default:
+                    walk_.add_problem(absl::StrCat(source_.describe(path),
+                                                   ": neither a file, a directory or a symlink"));
+                    break;
+                }
+            }
+            ++walk_.directories;
+        }
+
+        void copy_file(const std::string& path, const fuse_stat& st)
+        {
+            fuse_stat existing{};
+            if (options_.resume && dest_.stat(path, &existing)
+                && (existing.st_mode & S_IFMT) == S_IFREG)
+            {
+                if (same_content(st, existing))
+                {
+                    ++walk_.files;
+                    return;
+                }
+                // Finished before, so it may be read only by now.
+                dest_.chmod(path, kFillingFileMode);
+            }
+            auto input = source_.open(path);
+            auto output = dest_.create(path, options_.resume);
+            std::vector<char> buffer(
+                std::max<fuse_off_t>(1, std::min<fuse_off_t>(st.st_size, options_.chunk_size)));
+            for (fuse_off_t off = 0;;)
+            {
+                size_t size = input->read(buffer.data(), buffer.size(), off);
+                if (size == 0)
+                {
+                    break;
+                }
+                output->write(buffer.data(), size, off);
+                off += size;
+                walk_.bytes += size;
+            }
+            copy_xattrs(path);
+            output->finish(st);
+            ++walk_.files;
+        }
+
+        void copy_symlink(const std::string& path)
+        {
+            std::string target = source_.readlink(path);
+            fuse_stat existing{};
+            if (options_.resume && dest_.stat(path, &existing)
+                && (existing.st_mode & S_IFMT) == S_IFLNK && dest_.readlink(path) == target)
+            {
+                ++walk_.symlinks;
+                return;
+            }
+            dest_.symlink(target, path);
+            ++walk_.symlinks;
+        }
+
+        // Nothing is copied when either side lacks xattrs.
+        void copy_xattrs(const std::string& path)
+        {
+            int size = source_.listxattr(path, nullptr, 0);
+            if (size == 0 || is_unsupported(size))
+            {
+                return;
+            }
+            check(size, "listxattr", source_.describe(path));
+            std::string names(size, '\0');
+            size = source_.listxattr(path, names.data(), names.size());
+            check(size, "listxattr", source_.describe(path));
+            names.resize(size);
+
+            std::vector<char> value;
+            for (std::string_view name_view : absl::StrSplit(names, '\0', absl::SkipEmpty()))
+            {
+                std::string name(name_view);
+                int value_size = source_.getxattr(path, name.c_str(), nullptr, 0);
+                check(value_size, "getxattr", source_.describe(path));
+                value.resize(value_size);
+                value_size = source_.getxattr(path, name.c_str(), value.data(), value.size());
+                check(value_size, "getxattr", source_.describe(path));
+                int rc = dest_.setxattr(path, name.c_str(), value.data(), value_size);
+                if (is_unsupported(rc))
+                {
+                    return;
+                }
+                check(rc, "setxattr", dest_.describe(path));
+            }
+        }
+
+    private:
+        Tree& source_;
+        Tree& dest_;
+        const TransferOptions& options_;
+        absl::Mutex mu_;
+        // The directories whose attributes are applied once all their entries are written.
+        std::vector<std::pair<std::string, fuse_stat>> directories_ ABSL_GUARDED_BY(mu_);
+        // Last, so that its workers are gone before the rest.
+        ParallelWalk walk_;
+    };
+
+    /// Makes a path within a filesystem absolute, without a trailing slash except for the root.
+    std::string normalize_virtual_path(std::string_view path)
+    {
+        while (path.size() > 1 && path.back() == '/')
+        {
+            path.remove_suffix(1);
+        }
+        if (path.empty() || path.front() != '/')
+        {
+            return absl::StrCat("/", path);
+        }
+        return std::string(path);
+    }
+}    // namespace
+
+WalkReport import_tree(FuseHighLevelOpsBase& ops,
+                       const std::string& source,
+                       const std::string& dest,
+                       const TransferOptions& options)
+{
+    OsTree source_tree(source);
+    OpsTree dest_tree(ops, normalize_virtual_path(dest));
+    return Transfer(source_tree, dest_tree, options).run();
+}
+
+WalkReport export_tree(FuseHighLevelOpsBase& ops,
+                       const std::string& source,
+                       const std::string& dest,
+                       const TransferOptions& options)
+{
+    OSService::get_default().ensure_directory(dest, 0755);
+    OpsTree source_tree(ops, normalize_virtual_path(source));
+    OsTree dest_tree(dest);
+    return Transfer(source_tree, dest_tree, options).run();
+}
+
+WalkReport copy_tree(FuseHighLevelOpsBase& source_ops,
+                     const std::string& source,
+                     FuseHighLevelOpsBase& dest_ops,
+                     const std::string& dest,
+                     const TransferOptions& options)
+{
+    OpsTree source_tree(source_ops, normalize_virtual_path(source));
+    OpsTree dest_tree(dest_ops, normalize_virtual_path(dest));
+    return Transfer(source_tree, dest_tree, options).run();
+}
+}    // namespace securefs
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "parallel_walk.h"
+
+#include <string>
+
+namespace securefs
+{
+struct TransferOptions
+{
+    WalkOptions walk;
+    // Bytes per read and write. A multiple of the block size keeps the writes block aligned.
+    unsigned chunk_size = 4 << 20;
+    // Continues an interrupted transfer into the same destination. The entries that already match
+    // their sources are skipped, and the rest copied again, instead of being reported as problems.
+    bool resume = false;
+};
+
+/// Copies the tree under `source`, a directory outside, to `dest`, a directory in the filesystem of
+/// `ops`, with modes, timestamps, symlinks and, where supported, xattrs. Directories are listed
+/// and files copied in parallel, each file as a whole by one thread.
+///
+/// `dest` is created if it does not exist. Existing files are never overwritten, and each of them
+/// counts as a problem unless resuming. Hard links are copied as distinct files, and ownership is
+/// not preserved.
+///
+/// The modification time of a file is set after all its content, so a file whose size and time
+/// match the source has been copied completely. This is how resuming tells what remains to do.
+WalkReport import_tree(FuseHighLevelOpsBase& ops,
+                       const std::string& source,
+                       const std::string& dest,
+                       const TransferOptions& options);
+
+/// The converse of `import_tree`, copying from `source` in the filesystem of `ops` to `dest`
+/// outside.
+WalkReport export_tree(FuseHighLevelOpsBase& ops,
+                       const std::string& source,
+                       const std::string& dest,
+                       const TransferOptions& options);
+
+/// Like `import_tree`, but copying between two filesystems, such as two repositories of different
+/// formats.
+WalkReport copy_tree(FuseHighLevelOpsBase& source_ops,
+                     const std::string& source,
+                     FuseHighLevelOpsBase& dest_ops,
+                     const std::string& dest,
+                     const TransferOptions& options);
+}    // namespace securefs
@@ -1,26 +1,35 @@
 #include "commands.h"
+#include "aead_engine.h"
 #include "btree_dir.h"
+#include "bulk_transfer.h"
 #include "crypto.h"
 #include "exceptions.h"
 #include "files.h"
 #include "full_format.h"
+#include "fuse_bench.h"
 #include "fuse2_workaround.h"
 #include "fuse_high_level_ops_base.h"
 #include "git-version.h"
 #include "lite_format.h"
 #include "lock_enabled.h"
 #include "logger.h"
+#include "metrics.h"
 #include "myutils.h"
 #include "object.h"
 #include "params.pb.h"
 #include "params_io.h"
 #include "platform.h"
+#include "repo_verifier.h"
+#include "stats_file_ops.h"
 #include "tags.h"
+#include "trace_recorder.h"
+#include "trace_replay.h"
 
 #include <absl/strings/escaping.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
 #include <argon2.h>
 #include <cryptopp/cpu.h>
 #include <cryptopp/hmac.h>
@@ -46,6 +55,7 @@
 #include <string.h>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <typeinfo>
 #include <utility>
 #include <vector>
@@ -66,8 +76,6 @@ using namespace securefs;
 
 namespace
 {
-constexpr std::string_view const kLegacyConfigFileName = ".securefs.json";
-constexpr std::string_view const kConfigFileName = ".config.pb";
 constexpr std::string_view EMPTY_PASSWORD_WHEN_KEY_FILE_IS_USED = " ";
 }    // namespace
 
@@ -99,11 +107,17 @@ struct DataDirHolder : public ArgsHolder
 
     std::string get_real_config_path_for_reading()
     {
-        if (!config_path.getValue().empty())
+        return find_config_path(data_dir.getValue(), config_path.getValue());
+    }
+
+    static std::string find_config_path(const std::string& data_dir,
+                                        const std::string& config_path)
+    {
+        if (!config_path.empty())
         {
-            return config_path.getValue();
+            return config_path;
         }
-        OSService root(data_dir.getValue());
+        OSService root(data_dir);
         fuse_stat st{};
         if (root.stat(std::string(kConfigFileName), &st))
         {
@@ -128,6 +142,22 @@ static void secure_wipe(char* buffer, size_t size)
     CryptoPP::SecureWipeBuffer(reinterpret_cast<byte*>(buffer), size);
 }
 
+static void randomize(std::string* str, size_t size)
+{
+    str->resize(size);
+    generate_random(str->data(), str->size());
+}
+
+static std::vector<const char*> to_c_style_args(const std::vector<std::string>& args)
+{
+    std::vector<const char*> result(args.size());
+    std::transform(args.begin(),
+                   args.end(),
+                   result.begin(),
+                   [](const std::string& s) { return s.c_str(); });
+    return result;
+}
+
 void CommandBase::parse_cmdline(int argc, const char* const* argv) { cmdline().parse(argc, argv); }
 
 struct SinglePasswordHolder : public DataDirHolder
@@ -274,13 +304,6 @@ private:
         absl::StrCat(kSensitive, "/", kInsensitive),
         cmdline()};
 
-private:
-    static void randomize(std::string* str, size_t size)
-    {
-        str->resize(size);
-        generate_random(str->data(), str->size());
-    }
-
 public:
     void parse_cmdline(int argc, const char* const* argv) override
     {
@@ -517,6 +540,32 @@ private:
     SinglePasswordHolder single_pass_holder_{cmdline()};
 
     TCLAP::SwitchArg single_threaded{"s", "single", "Single threaded mode", cmdline()};
+    TCLAP::ValueArg<std::string> threads{
+        "",
+        "threads",
+        "Number of threads serving requests, as min:max, or as one number for a fixed count. The "
+        "pool starts with min threads and grows up to max while all of them are busy, such as "
+        "blocked in fsync. Both default to the number of hardware threads. Only max applies on "
+        "Windows, and neither on macOS.",
+        false,
+        "",
+        "min:max",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> metadata_threads{
+        "",
+        "metadata-threads",
+        "Number of the threads serving requests that reads, writes, flushes and fsyncs may not "
+        "occupy, so that lookups and other short operations never wait behind long transfers. 0 "
+        "lets transfers occupy every thread. No effect on Windows and macOS",
+        false,
+        0,
+        "integer",
+        cmdline()};
+    TCLAP::SwitchArg cpu_affinity{
+        "",
+        "cpu-affinity",
+        "Pin each thread serving requests to one CPU in turn (Linux only)",
+        cmdline()};
     TCLAP::SwitchArg background{"b",
                                 "background",
                                 "Run securefs in the background (currently no effect on Windows)",
@@ -534,6 +583,52 @@ private:
                                      "",
                                      "path",
                                      cmdline()};
+    TCLAP::SwitchArg async_log{
+        "",
+        "async-log",
+        "Write the log from a background thread, so that logging, even with --verbose or --trace, "
+        "does not hold up the filesystem operations. Lines that come faster than they can be "
+        "written are dropped and counted in the log.",
+        cmdline()};
+    TCLAP::ValueArg<std::string> stats_file{
+        "",
+        "stats-file",
+        "Path of a file to periodically replace with the metrics of the mount in JSON: per "
+        "operation call and error counts and latency percentiles, bytes encrypted and decrypted, "
+        "and cache hit rates. Regardless of this option, sending SIGUSR1 to the process writes the "
+        "metrics to the log.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> stats_interval{"",
+                                             "stats-interval",
+                                             "Seconds between rewrites of the stats file",
+                                             false,
+                                             10,
+                                             "seconds",
+                                             cmdline()};
+    TCLAP::ValueArg<std::string> stats_path{
+        "",
+        "stats-path",
+        "Path within the mount, such as /.securefs/stats, of a read-only file that returns the "
+        "same metrics as --stats-file when read. Neither it nor the directories leading to it are "
+        "listed, and they shadow any real file at the same path. Disabled by default.",
+        false,
+        "",
+        "path",
+        cmdline()};
+    TCLAP::ValueArg<std::string> trace_file{
+        "",
+        "trace-file",
+        "Path of a file to record every operation into, in a compact binary form that the replay "
+        "command takes. Only hashes of the paths, keyed with a random key that is not saved, are "
+        "recorded. Unlike --trace, the recording happens off the calling threads and barely slows "
+        "down the operations.",
+        false,
+        "",
+        "path",
+        cmdline()};
     TCLAP::MultiArg<std::string> fuse_options{
         "o",
         "opt",
@@ -588,6 +683,53 @@ private:
                                       30,
                                       "int",
                                       cmdline()};
+    TCLAP::ValueArg<unsigned> readahead_blocks{
+        "",
+        "readahead-blocks",
+        "Number of blocks to decrypt ahead in the background when a file is read sequentially. "
+        "0 disables read-ahead. Only applicable to lite format.",
+        false,
+        32,
+        "unsigned",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> write_behind{
+        "",
+        "write-behind",
+        "Maximum megabytes of written data per open file to buffer for encryption in the "
+        "background. 0 disables write-behind. When enabled, errors of deferred writes are "
+        "reported on the next flush, fsync or close of the file.",
+        false,
+        0,
+        "unsigned",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> fsync_window{
+        "",
+        "fsync-window",
+        "Microseconds to wait for concurrent fsync requests to join a batch, so that they are "
+        "flushed to the disk together. Requests arriving while a batch is being flushed are "
+        "always batched, even if this is 0.",
+        false,
+        0,
+        "unsigned",
+        cmdline()};
+    TCLAP::SwitchArg keep_cache{
+        "",
+        "keep-cache",
+        "Keeps the kernel page cache of files across opens, so that rereading unchanged files "
+        "does not involve securefs at all. Safe as long as the data directory is only modified "
+        "through this mount. Not applied to files with multiple hard links, or when names are "
+        "case or Unicode normalization insensitive.",
+        cmdline()};
+    TCLAP::ValueArg<std::string> aead_backend{
+        "",
+        "aead-backend",
+        "The implementation of AES-GCM for file contents and xattrs: cryptopp, aesni (AES-NI with "
+        "PCLMULQDQ) or vaes (VAES with VPCLMULQDQ). The default auto picks the fastest one the "
+        "CPU supports. The version command lists the supported ones.",
+        false,
+        "auto",
+        "auto/cryptopp/aesni/vaes",
+        cmdline()};
     TCLAP::SwitchArg skip_dot_dot{
         "", "skip-dot-dot", "A no-op option retained for backwards compatibility", cmdline()};
     TCLAP::SwitchArg plain_text_names{"",
@@ -616,15 +758,6 @@ private:
     DecryptedSecurefsParams fsparams{};
 
 private:
-    std::vector<const char*> to_c_style_args(const std::vector<std::string>& args)
-    {
-        std::vector<const char*> result(args.size());
-        std::transform(args.begin(),
-                       args.end(),
-                       result.begin(),
-                       [](const std::string& s) { return s.c_str(); });
-        return result;
-    }
 #ifdef _WIN32
     static bool is_letter(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
     static bool is_drive_mount(std::string_view mount_point)
@@ -659,22 +792,27 @@ private:
         return key_type{reinterpret_cast<const byte*>(view.data()), view.size()};
     }
 
-    static fruit::Component<FuseHighLevelOpsBase>
+    static fruit::Component<FuseHighLevelOpsBase, RepoVerifier>
     get_fuse_high_ops_component(const MountCommand* cmd)
     {
         auto internal_binder = [](DecryptedSecurefsParams::FormatSpecificParamsCase format_case)
-            -> fruit::Component<
-                fruit::Required<lite_format::FuseHighLevelOps, full_format::FuseHighLevelOps>,
-                FuseHighLevelOpsBase>
+            -> fruit::Component<fruit::Required<lite_format::FuseHighLevelOps,
+                                                full_format::FuseHighLevelOps,
+                                                lite_format::RepoVerifier,
+                                                full_format::RepoVerifier>,
+                                FuseHighLevelOpsBase,
+                                RepoVerifier>
         {
             switch (format_case)
             {
             case DecryptedSecurefsParams::kLiteFormatParams:
                 return fruit::createComponent()
-                    .bind<FuseHighLevelOpsBase, lite_format::FuseHighLevelOps>();
+                    .bind<FuseHighLevelOpsBase, lite_format::FuseHighLevelOps>()
+                    .bind<RepoVerifier, lite_format::RepoVerifier>();
             case DecryptedSecurefsParams::kFullFormatParams:
                 return fruit::createComponent()
-                    .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>();
+                    .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>()
+                    .bind<RepoVerifier, full_format::RepoVerifier>();
             default:
                 throwInvalidArgumentException("Unknown format case");
             }
@@ -724,8 +862,8 @@ private:
             .registerProvider<fruit::Annotated<tReadOnly, bool>(const MountCommand&)>(
                 [](const MountCommand& cmd)
                 {
-                    // TODO: Support readonly mounts.
-                    return false;
+                    // TODO: Support readonly mounts. Only the offline commands set this for now.
+                    return cmd.read_only_;
                 })
             .bind<Directory, BtreeDirectory>()
             .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>(const MountCommand&)>(
@@ -792,7 +930,18 @@ private:
                 })
             .registerProvider<fruit::Annotated<tCaseInsensitive, bool>(const MountCommand&)>(
                 [](const MountCommand& cmd)
-                { return cmd.fsparams.full_format_params().case_insensitive(); });
+                { return cmd.fsparams.full_format_params().case_insensitive(); })
+            .registerProvider<fruit::Annotated<tReadAheadBlocks, unsigned>(const MountCommand&)>(
+                [](const MountCommand& cmd) { return cmd.readahead_blocks.getValue(); })
+            .registerProvider<fruit::Annotated<tWriteBehindLimit, unsigned>(const MountCommand&)>(
+                [](const MountCommand& cmd) { return cmd.write_behind.getValue(); })
+            .registerProvider<fruit::Annotated<tFsyncWindow, unsigned>(const MountCommand&)>(
+                [](const MountCommand& cmd) { return cmd.fsync_window.getValue(); })
+            .registerProvider<fruit::Annotated<tAttrCacheTimeout, unsigned>(const MountCommand&)>(
+                [](const MountCommand& cmd)
+                { return static_cast<unsigned>(std::max(0, cmd.attr_timeout.getValue())); })
+            .registerProvider<fruit::Annotated<tKeepCache, bool>(const MountCommand&)>(
+                [](const MountCommand& cmd) { return cmd.keep_cache.getValue(); });
     }
 
     bool should_use_ino()
@@ -826,6 +975,9 @@ private:
         throw_runtime_error("Invalid --use_ino. Must be true/false/auto.");
     }
 
+    FuseThreadOptions thread_options_;
+    bool read_only_ = false;
+
 public:
     void parse_cmdline(int argc, const char* const* argv) override
     {
@@ -843,8 +995,35 @@ public:
         {
             WARN_LOG("Using --noflock without --single is highly dangerous");
         }
+        set_default_aead_backend(parse_aead_backend(aead_backend.getValue()));
+        if (stats_interval.getValue() == 0)
+        {
+            throw_runtime_error("--stats-interval must be positive");
+        }
+        // Before mounting, so that bad counts are reported before anything else happens, such as
+        // daemonizing.
+        thread_options_ = parse_thread_options(
+            threads.getValue(), metadata_threads.getValue(), std::thread::hardware_concurrency());
+        thread_options_.pin_to_cpus = cpu_affinity.getValue();
+    }
+
+    using RepoInjector = fruit::Injector<FuseHighLevelOpsBase, RepoVerifier>;
+
+    /// Builds the filesystem over the data dir as `execute()` does, but with the given params
+    /// instead of the decrypted config, so that its operations can be called in process. With
+    /// `read_only`, the underlying files are opened read only, so that only the operations that
+    /// read may be used.
+    std::unique_ptr<RepoInjector> create_injector(DecryptedSecurefsParams params,
+                                                  bool read_only = false)
+    {
+        fsparams = std::move(params);
+        read_only_ = read_only;
+        return std::make_unique<RepoInjector>(get_fuse_high_ops_component, this);
     }
 
+    /// False with --insecure, which turns off the checks of the MACs.
+    bool verifies_integrity() const noexcept { return !insecure.getValue(); }
+
     void recreate_logger()
     {
         if (log.isSet())
@@ -874,11 +1053,16 @@ public:
         {
             OSService::enter_background();
         }
+        if (global_logger && async_log.getValue())
+        {
+            global_logger->start_async();
+        }
 
         if (single_pass_holder_.data_dir.getValue() == mount_point.getValue())
         {
             WARN_LOG("Mounting a directory on itself may cause securefs to hang");
         }
+        VERBOSE_LOG("Using the %s backend for AES-GCM", stringify(get_default_aead_backend()));
 
 #ifdef _WIN32
         bool network_mount = is_network_mount(mount_point.getValue());
@@ -961,7 +1145,7 @@ public:
 #ifdef _WIN32
             fuse_args.emplace_back("-o");
             fuse_args.emplace_back(
-                absl::StrFormat("ThreadCount=%d", std::thread::hardware_concurrency()));
+                absl::StrFormat("ThreadCount=%d", thread_options_.max_threads));
 #endif
         }
         // Handling `daemon` ourselves, as FUSE's version interferes with our initialization.
@@ -1019,7 +1203,10 @@ public:
 #endif
             fuse_args.emplace_back(mount_point.getValue());
 
-        fruit::Injector<FuseHighLevelOpsBase> injector(get_fuse_high_ops_component, this);
+        // Declared before everything that may log on its destruction, such as the filesystem
+        // flushing its files, so that it runs after all of them.
+        DEFER(if (global_logger) global_logger->flush());
+        RepoInjector injector(get_fuse_high_ops_component, this);
 
         bool native_xattr = !noxattr.getValue();
 #ifdef __APPLE__
@@ -1037,13 +1224,27 @@ public:
             }
         }
 #endif
-        auto high_level_ops = injector.get<FuseHighLevelOpsBase*>();
+        FuseHighLevelOpsBase* high_level_ops = injector.get<FuseHighLevelOpsBase*>();
+        std::unique_ptr<StatsFileOps> stats_file_ops;
+        if (!stats_path.getValue().empty())
+        {
+            stats_file_ops = std::make_unique<StatsFileOps>(*high_level_ops, stats_path.getValue());
+            high_level_ops = stats_file_ops.get();
+        }
         auto fuse_callbacks = FuseHighLevelOpsBase::build_ops(high_level_ops, native_xattr);
+        std::unique_ptr<trace::TraceRecorder> trace_recorder;
+        if (!trace_file.getValue().empty())
+        {
+            trace_recorder = std::make_unique<trace::TraceRecorder>(trace_file.getValue());
+        }
+        MetricsReporter metrics_reporter(stats_file.getValue(),
+                                         absl::Seconds(stats_interval.getValue()));
         VERBOSE_LOG("Calling fuse_main with arguments: %s", escape_args(fuse_args));
         return my_fuse_main(static_cast<int>(fuse_args.size()),
                             const_cast<char**>(to_c_style_args(fuse_args).data()),
                             &fuse_callbacks,
-                            high_level_ops);
+                            high_level_ops,
+                            thread_options_);
     }
 
     const char* long_name() const noexcept override { return "mount"; }
@@ -1053,6 +1254,664 @@ public:
     const char* help_message() const noexcept override { return "Mount an existing filesystem"; }
 };
 
+/// A repository with random keys in a new directory, which is removed on destruction, and the
+/// filesystem over it as configured by the options of the mount command, for in process use.
+class TemporaryRepository
+{
+private:
+    std::string dir_;
+    MountCommand mount_;
+    std::unique_ptr<MountCommand::RepoInjector> injector_;
+
+    static void remove_recursively(const std::string& dir) noexcept
+    {
+        if (!OSService::get_default().remove_recursively_nothrow(dir))
+        {
+            WARN_LOG("Failed to remove the temporary repository %s", dir);
+        }
+    }
+
+    static DecryptedSecurefsParams
+    make_params(const std::string& format, unsigned block_size, unsigned max_padding)
+    {
+        DecryptedSecurefsParams params;
+        params.mutable_size_params()->set_iv_size(12);
+        params.mutable_size_params()->set_block_size(block_size);
+        params.mutable_size_params()->set_max_padding_size(max_padding);
+        if (format == "lite")
+        {
+            randomize(params.mutable_lite_format_params()->mutable_name_key(), 32);
+            randomize(params.mutable_lite_format_params()->mutable_content_key(), 32);
+            randomize(params.mutable_lite_format_params()->mutable_xattr_key(), 32);
+            randomize(params.mutable_lite_format_params()->mutable_padding_key(), 32);
+            params.mutable_lite_format_params()->set_long_name_threshold(128);
+        }
+        else if (format == "full")
+        {
+            randomize(params.mutable_full_format_params()->mutable_master_key(), 32);
+        }
+        else
+        {
+            throw_runtime_error("Invalid value for --format: " + format);
+        }
+        return params;
+    }
+
+public:
+    /// `mount_args` are separated by spaces.
+    TemporaryRepository(const std::string& parent_dir,
+                        const std::string& format,
+                        unsigned block_size,
+                        unsigned max_padding,
+                        std::string_view mount_args)
+    {
+        auto params = make_params(format, block_size, max_padding);
+        dir_ = OSService::temp_name(absl::StrCat(parent_dir, "/securefs-temp-"), "");
+        OSService::get_default().ensure_directory(dir_, 0755);
+        try
+        {
+            // The mount point and the password are required by the parser but never used.
+            std::vector<std::string> args{"mount", dir_, dir_, "--pass", "unused"};
+            for (std::string_view arg : absl::StrSplit(mount_args, ' ', absl::SkipWhitespace()))
+            {
+                args.emplace_back(arg);
+            }
+            mount_.parse_cmdline(static_cast<int>(args.size()), to_c_style_args(args).data());
+            VERBOSE_LOG("Using the %s backend for AES-GCM", stringify(get_default_aead_backend()));
+            injector_ = mount_.create_injector(std::move(params));
+            fuse_conn_info conn{};
+            ops().initialize(&conn);
+        }
+        catch (...)
+        {
+            injector_.reset();
+            remove_recursively(dir_);
+            throw;
+        }
+    }
+
+    ~TemporaryRepository()
+    {
+        // The filesystem may still write to the repository while being torn down.
+        injector_.reset();
+        remove_recursively(dir_);
+    }
+
+    DISABLE_COPY_MOVE(TemporaryRepository)
+
+    FuseHighLevelOpsBase& ops() { return injector_->get<FuseHighLevelOpsBase&>(); }
+};
+
+class BenchCommand : public CommandBase
+{
+private:
+    TCLAP::ValueArg<std::string> format{
+        "f",
+        "format",
+        "The format type of the temporary repository. Either lite or full.",
+        false,
+        "lite",
+        "lite/full",
+        cmdline()};
+    TCLAP::ValueArg<std::string> workload{
+        "w",
+        "workload",
+        "sequential: write then read one large file per thread. random: mixed reads and writes at "
+        "random offsets of one large file per thread. small-file: create, write, stat and read "
+        "many small files. metadata: create, stat, list, rename and unlink many empty files.",
+        false,
+        "sequential",
+        "sequential/random/small-file/metadata",
+        cmdline()};
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads issuing operations at once",
+                                      false,
+                                      4,
+                                      "integer",
+                                      cmdline()};
+    TCLAP::ValueArg<unsigned> file_size{"",
+                                        "file-size",
+                                        "Megabytes of the file of each thread in the sequential "
+                                        "and random workloads",
+                                        false,
+                                        64,
+                                        "integer",
+                                        cmdline()};
+    TCLAP::ValueArg<unsigned> io_size{"",
+                                      "io-size",
+                                      "Bytes per read or write, which is also the size of each "
+                                      "file of the small-file workload",
+                                      false,
+                                      128 << 10,
+                                      "integer",
+                                      cmdline()};
+    TCLAP::ValueArg<unsigned> files{"",
+                                    "files",
+                                    "Number of files per thread in the small-file and metadata "
+                                    "workloads",
+                                    false,
+                                    1000,
+                                    "integer",
+                                    cmdline()};
+    TCLAP::ValueArg<unsigned int> block_size{"",
+                                             "block-size",
+                                             "Block size for files of the temporary repository",
+                                             false,
+                                             4096,
+                                             "integer",
+                                             cmdline()};
+    TCLAP::ValueArg<unsigned> max_padding{
+        "",
+        "max-padding",
+        "Maximum number of padding bytes of files of the temporary repository",
+        false,
+        0,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<std::string> dir{"",
+                                     "dir",
+                                     "Directory in which to create the temporary repository, "
+                                     "which is removed afterwards",
+                                     false,
+                                     ".",
+                                     "path",
+                                     cmdline()};
+    TCLAP::ValueArg<std::string> mount_args{
+        "",
+        "mount-args",
+        "Options of the mount command to apply, separated by spaces, such as \"--write-behind 8 "
+        "--aead-backend aesni\"",
+        false,
+        "",
+        "options",
+        cmdline()};
+    TCLAP::SwitchArg json{"", "json", "Prints the report as JSON instead of text", cmdline()};
+
+public:
+    int execute() override
+    {
+        BenchOptions options;
+        options.workload = parse_bench_workload(workload.getValue());
+        options.threads = threads.getValue();
+        options.file_size = uint64_t{file_size.getValue()} << 20;
+        options.io_size = io_size.getValue();
+        options.files = files.getValue();
+
+        TemporaryRepository repo(dir.getValue(),
+                                 format.getValue(),
+                                 block_size.getValue(),
+                                 max_padding.getValue(),
+                                 mount_args.getValue());
+        auto report = run_fuse_bench(repo.ops(), options);
+        fputs((json.getValue() ? report.to_json() : report.to_text()).c_str(), stdout);
+        return 0;
+    }
+
+    const char* long_name() const noexcept override { return "bench"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Benchmark the filesystem operations in process on a temporary repository, without "
+               "FUSE";
+    }
+};
+
+class ReplayCommand : public CommandBase
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> trace_file{
+        "trace", "The file recorded by mount --trace-file", true, "", "trace", cmdline()};
+    TCLAP::ValueArg<std::string> format{
+        "f",
+        "format",
+        "The format type of the temporary repository. Either lite or full.",
+        false,
+        "lite",
+        "lite/full",
+        cmdline()};
+    TCLAP::ValueArg<double> speed{"",
+                                  "speed",
+                                  "How many times faster than recorded to issue the operations. 0 "
+                                  "issues them as fast as possible, keeping only their order "
+                                  "within each thread",
+                                  false,
+                                  1,
+                                  "number",
+                                  cmdline()};
+    TCLAP::ValueArg<unsigned int> block_size{"",
+                                             "block-size",
+                                             "Block size for files of the temporary repository",
+                                             false,
+                                             4096,
+                                             "integer",
+                                             cmdline()};
+    TCLAP::ValueArg<unsigned> max_padding{
+        "",
+        "max-padding",
+        "Maximum number of padding bytes of files of the temporary repository",
+        false,
+        0,
+        "int",
+        cmdline()};
+    TCLAP::ValueArg<std::string> dir{"",
+                                     "dir",
+                                     "Directory in which to create the temporary repository, "
+                                     "which is removed afterwards",
+                                     false,
+                                     ".",
+                                     "path",
+                                     cmdline()};
+    TCLAP::ValueArg<std::string> mount_args{
+        "",
+        "mount-args",
+        "Options of the mount command to apply, separated by spaces, such as \"--write-behind 8 "
+        "--aead-backend aesni\"",
+        false,
+        "",
+        "options",
+        cmdline()};
+    TCLAP::SwitchArg json{"", "json", "Prints the report as JSON instead of text", cmdline()};
+
+public:
+    int execute() override
+    {
+        trace::ReplayOptions options;
+        options.speed = speed.getValue();
+        auto records = trace::read_trace_file(trace_file.getValue());
+
+        TemporaryRepository repo(dir.getValue(),
+                                 format.getValue(),
+                                 block_size.getValue(),
+                                 max_padding.getValue(),
+                                 mount_args.getValue());
+        auto report = trace::replay_trace(repo.ops(), std::move(records), options);
+        fputs((json.getValue() ? report.to_json() : report.to_text()).c_str(), stdout);
+        return 0;
+    }
+
+    const char* long_name() const noexcept override { return "replay"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Replay a trace recorded by mount --trace-file in process on a temporary "
+               "repository, with the recorded concurrency and timing";
+    }
+};
+
+struct WalkArgsHolder : public ArgsHolder
+{
+    using ArgsHolder::ArgsHolder;
+
+    TCLAP::ValueArg<unsigned> threads{"t",
+                                      "threads",
+                                      "Number of threads working on the repository at once. 0 "
+                                      "means the number of hardware threads",
+                                      false,
+                                      0,
+                                      "integer",
+                                      cmdline};
+    TCLAP::ValueArg<unsigned> progress_interval{"",
+                                                "progress-interval",
+                                                "Seconds between the progress reports on stderr. 0 "
+                                                "disables them",
+                                                false,
+                                                10,
+                                                "seconds",
+                                                cmdline};
+    TCLAP::ValueArg<std::string> mount_args{
+        "",
+        "mount-args",
+        "Options of the mount command that the repository is mounted with, separated by spaces, "
+        "such as \"--plain-text-names\"",
+        false,
+        "",
+        "options",
+        cmdline};
+    TCLAP::SwitchArg json{"", "json", "Prints the report as JSON instead of text", cmdline};
+
+    WalkOptions to_options() const
+    {
+        WalkOptions options;
+        options.threads = threads.getValue();
+        options.progress_interval = progress_interval.getValue() > 0
+            ? absl::Seconds(progress_interval.getValue())
+            : absl::InfiniteDuration();
+        options.on_progress = [](const WalkProgress& p)
+        {
+            double seconds = absl::ToDoubleSeconds(p.elapsed);
+            absl::FPrintF(stderr,
+                          "%u files and %u directories, %.1f MiB in %.0f s (%.1f MiB/s), %u "
+                          "problems so far\n",
+                          p.files,
+                          p.directories,
+                          p.bytes / 1048576.0,
+                          seconds,
+                          seconds > 0 ? p.bytes / 1048576.0 / seconds : 0.0,
+                          p.problems);
+        };
+        return options;
+    }
+
+    int print(const WalkReport& report) const
+    {
+        fputs((json.getValue() ? report.to_json() : report.to_text()).c_str(), stdout);
+        return report.ok() ? 0 : 1;
+    }
+};
+
+/// A repository opened in process, as it would be mounted, for the commands that work on the
+/// whole of it at once.
+class OfflineRepository
+{
+private:
+    MountCommand mount_;
+    std::unique_ptr<MountCommand::RepoInjector> injector_;
+    bool initialized_ = false;
+
+public:
+    /// With `read_only`, only the verifier and the operations that read may be used. The password
+    /// is wiped afterwards.
+    OfflineRepository(const std::string& data_dir,
+                      const std::string& config_path,
+                      CryptoPP::AlignedSecByteBlock& password,
+                      const std::string& keyfile,
+                      std::string_view mount_args,
+                      bool read_only)
+    {
+        auto params = decrypt(
+            OSService::get_default()
+                .open_file_stream(DataDirHolder::find_config_path(data_dir, config_path),
+                                  O_RDONLY,
+                                  0)
+                ->as_string(),
+            {password.data(), password.size()},
+            maybe_open_key_stream(keyfile).get());
+        CryptoPP::SecureWipeBuffer(password.data(), password.size());
+
+        // The mount point and the password are required by the parser but never used.
+        std::vector<std::string> args{"mount", data_dir, data_dir, "--pass", "unused"};
+        for (std::string_view arg : absl::StrSplit(mount_args, ' ', absl::SkipWhitespace()))
+        {
+            args.emplace_back(arg);
+        }
+        mount_.parse_cmdline(static_cast<int>(args.size()), to_c_style_args(args).data());
+        injector_ = mount_.create_injector(std::move(params), read_only);
+    }
+
+    OfflineRepository(SinglePasswordHolder& pass_holder,
+                      const WalkArgsHolder& walk_holder,
+                      bool read_only)
+        : OfflineRepository(pass_holder.data_dir.getValue(),
+                            pass_holder.config_path.getValue(),
+                            pass_holder.password,
+                            pass_holder.keyfile.getValue(),
+                            walk_holder.mount_args.getValue(),
+                            read_only)
+    {
+    }
+
+    DISABLE_COPY_MOVE(OfflineRepository)
+
+    FuseHighLevelOpsBase& ops()
+    {
+        auto& ops = injector_->get<FuseHighLevelOpsBase&>();
+        if (!initialized_)
+        {
+            fuse_conn_info conn{};
+            ops.initialize(&conn);
+            initialized_ = true;
+        }
+        return ops;
+    }
+
+    RepoVerifier& verifier()
+    {
+        // Otherwise every file whose content was tampered with would be reported as fine.
+        if (!mount_.verifies_integrity())
+        {
+            throw_runtime_error("A repository cannot be verified with --insecure");
+        }
+        return injector_->get<RepoVerifier&>();
+    }
+};
+
+class VerifyCommand : public CommandBase
+{
+private:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    WalkArgsHolder walk_holder_{cmdline()};
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    int execute() override
+    {
+        OfflineRepository repo(single_pass_holder_, walk_holder_, true);
+        return walk_holder_.print(repo.verifier().verify(walk_holder_.to_options()));
+    }
+
+    const char* long_name() const noexcept override { return "verify"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Check the integrity of every file, directory and name of a repository without "
+               "mounting it, with many threads. Exits with 1 if any problem is found";
+    }
+};
+
+struct TransferArgsHolder : public ArgsHolder
+{
+    using ArgsHolder::ArgsHolder;
+
+    TCLAP::ValueArg<unsigned> chunk_size{"",
+                                         "chunk-size",
+                                         "Bytes of a file read and written at once. A multiple "
+                                         "of the block size avoids partial blocks",
+                                         false,
+                                         4 << 20,
+                                         "bytes",
+                                         cmdline};
+    TCLAP::SwitchArg resume{"",
+                            "resume",
+                            "Continues an interrupted copy into the same destination, skipping "
+                            "what is already there instead of reporting it",
+                            cmdline,
+                            false};
+
+    TransferOptions to_options(const WalkArgsHolder& walk_holder) const
+    {
+        TransferOptions options;
+        options.walk = walk_holder.to_options();
+        options.chunk_size = chunk_size.getValue();
+        options.resume = resume.getValue();
+        return options;
+    }
+};
+
+/// The common part of `import` and `export`, which differ only in the direction of the copy.
+class TransferCommandBase : public CommandBase
+{
+protected:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    WalkArgsHolder walk_holder_{cmdline()};
+    TCLAP::ValueArg<std::string> path{"",
+                                      "path",
+                                      "Directory inside the repository to copy into or from",
+                                      false,
+                                      "/",
+                                      "path",
+                                      cmdline()};
+    TransferArgsHolder transfer_holder_{cmdline()};
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+    }
+
+    char short_name() const noexcept override { return 0; }
+};
+
+class ImportCommand : public TransferCommandBase
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> source{"source",
+                                                 "Directory outside of the repository to copy from",
+                                                 true,
+                                                 "",
+                                                 "source",
+                                                 cmdline()};
+
+public:
+    int execute() override
+    {
+        OfflineRepository repo(single_pass_holder_, walk_holder_, false);
+        auto options = transfer_holder_.to_options(walk_holder_);
+        return walk_holder_.print(
+            import_tree(repo.ops(), source.getValue(), path.getValue(), options));
+    }
+
+    const char* long_name() const noexcept override { return "import"; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Copy a directory tree into a repository without mounting it, encrypting many "
+               "files at once. Exits with 1 if any entry fails to copy";
+    }
+};
+
+class ExportCommand : public TransferCommandBase
+{
+private:
+    TCLAP::UnlabeledValueArg<std::string> dest{
+        "dest", "Directory outside of the repository to copy to", true, "", "dest", cmdline()};
+
+public:
+    int execute() override
+    {
+        OfflineRepository repo(single_pass_holder_, walk_holder_, true);
+        auto options = transfer_holder_.to_options(walk_holder_);
+        return walk_holder_.print(
+            export_tree(repo.ops(), path.getValue(), dest.getValue(), options));
+    }
+
+    const char* long_name() const noexcept override { return "export"; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Copy a directory tree out of a repository without mounting it, decrypting many "
+               "files at once. Exits with 1 if any entry fails to copy";
+    }
+};
+
+class ConvertCommand : public CommandBase
+{
+private:
+    SinglePasswordHolder single_pass_holder_{cmdline()};
+    WalkArgsHolder walk_holder_{cmdline()};
+    TransferArgsHolder transfer_holder_{cmdline()};
+    TCLAP::UnlabeledValueArg<std::string> dest_dir{
+        "dest_dir",
+        "Directory of the destination repository, created beforehand with the create command",
+        true,
+        "",
+        "dest_dir",
+        cmdline()};
+    TCLAP::ValueArg<std::string> dest_config{
+        "",
+        "dest-config",
+        "Full path name of the config file of the destination. ${dest_dir}/.config.pb by default",
+        false,
+        "",
+        "config_path",
+        cmdline()};
+    TCLAP::ValueArg<std::string> dest_pass{
+        "",
+        "dest-pass",
+        "Password of the destination (prefer manually typing or piping since those methods are "
+        "more secure)",
+        false,
+        "",
+        "password",
+        cmdline()};
+    TCLAP::ValueArg<std::string> dest_keyfile{"",
+                                              "dest-keyfile",
+                                              "An optional path to a key file of the destination",
+                                              false,
+                                              "",
+                                              "path",
+                                              cmdline()};
+    TCLAP::ValueArg<std::string> dest_mount_args{
+        "",
+        "dest-mount-args",
+        "Options of the mount command that the destination is mounted with, separated by spaces",
+        false,
+        "",
+        "options",
+        cmdline()};
+    CryptoPP::AlignedSecByteBlock dest_password;
+
+public:
+    void parse_cmdline(int argc, const char* const* argv) override
+    {
+        CommandBase::parse_cmdline(argc, argv);
+        single_pass_holder_.get_password(false);
+        if (dest_pass.isSet() && !dest_pass.getValue().empty())
+        {
+            dest_password.Assign(reinterpret_cast<const byte*>(dest_pass.getValue().data()),
+                                 dest_pass.getValue().size());
+            secure_wipe(&dest_pass.getValue()[0], dest_pass.getValue().size());
+        }
+        else if (!dest_keyfile.getValue().empty())
+        {
+            dest_password.Assign(
+                reinterpret_cast<const byte*>(EMPTY_PASSWORD_WHEN_KEY_FILE_IS_USED.data()),
+                EMPTY_PASSWORD_WHEN_KEY_FILE_IS_USED.size());
+        }
+        else
+        {
+            OSService::read_password_no_confirmation("Destination password: ", &dest_password);
+        }
+    }
+
+    int execute() override
+    {
+        // The source is only read, so a conversion cannot modify it.
+        OfflineRepository source(single_pass_holder_, walk_holder_, true);
+        OfflineRepository dest(dest_dir.getValue(),
+                               dest_config.getValue(),
+                               dest_password,
+                               dest_keyfile.getValue(),
+                               dest_mount_args.getValue(),
+                               false);
+        auto options = transfer_holder_.to_options(walk_holder_);
+        return walk_holder_.print(copy_tree(source.ops(), "/", dest.ops(), "/", options));
+    }
+
+    const char* long_name() const noexcept override { return "convert"; }
+
+    char short_name() const noexcept override { return 0; }
+
+    const char* help_message() const noexcept override
+    {
+        return "Copy everything in a repository into another, such as one of a different format, "
+               "without mounting either, with many threads. An interrupted conversion continues "
+               "with --resume. Exits with 1 if any entry fails to copy";
+    }
+};
+
 class VersionCommand : public CommandBase
 {
 public:
@@ -1097,6 +1956,12 @@ public:
             CryptoPP::HasSHA3());
 #endif
 #endif
+        fputs("\nAES-GCM backends supported:", stdout);
+        for (AeadBackend backend : supported_aead_backends())
+        {
+            absl::PrintF(" %s", stringify(backend));
+        }
+        absl::PrintF(" (default: %s)\n", stringify(get_default_aead_backend()));
         return 0;
     }
 
@@ -1386,6 +2251,14 @@ public:
                         continue;
                     }
                 }
+                {
+                    auto a = dynamic_cast<TCLAP::ValueArg<double>*>(arg);
+                    if (a)
+                    {
+                        absl::PrintF("*Default: %g.*\n", a->getValue());
+                        continue;
+                    }
+                }
                 {
                     auto a = dynamic_cast<TCLAP::MultiArg<std::string>*>(arg);
                     if (a)
@@ -1412,6 +2285,12 @@ int commands_main(int argc, const char* const* argv)
                                                make_unique<VersionCommand>(),
                                                make_unique<InfoCommand>(),
                                                make_unique<MigrateLongNameCommand>(),
+                                               make_unique<BenchCommand>(),
+                                               make_unique<ReplayCommand>(),
+                                               make_unique<VerifyCommand>(),
+                                               make_unique<ImportCommand>(),
+                                               make_unique<ExportCommand>(),
+                                               make_unique<ConvertCommand>(),
                                                make_unique<DocCommand>()};
 
         const char* const program_name = argv[0];
@@ -45,6 +45,33 @@ void OSService::recursive_traverse(const std::string& dir,
     }
 }
 
+bool OSService::remove_recursively_nothrow(const std::string& dir) const noexcept
+{
+    try
+    {
+        std::vector<std::string> dirs{dir}, files;
+        recursive_traverse(
+            dir,
+            [&](const std::string& parent, const std::string& name, int type)
+            { (type == S_IFDIR ? dirs : files).push_back(StrCat(parent, "/", name)); });
+        bool success = true;
+        for (const std::string& f : files)
+        {
+            success = remove_file_nothrow(f) && success;
+        }
+        // Parents are listed before their children.
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it)
+        {
+            success = remove_directory_nothrow(*it) && success;
+        }
+        return success;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
 DirectoryTraverser::~DirectoryTraverser() = default;
 
 ssize_t FileStream::getxattr(const char*, void*, size_t) { throw VFSException(ENOTSUP); }
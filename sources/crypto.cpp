@@ -1,15 +1,22 @@
 #include "crypto.h"
 #include "exceptions.h"
-#include "lock_guard.h"
 
 #include <cryptopp/aes.h>
 #include <cryptopp/gcm.h>
 #include <cryptopp/hmac.h>
+#include <cryptopp/modes.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/pwdbased.h>
 #include <cryptopp/rng.h>
 #include <cryptopp/sha.h>
 
+#include <algorithm>
+#include <atomic>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 // Some of the following codes are copied from https://github.com/arktronic/aes-siv.
 // The licence follows:
 
@@ -61,35 +68,88 @@ static void aes256_siv_dbl(byte* block)
 }
 
 AES_SIV::AES_SIV(const void* key, size_t size)
-    : m_cmac(static_cast<const byte*>(key), size / 2)
+    : m_mac_cipher(static_cast<const byte*>(key), size / 2)
     , m_ctr(static_cast<const byte*>(key) + size / 2, size / 2, aes256_siv_zero_block)
 {
+    m_mac_cipher.ProcessBlock(aes256_siv_zero_block, m_cmac_k1);
+    aes256_siv_dbl(m_cmac_k1);
+    memcpy(m_cmac_k2, m_cmac_k1, sizeof(m_cmac_k2));
+    aes256_siv_dbl(m_cmac_k2);
+    cmac(aes256_siv_zero_block, array_length(aes256_siv_zero_block), nullptr, m_s2v_zero);
+}
+
+AES_SIV::~AES_SIV()
+{
+    CryptoPP::SecureWipeBuffer(m_cmac_k1, array_length(m_cmac_k1));
+    CryptoPP::SecureWipeBuffer(m_cmac_k2, array_length(m_cmac_k2));
+    CryptoPP::SecureWipeBuffer(m_s2v_zero, array_length(m_s2v_zero));
 }
 
-AES_SIV::~AES_SIV() = default;
+void AES_SIV::cmac(const byte* data, size_t size, const byte* tail, byte* mac) const
+{
+    byte X[AES_SIV::IV_SIZE] = {};
+    byte block[AES_SIV::IV_SIZE];
+
+    // Copies the block at `offset` with up to `length` bytes, and applies the part of `tail` that
+    // overlaps it.
+    auto load_block = [&](size_t offset, size_t length)
+    {
+        memcpy(block, data + offset, length);
+        if (tail && offset + length > size - AES_SIV::IV_SIZE)
+        {
+            size_t begin = std::max(offset, size - AES_SIV::IV_SIZE);
+            CryptoPP::xorbuf(block + (begin - offset),
+                             tail + (begin - (size - AES_SIV::IV_SIZE)),
+                             offset + length - begin);
+        }
+    };
+
+    // All but the last block, which is the only one that may be partial.
+    size_t last_offset = size == 0 ? 0 : (size - 1) / AES_SIV::IV_SIZE * AES_SIV::IV_SIZE;
+    for (size_t offset = 0; offset < last_offset; offset += AES_SIV::IV_SIZE)
+    {
+        load_block(offset, AES_SIV::IV_SIZE);
+        CryptoPP::xorbuf(X, block, AES_SIV::IV_SIZE);
+        m_mac_cipher.ProcessBlock(X);
+    }
+
+    size_t last_length = size - last_offset;
+    load_block(last_offset, last_length);
+    if (last_length == AES_SIV::IV_SIZE)
+    {
+        CryptoPP::xorbuf(X, m_cmac_k1, AES_SIV::IV_SIZE);
+    }
+    else
+    {
+        block[last_length] = aes256_iso_pad;
+        memset(block + last_length + 1, 0, AES_SIV::IV_SIZE - last_length - 1);
+        CryptoPP::xorbuf(X, m_cmac_k2, AES_SIV::IV_SIZE);
+    }
+    CryptoPP::xorbuf(X, block, AES_SIV::IV_SIZE);
+    m_mac_cipher.ProcessBlock(X, mac);
+}
 
 void AES_SIV::s2v(const void* plaintext,
                   size_t text_len,
                   const void* additional_data,
                   size_t additional_len,
-                  void* iv)
+                  void* iv) const
 {
     byte D[AES_SIV::IV_SIZE];
-    m_cmac.CalculateDigest(D, aes256_siv_zero_block, array_length(aes256_siv_zero_block));
+    memcpy(D, m_s2v_zero, array_length(D));
 
     if (additional_data && additional_len)
     {
         aes256_siv_dbl(D);
         byte add_mac[AES_SIV::IV_SIZE];
-        m_cmac.CalculateDigest(add_mac, static_cast<const byte*>(additional_data), additional_len);
+        cmac(static_cast<const byte*>(additional_data), additional_len, nullptr, add_mac);
         CryptoPP::xorbuf(D, add_mac, AES_SIV::IV_SIZE);
     }
 
     if (text_len >= AES_SIV::IV_SIZE)
     {
-        CryptoPP::AlignedSecByteBlock T(static_cast<const byte*>(plaintext), text_len);
-        CryptoPP::xorbuf(T.data() + text_len - array_length(D), D, array_length(D));
-        m_cmac.CalculateDigest(static_cast<byte*>(iv), T.data(), T.size());
+        // The xor of `D` into the end of the plaintext happens inside CMAC, without a copy.
+        cmac(static_cast<const byte*>(plaintext), text_len, D, static_cast<byte*>(iv));
     }
     else
     {
@@ -102,7 +162,7 @@ void AES_SIV::s2v(const void* plaintext,
             padded[i] = 0;
         }
         CryptoPP::xorbuf(D, padded, AES_SIV::IV_SIZE);
-        m_cmac.CalculateDigest(static_cast<byte*>(iv), D, array_length(D));
+        cmac(D, array_length(D), nullptr, static_cast<byte*>(iv));
     }
 }
 
@@ -113,8 +173,6 @@ void AES_SIV::encrypt_and_authenticate(const void* plaintext,
                                        void* ciphertext,
                                        void* siv)
 {
-    LockGuard<Mutex> lg(m_mutex);
-
     s2v(plaintext, text_len, additional_data, additional_len, siv);
     byte modded_iv[AES_SIV::IV_SIZE];
     memcpy(modded_iv, siv, AES_SIV::IV_SIZE);
@@ -135,8 +193,6 @@ bool AES_SIV::decrypt_and_verify(const void* ciphertext,
                                  void* plaintext,
                                  const void* siv)
 {
-    LockGuard<Mutex> lg(m_mutex);
-
     byte temp_iv[AES_SIV::IV_SIZE];
     memcpy(temp_iv, siv, AES_SIV::IV_SIZE);
     // Clear the 31st and 63rd bits in the IV.
@@ -157,6 +213,110 @@ void generate_random(void* buffer, size_t size)
     rng.GenerateBlock(static_cast<byte*>(buffer), size);
 }
 
+namespace
+{
+    // Bumped in the child of every `fork()`, so that the child never hands out the same IVs as the
+    // parent from a copied pool.
+    std::atomic<unsigned> fork_generation{0};
+
+    void on_fork_child() { fork_generation.fetch_add(1, std::memory_order_release); }
+
+    class AesCtrGenerator
+    {
+    public:
+        static constexpr size_t kKeySize = 32;
+        static constexpr size_t kSeedSize = kKeySize + CryptoPP::AES::BLOCKSIZE;
+        static constexpr size_t kPoolSize = 4096;
+        // Bounds the output derived from one seed from the operating system.
+        static constexpr unsigned kRefillsPerReseed = 256;
+
+    private:
+        CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption m_ctr;
+        // The trailing `kSeedSize` bytes of each refill become the next key and counter, and are
+        // never handed out.
+        CryptoPP::SecByteBlock m_pool{kPoolSize + kSeedSize};
+        size_t m_position = kPoolSize;
+        unsigned m_refills_until_reseed = 0;
+        unsigned m_fork_generation = 0;
+        bool m_seeded = false;
+
+        void rekey(byte* seed)
+        {
+            m_ctr.SetKeyWithIV(seed, kKeySize, seed + kKeySize, CryptoPP::AES::BLOCKSIZE);
+            CryptoPP::SecureWipeBuffer(seed, kSeedSize);
+        }
+
+        void reseed(unsigned generation)
+        {
+            byte seed[kSeedSize];
+            CryptoPP::OS_GenerateRandomBlock(false, seed, sizeof(seed));
+            if (m_seeded)
+            {
+                // Mix in the current state, so a weak OS generator never makes things worse.
+                byte state[kSeedSize] = {};
+                m_ctr.ProcessData(state, state, sizeof(state));
+                CryptoPP::xorbuf(seed, state, sizeof(state));
+                CryptoPP::SecureWipeBuffer(state, sizeof(state));
+            }
+            rekey(seed);
+            m_seeded = true;
+            m_refills_until_reseed = kRefillsPerReseed;
+            m_fork_generation = generation;
+        }
+
+        void refill()
+        {
+            unsigned generation = fork_generation.load(std::memory_order_acquire);
+            if (!m_seeded || m_refills_until_reseed == 0 || generation != m_fork_generation)
+            {
+                reseed(generation);
+            }
+            memset(m_pool.data(), 0, m_pool.size());
+            m_ctr.ProcessData(m_pool.data(), m_pool.data(), m_pool.size());
+            rekey(m_pool.data() + kPoolSize);
+            --m_refills_until_reseed;
+            m_position = 0;
+        }
+
+    public:
+        AesCtrGenerator()
+        {
+#ifndef _WIN32
+            static const int result = pthread_atfork(nullptr, nullptr, &on_fork_child);
+            (void)result;
+#endif
+        }
+
+        void generate(byte* output, size_t size)
+        {
+            if (m_fork_generation != fork_generation.load(std::memory_order_relaxed))
+            {
+                m_position = kPoolSize;
+            }
+            while (size > 0)
+            {
+                if (m_position >= kPoolSize)
+                {
+                    refill();
+                }
+                size_t n = std::min(size, kPoolSize - m_position);
+                memcpy(output, m_pool.data() + m_position, n);
+                // Wipe what has been handed out so that it cannot be recovered from this thread.
+                memset(m_pool.data() + m_position, 0, n);
+                m_position += n;
+                output += n;
+                size -= n;
+            }
+        }
+    };
+}    // namespace
+
+void generate_iv(void* buffer, size_t size)
+{
+    static thread_local AesCtrGenerator generator;
+    generator.generate(static_cast<byte*>(buffer), size);
+}
+
 void hmac_sha256_calculate(
     const void* message, size_t msg_len, const void* key, size_t key_len, void* mac, size_t mac_len)
 {
@@ -12,19 +12,28 @@
 namespace securefs
 {
 // Implementation of AES-SIV according to https://tools.ietf.org/html/rfc5297
+//
+// An instance is not safe to use from multiple threads concurrently. Callers keep one per thread,
+// such as through `ThreadLocal`, so no locking is done here.
 class AES_SIV
 {
 private:
-    Mutex m_mutex;
-    CryptoPP::CMAC<CryptoPP::AES> m_cmac ABSL_GUARDED_BY(m_mutex);
-    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption m_ctr ABSL_GUARDED_BY(m_mutex);
+    CryptoPP::AES::Encryption m_mac_cipher;
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption m_ctr;
+    // The CMAC subkeys (https://tools.ietf.org/html/rfc4493) and the first value of S2V, which only
+    // depend on the key.
+    byte m_cmac_k1[16], m_cmac_k2[16], m_s2v_zero[16];
 
 private:
+    // Computes the CMAC of `data`. If `tail` is not null, its 16 bytes are xored into the last 16
+    // bytes of `data` on the fly, and `size` must be at least 16.
+    void cmac(const byte* data, size_t size, const byte* tail, byte* mac) const;
+
     void s2v(const void* plaintext,
              size_t text_len,
              const void* additional_data,
              size_t additional_len,
-             void* iv) ABSL_EXCLUSIVE_LOCKS_REQUIRED(m_mutex);
+             void* iv) const;
 
 public:
     static constexpr size_t IV_SIZE = 16;
@@ -85,4 +94,11 @@ unsigned int pbkdf_hmac_sha256(const void* password,
                                size_t derive_len);
 
 void generate_random(void* buffer, size_t size);
+
+/// Fills the buffer from a per-thread generator based on AES-256 in CTR mode, which is seeded from
+/// the operating system, reseeds itself periodically and after `fork()`, and serves requests from a
+/// prefetched pool. It is meant for the per-block IVs, which are frequent and tiny, so that most
+/// calls reduce to a `memcpy`. Keys and other long-lived secrets should keep using
+/// `generate_random`.
+void generate_iv(void* buffer, size_t size);
 }    // namespace securefs
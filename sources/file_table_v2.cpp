@@ -4,6 +4,7 @@
 #include "files.h"
 #include "lock_guard.h"
 #include "logger.h"
+#include "metrics.h"
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
@@ -64,6 +65,7 @@ FilePtrHolder FileTable::open_as(const id_type& id, int type)
     LockGuard<Mutex> lg(s.mu);
     if (auto it = s.live_map.find(id); it != s.live_map.end())
     {
+        metrics::increment(MetricCounter::kFileTableHits);
         return create_holder(it->second);
     }
     if (auto it
@@ -76,12 +78,17 @@ FilePtrHolder FileTable::open_as(const id_type& id, int type)
         auto unique_base = std::move(*it);
         s.cache.erase(it);
         s.live_map.emplace(id, std::move(unique_base));
+        metrics::increment(MetricCounter::kFileTableHits);
+        metrics::adjust(MetricGauge::kFileTableCached, -1);
+        metrics::adjust(MetricGauge::kFileTableLive, 1);
         return holder;
     }
+    metrics::increment(MetricCounter::kFileTableMisses);
     auto [data, meta] = io_.open(id);
     auto unique_base = construct(type, std::move(data), std::move(meta), id);
     auto holder = create_holder(unique_base);
     s.live_map.emplace(id, std::move(unique_base));
+    metrics::adjust(MetricGauge::kFileTableLive, 1);
     return holder;
 }
 FileTable::Shard& FileTable::find_shard(const id_type& id)
@@ -102,6 +109,7 @@ FilePtrHolder FileTable::create_as(int type)
     auto fp = construct(type, std::move(data), std::move(meta), id);
     auto holder = create_holder(fp);
     s.live_map.emplace(id, std::move(fp));
+    metrics::adjust(MetricGauge::kFileTableLive, 1);
     return holder;
 }
 std::unique_ptr<FileBase> FileTable::construct(int type,
@@ -171,9 +179,11 @@ void FileTable::close_internal(const id_type id)
     bool should_unlink = query_link_status(it->second.get());
     auto holder = std::move(it->second);
     s.live_map.erase(it);
+    metrics::adjust(MetricGauge::kFileTableLive, -1);
     if (!should_unlink)
     {
         s.cache.emplace_back(std::move(holder));
+        metrics::adjust(MetricGauge::kFileTableCached, 1);
     }
     else
     {
@@ -194,6 +204,7 @@ void FileTable::close_internal(const id_type id)
             }
         }
         s.cache.erase(begin, end);
+        metrics::adjust(MetricGauge::kFileTableCached, -static_cast<int64_t>(kEjectNumber));
     }
 };
 
@@ -214,6 +225,8 @@ FileTable::~FileTable()
             LockGuard<FileBase> inner_lg(*p);
             p->flush();
         }
+        metrics::adjust(MetricGauge::kFileTableLive, -static_cast<int64_t>(s.live_map.size()));
+        metrics::adjust(MetricGauge::kFileTableCached, -static_cast<int64_t>(s.cache.size()));
     }
 }
 
@@ -1,4 +1,4 @@
-
+#pragma once
 #include "files.h"
 #include "myutils.h"
 #include "object.h"
@@ -1,6 +1,8 @@
 #include "files.h"
 #include "crypto.h"
 #include "exceptions.h"
+#include "lock_guard.h"
+#include "metrics.h"
 #include "myutils.h"
 #include "stat_workaround.h"
 
@@ -79,6 +81,9 @@ since epoch, and last one is the number of nanoseconds.
 
 namespace securefs
 {
+// The IV size is for historical reasons. Doesn't really matter.
+static const ssize_t XATTR_IV_LENGTH = 16, XATTR_MAC_LENGTH = 16;
+
 void FileBase::initialize_empty(uint32_t mode, uint32_t uid, uint32_t gid)
 {
     if (uid == -1)
@@ -113,6 +118,95 @@ void FileBase::initialize_empty(uint32_t mode, uint32_t uid, uint32_t gid)
     }
 }
 
+FileKeyCache::Entry::~Entry()
+{
+    CryptoPP::SecureWipeBuffer(data_key.data(), data_key.size());
+    CryptoPP::SecureWipeBuffer(meta_key.data(), meta_key.size());
+}
+
+FileKeyCache::~FileKeyCache()
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    metrics::adjust(MetricGauge::kKeyCacheEntries, -static_cast<int64_t>(entries_.size()));
+}
+
+std::unique_ptr<FileKeyCache::Entry> FileKeyCache::take(const id_type& id)
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    auto it = index_.find(id);
+    if (it == index_.end())
+    {
+        metrics::increment(MetricCounter::kKeyCacheMisses);
+        return nullptr;
+    }
+    metrics::increment(MetricCounter::kKeyCacheHits);
+    metrics::adjust(MetricGauge::kKeyCacheEntries, -1);
+    auto entry = std::move(it->second->second);
+    entries_.erase(it->second);
+    index_.erase(it);
+    return entry;
+}
+
+void FileKeyCache::put(const id_type& id, std::unique_ptr<Entry> entry)
+{
+    // Destroyed outside of the lock.
+    std::unique_ptr<Entry> replaced, evicted;
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        if (auto it = index_.find(id); it != index_.end())
+        {
+            replaced = std::move(it->second->second);
+            entries_.erase(it->second);
+            index_.erase(it);
+            metrics::adjust(MetricGauge::kKeyCacheEntries, -1);
+        }
+        entries_.emplace_front(id, std::move(entry));
+        index_.emplace(id, entries_.begin());
+        metrics::adjust(MetricGauge::kKeyCacheEntries, 1);
+        if (entries_.size() > kMaxEntries)
+        {
+            evicted = std::move(entries_.back().second);
+            index_.erase(entries_.back().first);
+            entries_.pop_back();
+            metrics::adjust(MetricGauge::kKeyCacheEntries, -1);
+        }
+    }
+}
+
+static std::unique_ptr<FileKeyCache::Entry> derive_file_keys(const key_type& master_key,
+                                                             const id_type& id,
+                                                             unsigned iv_size,
+                                                             unsigned max_padding_size)
+{
+    auto entry = std::make_unique<FileKeyCache::Entry>();
+    byte generated_keys[KEY_LENGTH * 4] = {};
+    DEFER(CryptoPP::SecureWipeBuffer(generated_keys, sizeof(generated_keys)));
+    hkdf(master_key.data(),
+         master_key.size(),
+         nullptr,
+         0,
+         id.data(),
+         id.size(),
+         generated_keys,
+         max_padding_size > 0 ? 4 * KEY_LENGTH : 3 * KEY_LENGTH);
+    memcpy(entry->data_key.data(), generated_keys, KEY_LENGTH);
+    memcpy(entry->meta_key.data(), generated_keys + KEY_LENGTH, KEY_LENGTH);
+    entry->data_gcm = make_aes_gcm_engine(generated_keys, KEY_LENGTH, iv_size);
+    entry->xattr_gcm
+        = make_aes_gcm_engine(generated_keys + 2 * KEY_LENGTH, KEY_LENGTH, XATTR_IV_LENGTH);
+
+    if (max_padding_size > 0)
+    {
+        warn_if_key_not_random(generated_keys, sizeof(generated_keys), __FILE__, __LINE__);
+        CryptoPP::Integer integer(generated_keys + 3 * KEY_LENGTH,
+                                  KEY_LENGTH,
+                                  CryptoPP::Integer::UNSIGNED,
+                                  CryptoPP::BIG_ENDIAN_ORDER);
+        entry->padding_size = static_cast<unsigned>(integer.Modulo(max_padding_size + 1));
+    }
+    return entry;
+}
+
 FileBase::FileBase(std::shared_ptr<FileStream> data_stream,
                    std::shared_ptr<FileStream> meta_stream,
                    const key_type& key_,
@@ -121,38 +215,34 @@ FileBase::FileBase(std::shared_ptr<FileStream> data_stream,
                    unsigned block_size,
                    unsigned iv_size,
                    unsigned max_padding_size,
-                   bool store_time)
+                   bool store_time,
+                   FileKeyCache& key_cache)
     : m_header()
     , m_id(id_)
     , m_data_stream(data_stream)
     , m_meta_stream(meta_stream)
+    , m_key_cache(key_cache)
     , m_dirty(false)
     , m_check(check)
     , m_store_time(store_time)
     , m_stream()
 {
     warn_if_key_not_random(key_, __FILE__, __LINE__);
-    key_type data_key, meta_key;
-    byte generated_keys[KEY_LENGTH * 4] = {};
-    hkdf(key_.data(),
-         key_.size(),
-         nullptr,
-         0,
-         id_.data(),
-         id_.size(),
-         generated_keys,
-         max_padding_size > 0 ? 4 * KEY_LENGTH : 3 * KEY_LENGTH);
-    memcpy(data_key.data(), generated_keys, KEY_LENGTH);
-    memcpy(meta_key.data(), generated_keys + KEY_LENGTH, KEY_LENGTH);
+    m_keys = m_key_cache.take(id_);
+    if (!m_keys)
+    {
+        m_keys = derive_file_keys(key_, id_, iv_size, max_padding_size);
+    }
     auto crypt = make_cryptstream_aes_gcm(std::static_pointer_cast<StreamBase>(data_stream),
                                           std::static_pointer_cast<StreamBase>(meta_stream),
-                                          data_key,
-                                          meta_key,
+                                          m_keys->data_key,
+                                          m_keys->meta_key,
                                           id_,
                                           check,
                                           block_size,
                                           iv_size,
-                                          store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE);
+                                          store_time ? EXTENDED_HEADER_SIZE : HEADER_SIZE,
+                                          m_keys->data_gcm);
     // The header size when time extension is enabled is enlarged by the space required by st_atime,
     // st_ctime and st_mtime
 
@@ -160,21 +250,9 @@ FileBase::FileBase(std::shared_ptr<FileStream> data_stream,
     m_header = crypt.second;
     read_header();
 
-    const byte null_iv[12] = {};
-    m_xattr_enc.SetKeyWithIV(
-        generated_keys + 2 * KEY_LENGTH, KEY_LENGTH, null_iv, array_length(null_iv));
-    m_xattr_dec.SetKeyWithIV(
-        generated_keys + 2 * KEY_LENGTH, KEY_LENGTH, null_iv, array_length(null_iv));
-
     if (max_padding_size > 0)
     {
-        warn_if_key_not_random(generated_keys, sizeof(generated_keys), __FILE__, __LINE__);
-        CryptoPP::Integer integer(generated_keys + 3 * KEY_LENGTH,
-                                  KEY_LENGTH,
-                                  CryptoPP::Integer::UNSIGNED,
-                                  CryptoPP::BIG_ENDIAN_ORDER);
-        auto padding_size = static_cast<unsigned>(integer.Modulo(max_padding_size + 1));
-        m_stream = std::make_shared<PaddedStream>(std::move(m_stream), padding_size);
+        m_stream = std::make_shared<PaddedStream>(std::move(m_stream), m_keys->padding_size);
     }
 }
 
@@ -240,7 +318,21 @@ void FileBase::stat(fuse_stat* st)
     }
 }
 
-FileBase::~FileBase() {}
+FileBase::~FileBase()
+{
+    if (!m_keys)
+    {
+        return;
+    }
+    // The crypt stream shares the data context, so it must be gone before the context can be
+    // handed to the next user.
+    m_stream.reset();
+    m_header.reset();
+    if (m_keys->data_gcm.use_count() == 1)
+    {
+        m_key_cache.put(m_id, std::move(m_keys));
+    }
+}
 
 void FileBase::flush()
 {
@@ -273,14 +365,44 @@ void FileBase::flush()
     m_stream->flush();
 }
 
+void FileBase::sync(FsyncBatcher& batcher, bool datasync)
+{
+    const unsigned required = datasync ? (kContent | kLayout) : kAllChanges;
+    if ((m_unsynced & required) == 0)
+    {
+        // In particular, fdatasync after mere timestamp updates needs neither the flush (with its
+        // recomputation of the HMAC over the meta file) nor any disk flush.
+        return;
+    }
+    flush();
+
+    // Any change touches the meta stream, as it holds the IVs, the header and half of each xattr.
+    // The data stream is only touched by content, xattrs, and timestamps when they are not stored
+    // within the filesystem.
+    unsigned data_changes = kContent;
+    if (!datasync)
+    {
+        data_changes |= kXattrs;
+        if (!m_store_time)
+        {
+            data_changes |= kAttributes;
+        }
+    }
+    FileStream* streams[2] = {m_meta_stream.get()};
+    size_t num_streams = 1;
+    if (m_unsynced & data_changes)
+    {
+        streams[num_streams++] = m_data_stream.get();
+    }
+    batcher.sync(absl::MakeConstSpan(streams, num_streams), datasync);
+    m_unsynced &= ~required;
+}
+
 void FileBase::throw_invalid_cast(int to_type)
 {
     throw InvalidCastException(type_name(this->type()), type_name(to_type));
 }
 
-// The IV size is for historical reasons. Doesn't really matter.
-static const ssize_t XATTR_IV_LENGTH = 16, XATTR_MAC_LENGTH = 16;
-
 ssize_t FileBase::listxattr(char* buffer, size_t size)
 {
     return m_data_stream->listxattr(buffer, size);
@@ -308,15 +430,14 @@ ssize_t FileBase::getxattr(const char* name, char* value, size_t size)
     byte* mac = meta + XATTR_IV_LENGTH;
     byte* ciphertext = reinterpret_cast<byte*>(value);
 
-    bool success = m_xattr_dec.DecryptAndVerify(reinterpret_cast<byte*>(value),
-                                                mac,
-                                                XATTR_MAC_LENGTH,
-                                                iv,
-                                                XATTR_IV_LENGTH,
-                                                header.get(),
-                                                name_len + ID_LENGTH,
-                                                ciphertext,
-                                                static_cast<size_t>(true_size));
+    GCMMessage message{iv,
+                       header.get(),
+                       name_len + ID_LENGTH,
+                       ciphertext,
+                       reinterpret_cast<byte*>(value),
+                       static_cast<size_t>(true_size),
+                       mac};
+    bool success = m_keys->xattr_gcm->decrypt({&message, 1}) == 1;
     if (m_check && !success)
         throw XattrVerificationException(get_id(), name);
     return true_size;
@@ -344,6 +465,7 @@ void FileBase::utimens(const fuse_timespec* ts)
     else
     {
         m_data_stream->utimens(ts);
+        m_unsynced |= kAttributes;
     }
 }
 
@@ -358,31 +480,32 @@ void FileBase::setxattr(const char* name, const char* value, size_t size, int fl
     byte meta[XATTR_MAC_LENGTH + XATTR_IV_LENGTH];
     byte* iv = meta;
     byte* mac = iv + XATTR_IV_LENGTH;
-    generate_random(iv, XATTR_IV_LENGTH);
+    generate_iv(iv, XATTR_IV_LENGTH);
 
     auto name_len = strlen(name);
     auto header = make_unique_array<byte>(name_len + ID_LENGTH);
     memcpy(header.get(), get_id().data(), ID_LENGTH);
     memcpy(header.get() + ID_LENGTH, name, name_len);
 
-    m_xattr_enc.EncryptAndAuthenticate(ciphertext,
-                                       mac,
-                                       XATTR_MAC_LENGTH,
-                                       iv,
-                                       XATTR_IV_LENGTH,
-                                       header.get(),
-                                       name_len + ID_LENGTH,
-                                       reinterpret_cast<const byte*>(value),
-                                       size);
+    GCMMessage message{iv,
+                       header.get(),
+                       name_len + ID_LENGTH,
+                       reinterpret_cast<const byte*>(value),
+                       ciphertext,
+                       size,
+                       mac};
+    m_keys->xattr_gcm->encrypt({&message, 1});
 
     m_data_stream->setxattr(name, ciphertext, size, flags);
     m_meta_stream->setxattr(name, meta, array_length(meta), flags);
+    m_unsynced |= kXattrs;
 }
 
 void FileBase::removexattr(const char* name)
 {
     m_data_stream->removexattr(name);
     m_meta_stream->removexattr(name);
+    m_unsynced |= kXattrs;
 }
 
 void SimpleDirectory::initialize()
@@ -1,6 +1,8 @@
 #pragma once
 
+#include "aead_engine.h"
 #include "exceptions.h"
+#include "fsync_batcher.h"
 #include "myutils.h"
 #include "object.h"
 #include "platform.h"
@@ -8,9 +10,9 @@
 #include "tags.h"
 
 #include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
 #include <absl/functional/function_ref.h>
 #include <cryptopp/aes.h>
-#include <cryptopp/gcm.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/rng.h>
 #include <fruit/macro.h>
@@ -19,6 +21,7 @@
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <list>
 #include <memory>
 #include <optional>
 #include <string>
@@ -31,6 +34,45 @@ class RegularFile;
 class Directory;
 class Symlink;
 
+/// Keeps the keys derived for recently closed files, together with their cipher contexts, so that
+/// reopening a file skips HKDF and the key schedules.
+///
+/// A file takes its entry out of the cache when constructed and puts it back when destroyed, so
+/// the contexts, which are not thread safe, never have two users at once. The keys are wiped when
+/// an entry is evicted.
+class FileKeyCache final : public Object
+{
+public:
+    static constexpr size_t kMaxEntries = 256;
+
+    struct Entry
+    {
+        key_type data_key, meta_key;
+        unsigned padding_size = 0;
+        std::shared_ptr<AeadEngine> data_gcm;
+        std::unique_ptr<AeadEngine> xattr_gcm;
+
+        Entry() = default;
+        ~Entry();
+        DISABLE_COPY_MOVE(Entry)
+    };
+
+    INJECT(FileKeyCache()) {}
+    ~FileKeyCache() override;
+
+    /// Returns null if there is no entry for `id`.
+    std::unique_ptr<Entry> take(const id_type& id);
+    void put(const id_type& id, std::unique_ptr<Entry> entry);
+
+private:
+    using EntryList = std::list<std::pair<id_type, std::unique_ptr<Entry>>>;
+
+    absl::Mutex mu_;
+    // The most recently used entries come first.
+    EntryList entries_ ABSL_GUARDED_BY(mu_);
+    absl::flat_hash_map<id_type, EntryList::iterator, id_hash> index_ ABSL_GUARDED_BY(mu_);
+};
+
 class ABSL_LOCKABLE FileBase : public Object
 {
 private:
@@ -43,6 +85,22 @@ private:
     static_assert(BTIME_OFFSET + sizeof(uint64_t) + sizeof(uint32_t) <= EXTENDED_HEADER_SIZE,
                   "Constants are wrong!");
 
+private:
+    /// What has changed since the last sync, so that `sync()` may skip the streams and the flushes
+    /// that are not needed.
+    enum UnsyncedChanges : unsigned
+    {
+        // The content, which spans the data stream and the per block IVs and MACs in the meta
+        // stream.
+        kContent = 1,
+        // Header fields needed to read back the content, such as the root page of a directory.
+        kLayout = 2,
+        // Header fields not needed to read back the content, such as mode and timestamps.
+        kAttributes = 4,
+        kXattrs = 8,
+        kAllChanges = kContent | kLayout | kAttributes | kXattrs,
+    };
+
 private:
     securefs::Mutex m_lock;
     std::atomic<ptrdiff_t> m_refcount{};
@@ -54,9 +112,12 @@ private:
         m_ctime ABSL_GUARDED_BY(*this){}, m_birthtime ABSL_GUARDED_BY(*this){};
     std::shared_ptr<FileStream>
         m_data_stream ABSL_GUARDED_BY(*this){}, m_meta_stream ABSL_GUARDED_BY(*this){};
-    CryptoPP::GCM<CryptoPP::AES>::Encryption m_xattr_enc ABSL_GUARDED_BY(*this){};
-    CryptoPP::GCM<CryptoPP::AES>::Decryption m_xattr_dec ABSL_GUARDED_BY(*this){};
+    FileKeyCache& m_key_cache;
+    std::unique_ptr<FileKeyCache::Entry> m_keys ABSL_GUARDED_BY(*this);
     bool m_dirty ABSL_GUARDED_BY(*this){};
+    // Bitmask of the `UnsyncedChanges` made since the last sync. Everything is assumed changed
+    // at first, because earlier handles of the same file may have left unsynced writes behind.
+    unsigned m_unsynced ABSL_GUARDED_BY(*this) = kAllChanges;
     const bool m_check{}, m_store_time{};
 
 private:
@@ -73,6 +134,7 @@ protected:
     {
         m_flags[4] = value;
         m_dirty = true;
+        m_unsynced |= kLayout;
     }
 
     uint32_t get_start_free_page() const noexcept { return m_flags[5]; }
@@ -81,6 +143,7 @@ protected:
     {
         m_flags[5] = value;
         m_dirty = true;
+        m_unsynced |= kLayout;
     }
 
     uint32_t get_num_free_page() const noexcept { return m_flags[6]; }
@@ -89,6 +152,12 @@ protected:
     {
         m_flags[6] = value;
         m_dirty = true;
+        m_unsynced |= kLayout;
+    }
+
+    void mark_content_changed() noexcept ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        m_unsynced |= kContent;
     }
 
     /**
@@ -146,7 +215,8 @@ public:
                       unsigned block_size,
                       unsigned iv_size,
                       unsigned max_padding_size,
-                      bool store_time);
+                      bool store_time,
+                      FileKeyCache& key_cache);
 
     virtual ~FileBase();
     DISABLE_COPY_MOVE(FileBase)
@@ -171,6 +241,7 @@ public:
         m_flags[0] = value;
         update_ctime_helper();
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     uint32_t get_uid() const noexcept { return m_flags[1]; }
@@ -182,6 +253,7 @@ public:
         m_flags[1] = value;
         update_ctime_helper();
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     uint32_t get_gid() const noexcept { return m_flags[2]; }
@@ -193,6 +265,7 @@ public:
         m_flags[2] = value;
         update_ctime_helper();
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     uint32_t get_nlink() const noexcept { return m_flags[3]; }
@@ -204,6 +277,7 @@ public:
         m_flags[3] = value;
         update_ctime_helper();
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     fuse_timespec get_atime() const noexcept ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
@@ -230,18 +304,21 @@ public:
     {
         m_atime = in;
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     void set_mtime(const fuse_timespec& in) noexcept ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         m_mtime = in;
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     void set_ctime(const fuse_timespec& in) noexcept ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         m_ctime = in;
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     void update_atime_helper() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
@@ -250,6 +327,7 @@ public:
         {
             OSService::get_current_time(m_atime);
             m_dirty = true;
+            m_unsynced |= kAttributes;
         }
     }
 
@@ -260,6 +338,7 @@ public:
             OSService::get_current_time(m_mtime);
             m_ctime = m_mtime;
             m_dirty = true;
+            m_unsynced |= kAttributes;
         }
     }
 
@@ -269,6 +348,7 @@ public:
         {
             OSService::get_current_time(m_ctime);
             m_dirty = true;
+            m_unsynced |= kAttributes;
         }
     }
 
@@ -294,15 +374,14 @@ public:
     {
         --m_flags[3];
         m_dirty = true;
+        m_unsynced |= kAttributes;
     }
 
     void flush() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
-    void fsync() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
-    {
-        m_data_stream->fsync();
-        m_meta_stream->fsync();
-    }
+    /// Flushes and makes durable the changes since the last sync. With `datasync`, only those
+    /// needed to read back the content are guaranteed, in the spirit of `fdatasync(2)`.
+    void sync(FsyncBatcher& batcher, bool datasync) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
     void utimens(const fuse_timespec ts[2]) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this);
 
@@ -343,7 +422,8 @@ public:
                        ANNOTATED(tBlockSize, unsigned) block_size,
                        ANNOTATED(tIvSize, unsigned) iv_size,
                        ANNOTATED(tMaxPaddingSize, unsigned) max_padding_size,
-                       ANNOTATED(tStoreTimeWithinFs, bool) store_time))
+                       ANNOTATED(tStoreTimeWithinFs, bool) store_time,
+                       FileKeyCache& key_cache))
         : FileBase(std::move(data_stream),
                    std::move(meta_stream),
                    key_,
@@ -352,7 +432,8 @@ public:
                    block_size,
                    iv_size,
                    max_padding_size,
-                   store_time)
+                   store_time,
+                   key_cache)
     {
     }
 
@@ -369,6 +450,7 @@ public:
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         update_mtime_helper();
+        mark_content_changed();
         return this->m_stream->write(input, off, len);
     }
 
@@ -380,6 +462,7 @@ public:
     void truncate(length_type new_size) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         update_mtime_helper();
+        mark_content_changed();
         return m_stream->resize(new_size);
     }
 };
@@ -397,7 +480,8 @@ public:
                    ANNOTATED(tBlockSize, unsigned) block_size,
                    ANNOTATED(tIvSize, unsigned) iv_size,
                    ANNOTATED(tMaxPaddingSize, unsigned) max_padding_size,
-                   ANNOTATED(tStoreTimeWithinFs, bool) store_time))
+                   ANNOTATED(tStoreTimeWithinFs, bool) store_time,
+                   FileKeyCache& key_cache))
         : FileBase(std::move(data_stream),
                    std::move(meta_stream),
                    key_,
@@ -406,7 +490,8 @@ public:
                    block_size,
                    iv_size,
                    max_padding_size,
-                   store_time)
+                   store_time,
+                   key_cache)
     {
     }
 
@@ -424,6 +509,7 @@ public:
     void set(std::string_view path) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         update_mtime_helper();
+        mark_content_changed();
         m_stream->write(path.data(), 0, path.size());
     }
 };
@@ -465,6 +551,7 @@ public:
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         update_mtime_helper();
+        mark_content_changed();
         return add_entry_impl(name, id, type);
     }
 
@@ -476,6 +563,7 @@ public:
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         update_mtime_helper();
+        mark_content_changed();
         return remove_entry_impl(name, id, type);
     }
 
@@ -0,0 +1,129 @@
+#include "fsync_batcher.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <absl/container/flat_hash_map.h>
+
+#include <utility>
+
+namespace securefs
+{
+FsyncBatcher::FsyncBatcher(absl::Duration window, SyncFilesystem sync_filesystem)
+    : window_(window), sync_filesystem_(std::move(sync_filesystem))
+{
+}
+
+void FsyncBatcher::sync(absl::Span<FileStream* const> streams, bool datasync)
+{
+    Request req{streams, datasync, false, nullptr, this};
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        pending_.push_back(&req);
+        mu_.Await(absl::Condition(&FsyncBatcher::can_proceed, &req));
+        if (!req.done)
+        {
+            // Nobody is flushing, so this thread leads the next batch, which includes itself.
+            leader_active_ = true;
+            if (window_ > absl::ZeroDuration())
+            {
+                mu_.AwaitWithTimeout(absl::Condition(this, &FsyncBatcher::batch_full), window_);
+            }
+            std::vector<Request*> batch;
+            batch.swap(pending_);
+
+            mu_.Unlock();
+            try
+            {
+                execute(batch);
+            }
+            catch (...)
+            {
+                auto error = std::current_exception();
+                for (Request* r : batch)
+                {
+                    r->error = error;
+                }
+            }
+            mu_.Lock();
+
+            for (Request* r : batch)
+            {
+                r->done = true;
+            }
+            leader_active_ = false;
+        }
+    }
+    if (req.error)
+    {
+        std::rethrow_exception(req.error);
+    }
+}
+
+void FsyncBatcher::execute(const std::vector<Request*>& batch)
+{
+    bool synced_filesystem = false;
+    if (sync_filesystem_ && batch.size() >= kSyncFilesystemThreshold)
+    {
+        try
+        {
+            synced_filesystem = sync_filesystem_();
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Filesystem wide flush failed with %s: %s", get_type_name(e).get(), e.what());
+        }
+    }
+
+    // Each stream is flushed once per batch, fully if any of the requests asks for it. Even after
+    // a filesystem wide flush, because that may not report the writeback errors of a given file.
+    // Everything is on disk by then, so the data only flush suffices to collect them.
+    absl::flat_hash_map<FileStream*, bool> datasync_only;
+    for (const Request* r : batch)
+    {
+        for (FileStream* s : r->streams)
+        {
+            auto [it, inserted] = datasync_only.emplace(s, r->datasync || synced_filesystem);
+            if (!inserted)
+            {
+                it->second = it->second && (r->datasync || synced_filesystem);
+            }
+        }
+    }
+
+    absl::flat_hash_map<FileStream*, std::exception_ptr> errors;
+    for (const auto& [stream, datasync] : datasync_only)
+    {
+        try
+        {
+            if (datasync)
+            {
+                stream->fdatasync();
+            }
+            else
+            {
+                stream->fsync();
+            }
+        }
+        catch (...)
+        {
+            errors.emplace(stream, std::current_exception());
+        }
+    }
+    if (errors.empty())
+    {
+        return;
+    }
+    for (Request* r : batch)
+    {
+        for (FileStream* s : r->streams)
+        {
+            auto it = errors.find(s);
+            if (it != errors.end() && !r->error)
+            {
+                r->error = it->second;
+            }
+        }
+    }
+}
+}    // namespace securefs
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "object.h"
+#include "platform.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+#include <absl/types/span.h>
+
+#include <exception>
+#include <functional>
+#include <vector>
+
+namespace securefs
+{
+/// Group commit of `fsync` and `fdatasync` requests.
+///
+/// The first caller to arrive becomes the leader. It optionally lingers for `window` to let more
+/// requests join, then flushes the whole batch on behalf of everyone, while the requests that
+/// arrive in the meantime queue up for the next leader. When a batch is large, a single
+/// filesystem wide flush writes everything back first, if the platform supports it. The per file
+/// flushes still follow, as only they report the writeback errors of each file, but they find
+/// little left to write.
+class FsyncBatcher final : public Object
+{
+public:
+    /// Flushes the entire filesystem holding the data. Returns false when unsupported.
+    using SyncFilesystem = std::function<bool()>;
+
+    /// A batch at least this large is flushed with `SyncFilesystem` first.
+    static constexpr size_t kSyncFilesystemThreshold = 16;
+
+    /// The leader stops waiting for more requests once the batch has grown this large.
+    static constexpr size_t kMaxBatchSize = 64;
+
+    explicit FsyncBatcher(absl::Duration window, SyncFilesystem sync_filesystem = nullptr);
+
+    /// Flushes all of `streams` to stable storage, only their data when `datasync` is true, and
+    /// returns once done. The streams must stay alive until then.
+    void sync(absl::Span<FileStream* const> streams, bool datasync);
+
+private:
+    struct Request
+    {
+        absl::Span<FileStream* const> streams;
+        bool datasync;
+        bool done = false;
+        std::exception_ptr error;
+        const FsyncBatcher* owner;
+    };
+
+    static bool can_proceed(Request* req) ABSL_NO_THREAD_SAFETY_ANALYSIS
+    {
+        return req->done || !req->owner->leader_active_;
+    }
+    bool batch_full() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    {
+        return pending_.size() >= kMaxBatchSize;
+    }
+    void execute(const std::vector<Request*>& batch);
+
+private:
+    absl::Duration window_;
+    SyncFilesystem sync_filesystem_;
+
+    absl::Mutex mu_;
+    std::vector<Request*> pending_ ABSL_GUARDED_BY(mu_);
+    bool leader_active_ ABSL_GUARDED_BY(mu_) = false;
+};
+}    // namespace securefs
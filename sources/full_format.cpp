@@ -2,6 +2,7 @@
 #include "apple_xattr_workaround.h"
 #include "exceptions.h"
 #include "files.h"
+#include "lock_guard.h"
 #include "logger.h"
 #include "myutils.h"
 #include "platform.h"
@@ -42,6 +43,7 @@ int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* st, const fuse_conte
     {
         return -ENOENT;
     }
+    sync_write_behind(opened->get());
     FileLockGuard lg(**opened);
     (**opened).stat(st);
     postprocess_stat(st);
@@ -53,6 +55,7 @@ int FuseHighLevelOps::vfgetattr(const char* path,
                                 const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    sync_write_behind(fp);
     FileLockGuard lg(*fp);
     fp->stat(st);
     postprocess_stat(st);
@@ -126,6 +129,7 @@ int FuseHighLevelOps::vcreate(const char* path,
                               const fuse_context* ctx)
 {
     auto holder = create(path, mode, RegularFile::class_type(), ctx->uid, ctx->gid);
+    acquire_write_behind(holder.get());
     set_file(info, holder.release());
     return 0;
 };
@@ -138,9 +142,14 @@ int FuseHighLevelOps::vopen(const char* path, fuse_file_info* info, const fuse_c
     }
     if (info->flags & O_TRUNC)
     {
+        sync_write_behind(opened->get());
         FileLockGuard lg(**opened);
         (**opened).cast_as<RegularFile>()->truncate(0);
     }
+    if ((**opened).type() == RegularFile::class_type())
+    {
+        acquire_write_behind(opened->get());
+    }
     set_file(info, opened->release());
     return 0;
 };
@@ -152,7 +161,8 @@ int FuseHighLevelOps::vrelease(const char* path, fuse_file_info* info, const fus
         return -EINVAL;
     }
     FilePtrHolder holder(fp, FileTableCloser(&ft_));
-    // Let destructor does its job.
+    DEFER(release_write_behind(fp));
+    sync_write_behind(fp);
     return 0;
 };
 int FuseHighLevelOps::vread(const char* path,
@@ -163,6 +173,7 @@ int FuseHighLevelOps::vread(const char* path,
                             const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    sync_write_behind(fp);
     FileLockGuard lg(*fp);
     return static_cast<int>(fp->cast_as<RegularFile>()->read(buf, offset, size));
 };
@@ -174,6 +185,11 @@ int FuseHighLevelOps::vwrite(const char* path,
                              const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    if (auto write_behind = find_write_behind(fp))
+    {
+        write_behind->enqueue(buf, offset, size);
+        return static_cast<int>(size);
+    }
     FileLockGuard lg(*fp);
     fp->cast_as<RegularFile>()->write(buf, offset, size);
     return static_cast<int>(size);
@@ -181,6 +197,7 @@ int FuseHighLevelOps::vwrite(const char* path,
 int FuseHighLevelOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    sync_write_behind(fp);
     FileLockGuard lg(*fp);
     fp->flush();
     return 0;
@@ -191,6 +208,7 @@ int FuseHighLevelOps::vftruncate(const char* path,
                                  const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    sync_write_behind(fp);
     FileLockGuard lg(*fp);
     fp->cast_as<RegularFile>()->truncate(len);
     return 0;
@@ -289,6 +307,7 @@ int FuseHighLevelOps::vlink(const char* src, const char* dest, const fuse_contex
             last_component, (**opened).get_id(), (**opened).get_real_type()))
     {
         (**opened).set_nlink((**opened).get_nlink() + 1);
+        check_multi_linked((**opened).get_id(), (**opened).get_nlink());
         return 0;
     }
     return -EEXIST;
@@ -350,8 +369,9 @@ int FuseHighLevelOps::vfsync(const char* path,
                              const fuse_context* ctx)
 {
     auto fp = get_file(info);
+    sync_write_behind(fp);
     FileLockGuard lg(*fp);
-    fp->fsync();
+    fp->sync(fsync_batcher_, datasync != 0);
     return 0;
 };
 int FuseHighLevelOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
@@ -361,6 +381,7 @@ int FuseHighLevelOps::vtruncate(const char* path, fuse_off_t len, const fuse_con
     {
         return -ENOENT;
     }
+    sync_write_behind(opened->get());
     FileLockGuard fg(**opened);
     (**opened).cast_as<RegularFile>()->truncate(len);
     return 0;
@@ -372,6 +393,7 @@ int FuseHighLevelOps::vutimens(const char* path, const fuse_timespec* ts, const
     {
         return -ENOENT;
     }
+    sync_write_behind(opened->get());
     FileLockGuard fg(**opened);
     (**opened).utimens(ts);
     return 0;
@@ -569,6 +591,84 @@ std::optional<FilePtrHolder> FuseHighLevelOps::open_all(absl::string_view path)
     return holder;
 }
 
+void FuseHighLevelOps::acquire_write_behind(FileBase* fp)
+{
+    if (write_behind_bytes_ <= 0)
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(write_behind_mu_);
+    auto& entry = write_behind_files_[fp->get_id()];
+    if (!entry.buffer)
+    {
+        entry.buffer = std::make_shared<WriteBehindBuffer>(
+            *background_pool_,
+            [fp](const WriteBehindBuffer::Extents& extents)
+            {
+                FileLockGuard lg(*fp);
+                auto regular_file = fp->cast_as<RegularFile>();
+                for (const auto& [offset, data] : extents)
+                {
+                    regular_file->write(data.data(), offset, data.size());
+                }
+            },
+            write_behind_bytes_);
+    }
+    ++entry.open_count;
+}
+
+void FuseHighLevelOps::release_write_behind(FileBase* fp)
+{
+    if (write_behind_bytes_ <= 0)
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(write_behind_mu_);
+    auto it = write_behind_files_.find(fp->get_id());
+    if (it != write_behind_files_.end() && --it->second.open_count <= 0)
+    {
+        write_behind_files_.erase(it);
+    }
+}
+
+std::shared_ptr<WriteBehindBuffer> FuseHighLevelOps::find_write_behind(FileBase* fp)
+{
+    if (write_behind_bytes_ <= 0)
+    {
+        return nullptr;
+    }
+    LockGuard<absl::Mutex> lg(write_behind_mu_);
+    auto it = write_behind_files_.find(fp->get_id());
+    if (it == write_behind_files_.end())
+    {
+        return nullptr;
+    }
+    return it->second.buffer;
+}
+
+void FuseHighLevelOps::sync_write_behind(FileBase* fp)
+{
+    if (auto write_behind = find_write_behind(fp))
+    {
+        write_behind->sync();
+    }
+}
+
+bool FuseHighLevelOps::check_multi_linked(const id_type& id, uint32_t nlink)
+{
+    if (!keep_cache_)
+    {
+        return true;
+    }
+    LockGuard<absl::Mutex> lg(multi_linked_mu_);
+    if (nlink > 1)
+    {
+        multi_linked_.insert(id);
+        return true;
+    }
+    return multi_linked_.contains(id);
+}
+
 void FuseHighLevelOps::postprocess_stat(fuse_stat* st)
 {
     if (owner_override_.uid_override.has_value())
@@ -5,14 +5,22 @@
 #include "myutils.h"
 #include "platform.h"
 #include "tags.h"
+#include "thread_pool.h"
+#include "write_behind.h"
 
+#include <absl/base/thread_annotations.h>
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
 #include <absl/strings/string_view.h>
+#include <absl/synchronization/mutex.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <exception>
 #include <fruit/macro.h>
 #include <memory>
 #include <optional>
+#include <thread>
 
 namespace securefs::full_format
 {
@@ -63,13 +71,25 @@ public:
                             FileTable& ft,
                             RepoLocker& locker,
                             const OwnerOverride& owner_override,
-                            ANNOTATED(tCaseInsensitive, bool) case_insensitive))
+                            ANNOTATED(tCaseInsensitive, bool) case_insensitive,
+                            ANNOTATED(tWriteBehindLimit, unsigned) write_behind_mib,
+                            ANNOTATED(tFsyncWindow, unsigned) fsync_window_us,
+                            ANNOTATED(tKeepCache, bool) keep_cache))
         : root_(root)
         , ft_(ft)
         , locker_(locker)
         , owner_override_(owner_override)
         , case_insensitive_(case_insensitive)
+        , write_behind_bytes_(static_cast<length_type>(write_behind_mib) << 20)
+        , fsync_batcher_(absl::Microseconds(fsync_window_us),
+                         [&root]() { return root.sync_filesystem(); })
+        , keep_cache_(keep_cache && !case_insensitive)
     {
+        if (write_behind_bytes_ > 0)
+        {
+            background_pool_ = std::make_unique<ThreadPool>(
+                std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u));
+        }
     }
 
     void initialize(fuse_conn_info* info) override;
@@ -151,6 +171,26 @@ private:
     [[maybe_unused]] RepoLocker& locker_;    // We only needs this to construct and destruct.
     OwnerOverride owner_override_;
     bool case_insensitive_;
+    length_type write_behind_bytes_;
+    std::unique_ptr<ThreadPool> background_pool_;
+    FsyncBatcher fsync_batcher_;
+    bool keep_cache_;
+
+    // `FileBase` objects are shared among all handles of the same file, so the write-behind
+    // buffers are too. An entry lives as long as the file has an open handle.
+    struct WriteBehindEntry
+    {
+        std::shared_ptr<WriteBehindBuffer> buffer;
+        unsigned open_count = 0;
+    };
+    absl::Mutex write_behind_mu_;
+    absl::flat_hash_map<id_type, WriteBehindEntry, id_hash>
+        write_behind_files_ ABSL_GUARDED_BY(write_behind_mu_);
+
+    // The files that have had several names since the mount, which are denied the page cache for
+    // good, because their cache may have gone stale under another name in the meantime.
+    absl::Mutex multi_linked_mu_;
+    absl::flat_hash_set<id_type, id_hash> multi_linked_ ABSL_GUARDED_BY(multi_linked_mu_);
 
 private:
     struct OpenBaseResult
@@ -163,6 +203,12 @@ private:
     FilePtrHolder create(absl::string_view path, unsigned mode, int type, int uid, int gid);
     std::optional<FilePtrHolder> open_all(absl::string_view path);
 
+    void acquire_write_behind(FileBase* fp);
+    void release_write_behind(FileBase* fp);
+    std::shared_ptr<WriteBehindBuffer> find_write_behind(FileBase* fp);
+    // Must be called without holding the lock of `fp`.
+    void sync_write_behind(FileBase* fp);
+
     FileBase* get_file(fuse_file_info* info)
     {
         return reinterpret_cast<FileBase*>(static_cast<uintptr_t>(info->fh));
@@ -170,8 +216,15 @@ private:
 
     void set_file(fuse_file_info* info, FileBase* fb)
     {
+        // A file with several names has a kernel node, and a page cache, for each of them, and a
+        // write through one name leaves the others stale.
+        info->keep_cache = keep_cache_ && fb->type() == RegularFile::class_type()
+            && !check_multi_linked(fb->get_id(), fb->get_nlink());
         info->fh = reinterpret_cast<uintptr_t>(fb);
     }
+    // Records the file as multi-linked if `nlink` is more than one, and tells whether it has ever
+    // been.
+    bool check_multi_linked(const id_type& id, uint32_t nlink);
 
     void postprocess_stat(fuse_stat* st);
 };
@@ -1,26 +1,69 @@
 #include "fuse2_workaround.h"
+#include "exceptions.h"
 
 #include <fuse.h>
 
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
 #ifndef _WIN32
 #include <fuse_lowlevel.h>
 
-#include "exceptions.h"
+#include "lock_guard.h"
 #include "logger.h"
+#include "metrics.h"
 #include "myutils.h"
 
+#include <absl/synchronization/mutex.h>
+
 #include <cerrno>
 #include <csignal>
+#include <cstdint>
+#include <cstring>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
 
+#include <algorithm>
 #include <atomic>
+#include <list>
 #include <thread>
 #include <vector>
 #endif
 
 namespace securefs
 {
+FuseThreadOptions parse_thread_options(std::string_view threads,
+                                       unsigned metadata_threads,
+                                       unsigned hardware_threads)
+{
+    FuseThreadOptions options;
+    options.metadata_threads = metadata_threads;
+    options.min_threads = options.max_threads = std::max(1u, hardware_threads);
+    if (!threads.empty())
+    {
+        std::vector<std::string_view> parts = absl::StrSplit(threads, ':');
+        if (parts.size() > 2 || !absl::SimpleAtoi(parts.front(), &options.min_threads)
+            || !absl::SimpleAtoi(parts.back(), &options.max_threads) || options.min_threads == 0
+            || options.min_threads > options.max_threads)
+        {
+            throwInvalidArgumentException(
+                "Invalid --threads. Must be min:max or a single number, with 0 < min <= max.");
+        }
+    }
+    if (options.metadata_threads >= options.max_threads)
+    {
+        throwInvalidArgumentException(absl::StrFormat(
+            "--metadata-threads must be less than the maximum of --threads, which is %u",
+            options.max_threads));
+    }
+    return options;
+}
 
 #if defined(_WIN32) || defined(__APPLE__)
 #else
@@ -82,40 +125,225 @@ namespace
         pthread_sigmask(SIG_BLOCK, &newset, nullptr);
     }
 
-    void worker_loop(fuse_session* session, fuse_chan* channel, std::atomic<int>* error_code)
+    // Opcodes of the kernel protocol, from fuse_kernel.h, which libfuse 2 does not install.
+    constexpr uint32_t kFuseOpcodeRead = 15;
+    constexpr uint32_t kFuseOpcodeWrite = 16;
+    constexpr uint32_t kFuseOpcodeFsync = 20;
+    constexpr uint32_t kFuseOpcodeFlush = 25;
+
+    bool is_data_request(const fuse_buf& buf)
+    {
+        // The opcode follows the length in `struct fuse_in_header`. Requests spliced into a pipe
+        // are not in memory, and are not classified.
+        if ((buf.flags & FUSE_BUF_IS_FD) || buf.size < 2 * sizeof(uint32_t))
+        {
+            return false;
+        }
+        uint32_t opcode;
+        memcpy(&opcode, static_cast<const char*>(buf.mem) + sizeof(uint32_t), sizeof(opcode));
+        return opcode == kFuseOpcodeRead || opcode == kFuseOpcodeWrite
+            || opcode == kFuseOpcodeFsync || opcode == kFuseOpcodeFlush;
+    }
+
+    void pin_to_cpu(std::thread& thread, unsigned cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (int rc = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set); rc != 0)
+        {
+            WARN_LOG("Failed to pin a FUSE worker to CPU %u: %s", cpu, strerror(rc));
+        }
+#else
+        (void)thread;
+        (void)cpu;
+#endif
+    }
+
+    /// The workers that receive and process the requests of one session, as
+    /// `FuseWorkerScheduler` directs.
+    class WorkerPool
     {
-        block_some_signals();
-        std::vector<char> buffer(fuse_chan_bufsize(channel));
+    public:
+        WorkerPool(fuse_session* session, fuse_chan* channel, const FuseThreadOptions& options)
+            : session_(session)
+            , channel_(channel)
+            , options_(options)
+            , buffer_size_(fuse_chan_bufsize(channel))
+            , scheduler_(options, options.max_threads)
+        {
+        }
+
+        DISABLE_COPY_MOVE(WorkerPool)
 
-        DEFER(global_semaphore.post());
+        void start()
+        {
+            for (unsigned i = 0; i < options_.min_threads; ++i)
+            {
+                scheduler_.add_worker();
+                spawn();
+            }
+        }
+
+        /// Called once the session has exited.
+        void stop()
+        {
+            scheduler_.stop();
+            std::list<Worker> workers;
+            {
+                LockGuard<absl::Mutex> lg(mu_);
+                stopping_ = true;
+                workers.swap(workers_);
+            }
+            for (Worker& w : workers)
+            {
+                if (!w.finished.load())
+                {
+                    pthread_cancel(w.thread.native_handle());
+                }
+            }
+            for (Worker& w : workers)
+            {
+                w.thread.join();
+            }
+        }
+
+        int error_code() const noexcept { return error_code_.load(); }
+
+    private:
+        struct Worker
+        {
+            std::thread thread;
+            std::atomic<bool> finished{false};
+        };
 
-        while (!fuse_session_exited(session))
+        struct DataRequest
         {
-            fuse_buf fbuf{};
-            fbuf.mem = buffer.data();
-            fbuf.size = buffer.size();
+            std::vector<char> buffer;
+            fuse_buf buf;
+            fuse_chan* channel;
+        };
 
-            int res;
-            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
-            res = fuse_session_receive_buf(session, &fbuf, &channel);
-            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
-            if (res == -EINTR)
-                continue;
-            if (res < 0)
+        fuse_session* session_;
+        fuse_chan* channel_;
+        FuseThreadOptions options_;
+        size_t buffer_size_;
+        std::atomic<int> error_code_{0};
+        // At most one deferred data request per worker.
+        FuseWorkerScheduler<DataRequest> scheduler_;
+
+        absl::Mutex mu_;
+        std::list<Worker> workers_ ABSL_GUARDED_BY(mu_);
+        bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+        unsigned next_cpu_ ABSL_GUARDED_BY(mu_) = 0;
+
+        void spawn()
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            if (stopping_)
             {
-                ERROR_LOG(
-                    "fuse_session_receive_buf failed with error code %d, exiting abnormally...",
-                    res);
-                *error_code = res;
                 return;
             }
-            if (res == 0)
+            // Joins the workers that have retired since the last time.
+            for (auto it = workers_.begin(); it != workers_.end();)
             {
+                if (it->finished.load())
+                {
+                    it->thread.join();
+                    it = workers_.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            Worker* w = &workers_.emplace_back();
+            w->thread = std::thread([this, w]() { run(w); });
+            if (options_.pin_to_cpus)
+            {
+                pin_to_cpu(w->thread,
+                           next_cpu_++ % std::max(1u, std::thread::hardware_concurrency()));
+            }
+        }
+
+        void process_data(std::vector<char>& buffer, fuse_buf& buf, fuse_chan* channel)
+        {
+            // Hands the buffer over with the request, whose `mem` points into it.
+            DataRequest request{std::move(buffer), buf, channel};
+            if (!scheduler_.begin_data(request))
+            {
+                buffer = std::vector<char>(buffer_size_);
                 return;
             }
-            fuse_session_process_buf(session, &fbuf, channel);
+            buffer = std::move(request.buffer);
+            fuse_session_process_buf(session_, &buf, channel);
+            while (auto deferred = scheduler_.end_data())
+            {
+                fuse_session_process_buf(session_, &deferred->buf, deferred->channel);
+            }
         }
-    }
+
+        void run(Worker* self)
+        {
+            block_some_signals();
+            DEFER(self->finished.store(true));
+            std::vector<char> buffer(buffer_size_);
+
+            metrics::adjust(MetricGauge::kFuseWorkers, 1);
+            DEFER(metrics::adjust(MetricGauge::kFuseWorkers, -1));
+
+            while (!fuse_session_exited(session_))
+            {
+                fuse_buf fbuf{};
+                fbuf.mem = buffer.data();
+                fbuf.size = buffer.size();
+                fuse_chan* channel = channel_;
+
+                int res;
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+                res = fuse_session_receive_buf(session_, &fbuf, &channel);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+                if (res == -EINTR)
+                    continue;
+                if (res < 0)
+                {
+                    ERROR_LOG(
+                        "fuse_session_receive_buf failed with error code %d, exiting abnormally...",
+                        res);
+                    error_code_ = res;
+                    global_semaphore.post();
+                    return;
+                }
+                if (res == 0)
+                {
+                    global_semaphore.post();
+                    return;
+                }
+
+                metrics::adjust(MetricGauge::kFuseWorkersBusy, 1);
+                // Before processing, which may block, so that the next request finds a worker.
+                if (scheduler_.begin_request())
+                {
+                    spawn();
+                }
+                if (options_.metadata_threads > 0 && is_data_request(fbuf))
+                {
+                    process_data(buffer, fbuf, channel);
+                }
+                else
+                {
+                    fuse_session_process_buf(session_, &fbuf, channel);
+                }
+                metrics::adjust(MetricGauge::kFuseWorkersBusy, -1);
+
+                if (scheduler_.end_request())
+                {
+                    return;
+                }
+            }
+        }
+    };
 
     void install_signal_handler(int sig)
     {
@@ -131,9 +359,14 @@ namespace
 }    // namespace
 #endif
 
-int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
+int my_fuse_main(int argc,
+                 char** argv,
+                 fuse_operations* op,
+                 void* user_data,
+                 const FuseThreadOptions& thread_options)
 {
 #if defined(_WIN32) || defined(__APPLE__)
+    (void)thread_options;
     return fuse_main(argc, argv, op, user_data);
 #else
     char* mountpoint;
@@ -157,12 +390,22 @@ int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
         return 3;
     }
 
-    std::atomic<int> error_code;
-    std::vector<std::thread> workers(multithreaded ? std::thread::hardware_concurrency() : 1);
-    for (auto&& w : workers)
+    FuseThreadOptions options;
+    if (multithreaded)
+    {
+        options = thread_options;
+        unsigned hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+        options.min_threads = options.min_threads ? options.min_threads : hardware_threads;
+        options.max_threads = std::max(
+            options.min_threads, options.max_threads ? options.max_threads : hardware_threads);
+    }
+    else
     {
-        w = std::thread(worker_loop, session, channel, &error_code);
+        options.min_threads = options.max_threads = 1;
     }
+    VERBOSE_LOG("Starting %u to %u FUSE workers", options.min_threads, options.max_threads);
+    WorkerPool pool(session, channel, options);
+    pool.start();
 
     install_signal_handler(SIGINT);
     install_signal_handler(SIGTERM);
@@ -174,20 +417,11 @@ int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data)
             block_some_signals();
             global_semaphore.wait();
             fuse_session_exit(session);
-
-            for (auto&& w : workers)
-            {
-                pthread_cancel(w.native_handle());
-            }
+            pool.stop();
         });
     waiter.join();
 
-    for (auto&& w : workers)
-    {
-        w.join();
-    }
-
-    return error_code;
+    return pool.error_code();
 #endif
 }
 }    // namespace securefs
@@ -1,8 +1,183 @@
 #pragma once
 
+#include "lock_guard.h"
+#include "myutils.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+
 #include <fuse.h>
 
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string_view>
+
 namespace securefs
 {
-int my_fuse_main(int argc, char** argv, fuse_operations* op, void* user_data);
+struct FuseThreadOptions
+{
+    // Zero means the number of hardware threads. The pool starts with `min_threads` workers, and
+    // grows up to `max_threads` while all of them are busy, such as blocked in fsync.
+    unsigned min_threads = 0;
+    unsigned max_threads = 0;
+    // When positive, reads, writes, flushes and fsyncs never occupy more than `max_threads -
+    // metadata_threads` workers at once. Requests beyond that are queued, so that lookups and
+    // other short operations are not stuck behind long transfers.
+    unsigned metadata_threads = 0;
+    // Pins each worker to one CPU, in turn. Only supported on Linux.
+    bool pin_to_cpus = false;
+};
+
+/// Parses `threads`, as min:max or as one number for a fixed count, and fills in the counts left
+/// out, or all of them if `threads` is empty, with `hardware_threads`. Throws if the counts are
+/// invalid, or if `metadata_threads` would leave no worker to the reads and writes.
+FuseThreadOptions parse_thread_options(std::string_view threads,
+                                       unsigned metadata_threads,
+                                       unsigned hardware_threads);
+
+/// The bookkeeping of the workers of `my_fuse_main()`, apart from their threads and the session
+/// so that it can be tested on its own. The pool grows by one worker whenever all of them are
+/// busy, and a worker retires after a request when more than `min_threads` are idle.
+///
+/// With `metadata_threads`, the data requests beyond the share of the workers they may occupy are
+/// deferred to a queue, which the workers already busy with data requests drain. At most
+/// `max_deferred` requests wait there; a worker that receives another one blocks until there is
+/// room, and so stops reading from the channel.
+template <class Request>
+class FuseWorkerScheduler
+{
+public:
+    FuseWorkerScheduler(const FuseThreadOptions& options, size_t max_deferred)
+        : options_(options), max_deferred_(max_deferred)
+    {
+    }
+
+    DISABLE_COPY_MOVE(FuseWorkerScheduler)
+
+    /// Counts a worker that the caller is about to start.
+    void add_worker()
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        live_.fetch_add(1);
+    }
+
+    /// Called when a worker has received a request, before processing it. Returns whether the
+    /// caller should start one more worker, which is then already counted, so that the next
+    /// request finds a worker even if this one blocks.
+    bool begin_request()
+    {
+        if (busy_.fetch_add(1) + 1 < live_.load())
+        {
+            return false;
+        }
+        LockGuard<absl::Mutex> lg(mu_);
+        if (stopping_ || busy_.load() < live_.load() || live_.load() >= options_.max_threads)
+        {
+            return false;
+        }
+        live_.fetch_add(1);
+        return true;
+    }
+
+    /// Called when a worker has processed its request. Returns whether the worker should exit,
+    /// in which case it is no longer counted.
+    bool end_request()
+    {
+        busy_.fetch_sub(1);
+        if (live_.load() <= options_.min_threads)
+        {
+            return false;
+        }
+        LockGuard<absl::Mutex> lg(mu_);
+        unsigned live = live_.load();
+        if (live <= options_.min_threads || live - busy_.load() <= options_.min_threads)
+        {
+            return false;
+        }
+        live_.fetch_sub(1);
+        return true;
+    }
+
+    /// Returns whether the caller should process the data request now. Otherwise `request` has
+    /// been moved to the queue, or dropped if the scheduler is stopping. Blocks while the queue is
+    /// full.
+    bool begin_data(Request& request)
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        mu_.Await(absl::Condition(this, &FuseWorkerScheduler::can_begin_data));
+        if (stopping_)
+        {
+            return false;
+        }
+        if (data_busy_ < data_limit())
+        {
+            ++data_busy_;
+            return true;
+        }
+        deferred_.push_back(std::move(request));
+        return false;
+    }
+
+    /// Called after processing a data request. Returns the next deferred request for the caller
+    /// to process in turn, if any.
+    std::optional<Request> end_data()
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        if (deferred_.empty())
+        {
+            --data_busy_;
+            return std::nullopt;
+        }
+        std::optional<Request> request(std::move(deferred_.front()));
+        deferred_.pop_front();
+        return request;
+    }
+
+    /// Stops growing the pool, and wakes up the workers blocked in `begin_data()`.
+    void stop()
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        stopping_ = true;
+    }
+
+    unsigned live() const noexcept { return live_.load(); }
+    unsigned busy() const noexcept { return busy_.load(); }
+    size_t deferred() const
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        return deferred_.size();
+    }
+
+private:
+    FuseThreadOptions options_;
+    size_t max_deferred_;
+    // `live_` is only changed with `mu_` held, so that growing and retiring agree.
+    std::atomic<unsigned> live_{0};
+    std::atomic<unsigned> busy_{0};
+
+    mutable absl::Mutex mu_;
+    bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+    unsigned data_busy_ ABSL_GUARDED_BY(mu_) = 0;
+    std::deque<Request> deferred_ ABSL_GUARDED_BY(mu_);
+
+    unsigned data_limit() const noexcept
+    {
+        return options_.max_threads - options_.metadata_threads;
+    }
+
+    bool can_begin_data() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    {
+        return stopping_ || data_busy_ < data_limit() || deferred_.size() < max_deferred_;
+    }
+};
+
+/// Like `fuse_main`, but with our own multithreaded loop where possible. The thread options are
+/// ignored on Windows and on Apple, and in single threaded mode.
+int my_fuse_main(int argc,
+                 char** argv,
+                 fuse_operations* op,
+                 void* user_data,
+                 const FuseThreadOptions& thread_options);
 }    // namespace securefs
@@ -0,0 +1,533 @@
+#include "fuse_bench.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "myutils.h"
+#include "platform.h"
+
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/synchronization/notification.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <exception>
+#include <random>
+#include <thread>
+
+namespace securefs
+{
+namespace
+{
+    // How many files the metadata workload creates between two listings of their directory.
+    constexpr unsigned kReaddirInterval = 32;
+
+    using Clock = std::chrono::steady_clock;
+
+    class BenchWorker
+    {
+    public:
+        BenchWorker(FuseHighLevelOpsBase& ops, const BenchOptions& options, unsigned index)
+            : ops_(ops), options_(options), dir_(absl::StrCat("/bench-", index))
+        {
+            ctx_.uid = OSService::getuid();
+            ctx_.gid = OSService::getgid();
+            uint64_t seed;
+            generate_random(&seed, sizeof(seed));
+            rng_.seed(seed);
+            buffer_.resize(options.io_size);
+            for (char& c : buffer_)
+            {
+                c = static_cast<char>(rng_());
+            }
+        }
+
+        // Untimed preparation.
+        void setup()
+        {
+            check(ops_.vmkdir(dir_.c_str(), 0755, &ctx_), "mkdir", dir_);
+            if (options_.workload == BenchWorkload::kRandom)
+            {
+                auto path = file_path("random");
+                fuse_file_info info{};
+                info.flags = O_RDWR;
+                check(ops_.vcreate(path.c_str(), 0644, &info, &ctx_), "create", path);
+                for (uint64_t offset = 0; offset < options_.file_size; offset += buffer_.size())
+                {
+                    auto size = std::min<uint64_t>(buffer_.size(), options_.file_size - offset);
+                    check(ops_.vwrite(path.c_str(),
+                                      buffer_.data(),
+                                      size,
+                                      static_cast<fuse_off_t>(offset),
+                                      &info,
+                                      &ctx_),
+                          "write",
+                          path);
+                }
+                check(ops_.vrelease(path.c_str(), &info, &ctx_), "release", path);
+            }
+        }
+
+        void run()
+        {
+            switch (options_.workload)
+            {
+            case BenchWorkload::kSequential:
+                return run_sequential();
+            case BenchWorkload::kRandom:
+                return run_random();
+            case BenchWorkload::kSmallFile:
+                return run_small_file();
+            case BenchWorkload::kMetadata:
+                return run_metadata();
+            }
+        }
+
+        const std::array<std::vector<int64_t>, kNumBenchOps>& latencies() const
+        {
+            return latencies_;
+        }
+        uint64_t bytes() const { return bytes_; }
+
+    private:
+        FuseHighLevelOpsBase& ops_;
+        const BenchOptions& options_;
+        std::string dir_;
+        fuse_context ctx_{};
+        std::mt19937_64 rng_;
+        std::vector<char> buffer_;
+        // In nanoseconds, one for each call.
+        std::array<std::vector<int64_t>, kNumBenchOps> latencies_;
+        uint64_t bytes_ = 0;
+
+        static int check(int rc, const char* op_name, const std::string& path)
+        {
+            if (rc < 0)
+            {
+                THROW_POSIX_EXCEPTION(-rc, absl::StrCat(op_name, " ", path));
+            }
+            return rc;
+        }
+
+        template <class Func>
+        int timed(BenchOp op, const std::string& path, Func&& func)
+        {
+            auto start = Clock::now();
+            int rc = func();
+            auto elapsed = Clock::now() - start;
+            latencies_[static_cast<size_t>(op)].push_back(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+            return check(rc, stringify(op), path);
+        }
+
+        std::string file_path(std::string_view name) const
+        {
+            return absl::StrCat(dir_, "/", name);
+        }
+
+        void create(const std::string& path, fuse_file_info& info)
+        {
+            info = {};
+            info.flags = O_RDWR;
+            timed(BenchOp::kCreate,
+                  path,
+                  [&]() { return ops_.vcreate(path.c_str(), 0644, &info, &ctx_); });
+        }
+
+        void open(const std::string& path, int flags, fuse_file_info& info)
+        {
+            info = {};
+            info.flags = flags;
+            timed(BenchOp::kOpen, path, [&]() { return ops_.vopen(path.c_str(), &info, &ctx_); });
+        }
+
+        void release(const std::string& path, fuse_file_info& info)
+        {
+            timed(BenchOp::kRelease,
+                  path,
+                  [&]() { return ops_.vrelease(path.c_str(), &info, &ctx_); });
+        }
+
+        void write(const std::string& path, uint64_t offset, size_t size, fuse_file_info& info)
+        {
+            bytes_ += timed(BenchOp::kWrite,
+                            path,
+                            [&]()
+                            {
+                                return ops_.vwrite(path.c_str(),
+                                                   buffer_.data(),
+                                                   size,
+                                                   static_cast<fuse_off_t>(offset),
+                                                   &info,
+                                                   &ctx_);
+                            });
+        }
+
+        void read(const std::string& path, uint64_t offset, size_t size, fuse_file_info& info)
+        {
+            bytes_ += timed(BenchOp::kRead,
+                            path,
+                            [&]()
+                            {
+                                return ops_.vread(path.c_str(),
+                                                  buffer_.data(),
+                                                  size,
+                                                  static_cast<fuse_off_t>(offset),
+                                                  &info,
+                                                  &ctx_);
+                            });
+        }
+
+        void getattr(const std::string& path)
+        {
+            fuse_stat st{};
+            timed(BenchOp::kGetattr,
+                  path,
+                  [&]() { return ops_.vgetattr(path.c_str(), &st, &ctx_); });
+        }
+
+        void readdir(const std::string& path)
+        {
+            fuse_file_info info{};
+            check(ops_.vopendir(path.c_str(), &info, &ctx_), "opendir", path);
+            DEFER(ops_.vreleasedir(path.c_str(), &info, &ctx_));
+            timed(BenchOp::kReaddir,
+                  path,
+                  [&]()
+                  {
+                      return ops_.vreaddir(
+                          path.c_str(),
+                          nullptr,
+                          [](void*, const char*, const fuse_stat*, fuse_off_t) { return 0; },
+                          0,
+                          &info,
+                          &ctx_);
+                  });
+        }
+
+        void run_sequential()
+        {
+            auto path = file_path("sequential");
+            fuse_file_info info{};
+            create(path, info);
+            for (uint64_t offset = 0; offset < options_.file_size; offset += buffer_.size())
+            {
+                write(path,
+                      offset,
+                      std::min<uint64_t>(buffer_.size(), options_.file_size - offset),
+                      info);
+            }
+            release(path, info);
+
+            open(path, O_RDONLY, info);
+            for (uint64_t offset = 0; offset < options_.file_size; offset += buffer_.size())
+            {
+                read(path,
+                     offset,
+                     std::min<uint64_t>(buffer_.size(), options_.file_size - offset),
+                     info);
+            }
+            release(path, info);
+        }
+
+        void run_random()
+        {
+            auto path = file_path("random");
+            uint64_t blocks = std::max<uint64_t>(1, options_.file_size / buffer_.size());
+            fuse_file_info info{};
+            open(path, O_RDWR, info);
+            for (uint64_t i = 0; i < blocks; ++i)
+            {
+                uint64_t offset = rng_() % blocks * buffer_.size();
+                if (rng_() % 2)
+                {
+                    write(path, offset, buffer_.size(), info);
+                }
+                else
+                {
+                    read(path, offset, buffer_.size(), info);
+                }
+            }
+            release(path, info);
+        }
+
+        void run_small_file()
+        {
+            fuse_file_info info{};
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                auto path = file_path(absl::StrCat("small-", i));
+                create(path, info);
+                write(path, 0, buffer_.size(), info);
+                release(path, info);
+            }
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                getattr(file_path(absl::StrCat("small-", i)));
+            }
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                auto path = file_path(absl::StrCat("small-", i));
+                open(path, O_RDONLY, info);
+                read(path, 0, buffer_.size(), info);
+                release(path, info);
+            }
+        }
+
+        void run_metadata()
+        {
+            fuse_file_info info{};
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                auto path = file_path(absl::StrCat("meta-", i));
+                create(path, info);
+                release(path, info);
+                if ((i + 1) % kReaddirInterval == 0)
+                {
+                    readdir(dir_);
+                }
+            }
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                getattr(file_path(absl::StrCat("meta-", i)));
+            }
+            readdir(dir_);
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                auto from = file_path(absl::StrCat("meta-", i));
+                auto to = file_path(absl::StrCat("renamed-", i));
+                timed(BenchOp::kRename,
+                      from,
+                      [&]() { return ops_.vrename(from.c_str(), to.c_str(), &ctx_); });
+            }
+            for (unsigned i = 0; i < options_.files; ++i)
+            {
+                auto path = file_path(absl::StrCat("renamed-", i));
+                timed(
+                    BenchOp::kUnlink, path, [&]() { return ops_.vunlink(path.c_str(), &ctx_); });
+            }
+        }
+    };
+
+    BenchOpSummary summarize(BenchOp op, std::vector<int64_t>& latencies)
+    {
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p)
+        {
+            auto rank = static_cast<size_t>(p * (latencies.size() - 1) + 0.5);
+            return latencies[rank] / 1e3;
+        };
+        double total = 0;
+        for (int64_t ns : latencies)
+        {
+            total += ns;
+        }
+        BenchOpSummary summary;
+        summary.op = op;
+        summary.count = latencies.size();
+        summary.mean = total / latencies.size() / 1e3;
+        summary.p50 = percentile(0.5);
+        summary.p90 = percentile(0.9);
+        summary.p99 = percentile(0.99);
+        summary.max = latencies.back() / 1e3;
+        return summary;
+    }
+}    // namespace
+
+const char* stringify(BenchWorkload workload)
+{
+    switch (workload)
+    {
+    case BenchWorkload::kSequential:
+        return "sequential";
+    case BenchWorkload::kRandom:
+        return "random";
+    case BenchWorkload::kSmallFile:
+        return "small-file";
+    case BenchWorkload::kMetadata:
+        return "metadata";
+    }
+    return "UNKNOWN";
+}
+
+BenchWorkload parse_bench_workload(std::string_view name)
+{
+    for (BenchWorkload workload : {BenchWorkload::kSequential,
+                                   BenchWorkload::kRandom,
+                                   BenchWorkload::kSmallFile,
+                                   BenchWorkload::kMetadata})
+    {
+        if (name == stringify(workload))
+        {
+            return workload;
+        }
+    }
+    throwInvalidArgumentException(absl::StrCat("Unknown benchmark workload ", name));
+}
+
+const char* stringify(BenchOp op)
+{
+    switch (op)
+    {
+    case BenchOp::kCreate:
+        return "create";
+    case BenchOp::kOpen:
+        return "open";
+    case BenchOp::kRelease:
+        return "release";
+    case BenchOp::kRead:
+        return "read";
+    case BenchOp::kWrite:
+        return "write";
+    case BenchOp::kGetattr:
+        return "getattr";
+    case BenchOp::kReaddir:
+        return "readdir";
+    case BenchOp::kRename:
+        return "rename";
+    case BenchOp::kUnlink:
+        return "unlink";
+    }
+    return "UNKNOWN";
+}
+
+std::string BenchReport::to_text() const
+{
+    std::string result = absl::StrFormat(
+        "workload %s, %u threads, %.3f s\n%.0f ops/s, %.2f MB/s\n\n%-8s %10s %10s %10s %10s "
+        "%10s %10s\n",
+        stringify(options.workload),
+        options.threads,
+        seconds,
+        ops_per_second(),
+        megabytes_per_second(),
+        "op",
+        "count",
+        "mean(us)",
+        "p50(us)",
+        "p90(us)",
+        "p99(us)",
+        "max(us)");
+    for (const BenchOpSummary& s : per_op)
+    {
+        absl::StrAppendFormat(&result,
+                              "%-8s %10u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                              stringify(s.op),
+                              s.count,
+                              s.mean,
+                              s.p50,
+                              s.p90,
+                              s.p99,
+                              s.max);
+    }
+    return result;
+}
+
+std::string BenchReport::to_json() const
+{
+    std::string result = absl::StrFormat(
+        R"({"workload":"%s","threads":%u,"file_size":%u,"io_size":%u,"files":%u,)"
+        R"("seconds":%.6f,"ops":%u,"bytes":%u,"ops_per_second":%.1f,"mb_per_second":%.3f,)"
+        R"("latency_us":{)",
+        stringify(options.workload),
+        options.threads,
+        options.file_size,
+        options.io_size,
+        options.files,
+        seconds,
+        ops,
+        bytes,
+        ops_per_second(),
+        megabytes_per_second());
+    for (size_t i = 0; i < per_op.size(); ++i)
+    {
+        const BenchOpSummary& s = per_op[i];
+        absl::StrAppendFormat(
+            &result,
+            R"(%s"%s":{"count":%u,"mean":%.1f,"p50":%.1f,"p90":%.1f,"p99":%.1f,"max":%.1f})",
+            i == 0 ? "" : ",",
+            stringify(s.op),
+            s.count,
+            s.mean,
+            s.p50,
+            s.p90,
+            s.p99,
+            s.max);
+    }
+    result.append("}}\n");
+    return result;
+}
+
+BenchReport run_fuse_bench(FuseHighLevelOpsBase& ops, const BenchOptions& options)
+{
+    if (options.threads == 0 || options.io_size == 0)
+    {
+        throwInvalidArgumentException("The thread count and the I/O size must be positive");
+    }
+
+    std::vector<std::unique_ptr<BenchWorker>> workers;
+    for (unsigned i = 0; i < options.threads; ++i)
+    {
+        workers.push_back(std::make_unique<BenchWorker>(ops, options, i));
+        workers.back()->setup();
+    }
+
+    absl::Notification start;
+    std::vector<std::exception_ptr> errors(workers.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        threads.emplace_back(
+            [&, i]()
+            {
+                start.WaitForNotification();
+                try
+                {
+                    workers[i]->run();
+                }
+                catch (...)
+                {
+                    errors[i] = std::current_exception();
+                }
+            });
+    }
+    auto start_time = Clock::now();
+    start.Notify();
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+    auto elapsed = Clock::now() - start_time;
+    for (const std::exception_ptr& e : errors)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+
+    BenchReport report;
+    report.options = options;
+    report.seconds = std::chrono::duration<double>(elapsed).count();
+    for (size_t op = 0; op < kNumBenchOps; ++op)
+    {
+        std::vector<int64_t> merged;
+        for (const auto& w : workers)
+        {
+            const auto& latencies = w->latencies()[op];
+            merged.insert(merged.end(), latencies.begin(), latencies.end());
+        }
+        if (merged.empty())
+        {
+            continue;
+        }
+        report.ops += merged.size();
+        report.per_op.push_back(summarize(static_cast<BenchOp>(op), merged));
+    }
+    for (const auto& w : workers)
+    {
+        report.bytes += w->bytes();
+    }
+    return report;
+}
+}    // namespace securefs
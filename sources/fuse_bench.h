@@ -0,0 +1,87 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+enum class BenchWorkload : unsigned char
+{
+    // Each thread writes a file of `file_size` from start to end, then reads it back.
+    kSequential = 0,
+    // Each thread reads and writes `io_size` blocks at random offsets of a prefilled file.
+    kRandom = 1,
+    // Each thread creates `files` files of `io_size` bytes, stats them and reads them back.
+    kSmallFile = 2,
+    // Each thread creates, stats, lists, renames and unlinks `files` empty files.
+    kMetadata = 3,
+};
+
+const char* stringify(BenchWorkload workload);
+
+/// Accepts the strings returned by `stringify()`.
+BenchWorkload parse_bench_workload(std::string_view name);
+
+/// The operations whose latencies are reported.
+enum class BenchOp : unsigned char
+{
+    kCreate,
+    kOpen,
+    kRelease,
+    kRead,
+    kWrite,
+    kGetattr,
+    kReaddir,
+    kRename,
+    kUnlink,
+};
+
+inline constexpr size_t kNumBenchOps = static_cast<size_t>(BenchOp::kUnlink) + 1;
+
+const char* stringify(BenchOp op);
+
+struct BenchOptions
+{
+    BenchWorkload workload = BenchWorkload::kSequential;
+    unsigned threads = 4;
+    uint64_t file_size = 64 << 20;
+    unsigned io_size = 128 << 10;
+    unsigned files = 1000;
+};
+
+struct BenchOpSummary
+{
+    BenchOp op;
+    uint64_t count;
+    // In microseconds.
+    double mean, p50, p90, p99, max;
+};
+
+struct BenchReport
+{
+    BenchOptions options;
+    double seconds = 0;
+    uint64_t ops = 0;
+    // Read or written by the timed operations.
+    uint64_t bytes = 0;
+    // Only the operations that occurred, in the order of `BenchOp`.
+    std::vector<BenchOpSummary> per_op;
+
+    double ops_per_second() const { return seconds > 0 ? ops / seconds : 0; }
+    double megabytes_per_second() const { return seconds > 0 ? bytes / seconds / 1e6 : 0; }
+
+    std::string to_text() const;
+    std::string to_json() const;
+};
+
+/// Drives `ops` directly, without FUSE, from `options.threads` threads at once. Every thread works
+/// under its own top level directory, which is created first and left behind. Only the timed part
+/// of the workload is reported, not the setup, such as prefilling the file of `kRandom`.
+///
+/// Any failing operation aborts the run with an exception.
+BenchReport run_fuse_bench(FuseHighLevelOpsBase& ops, const BenchOptions& options);
+}    // namespace securefs
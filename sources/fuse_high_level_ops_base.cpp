@@ -1,6 +1,7 @@
 #include "fuse_high_level_ops_base.h"
 #include "fuse_tracer_v2.h"
 #include "logger.h"
+#include "metrics.h"
 
 #include <absl/functional/function_ref.h>
 
@@ -11,7 +12,7 @@ int FuseHighLevelOpsBase::static_statfs(const char* path, fuse_statvfs* buf)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vstatfs(path, buf, ctx); },
-                                          "statfs",
+                                          FuseOp::kStatfs,
                                           __LINE__,
                                           {{"path", {path}}, {"buf", {buf}}});
 }
@@ -20,7 +21,7 @@ int FuseHighLevelOpsBase::static_getattr(const char* path, fuse_stat* st)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vgetattr(path, st, ctx); },
-                                          "getattr",
+                                          FuseOp::kGetattr,
                                           __LINE__,
                                           {{"path", {path}}, {"st", {st}}});
 }
@@ -29,7 +30,7 @@ int FuseHighLevelOpsBase::static_fgetattr(const char* path, fuse_stat* st, fuse_
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vfgetattr(path, st, info, ctx); },
-                                          "fgetattr",
+                                          FuseOp::kFgetattr,
                                           __LINE__,
                                           {{"path", {path}}, {"st", {st}}, {"info", {info}}});
 }
@@ -38,7 +39,7 @@ int FuseHighLevelOpsBase::static_opendir(const char* path, fuse_file_info* info)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vopendir(path, info, ctx); },
-                                          "opendir",
+                                          FuseOp::kOpendir,
                                           __LINE__,
                                           {{"path", {path}}, {"info", {info}}});
 }
@@ -47,7 +48,7 @@ int FuseHighLevelOpsBase::static_releasedir(const char* path, fuse_file_info* in
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vreleasedir(path, info, ctx); },
-                                          "releasedir",
+                                          FuseOp::kReleasedir,
                                           __LINE__,
                                           {{"path", {path}}, {"info", {info}}});
 }
@@ -58,7 +59,7 @@ int FuseHighLevelOpsBase::static_readdir(
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vreaddir(path, buf, filler, off, info, ctx); },
-        "readdir",
+        FuseOp::kReaddir,
         __LINE__,
         {{"path", {path}}, {"buf", {buf}}, {"filler", {filler}}, {"off", {off}}, {"info", {info}}});
 }
@@ -66,26 +67,38 @@ int FuseHighLevelOpsBase::static_create(const char* path, fuse_mode_t mode, fuse
 {
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
-    return trace::FuseTracer::traced_call([=]() { return op->vcreate(path, mode, info, ctx); },
-                                          "create",
-                                          __LINE__,
-                                          {{"path", {path}}, {"mode", {mode}}, {"info", {info}}});
+    int rc = trace::FuseTracer::traced_call([=]() { return op->vcreate(path, mode, info, ctx); },
+                                            FuseOp::kCreate,
+                                            __LINE__,
+                                            {{"path", {path}}, {"mode", {mode}}, {"info", {info}}});
+    if (rc == 0)
+    {
+        metrics::adjust(MetricGauge::kOpenFiles, 1);
+    }
+    return rc;
 }
 int FuseHighLevelOpsBase::static_open(const char* path, fuse_file_info* info)
 {
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
-    return trace::FuseTracer::traced_call([=]() { return op->vopen(path, info, ctx); },
-                                          "open",
-                                          __LINE__,
-                                          {{"path", {path}}, {"info", {info}}});
+    int rc = trace::FuseTracer::traced_call([=]() { return op->vopen(path, info, ctx); },
+                                            FuseOp::kOpen,
+                                            __LINE__,
+                                            {{"path", {path}}, {"info", {info}}});
+    if (rc == 0)
+    {
+        metrics::adjust(MetricGauge::kOpenFiles, 1);
+    }
+    return rc;
 }
 int FuseHighLevelOpsBase::static_release(const char* path, fuse_file_info* info)
 {
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
+    // The kernel forgets the handle whatever the result is.
+    metrics::adjust(MetricGauge::kOpenFiles, -1);
     return trace::FuseTracer::traced_call([=]() { return op->vrelease(path, info, ctx); },
-                                          "release",
+                                          FuseOp::kRelease,
                                           __LINE__,
                                           {{"path", {path}}, {"info", {info}}});
 }
@@ -96,7 +109,7 @@ int FuseHighLevelOpsBase::static_read(
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]()
                                           { return op->vread(path, buf, size, offset, info, ctx); },
-                                          "read",
+                                          FuseOp::kRead,
                                           __LINE__,
                                           {{"path", {path}},
                                            {"buf", {static_cast<const void*>(buf)}},
@@ -111,7 +124,7 @@ int FuseHighLevelOpsBase::static_write(
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vwrite(path, buf, size, offset, info, ctx); },
-        "write",
+        FuseOp::kWrite,
         __LINE__,
         {{"path", {path}},
          {"buf", {static_cast<const void*>(buf)}},
@@ -124,7 +137,7 @@ int FuseHighLevelOpsBase::static_flush(const char* path, fuse_file_info* info)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vflush(path, info, ctx); },
-                                          "flush",
+                                          FuseOp::kFlush,
                                           __LINE__,
                                           {{"path", {path}}, {"info", {info}}});
 }
@@ -133,7 +146,7 @@ int FuseHighLevelOpsBase::static_ftruncate(const char* path, fuse_off_t len, fus
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vftruncate(path, len, info, ctx); },
-                                          "ftruncate",
+                                          FuseOp::kFtruncate,
                                           __LINE__,
                                           {{"path", {path}}, {"len", {len}}, {"info", {info}}});
 }
@@ -142,14 +155,14 @@ int FuseHighLevelOpsBase::static_unlink(const char* path)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
-        [=]() { return op->vunlink(path, ctx); }, "unlink", __LINE__, {{"path", {path}}});
+        [=]() { return op->vunlink(path, ctx); }, FuseOp::kUnlink, __LINE__, {{"path", {path}}});
 }
 int FuseHighLevelOpsBase::static_mkdir(const char* path, fuse_mode_t mode)
 {
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vmkdir(path, mode, ctx); },
-                                          "mkdir",
+                                          FuseOp::kMkdir,
                                           __LINE__,
                                           {{"path", {path}}, {"mode", {mode}}});
 }
@@ -158,14 +171,14 @@ int FuseHighLevelOpsBase::static_rmdir(const char* path)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
-        [=]() { return op->vrmdir(path, ctx); }, "rmdir", __LINE__, {{"path", {path}}});
+        [=]() { return op->vrmdir(path, ctx); }, FuseOp::kRmdir, __LINE__, {{"path", {path}}});
 }
 int FuseHighLevelOpsBase::static_chmod(const char* path, fuse_mode_t mode)
 {
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vchmod(path, mode, ctx); },
-                                          "chmod",
+                                          FuseOp::kChmod,
                                           __LINE__,
                                           {{"path", {path}}, {"mode", {mode}}});
 }
@@ -174,7 +187,7 @@ int FuseHighLevelOpsBase::static_chown(const char* path, fuse_uid_t uid, fuse_gi
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vchown(path, uid, gid, ctx); },
-                                          "chown",
+                                          FuseOp::kChown,
                                           __LINE__,
                                           {{"path", {path}}, {"uid", {uid}}, {"gid", {gid}}});
 }
@@ -183,7 +196,7 @@ int FuseHighLevelOpsBase::static_symlink(const char* to, const char* from)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vsymlink(to, from, ctx); },
-                                          "symlink",
+                                          FuseOp::kSymlink,
                                           __LINE__,
                                           {{"to", {to}}, {"from", {from}}});
 }
@@ -192,7 +205,7 @@ int FuseHighLevelOpsBase::static_link(const char* src, const char* dest)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vlink(src, dest, ctx); },
-                                          "link",
+                                          FuseOp::kLink,
                                           __LINE__,
                                           {{"src", {src}}, {"dest", {dest}}});
 }
@@ -202,7 +215,7 @@ int FuseHighLevelOpsBase::static_readlink(const char* path, char* buf, size_t si
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vreadlink(path, buf, size, ctx); },
-        "readlink",
+        FuseOp::kReadlink,
         __LINE__,
         {{"path", {path}}, {"buf", {static_cast<const void*>(buf)}}, {"size", {size}}});
 }
@@ -211,7 +224,7 @@ int FuseHighLevelOpsBase::static_rename(const char* from, const char* to)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vrename(from, to, ctx); },
-                                          "rename",
+                                          FuseOp::kRename,
                                           __LINE__,
                                           {{"from", {from}}, {"to", {to}}});
 }
@@ -221,7 +234,7 @@ int FuseHighLevelOpsBase::static_fsync(const char* path, int datasync, fuse_file
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vfsync(path, datasync, info, ctx); },
-        "fsync",
+        FuseOp::kFsync,
         __LINE__,
         {{"path", {path}}, {"datasync", {datasync}}, {"info", {info}}});
 }
@@ -230,7 +243,7 @@ int FuseHighLevelOpsBase::static_truncate(const char* path, fuse_off_t len)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vtruncate(path, len, ctx); },
-                                          "truncate",
+                                          FuseOp::kTruncate,
                                           __LINE__,
                                           {{"path", {path}}, {"len", {len}}});
 }
@@ -239,7 +252,7 @@ int FuseHighLevelOpsBase::static_utimens(const char* path, const fuse_timespec*
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vutimens(path, ts, ctx); },
-                                          "utimens",
+                                          FuseOp::kUtimens,
                                           __LINE__,
                                           {{"path", {path}}, {"ts", {ts}}});
 }
@@ -248,7 +261,7 @@ int FuseHighLevelOpsBase::static_listxattr(const char* path, char* list, size_t
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vlistxattr(path, list, size, ctx); },
-                                          "listxattr",
+                                          FuseOp::kListxattr,
                                           __LINE__,
                                           {{"path", {path}}, {"list", {list}}, {"size", {size}}});
 }
@@ -259,7 +272,7 @@ int FuseHighLevelOpsBase::static_getxattr(
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vgetxattr(path, name, value, size, position, ctx); },
-        "getxattr",
+        FuseOp::kGetxattr,
         __LINE__,
         {{"path", {path}},
          {"name", {name}},
@@ -278,7 +291,7 @@ int FuseHighLevelOpsBase::static_setxattr(const char* path,
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call(
         [=]() { return op->vsetxattr(path, name, value, size, flags, position, ctx); },
-        "setxattr",
+        FuseOp::kSetxattr,
         __LINE__,
         {{"path", {path}},
          {"name", {name}},
@@ -292,7 +305,7 @@ int FuseHighLevelOpsBase::static_removexattr(const char* path, const char* name)
     auto ctx = fuse_get_context();
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]() { return op->vremovexattr(path, name, ctx); },
-                                          "removexattr",
+                                          FuseOp::kRemovexattr,
                                           __LINE__,
                                           {{"path", {path}}, {"name", {name}}});
 }
@@ -306,7 +319,7 @@ int FuseHighLevelOpsBase::static_getpath(const char* path,
     auto op = static_cast<FuseHighLevelOpsBase*>(ctx->private_data);
     return trace::FuseTracer::traced_call([=]()
                                           { return op->vgetpath(path, buf, size, info, ctx); },
-                                          "getpath",
+                                          FuseOp::kGetpath,
                                           __LINE__,
                                           {{"path", {path}},
                                            {"buf", {static_cast<const void*>(buf)}},
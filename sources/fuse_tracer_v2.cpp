@@ -7,6 +7,7 @@
 #include <absl/time/time.h>
 
 #include <ctime>
+#include <optional>
 #include <type_traits>
 #include <variant>
 
@@ -99,48 +100,71 @@ namespace
     {
         absl::Format(&sink, "%v", value.value);
     }
+
+    std::optional<int64_t> as_integer(const WrappedFuseArg& arg)
+    {
+        return std::visit(
+            [](auto value) -> std::optional<int64_t>
+            {
+                if constexpr (std::is_integral_v<decltype(value)>)
+                {
+                    return static_cast<int64_t>(value);
+                }
+                else
+                {
+                    return std::nullopt;
+                }
+            },
+            arg.value);
+    }
+
+    uint64_t hash_string_arg(const TraceRecorder& recorder, const WrappedFuseArg& arg)
+    {
+        auto str = std::get_if<const char*>(&arg.value);
+        return str && *str ? recorder.hash_path(*str) : 0;
+    }
 }    // namespace
 
-void FuseTracer::print(FILE* fp, const WrappedFuseArg& arg)
+void FuseTracer::print(std::string& out, const WrappedFuseArg& arg)
 {
-    absl::FPrintF(fp, "%s=", arg.name);
+    absl::StrAppendFormat(&out, "%s=", arg.name);
     std::visit(
-        [fp](auto value)
+        [&out](auto value)
         {
             if constexpr (std::is_convertible_v<decltype(value), fuse_fill_dir_t>)
             {
-                absl::FPrintF(fp, "%p", value);
+                absl::StrAppendFormat(&out, "%p", value);
             }
             else if constexpr (std::is_pointer_v<decltype(value)>)
             {
                 if (value == nullptr)
                 {
-                    absl::FPrintF(fp, "%p", nullptr);
+                    absl::StrAppendFormat(&out, "%p", nullptr);
                 }
                 else
                 {
-                    absl::FPrintF(fp, "%v", Wrapped<decltype(value)>{value});
+                    absl::StrAppendFormat(&out, "%v", Wrapped<decltype(value)>{value});
                 }
             }
             else
             {
-                absl::FPrintF(fp, "%v", value);
+                absl::StrAppendFormat(&out, "%v", value);
             }
         },
         arg.value);
 }
-void FuseTracer::print(FILE* fp, const WrappedFuseArg* args, size_t arg_size)
+void FuseTracer::print(std::string& out, const WrappedFuseArg* args, size_t arg_size)
 {
-    fputc('(', fp);
+    out.push_back('(');
     for (size_t i = 0; i < arg_size; ++i)
     {
         if (i)
         {
-            fputs(", ", fp);
+            out.append(", ");
         }
-        print(fp, args[i]);
+        print(out, args[i]);
     }
-    fputc(')', fp);
+    out.push_back(')');
 }
 
 void FuseTracer::print_function_starts(
@@ -148,11 +172,14 @@ void FuseTracer::print_function_starts(
 {
     if (logger && logger->get_level() <= LoggingLevel::kLogTrace)
     {
-        logger->prelog(LoggingLevel::kLogTrace, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogTrace));
-
-        fputs("Function starts with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
+        logger->log_v2(LoggingLevel::kLogTrace,
+                       funcsig,
+                       lineno,
+                       [&](std::string& out)
+                       {
+                           out.append("Function starts with arguments ");
+                           print(out, args, arg_size);
+                       });
     }
 }
 
@@ -165,12 +192,15 @@ void FuseTracer::print_function_returns(Logger* logger,
 {
     if (logger && logger->get_level() <= LoggingLevel::kLogTrace)
     {
-        logger->prelog(LoggingLevel::kLogTrace, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogTrace));
-
-        fputs("Function ends with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
-        absl::FPrintF(logger->m_fp, " and return code %lld", rc);
+        logger->log_v2(LoggingLevel::kLogTrace,
+                       funcsig,
+                       lineno,
+                       [&](std::string& out)
+                       {
+                           out.append("Function ends with arguments ");
+                           print(out, args, arg_size);
+                           absl::StrAppendFormat(&out, " and return code %lld", rc);
+                       });
     }
 }
 
@@ -198,17 +228,73 @@ void FuseTracer::print_function_exception(Logger* logger,
     }
     if (logger->get_level() <= LoggingLevel::kLogError)
     {
-        logger->prelog(LoggingLevel::kLogError, funcsig, lineno);
-        DEFER(logger->postlog(LoggingLevel::kLogError));
-
-        fputs("Function fails with arguments ", logger->m_fp);
-        print(logger->m_fp, args, arg_size);
-        absl::FPrintF(logger->m_fp,
-                      " with return code %d because it encounters exception %s: %s",
-                      rc,
-                      get_type_name(e).get(),
-                      e.what());
+        logger->log_v2(LoggingLevel::kLogError,
+                       funcsig,
+                       lineno,
+                       [&](std::string& out)
+                       {
+                           out.append("Function fails with arguments ");
+                           print(out, args, arg_size);
+                           absl::StrAppendFormat(
+                               &out,
+                               " with return code %d because it encounters exception %s: %s",
+                               rc,
+                               get_type_name(e).get(),
+                               e.what());
+                       });
     }
 }
 
+void FuseTracer::record_binary(TraceRecorder& recorder,
+                               FuseOp op,
+                               const WrappedFuseArg* args,
+                               size_t arg_size,
+                               int rc,
+                               std::chrono::steady_clock::time_point start,
+                               std::chrono::steady_clock::duration elapsed)
+{
+    TraceRecord record{};
+    record.op = static_cast<uint8_t>(op);
+    record.result = rc;
+    record.duration_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    // The names of the arguments are those given by `FuseHighLevelOpsBase`. Symlink passes the
+    // target as "to" and the link as "from", so "from" is always the path being operated on.
+    for (size_t i = 0; i < arg_size; ++i)
+    {
+        const auto& arg = args[i];
+        if (arg.name == "path" || arg.name == "src" || arg.name == "from")
+        {
+            record.path_hash = hash_string_arg(recorder, arg);
+        }
+        else if (arg.name == "to" || arg.name == "dest" || arg.name == "name")
+        {
+            record.path2_hash = hash_string_arg(recorder, arg);
+        }
+        else if (arg.name == "offset" || arg.name == "off")
+        {
+            record.offset = as_integer(arg).value_or(0);
+        }
+        else if (arg.name == "size" || arg.name == "len" || arg.name == "mode")
+        {
+            record.size = static_cast<uint64_t>(as_integer(arg).value_or(0));
+        }
+        else if (arg.name == "flags" || arg.name == "datasync")
+        {
+            record.flags = static_cast<int32_t>(as_integer(arg).value_or(0));
+        }
+        else if (arg.name == "info")
+        {
+            if (auto info = std::get_if<const fuse_file_info*>(&arg.value); info && *info)
+            {
+                record.handle = (*info)->fh;
+                if (op == FuseOp::kOpen || op == FuseOp::kCreate)
+                {
+                    record.flags = (*info)->flags;
+                }
+            }
+        }
+    }
+    recorder.record(record, start);
+}
 }    // namespace securefs::trace
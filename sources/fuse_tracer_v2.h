@@ -1,10 +1,14 @@
 #pragma once
 #include "exceptions.h"
 #include "logger.h"
+#include "metrics.h"
 #include "platform.h"    // IWYU pragma: keep
+#include "trace_recorder.h"
 
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <string>
 #include <variant>
 
 namespace securefs::trace
@@ -29,8 +33,8 @@ struct WrappedFuseArg
 class FuseTracer
 {
 private:
-    static void print(FILE* fp, const WrappedFuseArg& arg);
-    static void print(FILE* fp, const WrappedFuseArg* args, size_t arg_size);
+    static void print(std::string& out, const WrappedFuseArg& arg);
+    static void print(std::string& out, const WrappedFuseArg* args, size_t arg_size);
 
     static void print_function_starts(Logger* logger,
                                       const char* funcsig,
@@ -53,13 +57,20 @@ private:
                                          const std::exception& e,
                                          int rc);
 
-public:
+    static void record_binary(TraceRecorder& recorder,
+                              FuseOp op,
+                              const WrappedFuseArg* args,
+                              size_t arg_size,
+                              int rc,
+                              std::chrono::steady_clock::time_point start,
+                              std::chrono::steady_clock::duration elapsed);
+
     template <class ActualFunction>
-    static inline auto traced_call(ActualFunction&& func,
+    static inline auto logged_call(ActualFunction&& func,
                                    const char* funcsig,
                                    int lineno,
                                    const std::initializer_list<WrappedFuseArg>& args,
-                                   Logger* logger = global_logger) -> decltype(func())
+                                   Logger* logger) -> decltype(func())
     {
         print_function_starts(logger, funcsig, lineno, args.begin(), args.size());
         try
@@ -87,5 +98,31 @@ public:
             return rc;
         }
     }
+
+public:
+    /// Logs the call at trace level, turns exceptions into error codes, and records the call in
+    /// the metrics of `op` and in the active binary trace, if any.
+    template <class ActualFunction>
+    static inline auto traced_call(ActualFunction&& func,
+                                   FuseOp op,
+                                   int lineno,
+                                   const std::initializer_list<WrappedFuseArg>& args,
+                                   Logger* logger = global_logger) -> decltype(func())
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto rc
+            = logged_call(std::forward<ActualFunction>(func), stringify(op), lineno, args, logger);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        metrics::record_call(
+            op,
+            static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()),
+            rc < 0);
+        if (auto* recorder = TraceRecorder::active())
+        {
+            record_binary(*recorder, op, args.begin(), args.size(), rc, start, elapsed);
+        }
+        return rc;
+    }
 };
 }    // namespace securefs::trace
@@ -0,0 +1,754 @@
+#include "gcm_aesni.h"
+
+#include <cryptopp/misc.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SECUREFS_HAS_AESNI 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SECUREFS_AESNI_TARGET
+#define SECUREFS_AESNI_INLINE __forceinline
+#define SECUREFS_VAES_TARGET
+#define SECUREFS_VAES_INLINE __forceinline
+#define SECUREFS_UNROLL_LANES
+#else
+#define SECUREFS_AESNI_TARGET __attribute__((target("aes,pclmul,ssse3")))
+#define SECUREFS_AESNI_INLINE inline __attribute__((target("aes,pclmul,ssse3"), always_inline))
+#define SECUREFS_VAES_TARGET __attribute__((target("vaes,vpclmulqdq,avx2,aes,pclmul,ssse3")))
+#define SECUREFS_VAES_INLINE                                                                       \
+    inline __attribute__((target("vaes,vpclmulqdq,avx2,aes,pclmul,ssse3"), always_inline))
+// The loops over the lanes must be unrolled so that their states stay in registers.
+#define SECUREFS_UNROLL_LANES _Pragma("GCC unroll 4")
+#endif
+#else
+#define SECUREFS_HAS_AESNI 0
+#endif
+
+namespace securefs::aesni_gcm
+{
+#if SECUREFS_HAS_AESNI
+namespace
+{
+    // SubWord of FIPS-197 through the AES unit, whose timing, unlike that of a table lookup, does
+    // not depend on the key.
+    SECUREFS_AESNI_INLINE uint32_t sub_word(uint32_t word)
+    {
+        __m128i v = _mm_set_epi32(0, 0, static_cast<int>(word), 0);
+        return static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_aeskeygenassist_si128(v, 0)));
+    }
+
+    // The key expansion of FIPS-197, which yields the round keys in the layout AES-NI expects. The
+    // words are in memory order, so RotWord is a right rotation on little endian x86.
+    SECUREFS_AESNI_TARGET void
+    expand_key(const unsigned char* key, size_t key_size, unsigned char* out, unsigned* rounds)
+    {
+        size_t nk = key_size / 4;
+        size_t nr = nk + 6;
+        size_t total_words = 4 * (nr + 1);
+        memcpy(out, key, key_size);
+        uint32_t rcon = 1;
+        uint32_t t = 0, previous = 0;
+        for (size_t i = nk; i < total_words; ++i)
+        {
+            memcpy(&t, out + 4 * (i - 1), 4);
+            if (i % nk == 0)
+            {
+                t = sub_word(t);
+                t = ((t >> 8) | (t << 24)) ^ rcon;
+                rcon = ((rcon << 1) ^ ((rcon & 0x80) ? 0x1b : 0)) & 0xff;
+            }
+            else if (nk > 6 && i % nk == 4)
+            {
+                t = sub_word(t);
+            }
+            memcpy(&previous, out + 4 * (i - nk), 4);
+            t ^= previous;
+            memcpy(out + 4 * i, &t, 4);
+        }
+        CryptoPP::SecureWipeBuffer(&t, 1);
+        CryptoPP::SecureWipeBuffer(&previous, 1);
+        *rounds = static_cast<unsigned>(nr);
+    }
+
+    void store_be64(unsigned char* out, uint64_t value)
+    {
+        for (int i = 7; i >= 0; --i)
+        {
+            out[i] = static_cast<unsigned char>(value);
+            value >>= 8;
+        }
+    }
+
+    uint32_t byte_swap32(uint32_t v)
+    {
+        return (v >> 24) | ((v >> 8) & 0xff00u) | ((v << 8) & 0xff0000u) | (v << 24);
+    }
+
+    SECUREFS_AESNI_INLINE __m128i byte_reverse(__m128i x)
+    {
+        return _mm_shuffle_epi8(x,
+                                _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    }
+
+    SECUREFS_AESNI_INLINE __m128i load_partial(const unsigned char* p, size_t n)
+    {
+        if (n == 16)
+        {
+            return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        }
+        alignas(16) unsigned char buffer[16] = {};
+        memcpy(buffer, p, n);
+        return _mm_load_si128(reinterpret_cast<const __m128i*>(buffer));
+    }
+
+    SECUREFS_AESNI_INLINE void store_partial(unsigned char* p, __m128i v, size_t n)
+    {
+        if (n == 16)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+            return;
+        }
+        alignas(16) unsigned char buffer[16];
+        _mm_store_si128(reinterpret_cast<__m128i*>(buffer), v);
+        memcpy(p, buffer, n);
+    }
+
+    // Multiplication in GF(2^128) of byte reversed operands, from Intel's white paper "Intel
+    // Carry-Less Multiplication Instruction and its Usage for Computing the GCM Mode".
+    SECUREFS_AESNI_INLINE __m128i gf_multiply(__m128i a, __m128i b)
+    {
+        __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+        __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+                                    _mm_clmulepi64_si128(a, b, 0x01));
+        __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+        lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+        hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+        // Shift the 256 bit product left by one, because the operands are bit reflected.
+        __m128i lo_carry = _mm_srli_epi32(lo, 31);
+        __m128i hi_carry = _mm_srli_epi32(hi, 31);
+        lo = _mm_slli_epi32(lo, 1);
+        hi = _mm_slli_epi32(hi, 1);
+        __m128i cross_carry = _mm_srli_si128(lo_carry, 12);
+        hi_carry = _mm_slli_si128(hi_carry, 4);
+        lo_carry = _mm_slli_si128(lo_carry, 4);
+        lo = _mm_or_si128(lo, lo_carry);
+        hi = _mm_or_si128(_mm_or_si128(hi, hi_carry), cross_carry);
+
+        // Reduce modulo x^128 + x^7 + x^2 + x + 1.
+        __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                                  _mm_slli_epi32(lo, 25));
+        __m128i t_hi = _mm_srli_si128(t, 4);
+        lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+        __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                                  _mm_srli_epi32(lo, 7));
+        u = _mm_xor_si128(u, t_hi);
+        lo = _mm_xor_si128(lo, u);
+        return _mm_xor_si128(hi, lo);
+    }
+
+    SECUREFS_AESNI_INLINE __m128i
+    ghash_update(__m128i x, __m128i h, const unsigned char* data, size_t size)
+    {
+        for (size_t off = 0; off < size; off += 16)
+        {
+            __m128i block = load_partial(data + off, std::min<size_t>(16, size - off));
+            x = gf_multiply(_mm_xor_si128(x, byte_reverse(block)), h);
+        }
+        return x;
+    }
+
+    SECUREFS_AESNI_INLINE __m128i length_block(size_t aad_size, size_t text_size)
+    {
+        alignas(16) unsigned char buffer[16];
+        store_be64(buffer, static_cast<uint64_t>(aad_size) * 8);
+        store_be64(buffer + 8, static_cast<uint64_t>(text_size) * 8);
+        return byte_reverse(_mm_load_si128(reinterpret_cast<const __m128i*>(buffer)));
+    }
+
+    SECUREFS_AESNI_INLINE __m128i initial_counter(__m128i h,
+                                                  const unsigned char* iv,
+                                                  size_t iv_size)
+    {
+        if (iv_size == 12)
+        {
+            alignas(16) unsigned char buffer[16] = {};
+            memcpy(buffer, iv, 12);
+            buffer[15] = 1;
+            return _mm_load_si128(reinterpret_cast<const __m128i*>(buffer));
+        }
+        __m128i x = ghash_update(_mm_setzero_si128(), h, iv, iv_size);
+        x = gf_multiply(_mm_xor_si128(x, length_block(0, iv_size)), h);
+        return byte_reverse(x);
+    }
+
+    template <size_t N>
+    SECUREFS_AESNI_INLINE void aes_encrypt(const __m128i* round_keys, unsigned rounds, __m128i* b)
+    {
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            b[l] = _mm_xor_si128(b[l], round_keys[0]);
+        }
+        for (unsigned r = 1; r < rounds; ++r)
+        {
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < N; ++l)
+            {
+                b[l] = _mm_aesenc_si128(b[l], round_keys[r]);
+            }
+        }
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            b[l] = _mm_aesenclast_si128(b[l], round_keys[rounds]);
+        }
+    }
+
+    // Produces the next keystream block of each of the `N` messages.
+    template <size_t N>
+    SECUREFS_AESNI_INLINE void encrypt_counters(const __m128i* round_keys,
+                                                unsigned rounds,
+                                                const __m128i* counter_base,
+                                                uint32_t* counter,
+                                                __m128i* blocks)
+    {
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            blocks[l] = _mm_or_si128(
+                counter_base[l], _mm_set_epi32(static_cast<int>(byte_swap32(counter[l])), 0, 0, 0));
+            ++counter[l];
+        }
+        aes_encrypt<N>(round_keys, rounds, blocks);
+    }
+
+    // Processes `N` messages of the same shape in lockstep. Returns a bitmask of the messages
+    // whose tags verify, which is meaningless on encryption.
+    template <size_t N, bool Encrypt>
+    SECUREFS_AESNI_TARGET unsigned
+    process_group(const Key& key, size_t iv_size, const GCMMessage* messages)
+    {
+        __m128i round_keys[15];
+        for (unsigned r = 0; r <= key.rounds; ++r)
+        {
+            round_keys[r]
+                = _mm_load_si128(reinterpret_cast<const __m128i*>(key.round_keys + 16 * r));
+        }
+        const __m128i h = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hash_key));
+        const size_t aad_size = messages[0].aad_size;
+        const size_t size = messages[0].size;
+
+        __m128i x[N], tag_mask[N], blocks[N], counter_base[N];
+        uint32_t counter[N];
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            blocks[l] = initial_counter(h, messages[l].iv, iv_size);
+            alignas(16) unsigned char j0[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(j0), blocks[l]);
+            counter[l] = ((uint32_t{j0[12]} << 24) | (uint32_t{j0[13]} << 16)
+                          | (uint32_t{j0[14]} << 8) | uint32_t{j0[15]})
+                + 1;
+            counter_base[l] = _mm_and_si128(blocks[l], _mm_set_epi32(0, -1, -1, -1));
+            x[l] = _mm_setzero_si128();
+        }
+        aes_encrypt<N>(round_keys, key.rounds, blocks);
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            tag_mask[l] = blocks[l];
+        }
+
+        for (size_t off = 0; off < aad_size; off += 16)
+        {
+            size_t n = std::min<size_t>(16, aad_size - off);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < N; ++l)
+            {
+                __m128i a = byte_reverse(load_partial(messages[l].aad + off, n));
+                x[l] = gf_multiply(_mm_xor_si128(x[l], a), h);
+            }
+        }
+
+        // The loop over whole blocks is kept free of branches and memory round trips.
+        size_t off = 0;
+        for (; off + 16 <= size; off += 16)
+        {
+            encrypt_counters<N>(round_keys, key.rounds, counter_base, counter, blocks);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < N; ++l)
+            {
+                __m128i in
+                    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(messages[l].input + off));
+                __m128i out = _mm_xor_si128(in, blocks[l]);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[l].output + off), out);
+                x[l] = gf_multiply(_mm_xor_si128(x[l], byte_reverse(Encrypt ? out : in)), h);
+            }
+        }
+        if (off < size)
+        {
+            size_t n = size - off;
+            encrypt_counters<N>(round_keys, key.rounds, counter_base, counter, blocks);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < N; ++l)
+            {
+                __m128i in = load_partial(messages[l].input + off, n);
+                store_partial(messages[l].output + off, _mm_xor_si128(in, blocks[l]), n);
+                // The ciphertext is hashed with zeros beyond its end.
+                __m128i ciphertext = Encrypt ? load_partial(messages[l].output + off, n) : in;
+                x[l] = gf_multiply(_mm_xor_si128(x[l], byte_reverse(ciphertext)), h);
+            }
+        }
+
+        const __m128i lengths = length_block(aad_size, size);
+        unsigned verified = 0;
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < N; ++l)
+        {
+            x[l] = gf_multiply(_mm_xor_si128(x[l], lengths), h);
+            __m128i tag = _mm_xor_si128(byte_reverse(x[l]), tag_mask[l]);
+            if (Encrypt)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[l].mac), tag);
+            }
+            else
+            {
+                __m128i expected
+                    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(messages[l].mac));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(tag, expected)) == 0xffff)
+                {
+                    verified |= 1u << l;
+                }
+            }
+        }
+        CryptoPP::SecureWipeBuffer(reinterpret_cast<unsigned char*>(round_keys),
+                                   sizeof(round_keys));
+        return verified;
+    }
+
+    using GroupKernel = unsigned (*)(const Key&, size_t, const GCMMessage*, size_t);
+
+    template <bool Encrypt>
+    SECUREFS_AESNI_TARGET unsigned
+    process_narrow_group(const Key& key, size_t iv_size, const GCMMessage* messages, size_t n)
+    {
+        switch (n)
+        {
+        case 4:
+            return process_group<4, Encrypt>(key, iv_size, messages);
+        case 3:
+            return process_group<3, Encrypt>(key, iv_size, messages);
+        case 2:
+            return process_group<2, Encrypt>(key, iv_size, messages);
+        default:
+            return process_group<1, Encrypt>(key, iv_size, messages);
+        }
+    }
+
+    // Splits the messages into runs of the same shape, and hands them to `kernel` in groups of at
+    // most `max_lanes`.
+    template <bool Encrypt>
+    size_t process(const Key& key,
+                   size_t iv_size,
+                   const GCMMessage* messages,
+                   size_t count,
+                   size_t max_lanes,
+                   GroupKernel kernel)
+    {
+        size_t first_failure = count;
+        for (size_t i = 0; i < count;)
+        {
+            size_t n = 1;
+            while (n < max_lanes && i + n < count && messages[i + n].size == messages[i].size
+                   && messages[i + n].aad_size == messages[i].aad_size)
+            {
+                ++n;
+            }
+            unsigned verified = kernel(key, iv_size, messages + i, n);
+            if (!Encrypt && first_failure == count && verified != (1u << n) - 1)
+            {
+                for (size_t l = 0; l < n; ++l)
+                {
+                    if (!(verified & (1u << l)))
+                    {
+                        first_failure = i + l;
+                        break;
+                    }
+                }
+            }
+            i += n;
+        }
+        return first_failure;
+    }
+}    // namespace
+
+bool is_supported() noexcept
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    unsigned ecx = static_cast<unsigned>(info[2]);
+    return (ecx & (1u << 25)) && (ecx & (1u << 1)) && (ecx & (1u << 9));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul")
+        && __builtin_cpu_supports("ssse3");
+#endif
+}
+
+SECUREFS_AESNI_TARGET void init_key(Key& key, const unsigned char* raw_key, size_t raw_key_size)
+{
+    expand_key(raw_key, raw_key_size, key.round_keys, &key.rounds);
+    __m128i round_keys[15];
+    for (unsigned r = 0; r <= key.rounds; ++r)
+    {
+        round_keys[r] = _mm_load_si128(reinterpret_cast<const __m128i*>(key.round_keys + 16 * r));
+    }
+    // The hash key is stored byte reversed, ready for `gf_multiply`.
+    __m128i h = _mm_setzero_si128();
+    aes_encrypt<1>(round_keys, key.rounds, &h);
+    _mm_store_si128(reinterpret_cast<__m128i*>(key.hash_key), byte_reverse(h));
+    CryptoPP::SecureWipeBuffer(reinterpret_cast<unsigned char*>(round_keys), sizeof(round_keys));
+}
+
+void encrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count)
+{
+    process<true>(key, iv_size, messages, count, kLanes, &process_narrow_group<true>);
+}
+
+size_t decrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count)
+{
+    return process<false>(key, iv_size, messages, count, kLanes, &process_narrow_group<false>);
+}
+#else
+bool is_supported() noexcept { return false; }
+void init_key(Key&, const unsigned char*, size_t) { std::abort(); }
+void encrypt(const Key&, size_t, const GCMMessage*, size_t) { std::abort(); }
+size_t decrypt(const Key&, size_t, const GCMMessage*, size_t) { std::abort(); }
+#endif
+}    // namespace securefs::aesni_gcm
+
+namespace securefs::vaes_gcm
+{
+#if SECUREFS_HAS_AESNI
+namespace
+{
+    using aesni_gcm::Key;
+
+    SECUREFS_VAES_INLINE __m256i combine(__m128i low, __m128i high)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+    }
+
+    SECUREFS_VAES_INLINE __m256i byte_reverse(__m256i x)
+    {
+        return _mm256_shuffle_epi8(x,
+                                   _mm256_broadcastsi128_si256(_mm_set_epi8(
+                                       0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)));
+    }
+
+    SECUREFS_VAES_INLINE __m256i load_pair(const unsigned char* low,
+                                           const unsigned char* high,
+                                           size_t n)
+    {
+        if (n == 16)
+        {
+            return combine(_mm_loadu_si128(reinterpret_cast<const __m128i*>(low)),
+                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(high)));
+        }
+        return combine(aesni_gcm::load_partial(low, n), aesni_gcm::load_partial(high, n));
+    }
+
+    // The same computation as `aesni_gcm::gf_multiply`, on both halves at once.
+    SECUREFS_VAES_INLINE __m256i gf_multiply(__m256i a, __m256i b)
+    {
+        __m256i lo = _mm256_clmulepi64_epi128(a, b, 0x00);
+        __m256i mid = _mm256_xor_si256(_mm256_clmulepi64_epi128(a, b, 0x10),
+                                       _mm256_clmulepi64_epi128(a, b, 0x01));
+        __m256i hi = _mm256_clmulepi64_epi128(a, b, 0x11);
+        lo = _mm256_xor_si256(lo, _mm256_bslli_epi128(mid, 8));
+        hi = _mm256_xor_si256(hi, _mm256_bsrli_epi128(mid, 8));
+
+        __m256i lo_carry = _mm256_srli_epi32(lo, 31);
+        __m256i hi_carry = _mm256_srli_epi32(hi, 31);
+        lo = _mm256_slli_epi32(lo, 1);
+        hi = _mm256_slli_epi32(hi, 1);
+        __m256i cross_carry = _mm256_bsrli_epi128(lo_carry, 12);
+        hi_carry = _mm256_bslli_epi128(hi_carry, 4);
+        lo_carry = _mm256_bslli_epi128(lo_carry, 4);
+        lo = _mm256_or_si256(lo, lo_carry);
+        hi = _mm256_or_si256(_mm256_or_si256(hi, hi_carry), cross_carry);
+
+        __m256i t = _mm256_xor_si256(
+            _mm256_xor_si256(_mm256_slli_epi32(lo, 31), _mm256_slli_epi32(lo, 30)),
+            _mm256_slli_epi32(lo, 25));
+        __m256i t_hi = _mm256_bsrli_epi128(t, 4);
+        lo = _mm256_xor_si256(lo, _mm256_bslli_epi128(t, 12));
+        __m256i u = _mm256_xor_si256(
+            _mm256_xor_si256(_mm256_srli_epi32(lo, 1), _mm256_srli_epi32(lo, 2)),
+            _mm256_srli_epi32(lo, 7));
+        u = _mm256_xor_si256(u, t_hi);
+        lo = _mm256_xor_si256(lo, u);
+        return _mm256_xor_si256(hi, lo);
+    }
+
+    template <size_t M>
+    SECUREFS_VAES_INLINE void aes_encrypt(const __m256i* round_keys, unsigned rounds, __m256i* b)
+    {
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            b[l] = _mm256_xor_si256(b[l], round_keys[0]);
+        }
+        for (unsigned r = 1; r < rounds; ++r)
+        {
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < M; ++l)
+            {
+                b[l] = _mm256_aesenc_epi128(b[l], round_keys[r]);
+            }
+        }
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            b[l] = _mm256_aesenclast_epi128(b[l], round_keys[rounds]);
+        }
+    }
+
+    // The counters are kept as native integers in the last word of each half, so that one add
+    // advances all of them, and are byte swapped into place when the counter blocks are formed.
+    template <size_t M>
+    SECUREFS_VAES_INLINE void encrypt_counters(const __m256i* round_keys,
+                                               unsigned rounds,
+                                               const __m256i* counter_base,
+                                               __m256i* counter,
+                                               __m256i* blocks)
+    {
+        const __m256i swap_counter = _mm256_broadcastsi128_si256(_mm_set_epi8(
+            12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+        const __m256i one = _mm256_set_epi32(1, 0, 0, 0, 1, 0, 0, 0);
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            blocks[l]
+                = _mm256_or_si256(counter_base[l], _mm256_shuffle_epi8(counter[l], swap_counter));
+            counter[l] = _mm256_add_epi32(counter[l], one);
+        }
+        aes_encrypt<M>(round_keys, rounds, blocks);
+    }
+
+    // Processes `2 * M` messages of the same shape in lockstep, message `2 * l` in the low half of
+    // register `l` and message `2 * l + 1` in the high half. Returns the same bitmask as
+    // `aesni_gcm::process_group`.
+    template <size_t M, bool Encrypt>
+    SECUREFS_VAES_TARGET unsigned
+    process_group(const Key& key, size_t iv_size, const GCMMessage* messages)
+    {
+        __m128i narrow_round_keys[15];
+        __m256i round_keys[15];
+        for (unsigned r = 0; r <= key.rounds; ++r)
+        {
+            narrow_round_keys[r]
+                = _mm_load_si128(reinterpret_cast<const __m128i*>(key.round_keys + 16 * r));
+            round_keys[r] = _mm256_broadcastsi128_si256(narrow_round_keys[r]);
+        }
+        const __m128i narrow_h = _mm_load_si128(reinterpret_cast<const __m128i*>(key.hash_key));
+        const __m256i h = _mm256_broadcastsi128_si256(narrow_h);
+        const size_t aad_size = messages[0].aad_size;
+        const size_t size = messages[0].size;
+
+        __m256i x[M], tag_mask[M], blocks[M], counter_base[M], counter[M];
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            __m128i j0[2];
+            uint32_t initial[2];
+            for (size_t k = 0; k < 2; ++k)
+            {
+                j0[k] = aesni_gcm::initial_counter(narrow_h, messages[2 * l + k].iv, iv_size);
+                initial[k] = aesni_gcm::byte_swap32(
+                                 static_cast<uint32_t>(_mm_extract_epi32(j0[k], 3)))
+                    + 1;
+            }
+            blocks[l] = combine(j0[0], j0[1]);
+            counter_base[l]
+                = _mm256_and_si256(blocks[l], _mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+            counter[l] = _mm256_set_epi32(
+                static_cast<int>(initial[1]), 0, 0, 0, static_cast<int>(initial[0]), 0, 0, 0);
+            x[l] = _mm256_setzero_si256();
+        }
+        aes_encrypt<M>(round_keys, key.rounds, blocks);
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            tag_mask[l] = blocks[l];
+        }
+
+        for (size_t off = 0; off < aad_size; off += 16)
+        {
+            size_t n = std::min<size_t>(16, aad_size - off);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < M; ++l)
+            {
+                __m256i a = byte_reverse(
+                    load_pair(messages[2 * l].aad + off, messages[2 * l + 1].aad + off, n));
+                x[l] = gf_multiply(_mm256_xor_si256(x[l], a), h);
+            }
+        }
+
+        size_t off = 0;
+        for (; off + 16 <= size; off += 16)
+        {
+            encrypt_counters<M>(round_keys, key.rounds, counter_base, counter, blocks);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < M; ++l)
+            {
+                __m256i in = load_pair(
+                    messages[2 * l].input + off, messages[2 * l + 1].input + off, 16);
+                __m256i out = _mm256_xor_si256(in, blocks[l]);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[2 * l].output + off),
+                                 _mm256_castsi256_si128(out));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[2 * l + 1].output + off),
+                                 _mm256_extracti128_si256(out, 1));
+                x[l] = gf_multiply(_mm256_xor_si256(x[l], byte_reverse(Encrypt ? out : in)), h);
+            }
+        }
+        if (off < size)
+        {
+            size_t n = size - off;
+            encrypt_counters<M>(round_keys, key.rounds, counter_base, counter, blocks);
+            SECUREFS_UNROLL_LANES
+            for (size_t l = 0; l < M; ++l)
+            {
+                __m256i in
+                    = load_pair(messages[2 * l].input + off, messages[2 * l + 1].input + off, n);
+                __m256i out = _mm256_xor_si256(in, blocks[l]);
+                aesni_gcm::store_partial(
+                    messages[2 * l].output + off, _mm256_castsi256_si128(out), n);
+                aesni_gcm::store_partial(
+                    messages[2 * l + 1].output + off, _mm256_extracti128_si256(out, 1), n);
+                // The ciphertext is hashed with zeros beyond its end.
+                __m256i ciphertext = Encrypt ? load_pair(messages[2 * l].output + off,
+                                                         messages[2 * l + 1].output + off,
+                                                         n)
+                                             : in;
+                x[l] = gf_multiply(_mm256_xor_si256(x[l], byte_reverse(ciphertext)), h);
+            }
+        }
+
+        const __m256i lengths
+            = _mm256_broadcastsi128_si256(aesni_gcm::length_block(aad_size, size));
+        unsigned verified = 0;
+        SECUREFS_UNROLL_LANES
+        for (size_t l = 0; l < M; ++l)
+        {
+            x[l] = gf_multiply(_mm256_xor_si256(x[l], lengths), h);
+            __m256i tag = _mm256_xor_si256(byte_reverse(x[l]), tag_mask[l]);
+            if (Encrypt)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[2 * l].mac),
+                                 _mm256_castsi256_si128(tag));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(messages[2 * l + 1].mac),
+                                 _mm256_extracti128_si256(tag, 1));
+            }
+            else
+            {
+                __m256i expected = load_pair(messages[2 * l].mac, messages[2 * l + 1].mac, 16);
+                unsigned equal
+                    = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(tag, expected)));
+                if ((equal & 0xffffu) == 0xffffu)
+                {
+                    verified |= 1u << (2 * l);
+                }
+                if ((equal >> 16) == 0xffffu)
+                {
+                    verified |= 1u << (2 * l + 1);
+                }
+            }
+        }
+        CryptoPP::SecureWipeBuffer(reinterpret_cast<unsigned char*>(narrow_round_keys),
+                                   sizeof(narrow_round_keys));
+        CryptoPP::SecureWipeBuffer(reinterpret_cast<unsigned char*>(round_keys),
+                                   sizeof(round_keys));
+        return verified;
+    }
+
+    template <bool Encrypt>
+    SECUREFS_VAES_TARGET unsigned
+    process_wide_group(const Key& key, size_t iv_size, const GCMMessage* messages, size_t n)
+    {
+        unsigned verified = 0;
+        switch (n / 2)
+        {
+        case 4:
+            verified = process_group<4, Encrypt>(key, iv_size, messages);
+            break;
+        case 3:
+            verified = process_group<3, Encrypt>(key, iv_size, messages);
+            break;
+        case 2:
+            verified = process_group<2, Encrypt>(key, iv_size, messages);
+            break;
+        case 1:
+            verified = process_group<1, Encrypt>(key, iv_size, messages);
+            break;
+        default:
+            break;
+        }
+        // A message without a partner goes through the narrow kernel.
+        if (n % 2)
+        {
+            verified |= aesni_gcm::process_group<1, Encrypt>(key, iv_size, messages + n - 1)
+                << (n - 1);
+        }
+        return verified;
+    }
+}    // namespace
+
+bool is_supported() noexcept
+{
+    if (!aesni_gcm::is_supported())
+    {
+        return false;
+    }
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    // The OS must save the AVX registers on context switches.
+    if (!(static_cast<unsigned>(info[2]) & (1u << 27)) || (_xgetbv(0) & 6) != 6)
+    {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    unsigned ebx = static_cast<unsigned>(info[1]);
+    unsigned ecx = static_cast<unsigned>(info[2]);
+    return (ebx & (1u << 5)) && (ecx & (1u << 9)) && (ecx & (1u << 10));
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("vaes")
+        && __builtin_cpu_supports("vpclmulqdq");
+#endif
+}
+
+void encrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count)
+{
+    aesni_gcm::process<true>(key, iv_size, messages, count, kLanes, &process_wide_group<true>);
+}
+
+size_t decrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count)
+{
+    return aesni_gcm::process<false>(
+        key, iv_size, messages, count, kLanes, &process_wide_group<false>);
+}
+#else
+bool is_supported() noexcept { return false; }
+void encrypt(const aesni_gcm::Key&, size_t, const GCMMessage*, size_t) { std::abort(); }
+size_t decrypt(const aesni_gcm::Key&, size_t, const GCMMessage*, size_t) { std::abort(); }
+#endif
+}    // namespace securefs::vaes_gcm
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+
+namespace securefs
+{
+/// One message of a batched AES-GCM operation. All messages of a batch share the key and the IV
+/// size, while everything else may differ. The tag is always 16 bytes.
+struct GCMMessage
+{
+    const unsigned char* iv;
+    const unsigned char* aad;
+    size_t aad_size;
+    const unsigned char* input;
+    unsigned char* output;
+    size_t size;
+    // Receives the tag on encryption, and holds the expected tag on decryption.
+    unsigned char* mac;
+};
+
+/// AES-GCM with AES-NI and PCLMULQDQ. Consecutive messages of the same shape are processed in
+/// groups of up to `kLanes`, with their AES rounds and GHASH multiplications interleaved, so that
+/// the latencies of one message hide behind the work on the others.
+namespace aesni_gcm
+{
+    constexpr size_t kLanes = 4;
+
+    struct Key
+    {
+        alignas(16) unsigned char round_keys[15 * 16];
+        alignas(16) unsigned char hash_key[16];
+        unsigned rounds;
+    };
+
+    /// Whether both the compiler and the CPU support the instructions required.
+    bool is_supported() noexcept;
+
+    /// Only valid to call when `is_supported()`.
+    void init_key(Key& key, const unsigned char* raw_key, size_t raw_key_size);
+    void encrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count);
+    /// Decrypts all the messages even if some fail to verify, and returns the index of the first
+    /// failure, or `count` if there is none.
+    size_t decrypt(const Key& key, size_t iv_size, const GCMMessage* messages, size_t count);
+}    // namespace aesni_gcm
+
+/// The same algorithm as `aesni_gcm` on 256 bit registers with VAES and VPCLMULQDQ, where each
+/// register holds the states of two messages, so that up to `kLanes` messages proceed together.
+/// The keys are shared with `aesni_gcm`.
+namespace vaes_gcm
+{
+    constexpr size_t kLanes = 8;
+
+    bool is_supported() noexcept;
+
+    /// Only valid to call when `is_supported()`.
+    void encrypt(const aesni_gcm::Key& key,
+                 size_t iv_size,
+                 const GCMMessage* messages,
+                 size_t count);
+    size_t decrypt(const aesni_gcm::Key& key,
+                   size_t iv_size,
+                   const GCMMessage* messages,
+                   size_t count);
+}    // namespace vaes_gcm
+}    // namespace securefs
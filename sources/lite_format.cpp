@@ -8,6 +8,7 @@
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
+#include "stat_workaround.h"
 #include "tags.h"
 
 #include <absl/base/thread_annotations.h>
@@ -29,6 +30,7 @@
 #include <uni_algo/case.h>
 #include <uni_algo/norm.h>
 
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cstddef>
@@ -36,6 +38,7 @@
 #include <cstdlib>
 #include <exception>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <utility>
@@ -67,6 +70,67 @@ unsigned StreamOpener::compute_padding(const std::array<unsigned char, 16>& id)
         max_padding_size_, padding_ecb.get(), id.data(), id.size());
 }
 
+length_type
+StreamOpener::compute_virtual_size(const fuse_stat& underlying_st,
+                                   absl::FunctionRef<std::shared_ptr<StreamBase>()> open_underlying)
+{
+    if (can_compute_virtual_size())
+    {
+        return compute_virtual_size(underlying_st.st_size);
+    }
+
+    std::optional<unsigned> padding_size;
+    auto ctime = get_ctim(underlying_st);
+    {
+        LockGuard<absl::Mutex> lg(padding_cache_mu_, false);
+        auto it = padding_cache_.find(underlying_st.st_ino);
+        // The inode number may be reused by a new file, but then the ctime differs.
+        if (it != padding_cache_.end() && it->second.ctime.tv_sec == ctime.tv_sec
+            && it->second.ctime.tv_nsec == ctime.tv_nsec)
+        {
+            padding_size = it->second.padding_size;
+        }
+    }
+    if (!padding_size)
+    {
+        padding_size = read_padding_size(*open_underlying());
+        cache_padding_size(underlying_st, *padding_size);
+    }
+
+    length_type header_size = lite::AESGCMCryptStream::get_id_size() + *padding_size;
+    if (static_cast<length_type>(underlying_st.st_size) <= header_size)
+    {
+        return 0;
+    }
+    return compute_virtual_size(underlying_st.st_size - *padding_size);
+}
+
+void StreamOpener::cache_padding_size(const fuse_stat& underlying_st, unsigned padding_size)
+{
+    if (can_compute_virtual_size())
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(padding_cache_mu_);
+    if (padding_cache_.size() >= kMaxPaddingCacheEntries)
+    {
+        padding_cache_.clear();
+    }
+    padding_cache_.insert_or_assign(underlying_st.st_ino,
+                                    PaddingCacheEntry{get_ctim(underlying_st), padding_size});
+}
+
+unsigned StreamOpener::read_padding_size(StreamBase& underlying)
+{
+    // The padding is derived from the file ID, so there is no need to set up the whole stream.
+    std::array<unsigned char, lite::AESGCMCryptStream::get_id_size()> id;
+    if (underlying.read(id.data(), 0, id.size()) != id.size())
+    {
+        return 0;
+    }
+    return compute_padding(id);
+}
+
 void StreamOpener::validate()
 {
     warn_if_key_not_random(content_master_key_, __FILE__, __LINE__);
@@ -79,16 +143,15 @@ void StreamOpener::validate()
 std::vector<byte> XattrCryptor::encrypt(const char* value, size_t size)
 {
     std::vector<byte> result(infer_encrypted_size(size));
-    generate_random(result.data(), iv_size_);
-    crypt_.get().enc.EncryptAndAuthenticate(result.data() + iv_size_,
-                                            result.data() + (result.size() - kMacSize),
-                                            kMacSize,
-                                            result.data(),
-                                            static_cast<int>(iv_size_),
-                                            nullptr,
-                                            0,
-                                            reinterpret_cast<const byte*>(value),
-                                            size);
+    generate_iv(result.data(), iv_size_);
+    GCMMessage message{result.data(),
+                       nullptr,
+                       0,
+                       reinterpret_cast<const byte*>(value),
+                       result.data() + iv_size_,
+                       size,
+                       result.data() + (result.size() - kMacSize)};
+    crypt_.get().encrypt({&message, 1});
     return result;
 }
 void XattrCryptor::decrypt(const byte* input, size_t size, byte* output, size_t out_size)
@@ -97,15 +160,15 @@ void XattrCryptor::decrypt(const byte* input, size_t size, byte* output, size_t
     {
         throwInvalidArgumentException("Insufficent output buffer size");
     }
-    bool success = crypt_.get().dec.DecryptAndVerify(output,
-                                                     input + (size - kMacSize),
-                                                     kMacSize,
-                                                     input,
-                                                     static_cast<int>(iv_size_),
-                                                     nullptr,
-                                                     0,
-                                                     input + iv_size_,
-                                                     size - iv_size_ - kMacSize);
+    // The tag is only read on decryption.
+    GCMMessage message{input,
+                       nullptr,
+                       0,
+                       input + iv_size_,
+                       output,
+                       size - iv_size_ - kMacSize,
+                       const_cast<byte*>(input + (size - kMacSize))};
+    bool success = crypt_.get().decrypt({&message, 1}) == 1;
     if (!success && verify_)
     {
         throw XattrVerificationException();
@@ -557,27 +620,46 @@ namespace
         std::string encrypt_full_path(std::string_view path,
                                       std::string* out_encrypted_last_component) override
         {
-            try
+            return delegate_->encrypt_full_path(normalize_path(path),
+                                                out_encrypted_last_component);
+        }
+
+        std::string normalize_path(std::string_view path) override
+        {
+            if (is_ascii(path))
             {
-                std::string normed_string;
-                std::string_view subject = path;
-                if (nfc_)
+                // NFC leaves ASCII alone, and case folding only lowers its letters.
+                return case_fold_ ? to_lower(path) : std::string(path);
+            }
+            // Both transformations work within components, as the separator neither composes
+            // nor folds, so only the components that are not ASCII need the slow path.
+            std::string result;
+            result.reserve(path.size());
+            bool first = true;
+            for (std::string_view component : absl::StrSplit(path, '/'))
+            {
+                if (!first)
                 {
-                    normed_string = una::norm::to_nfc_utf8(subject);
-                    subject = normed_string;
+                    result.push_back('/');
                 }
-                if (case_fold_)
+                first = false;
+                if (is_ascii(component))
                 {
-                    normed_string = una::cases::to_casefold_utf8(subject);
-                    subject = normed_string;
+                    if (case_fold_)
+                    {
+                        result.append(to_lower(component));
+                    }
+                    else
+                    {
+                        result.append(component);
+                    }
+                }
+                else
+                {
+                    result.append(normalize_component(component));
                 }
-                return delegate_->encrypt_full_path(normed_string, out_encrypted_last_component);
-            }
-            catch (const std::exception& e)
-            {
-                WARN_LOG("Failed to normalize path %s: %s", path, e.what());
-                return delegate_->encrypt_full_path(path, out_encrypted_last_component);
             }
+            return result;
         }
 
         absl::variant<InvalidNameTag, LongNameTag, std::string>
@@ -600,10 +682,55 @@ namespace
             return delegate_->max_virtual_path_component_size(physical_path_component_size);
         }
 
+        bool has_aliases() const noexcept override { return true; }
+
+    private:
+        std::string normalize_component(std::string_view component)
+        {
+            {
+                LockGuard<absl::Mutex> lg(cache_mutex_, false);
+                auto it = cache_.find(component);
+                if (it != cache_.end())
+                {
+                    return it->second;
+                }
+            }
+            std::string normed_string(component);
+            try
+            {
+                if (nfc_)
+                {
+                    normed_string = una::norm::to_nfc_utf8(normed_string);
+                }
+                if (case_fold_)
+                {
+                    normed_string = una::cases::to_casefold_utf8(normed_string);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                WARN_LOG("Failed to normalize path component %s: %s", component, e.what());
+                return std::string(component);
+            }
+            LockGuard<absl::Mutex> lg(cache_mutex_);
+            if (cache_.size() >= kMaxCachedComponents)
+            {
+                cache_.clear();
+            }
+            cache_.emplace(component, normed_string);
+            return normed_string;
+        }
+
     private:
+        // The cache is simply cleared when it grows beyond this.
+        static constexpr size_t kMaxCachedComponents = 4096;
+
         std::unique_ptr<NameTranslator> delegate_;
         bool case_fold_;
         bool nfc_;
+        absl::Mutex cache_mutex_;
+        // Memoizes the normalization of components that are not ASCII.
+        absl::flat_hash_map<std::string, std::string> cache_ ABSL_GUARDED_BY(cache_mutex_);
     };
 
     class DirectoryImpl : public Directory
@@ -612,17 +739,15 @@ namespace
         DirectoryImpl(std::string dir_abs_path,
                       NameTranslator& name_trans,
                       StreamOpener& opener,
-                      bool readdir_plus)
+                      bool readdir_plus,
+                      ThreadPool* pool)
             : dir_abs_path_(std::move(dir_abs_path))
             , name_trans_(name_trans)
             , opener_(opener)
             , readdir_plus_(readdir_plus)
         {
-            if (readdir_plus && !opener_.can_compute_virtual_size())
-            {
-                throw_runtime_error("Readdir plus should only be used without padding");
-            }
-            under_traverser_ = OSService::get_default().create_traverser(dir_abs_path_);
+            under_traverser_
+                = OSService::get_default().create_traverser(dir_abs_path_, readdir_plus, pool);
         }
 
         void fstat(fuse_stat* stat) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
@@ -651,7 +776,12 @@ namespace
                 }
                 if (stbuf && readdir_plus_ && (stbuf->st_mode & S_IFMT) == S_IFREG)
                 {
-                    stbuf->st_size = opener_.compute_virtual_size(stbuf->st_size);
+                    stbuf->st_size = virtual_file_size(under_name, *stbuf);
+                }
+                if (stbuf && readdir_plus_ && (stbuf->st_mode & S_IFMT) == S_IFLNK
+                    && stbuf->st_size > 0 && !name_trans_.is_no_op())
+                {
+                    stbuf->st_size = virtual_symlink_size(under_name, stbuf->st_size);
                 }
                 if (name_trans_.is_no_op())
                 {
@@ -693,6 +823,54 @@ namespace
         void rewind() override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { under_traverser_->rewind(); }
 
     private:
+        fuse_off_t virtual_file_size(const std::string& under_name, const fuse_stat& st)
+        {
+            try
+            {
+                return opener_.compute_virtual_size(
+                    st,
+                    [&]()
+                    {
+                        return OSService::get_default().open_file_stream(
+                            OSService::concat_and_norm_narrowed(dir_abs_path_, under_name),
+                            O_RDONLY,
+                            0);
+                    });
+            }
+            catch (const std::exception& e)
+            {
+                VERBOSE_LOG("Failed to compute the size of %s/%s: %s",
+                            dir_abs_path_,
+                            under_name,
+                            e.what());
+                return 0;
+            }
+        }
+
+        // The size of a symlink is that of its decrypted target, which cannot be computed
+        // arithmetically.
+        fuse_off_t virtual_symlink_size(const std::string& under_name, fuse_off_t physical_size)
+        {
+            try
+            {
+                std::string buffer(physical_size, '\0');
+                auto link_size = OSService::get_default().readlink(
+                    OSService::concat_and_norm_narrowed(dir_abs_path_, under_name),
+                    buffer.data(),
+                    buffer.size());
+                buffer.resize(std::max<ssize_t>(0, link_size));
+                return name_trans_.decrypt_path_from_symlink(buffer).size();
+            }
+            catch (const std::exception& e)
+            {
+                VERBOSE_LOG("Failed to resolve the size of symlink %s/%s: %s",
+                            dir_abs_path_,
+                            under_name,
+                            e.what());
+                return 0;
+            }
+        }
+
         LongNameLookupTable& lazy_get_table() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
         {
             if (long_table_.has_value())
@@ -743,7 +921,7 @@ void FuseHighLevelOps::initialize(fuse_conn_info* info)
 {
     (void)info;
 #ifdef FSP_FUSE_CAP_READDIR_PLUS
-    if (opener_.can_compute_virtual_size() && (info->capable & FSP_FUSE_CAP_READDIR_PLUS))
+    if (info->capable & FSP_FUSE_CAP_READDIR_PLUS)
     {
         info->want |= FSP_FUSE_CAP_READDIR_PLUS;
         read_dir_plus_ = true;
@@ -758,6 +936,25 @@ int FuseHighLevelOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_co
     return 0;
 }
 int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_context* ctx)
+{
+    if (!attr_cache_.enabled())
+    {
+        return getattr_uncached(path, buf);
+    }
+    auto key = name_trans_.normalize_path(path);
+    if (attr_cache_.lookup(key, buf))
+    {
+        return 0;
+    }
+    auto ticket = attr_cache_.begin_fill();
+    int rc = getattr_uncached(path, buf);
+    if (rc == 0)
+    {
+        attr_cache_.fill(ticket, std::move(key), *buf);
+    }
+    return rc;
+}
+int FuseHighLevelOps::getattr_uncached(const char* path, fuse_stat* buf)
 {
     auto enc_path = name_trans_.encrypt_full_path(path, nullptr);
     if (!root_.stat(enc_path, buf))
@@ -794,26 +991,25 @@ int FuseHighLevelOps::vgetattr(const char* path, fuse_stat* buf, const fuse_cont
     case S_IFDIR:
         break;
     case S_IFREG:
+        if (write_behind_bytes_ > 0)
+        {
+            sync_write_behind(buf->st_ino);
+            if (!root_.stat(enc_path, buf))
+                return -ENOENT;
+        }
         if (buf->st_size > 0)
         {
-            if (opener_.can_compute_virtual_size())
+            try
             {
-                buf->st_size = opener_.compute_virtual_size(buf->st_size);
+                buf->st_size = opener_.compute_virtual_size(
+                    *buf, [&]() { return root_.open_file_stream(enc_path, O_RDONLY, 0); });
             }
-            else
+            catch (const std::exception& e)
             {
-                try
-                {
-                    auto virtual_file = opener_.open(root_.open_file_stream(enc_path, O_RDONLY, 0));
-                    buf->st_size = virtual_file->size();
-                }
-                catch (const std::exception& e)
-                {
-                    ERROR_LOG("Encountered exception %s when opening file %s for read: %s",
-                              get_type_name(e).get(),
-                              path,
-                              e.what());
-                }
+                ERROR_LOG("Encountered exception %s when opening file %s for read: %s",
+                          get_type_name(e).get(),
+                          path,
+                          e.what());
             }
         }
         break;
@@ -828,6 +1024,11 @@ int FuseHighLevelOps::vfgetattr(const char* path,
                                 const fuse_context* ctx)
 {
     auto fp = get_base(info);
+    if (auto file = fp->as_file(); file && write_behind_bytes_ > 0)
+    {
+        // Other handles of the same file have their own buffers.
+        sync_write_behind(file->underlying_ino());
+    }
     LockGuard<Base> lg(*fp);
     fp->fstat(st);
     return 0;
@@ -838,7 +1039,8 @@ int FuseHighLevelOps::vopendir(const char* path, fuse_file_info* info, const fus
         root_.norm_path_narrowed(name_trans_.encrypt_full_path(path, nullptr)),
         name_trans_,
         opener_,
-        read_dir_plus_);
+        read_dir_plus_,
+        background_pool_.get());
     info->fh = reinterpret_cast<uintptr_t>(dir.release());
     return 0;
 }
@@ -856,6 +1058,11 @@ int FuseHighLevelOps::vreaddir(const char* path,
 {
     auto dir = get_dir_checked(info);
     LockGuard<Directory> lg(*dir);
+    if (read_dir_plus_)
+    {
+        // The sizes in the listing must reflect the writes still buffered.
+        sync_write_behind(*dir);
+    }
 
     std::string name;
     fuse_stat st{};
@@ -877,17 +1084,23 @@ int FuseHighLevelOps::vcreate(const char* path,
                               fuse_file_info* info,
                               const fuse_context* ctx)
 {
-    info->fh = reinterpret_cast<uintptr_t>(open(path, O_CREAT | O_EXCL | O_RDWR, mode).release());
+    set_file(info, open(path, O_CREAT | O_EXCL | O_RDWR, mode));
     return 0;
 }
 int FuseHighLevelOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
-    info->fh = reinterpret_cast<uintptr_t>(open(path, info->flags, 0).release());
+    set_file(info, open(path, info->flags, 0));
     return 0;
 }
 int FuseHighLevelOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
-    delete get_base(info);
+    std::unique_ptr<Base> base(get_base(info));
+    if (auto fp = base->as_file(); fp && fp->write_behind())
+    {
+        DEFER(unregister_write_behind(*fp));
+        fp->sync_write_behind();
+        attr_cache_.invalidate_ino(fp->underlying_ino());
+    }
     return 0;
 }
 int FuseHighLevelOps::vread(const char* path,
@@ -898,6 +1111,11 @@ int FuseHighLevelOps::vread(const char* path,
                             const fuse_context* ctx)
 {
     auto fp = get_file_checked(info);
+    if (write_behind_bytes_ > 0)
+    {
+        // Other handles of the same file have their own buffers.
+        sync_write_behind(fp->underlying_ino());
+    }
     LockGuard<File> lg(*fp);
     return static_cast<int>(fp->read(buf, offset, size));
 }
@@ -909,6 +1127,12 @@ int FuseHighLevelOps::vwrite(const char* path,
                              const fuse_context* ctx)
 {
     auto fp = get_file_checked(info);
+    DEFER(attr_cache_.invalidate_ino(fp->underlying_ino()));
+    if (const auto& write_behind = fp->write_behind())
+    {
+        write_behind->enqueue(buf, offset, size);
+        return static_cast<int>(size);
+    }
     LockGuard<File> lg(*fp);
     fp->write(buf, offset, size);
     return static_cast<int>(size);
@@ -916,6 +1140,8 @@ int FuseHighLevelOps::vwrite(const char* path,
 int FuseHighLevelOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
 {
     auto fp = get_file_checked(info);
+    DEFER(attr_cache_.invalidate_ino(fp->underlying_ino()));
+    fp->sync_write_behind();
     LockGuard<File> lg(*fp);
     fp->flush();
     return 0;
@@ -926,12 +1152,15 @@ int FuseHighLevelOps::vftruncate(const char* path,
                                  const fuse_context* ctx)
 {
     auto fp = get_file_checked(info);
+    DEFER(attr_cache_.invalidate_ino(fp->underlying_ino()));
+    fp->sync_write_behind();
     LockGuard<File> lg(*fp);
     fp->resize(len);
     return 0;
 }
 int FuseHighLevelOps::vunlink(const char* path, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(path, true));
     process_possible_long_name(path,
                                LongNameComponentAction::kDelete,
                                [&](std::string&& enc_path) { root_.remove_file(enc_path); });
@@ -939,6 +1168,7 @@ int FuseHighLevelOps::vunlink(const char* path, const fuse_context* ctx)
 };
 int FuseHighLevelOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(path, true));
     process_possible_long_name(path,
                                LongNameComponentAction::kCreate,
                                [&](std::string&& enc_path) { root_.mkdir(enc_path, mode); });
@@ -946,6 +1176,7 @@ int FuseHighLevelOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_cont
 }
 int FuseHighLevelOps::vrmdir(const char* path, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(path, true));
     process_possible_long_name(path,
                                LongNameComponentAction::kDelete,
                                [&](std::string&& enc_path)
@@ -958,6 +1189,7 @@ int FuseHighLevelOps::vrmdir(const char* path, const fuse_context* ctx)
 }
 int FuseHighLevelOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(path, false));
     root_.chmod(name_trans_.encrypt_full_path(path, nullptr), mode);
     return 0;
 }
@@ -966,11 +1198,13 @@ int FuseHighLevelOps::vchown(const char* path,
                              fuse_gid_t gid,
                              const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(path, false));
     root_.chown(name_trans_.encrypt_full_path(path, nullptr), uid, gid);
     return 0;
 }
 int FuseHighLevelOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
 {
+    DEFER(invalidate_attr(from, true));
     process_possible_long_name(
         from,
         LongNameComponentAction::kCreate,
@@ -980,11 +1214,17 @@ int FuseHighLevelOps::vsymlink(const char* to, const char* from, const fuse_cont
 }
 int FuseHighLevelOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
 {
-    process_possible_long_name(
-        dest,
-        LongNameComponentAction::kCreate,
-        [&](std::string&& enc_path)
-        { root_.link(name_trans_.encrypt_full_path(src, nullptr), enc_path); });
+    // The source is invalidated too, since its link count changes.
+    DEFER(invalidate_attr(src, false); invalidate_attr(dest, true));
+    auto enc_src = name_trans_.encrypt_full_path(src, nullptr);
+    process_possible_long_name(dest,
+                               LongNameComponentAction::kCreate,
+                               [&](std::string&& enc_path) { root_.link(enc_src, enc_path); });
+    fuse_stat st{};
+    if (keep_cache_ && root_.stat(enc_src, &st))
+    {
+        check_multi_linked(st.st_ino, st.st_nlink);
+    }
     return 0;
 }
 int FuseHighLevelOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
@@ -1006,6 +1246,11 @@ int FuseHighLevelOps::vreadlink(const char* path, char* buf, size_t size, const
 }
 int FuseHighLevelOps::vrename(const char* from, const char* to, const fuse_context* ctx)
 {
+    DEFER({
+        invalidate_attr(from, true);
+        invalidate_attr(to, true);
+        attr_cache_.invalidate_descendants(name_trans_.normalize_path(from));
+    });
     std::string encrypted_last_component_from, encrypted_last_component_to;
     auto enc_from = name_trans_.encrypt_full_path(from, &encrypted_last_component_from);
     auto enc_to = name_trans_.encrypt_full_path(to, &encrypted_last_component_to);
@@ -1039,21 +1284,29 @@ int FuseHighLevelOps::vfsync(const char* path,
                              const fuse_context* ctx)
 {
     auto fp = get_file_checked(info);
+    DEFER(attr_cache_.invalidate_ino(fp->underlying_ino()));
+    fp->sync_write_behind();
     LockGuard<File> lg(*fp);
     fp->flush();
-    fp->fsync();
+    fp->fsync(fsync_batcher_, datasync != 0);
     return 0;
 }
 int FuseHighLevelOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
 {
-    auto fp = open(path, O_WRONLY, 0);
+    DEFER(invalidate_attr(path, false));
+    sync_write_behind(name_trans_.encrypt_full_path(path, nullptr));
+    auto fp = open(path, O_WRONLY, 0, false);
     LockGuard<File> lg(*fp);
     fp->resize(len);
     return 0;
 }
 int FuseHighLevelOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
 {
-    root_.utimens(name_trans_.encrypt_full_path(path, nullptr), ts);
+    DEFER(invalidate_attr(path, false));
+    auto enc_path = name_trans_.encrypt_full_path(path, nullptr);
+    // Otherwise a pending write would overwrite the mtime set here.
+    sync_write_behind(enc_path);
+    root_.utimens(enc_path, ts);
     return 0;
 }
 int FuseHighLevelOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
@@ -1125,6 +1378,7 @@ int FuseHighLevelOps::vsetxattr(const char* path,
         return 0;
     }
     auto data = xattr_.encrypt(value, size);
+    DEFER(invalidate_attr(path, false));
     return root_.setxattr(name_trans_.encrypt_full_path(path, nullptr).c_str(),
                           name,
                           data.data(),
@@ -1138,9 +1392,11 @@ int FuseHighLevelOps::vremovexattr(const char* path, const char* name, const fus
     {
         return rc;
     }
+    DEFER(invalidate_attr(path, false));
     return root_.removexattr(name_trans_.encrypt_full_path(path, nullptr).c_str(), name);
 }
-std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, unsigned mode)
+std::unique_ptr<File>
+FuseHighLevelOps::open(std::string_view path, int flags, unsigned mode, bool enable_background)
 {
     if (flags & O_APPEND)
     {
@@ -1160,20 +1416,185 @@ std::unique_ptr<File> FuseHighLevelOps::open(std::string_view path, int flags, u
         mode |= S_IRUSR;
     }
     std::unique_ptr<File> fp;
+    DEFER(if (flags & (O_CREAT | O_TRUNC)) { invalidate_attr(path, (flags & O_CREAT) != 0); });
 
     process_possible_long_name(
         path,
         (flags & O_CREAT) ? LongNameComponentAction::kCreate : LongNameComponentAction::kIgnore,
         [&](std::string&& enc_path)
-        { fp = std::make_unique<File>(root_.open_file_stream(enc_path, flags, mode), opener_); });
+        {
+            if (flags & O_TRUNC)
+            {
+                sync_write_behind(enc_path);
+            }
+            fp = std::make_unique<File>(root_.open_file_stream(enc_path, flags, mode),
+                                        opener_,
+                                        enable_background ? background_pool_.get() : nullptr,
+                                        readahead_blocks_,
+                                        write_behind_bytes_,
+                                        readahead_blocks_ > 0 ? &write_generations_ : nullptr);
+        });
 
     if (flags & O_TRUNC)
     {
         LockGuard<File> lock_guard(*fp, true);
         fp->resize(0);
     }
+    if (!opener_.can_compute_virtual_size())
+    {
+        LockGuard<File> lock_guard(*fp, true);
+        fuse_stat st{};
+        fp->fstat(&st);
+        opener_.cache_padding_size(st, fp->padding_size());
+    }
     return fp;
 }
+std::shared_ptr<WriteGenerationTable::Counter> WriteGenerationTable::get(uint64_t underlying_ino)
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    auto& weak = counters_[underlying_ino];
+    if (auto counter = weak.lock())
+    {
+        return counter;
+    }
+    std::shared_ptr<Counter> counter(new Counter(0),
+                                     [this, underlying_ino](Counter* c)
+                                     {
+                                         delete c;
+                                         LockGuard<absl::Mutex> lg(mu_);
+                                         auto it = counters_.find(underlying_ino);
+                                         // It may have been replaced since by a new counter.
+                                         if (it != counters_.end() && it->second.expired())
+                                         {
+                                             counters_.erase(it);
+                                         }
+                                     });
+    weak = counter;
+    return counter;
+}
+void FuseHighLevelOps::set_file(fuse_file_info* info, std::unique_ptr<File> fp)
+{
+    // The kernel updates its page cache on every write through the mount, so the cache can only
+    // go stale when the same file is also reachable under another node, i.e. another name, even
+    // if only for a while.
+    info->keep_cache
+        = keep_cache_ && !check_multi_linked(fp->underlying_ino(), fp->nlink_at_open());
+    register_write_behind(*fp);
+    info->fh = reinterpret_cast<uintptr_t>(fp.release());
+}
+bool FuseHighLevelOps::check_multi_linked(uint64_t underlying_ino, uint64_t nlink)
+{
+    LockGuard<absl::Mutex> lg(multi_linked_mu_);
+    if (nlink > 1)
+    {
+        multi_linked_.insert(underlying_ino);
+        return true;
+    }
+    return multi_linked_.contains(underlying_ino);
+}
+void FuseHighLevelOps::invalidate_attr(std::string_view path, bool with_parent)
+{
+    if (!attr_cache_.enabled())
+    {
+        return;
+    }
+    auto key = name_trans_.normalize_path(path);
+    attr_cache_.invalidate(key);
+    if (with_parent)
+    {
+        auto parent = NameTranslator::remove_last_component(key);
+        if (parent.size() > 1 && parent.back() == '/')
+        {
+            parent.remove_suffix(1);
+        }
+        attr_cache_.invalidate(parent);
+    }
+}
+void FuseHighLevelOps::register_write_behind(const File& file)
+{
+    if (!file.write_behind())
+    {
+        return;
+    }
+    LockGuard<absl::Mutex> lg(write_behind_mu_);
+    write_behind_files_[file.underlying_ino()].push_back(file.write_behind());
+}
+void FuseHighLevelOps::unregister_write_behind(const File& file)
+{
+    LockGuard<absl::Mutex> lg(write_behind_mu_);
+    auto it = write_behind_files_.find(file.underlying_ino());
+    if (it == write_behind_files_.end())
+    {
+        return;
+    }
+    auto& buffers = it->second;
+    buffers.erase(std::remove(buffers.begin(), buffers.end(), file.write_behind()), buffers.end());
+    if (buffers.empty())
+    {
+        write_behind_files_.erase(it);
+    }
+}
+void FuseHighLevelOps::sync_write_behind(Directory& dir)
+{
+    if (write_behind_bytes_ <= 0)
+    {
+        return;
+    }
+    {
+        LockGuard<absl::Mutex> lg(write_behind_mu_);
+        if (write_behind_files_.empty())
+        {
+            return;
+        }
+    }
+    // Lists the raw entries without decrypting their names. With readdirplus this stats each entry
+    // a second time, which is only paid while some file has writes buffered.
+    fuse_stat st{};
+    dir.rewind();
+    while (dir.next(nullptr, &st))
+    {
+        if ((st.st_mode & S_IFMT) == S_IFREG)
+        {
+            sync_write_behind(st.st_ino);
+        }
+    }
+}
+void FuseHighLevelOps::sync_write_behind(uint64_t underlying_ino)
+{
+    absl::InlinedVector<std::shared_ptr<WriteBehindBuffer>, 1> buffers;
+    {
+        LockGuard<absl::Mutex> lg(write_behind_mu_);
+        auto it = write_behind_files_.find(underlying_ino);
+        if (it == write_behind_files_.end())
+        {
+            return;
+        }
+        buffers = it->second;
+    }
+    for (const auto& b : buffers)
+    {
+        b->sync();
+    }
+}
+void FuseHighLevelOps::sync_write_behind(const std::string& enc_path)
+{
+    if (write_behind_bytes_ <= 0)
+    {
+        return;
+    }
+    {
+        LockGuard<absl::Mutex> lg(write_behind_mu_);
+        if (write_behind_files_.empty())
+        {
+            return;
+        }
+    }
+    fuse_stat st{};
+    if (root_.stat(enc_path, &st))
+    {
+        sync_write_behind(st.st_ino);
+    }
+}
 std::string FuseHighLevelOps::long_name_table_file_name(absl::string_view enc_path)
 {
     return root_.norm_path_narrowed(
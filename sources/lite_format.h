@@ -1,19 +1,29 @@
 #pragma once
 
+#include "aead_engine.h"
+#include "attr_cache.h"
+#include "fsync_batcher.h"
 #include "fuse_high_level_ops_base.h"
 #include "lite_stream.h"
 #include "lock_guard.h"
+#include "logger.h"
 #include "mystring.h"
 #include "myutils.h"
 #include "platform.h"
+#include "readahead.h"
 #include "tags.h"
 #include "thread_local.h"
+#include "thread_pool.h"
+#include "write_behind.h"
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/container/inlined_vector.h>
 #include <absl/functional/function_ref.h>
 #include <absl/strings/string_view.h>
+#include <algorithm>
 #include <array>
 #include <cryptopp/aes.h>
-#include <cryptopp/gcm.h>
 #include <cryptopp/modes.h>
 #include <cstddef>
 #include <exception>
@@ -22,6 +32,7 @@
 
 #include <memory>
 #include <string_view>
+#include <thread>
 #include <variant>
 #include <vector>
 
@@ -66,6 +77,16 @@ public:
 
     bool can_compute_virtual_size() const noexcept { return max_padding_size_ <= 0; }
 
+    /// Computes the virtual size from the attributes of the underlying file. When padding is
+    /// enabled, the padding size comes from a cache keyed by the underlying inode and ctime, and on
+    /// a miss, from the header of the file returned by `open_underlying`.
+    length_type
+    compute_virtual_size(const fuse_stat& underlying_st,
+                         absl::FunctionRef<std::shared_ptr<StreamBase>()> open_underlying);
+
+    /// Seeds the padding size cache with a file that has been opened anyway.
+    void cache_padding_size(const fuse_stat& underlying_st, unsigned padding_size);
+
     void compute_session_key(const std::array<unsigned char, 16>& id,
                              std::array<unsigned char, 16>& outkey) override;
     unsigned compute_padding(const std::array<unsigned char, 16>& id) override;
@@ -73,17 +94,47 @@ public:
 private:
     using AES_ECB = CryptoPP::ECB_Mode<CryptoPP::AES>::Encryption;
     void validate();
+    unsigned read_padding_size(StreamBase& underlying);
+
+    struct PaddingCacheEntry
+    {
+        fuse_timespec ctime;
+        unsigned padding_size;
+    };
+
+    // The cache is simply cleared when it grows beyond this.
+    static constexpr size_t kMaxPaddingCacheEntries = 1 << 18;
 
 private:
     key_type content_master_key_, padding_master_key_;
     unsigned block_size_, iv_size_, max_padding_size_;
     bool verify_;
     ThreadLocal<AES_ECB> content_ecb, padding_ecb;
+
+    absl::Mutex padding_cache_mu_;
+    absl::flat_hash_map<uint64_t, PaddingCacheEntry>
+        padding_cache_ ABSL_GUARDED_BY(padding_cache_mu_);
 };
 
 class File;
 class Directory;
 
+/// Counts the writes to each underlying file that is open, through whichever handle they are
+/// made, so that one handle can tell whether the plaintext it derived is still current.
+class WriteGenerationTable
+{
+public:
+    using Counter = ReadAheadBuffer::WriteGeneration;
+
+    /// The counter is shared by all the callers with the same inode, and dropped from the table
+    /// together with the last of them.
+    std::shared_ptr<Counter> get(uint64_t underlying_ino);
+
+private:
+    absl::Mutex mu_;
+    absl::flat_hash_map<uint64_t, std::weak_ptr<Counter>> counters_ ABSL_GUARDED_BY(mu_);
+};
+
 class ABSL_LOCKABLE Base : public Object
 {
 public:
@@ -114,17 +165,78 @@ class ABSL_LOCKABLE File final : public Base
 private:
     std::unique_ptr<lite::AESGCMCryptStream> m_crypt_stream ABSL_GUARDED_BY(*this);
     std::shared_ptr<securefs::FileStream> m_file_stream ABSL_GUARDED_BY(*this);
+    std::shared_ptr<ReadAheadBuffer> m_readahead ABSL_GUARDED_BY(*this);
+    // Set only in the constructor, and internally synchronized.
+    std::shared_ptr<WriteBehindBuffer> m_write_behind;
+    std::shared_ptr<WriteGenerationTable::Counter> m_write_generation;
+    uint64_t m_underlying_ino = 0;
+    uint64_t m_nlink_at_open = 0;
     securefs::Mutex m_lock;
 
 public:
-    File(std::shared_ptr<securefs::FileStream> file_stream, StreamOpener& opener)
+    File(std::shared_ptr<securefs::FileStream> file_stream,
+         StreamOpener& opener,
+         ThreadPool* background_pool = nullptr,
+         unsigned readahead_blocks = 0,
+         length_type write_behind_bytes = 0,
+         WriteGenerationTable* write_generations = nullptr)
         : m_file_stream(std::move(file_stream))
     {
         LockGuard<FileStream> lock_guard(*m_file_stream, true);
         m_crypt_stream = opener.open(m_file_stream);
+        fuse_stat st{};
+        m_file_stream->fstat(&st);
+        m_underlying_ino = st.st_ino;
+        m_nlink_at_open = st.st_nlink;
+        if (write_generations)
+        {
+            m_write_generation = write_generations->get(m_underlying_ino);
+        }
+        if (background_pool && write_behind_bytes > 0)
+        {
+            m_write_behind = std::make_shared<WriteBehindBuffer>(
+                *background_pool,
+                [this](const WriteBehindBuffer::Extents& extents)
+                {
+                    LockGuard<File> lg(*this);
+                    for (const auto& [offset, data] : extents)
+                    {
+                        write(data.data(), offset, data.size());
+                    }
+                },
+                write_behind_bytes);
+        }
+        if (background_pool && readahead_blocks > 0 && m_write_generation)
+        {
+            ReadAheadBuffer::Geometry geometry{m_crypt_stream->get_block_size(),
+                                               m_crypt_stream->get_underlying_block_size(),
+                                               m_crypt_stream->get_header_size()};
+            m_readahead = std::make_shared<ReadAheadBuffer>(
+                *background_pool,
+                m_file_stream,
+                [&opener, stream = m_file_stream]() -> std::unique_ptr<StreamBase>
+                { return opener.open(stream); },
+                geometry,
+                readahead_blocks,
+                m_write_generation);
+        }
     }
 
-    ~File() = default;
+    ~File()
+    {
+        // Normally a no-op, since `vrelease` already waited for the pending writes.
+        if (m_write_behind)
+        {
+            try
+            {
+                m_write_behind->sync();
+            }
+            catch (const std::exception& e)
+            {
+                ERROR_LOG("Deferred write is lost: %s", e.what());
+            }
+        }
+    }
 
     length_type size() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { return m_crypt_stream->size(); }
     void flush() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { m_crypt_stream->flush(); }
@@ -134,16 +246,30 @@ public:
     }
     void resize(length_type len) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
+        DEFER(invalidate_readahead());
         m_crypt_stream->resize(len);
     }
     length_type read(void* output, offset_type off, length_type len)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
-        return m_crypt_stream->read(output, off, len);
+        if (!m_readahead)
+        {
+            return m_crypt_stream->read(output, off, len);
+        }
+        bool reached_eof = false;
+        length_type result = m_readahead->serve(output, off, len, &reached_eof);
+        if (result < len && !reached_eof)
+        {
+            result += m_crypt_stream->read(
+                static_cast<byte*>(output) + result, off + result, len - result);
+        }
+        m_readahead->record_read(off, result, len);
+        return result;
     }
     void write(const void* input, offset_type off, length_type len)
         ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
+        DEFER(invalidate_readahead());
         return m_crypt_stream->write(input, off, len);
     }
     void fstat(fuse_stat* stat) override ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
@@ -151,7 +277,11 @@ public:
         m_file_stream->fstat(stat);
         stat->st_size = m_crypt_stream->size();
     }
-    void fsync() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this) { m_file_stream->fsync(); }
+    void fsync(FsyncBatcher& batcher, bool datasync) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        FileStream* stream = m_file_stream.get();
+        batcher.sync({&stream, 1}, datasync);
+    }
     void utimens(const fuse_timespec ts[2]) ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
     {
         m_file_stream->utimens(ts);
@@ -175,6 +305,40 @@ public:
         m_lock.Unlock();
     }
     File* as_file() noexcept override { return this; }
+
+    /// Null unless write-behind is enabled for this file.
+    const std::shared_ptr<WriteBehindBuffer>& write_behind() const noexcept
+    {
+        return m_write_behind;
+    }
+    uint64_t underlying_ino() const noexcept { return m_underlying_ino; }
+    uint64_t nlink_at_open() const noexcept { return m_nlink_at_open; }
+    unsigned padding_size() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        return m_crypt_stream->get_padding_size();
+    }
+
+    /// Must be called without holding the lock of this file.
+    void sync_write_behind()
+    {
+        if (m_write_behind)
+        {
+            m_write_behind->sync();
+        }
+    }
+
+private:
+    void invalidate_readahead() ABSL_EXCLUSIVE_LOCKS_REQUIRED(*this)
+    {
+        if (m_write_generation)
+        {
+            m_write_generation->fetch_add(1, std::memory_order_release);
+        }
+        if (m_readahead)
+        {
+            m_readahead->invalidate();
+        }
+    }
 };
 
 struct InvalidNameTag
@@ -205,6 +369,13 @@ struct NameTranslator : public Object
 
     virtual unsigned max_virtual_path_component_size(unsigned physical_path_component_size) = 0;
 
+    /// @brief Maps a path to the canonical spelling under which it is stored, so that all the
+    /// paths naming the same file compare equal.
+    virtual std::string normalize_path(std::string_view path) { return std::string(path); }
+
+    /// @brief Whether distinct virtual paths may name the same file.
+    virtual bool has_aliases() const noexcept { return false; }
+
     static std::string_view get_last_component(std::string_view path);
     static std::string_view remove_last_component(std::string_view path);
 };
@@ -234,7 +405,7 @@ public:
     INJECT(XattrCryptor(ANNOTATED(tXattrMasterKey, const key_type&) key,
                         ANNOTATED(tIvSize, unsigned) iv_size,
                         ANNOTATED(tVerify, bool) verify))
-        : crypt_([key]() { return std::make_unique<Cryptor>(key); })
+        : crypt_([key, iv_size]() { return make_aes_gcm_engine(key.data(), key.size(), iv_size); })
         , iv_size_(iv_size)
         , verify_(verify)
     {
@@ -248,20 +419,7 @@ public:
     static constexpr unsigned kMacSize = 16;
 
 private:
-    struct Cryptor
-    {
-        CryptoPP::GCM<CryptoPP::AES>::Encryption enc;
-        CryptoPP::GCM<CryptoPP::AES>::Decryption dec;
-
-        explicit Cryptor(const key_type& key)
-        {
-            const std::array<byte, 12> null_iv{};
-            enc.SetKeyWithIV(key.data(), key.size(), null_iv.data(), null_iv.size());
-            dec.SetKeyWithIV(key.data(), key.size(), null_iv.data(), null_iv.size());
-        }
-    };
-
-    ThreadLocal<Cryptor> crypt_;
+    ThreadLocal<AeadEngine> crypt_;
     unsigned iv_size_;
     bool verify_;
 };
@@ -272,9 +430,28 @@ public:
     INJECT(FuseHighLevelOps(::securefs::OSService& root,
                             StreamOpener& opener,
                             NameTranslator& name_trans,
-                            XattrCryptor& xattr))
-        : root_(root), opener_(opener), name_trans_(name_trans), xattr_(xattr)
+                            XattrCryptor& xattr,
+                            ANNOTATED(tReadAheadBlocks, unsigned) readahead_blocks,
+                            ANNOTATED(tWriteBehindLimit, unsigned) write_behind_mib,
+                            ANNOTATED(tFsyncWindow, unsigned) fsync_window_us,
+                            ANNOTATED(tAttrCacheTimeout, unsigned) attr_cache_timeout,
+                            ANNOTATED(tKeepCache, bool) keep_cache))
+        : root_(root)
+        , opener_(opener)
+        , name_trans_(name_trans)
+        , xattr_(xattr)
+        , readahead_blocks_(readahead_blocks)
+        , write_behind_bytes_(static_cast<length_type>(write_behind_mib) << 20)
+        , fsync_batcher_(absl::Microseconds(fsync_window_us),
+                         [&root]() { return root.sync_filesystem(); })
+        , attr_cache_(absl::Seconds(attr_cache_timeout))
+        , keep_cache_(keep_cache && !name_trans.has_aliases())
     {
+        if (readahead_blocks_ > 0 || write_behind_bytes_ > 0)
+        {
+            background_pool_ = std::make_unique<ThreadPool>(
+                std::clamp(std::thread::hardware_concurrency() / 2, 1u, 4u));
+        }
     }
 
     void initialize(fuse_conn_info* info) override;
@@ -350,9 +527,44 @@ private:
     NameTranslator& name_trans_;
     XattrCryptor& xattr_;
     bool read_dir_plus_ = false;
+    unsigned readahead_blocks_;
+    length_type write_behind_bytes_;
+    // Outlives `background_pool_`, whose pending tasks may still hold counters.
+    WriteGenerationTable write_generations_;
+    std::unique_ptr<ThreadPool> background_pool_;
+    FsyncBatcher fsync_batcher_;
+    AttrCache attr_cache_;
+    bool keep_cache_;
+
+    // Open files with write-behind, keyed by the inode number of the underlying file, so that
+    // path based operations can wait for their pending writes.
+    absl::Mutex write_behind_mu_;
+    absl::flat_hash_map<uint64_t, absl::InlinedVector<std::shared_ptr<WriteBehindBuffer>, 1>>
+        write_behind_files_ ABSL_GUARDED_BY(write_behind_mu_);
+
+    // The underlying files that have had several names since the mount, which are denied the page
+    // cache for good, because their cache may have gone stale under another name in the meantime.
+    absl::Mutex multi_linked_mu_;
+    absl::flat_hash_set<uint64_t> multi_linked_ ABSL_GUARDED_BY(multi_linked_mu_);
 
 private:
-    std::unique_ptr<File> open(std::string_view path, int flags, unsigned mode);
+    std::unique_ptr<File>
+    open(std::string_view path, int flags, unsigned mode, bool enable_background = true);
+
+    void register_write_behind(const File& file);
+    void unregister_write_behind(const File& file);
+    // Waits for the pending writes to the files in `dir`, which must be locked.
+    void sync_write_behind(Directory& dir) ABSL_EXCLUSIVE_LOCKS_REQUIRED(dir);
+    void sync_write_behind(uint64_t underlying_ino);
+    void sync_write_behind(const std::string& enc_path);
+
+    int getattr_uncached(const char* path, fuse_stat* buf);
+    void set_file(fuse_file_info* info, std::unique_ptr<File> fp);
+    // Records the file as multi-linked if `nlink` is more than one, and tells whether it has ever
+    // been.
+    bool check_multi_linked(uint64_t underlying_ino, uint64_t nlink);
+    // Drops the cached attributes of `path`, and those of its parent directory if `with_parent`.
+    void invalidate_attr(std::string_view path, bool with_parent);
 
     enum class LongNameComponentAction : unsigned char
     {
@@ -129,12 +129,7 @@ AESGCMCryptStream::AESGCMCryptStream(std::shared_ptr<StreamBase> stream,
     }
 
     calc.compute_session_key(id, session_key);
-    // The null iv is only a placeholder; it will replaced during encryption and decryption
-    const byte null_iv[12] = {0};
-    m_encryptor.SetKeyWithIV(
-        session_key.data(), session_key.size(), null_iv, array_length(null_iv));
-    m_decryptor.SetKeyWithIV(
-        session_key.data(), session_key.size(), null_iv, array_length(null_iv));
+    m_gcm = make_aes_gcm_engine(session_key.data(), session_key.size(), m_iv_size);
 }
 
 AESGCMCryptStream::~AESGCMCryptStream() {}
@@ -154,12 +149,17 @@ AESGCMCryptStream::read_multi_blocks(offset_type start_block, offset_type end_bl
                                     buffer.size());
     length_type transformed_read_len = 0;
 
+    // All the blocks are decrypted together once their messages are collected.
+    std::vector<GCMMessage> messages;
+    messages.reserve(end_block - start_block);
+    std::vector<byte> aad(m_auxiliary.size() * (end_block - start_block));
+
     for (length_type i = 0; i < rc; i += get_underlying_block_size())
     {
         auto this_block_underlying_size = std::min(get_underlying_block_size(), rc - i);
         if (this_block_underlying_size <= get_mac_size() + get_iv_size())
         {
-            return transformed_read_len;
+            break;
         }
         auto this_block_virtual_size = this_block_underlying_size - get_mac_size() - get_iv_size();
         auto* start_data = buffer.data() + i;
@@ -178,24 +178,23 @@ AESGCMCryptStream::read_multi_blocks(offset_type start_block, offset_type end_bl
                 WARN_LOG("Null IV for block number %d indicates a potential bug in securefs",
                          i / get_underlying_block_size() + start_block);
             }
+            byte* block_aad = aad.data() + messages.size() * m_auxiliary.size();
+            memcpy(block_aad, m_auxiliary.data(), m_auxiliary.size());
             to_little_endian(
                 static_cast<std::uint32_t>(i / get_underlying_block_size() + start_block),
-                m_auxiliary.data());
-            bool success = m_decryptor.DecryptAndVerify(static_cast<byte*>(output),
-                                                        end_data - get_mac_size(),
-                                                        get_mac_size(),
-                                                        start_data,
-                                                        static_cast<int>(get_iv_size()),
-                                                        m_auxiliary.data(),
-                                                        m_auxiliary.size(),
-                                                        start_data + get_iv_size(),
-                                                        this_block_virtual_size);
-
-            if (m_check && !success)
-                throw LiteMessageVerificationException();
+                block_aad);
+            messages.push_back(GCMMessage{start_data,
+                                          block_aad,
+                                          m_auxiliary.size(),
+                                          start_data + get_iv_size(),
+                                          static_cast<byte*>(output),
+                                          this_block_virtual_size,
+                                          end_data - get_mac_size()});
         }
         output = static_cast<byte*>(output) + this_block_virtual_size;
     }
+    if (m_gcm->decrypt(messages) != messages.size() && m_check)
+        throw LiteMessageVerificationException();
     return transformed_read_len;
 }
 
@@ -210,6 +209,11 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
     std::vector<unsigned char> buffer(
         (end_block - start_block) * get_underlying_block_size()
         + (end_residue <= 0 ? 0 : end_residue + get_iv_size() + get_mac_size()));
+
+    std::vector<GCMMessage> messages;
+    messages.reserve(end_block - start_block + 1);
+    std::vector<byte> aad(m_auxiliary.size() * (end_block - start_block + 1));
+
     for (length_type i = 0; i < buffer.size();)
     {
         auto this_block_underlying_size = std::min(get_underlying_block_size(), buffer.size() - i);
@@ -221,25 +225,26 @@ void AESGCMCryptStream::write_multi_blocks(offset_type start_block,
             auto* iv = start_data;
             auto* ciphertext = iv + get_iv_size();
             auto* mac = end_data - get_mac_size();
+            byte* block_aad = aad.data() + messages.size() * m_auxiliary.size();
+            memcpy(block_aad, m_auxiliary.data(), m_auxiliary.size());
             to_little_endian(static_cast<uint32_t>(start_block + i / get_underlying_block_size()),
-                             m_auxiliary.data());
+                             block_aad);
             do
             {
-                generate_random(iv, get_iv_size());
+                generate_iv(iv, get_iv_size());
             } while (is_all_zeros(iv, get_iv_size()));
-            m_encryptor.EncryptAndAuthenticate(ciphertext,
-                                               mac,
-                                               get_mac_size(),
-                                               iv,
-                                               static_cast<int>(get_iv_size()),
-                                               m_auxiliary.data(),
-                                               m_auxiliary.size(),
-                                               static_cast<const byte*>(input),
-                                               this_block_virtual_size);
+            messages.push_back(GCMMessage{iv,
+                                          block_aad,
+                                          m_auxiliary.size(),
+                                          static_cast<const byte*>(input),
+                                          ciphertext,
+                                          this_block_virtual_size,
+                                          mac});
         }
         input = static_cast<const byte*>(input) + this_block_virtual_size;
         i += this_block_underlying_size;
     }
+    m_gcm->encrypt(messages);
     m_stream->write(buffer.data(),
                     start_block * get_underlying_block_size() + get_header_size(),
                     buffer.size());
@@ -1,16 +1,18 @@
 #pragma once
 
+#include "aead_engine.h"
 #include "exceptions.h"
 #include "mystring.h"
 #include "streams.h"
 
 #include <absl/container/inlined_vector.h>
 #include <cryptopp/aes.h>
-#include <cryptopp/gcm.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/rng.h>
 #include <cryptopp/secblock.h>
 
+#include <memory>
+
 namespace securefs::lite
 {
 class CorruptedStreamException : public ExceptionBase
@@ -27,8 +29,7 @@ unsigned default_compute_padding(unsigned max_padding,
 class AESGCMCryptStream : public BlockBasedStream
 {
 private:
-    CryptoPP::GCM<CryptoPP::AES>::Encryption m_encryptor;
-    CryptoPP::GCM<CryptoPP::AES>::Decryption m_decryptor;
+    std::unique_ptr<AeadEngine> m_gcm;
     std::shared_ptr<StreamBase> m_stream;
     absl::InlinedVector<byte, 32> m_auxiliary;
     unsigned m_iv_size, m_padding_size;
@@ -35,10 +35,11 @@ public:
 
 private:
     Lockable* m_lock;
+    bool m_exclusive = true;
 
 public:
     explicit LockGuard(Lockable& lock, bool exclusive) ABSL_EXCLUSIVE_LOCK_FUNCTION(&lock)
-        : m_lock(&lock)
+        : m_lock(&lock), m_exclusive(exclusive)
     {
         if (exclusive)
         {
@@ -53,7 +54,17 @@ public:
     {
         m_lock->Lock();
     }
-    ~LockGuard() ABSL_UNLOCK_FUNCTION() { m_lock->Unlock(); }
+    ~LockGuard() ABSL_UNLOCK_FUNCTION()
+    {
+        if (m_exclusive)
+        {
+            m_lock->Unlock();
+        }
+        else
+        {
+            m_lock->ReaderUnlock();
+        }
+    }
     LockGuard(LockGuard&&) = delete;
     LockGuard(const LockGuard&) = delete;
     LockGuard& operator=(LockGuard&&) = delete;
@@ -1,9 +1,17 @@
 #include "logger.h"
 #include "exceptions.h"
+#include "lock_guard.h"
+#include "mpsc_queue.h"
 #include "myutils.h"
 #include "platform.h"
 
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+#include <absl/time/time.h>
+
+#include <atomic>
 #include <stdio.h>
+#include <thread>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -23,85 +31,205 @@ static const void* current_thread_id(void) { return (void*)(pthread_self()); }
 
 namespace securefs
 {
+struct Logger::AsyncWriter
+{
+    struct Line
+    {
+        LoggingLevel level = LoggingLevel::kLogInfo;
+        std::string text;
+
+        friend void swap(Line& a, Line& b) noexcept
+        {
+            std::swap(a.level, b.level);
+            a.text.swap(b.text);
+        }
+    };
+
+    explicit AsyncWriter(size_t capacity) : queue(capacity) {}
+
+    BoundedMpscQueue<Line> queue;
+    std::atomic<uint64_t> dropped{0};
+    // Serializes the consumers of `queue`, which are the writer thread and `flush()`.
+    absl::Mutex consumer_mu;
+    uint64_t reported_dropped ABSL_GUARDED_BY(consumer_mu) = 0;
+    absl::Notification stop;
+    std::thread thread;
+};
+
 Logger::Logger(FILE* fp, bool close_on_exit)
     : m_level(LoggingLevel::kLogInfo), m_fp(fp), m_close_on_exit(close_on_exit)
 {
     m_console_color = ConsoleColourSetter::create_setter(m_fp);
 }
 
-void Logger::prelog(LoggingLevel level, const char* funcsig, int lineno) noexcept
+void Logger::append_prefix(std::string& line,
+                           LoggingLevel level,
+                           const char* funcsig,
+                           int lineno) noexcept
 {
-    if (!m_fp || level < this->get_level())
-        return;
-
     struct tm now;
     int now_ns = 0;
     OSService::get_current_time_in_tm(&now, &now_ns);
 
-    flockfile(m_fp);
-    if (m_console_color)
-    {
-        switch (level)
-        {
-        case LoggingLevel::kLogWarning:
-            m_console_color->use(Colour::Warning);
-            break;
-        case LoggingLevel::kLogError:
-            m_console_color->use(Colour::Error);
-            break;
-        default:
-            break;
-        }
-    }
-
-    fprintf(m_fp,
-            "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC] [%s:%d]    ",
-            stringify(level),
-            current_thread_id(),
-            now.tm_year + 1900,
-            now.tm_mon + 1,
-            now.tm_mday,
-            now.tm_hour,
-            now.tm_min,
-            now.tm_sec,
-            now_ns,
-            funcsig,
-            lineno);
+    absl::StrAppendFormat(&line,
+                          "[%s] [%p] [%d-%02d-%02d %02d:%02d:%02d.%09d UTC] [%s:%d]    ",
+                          stringify(level),
+                          current_thread_id(),
+                          now.tm_year + 1900,
+                          now.tm_mon + 1,
+                          now.tm_mday,
+                          now.tm_hour,
+                          now.tm_min,
+                          now.tm_sec,
+                          now_ns,
+                          funcsig,
+                          lineno);
 }
 
-void Logger::postlog(LoggingLevel level) noexcept
+void Logger::write_line(LoggingLevel level, std::string_view line, bool flush) noexcept
 {
-    if (m_console_color && (level == LoggingLevel::kLogWarning || level == LoggingLevel::kLogError))
+    flockfile(m_fp);
+    bool coloured = m_console_color
+        && (level == LoggingLevel::kLogWarning || level == LoggingLevel::kLogError);
+    if (coloured)
+    {
+        m_console_color->use(level == LoggingLevel::kLogWarning ? Colour::Warning : Colour::Error);
+    }
+    fwrite(line.data(), 1, line.size(), m_fp);
+    if (coloured)
     {
         m_console_color->use(Colour::Default);
     }
-
     putc('\n', m_fp);
-    fflush(m_fp);
+    if (flush)
+    {
+        fflush(m_fp);
+    }
     funlockfile(m_fp);
 }
 
 void Logger::log_v2(LoggingLevel level,
                     const char* funcsig,
                     int lineno,
-                    absl::FunctionRef<void(std::FILE*)> output_fun)
+                    absl::FunctionRef<void(std::string&)> output_fun)
 {
     if (!m_fp || level < this->get_level())
         return;
-    prelog(level, funcsig, lineno);
-    DEFER(postlog(level));
+
+    // Reused by every call of the thread, so that formatting does not allocate once warmed up. In
+    // async mode, it trades buffers with the slots of the queue.
+    static thread_local AsyncWriter::Line line;
+    line.level = level;
+    line.text.clear();
+    append_prefix(line.text, level, funcsig, lineno);
     try
     {
-        output_fun(m_fp);
+        output_fun(line.text);
     }
     catch (const std::exception& e)
     {
-        absl::FPrintF(m_fp, "Logging itself throws exception: %s", e.what());
+        absl::StrAppendFormat(&line.text, "Logging itself throws exception: %s", e.what());
+    }
+
+    if (!m_async)
+    {
+        write_line(level, line.text, true);
+        return;
+    }
+    uint64_t position;
+    if (!m_async->queue.try_push(line, &position))
+    {
+        m_async->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (level >= LoggingLevel::kLogError)
+    {
+        // An error may precede a crash, which must not take the explanation with it.
+        drain(position + 1);
+    }
+}
+
+void Logger::start_async(size_t capacity)
+{
+    if (m_async || !m_fp)
+    {
+        return;
+    }
+    m_async = std::make_unique<AsyncWriter>(capacity);
+    m_async->thread = std::thread([this]() { run_async_writer(); });
+}
+
+void Logger::run_async_writer()
+{
+    while (!m_async->stop.WaitForNotificationWithTimeout(absl::Milliseconds(10)))
+    {
+        drain(0);
+    }
+    drain(0);
+}
+
+void Logger::flush() noexcept
+{
+    if (!m_fp)
+    {
+        return;
+    }
+    if (!m_async)
+    {
+        fflush(m_fp);
+        return;
+    }
+    drain(m_async->queue.pushed());
+}
+
+void Logger::drain(uint64_t until) noexcept
+{
+    LockGuard<absl::Mutex> lg(m_async->consumer_mu);
+    bool written = false;
+    auto write = [&](const AsyncWriter::Line& line)
+    {
+        write_line(line.level, line.text, false);
+        written = true;
+    };
+    while (true)
+    {
+        if (m_async->queue.try_pop(write))
+        {
+            continue;
+        }
+        if (m_async->queue.popped() >= until)
+        {
+            break;
+        }
+        // The next line is still being pushed by another thread, which takes no lock to finish.
+        std::this_thread::yield();
+    }
+    auto dropped = m_async->dropped.load(std::memory_order_relaxed);
+    if (dropped != m_async->reported_dropped)
+    {
+        std::string text;
+        append_prefix(text, LoggingLevel::kLogWarning, FULL_FUNCTION_NAME, __LINE__);
+        absl::StrAppendFormat(&text,
+                              "%d log lines were dropped because they came faster than they "
+                              "could be written",
+                              dropped - m_async->reported_dropped);
+        write_line(LoggingLevel::kLogWarning, text, false);
+        m_async->reported_dropped = dropped;
+        written = true;
+    }
+    if (written)
+    {
+        fflush(m_fp);
     }
 }
 
 Logger::~Logger()
 {
+    if (m_async)
+    {
+        m_async->stop.Notify();
+        m_async->thread.join();
+    }
     if (m_close_on_exit)
         fclose(m_fp);
 }
@@ -4,9 +4,11 @@
 #include <absl/functional/function_ref.h>
 #include <absl/strings/str_format.h>
 
+#include <cstddef>
 #include <memory>
 #include <stdio.h>
 #include <string>
+#include <string_view>
 
 namespace securefs
 {
@@ -51,20 +53,31 @@ class Logger
     friend class trace::FuseTracer;
 
 private:
+    struct AsyncWriter;
+
     LoggingLevel m_level;
     FILE* m_fp;
     std::unique_ptr<ConsoleColourSetter> m_console_color;
     bool m_close_on_exit;
+    std::unique_ptr<AsyncWriter> m_async;
 
     explicit Logger(FILE* fp, bool close_on_exit);
 
-    void prelog(LoggingLevel level, const char* funcsig, int lineno) noexcept;
-    void postlog(LoggingLevel level) noexcept;
-
+    static void append_prefix(std::string& line,
+                              LoggingLevel level,
+                              const char* funcsig,
+                              int lineno) noexcept;
+    void write_line(LoggingLevel level, std::string_view line, bool flush) noexcept;
+    void run_async_writer();
+    /// Writes out the queued lines, waiting for those before position `until` whose push is still
+    /// in progress.
+    void drain(uint64_t until) noexcept;
+
+    /// Formats the whole line on the calling thread, then writes it out or queues it.
     void log_v2(LoggingLevel level,
                 const char* funcsig,
                 int lineno,
-                absl::FunctionRef<void(std::FILE*)> output_fun);
+                absl::FunctionRef<void(std::string&)> output_fun);
 
 public:
     static Logger* create_stderr_logger();
@@ -80,12 +93,24 @@ public:
         log_v2(level,
                funcsig,
                lineno,
-               [&](std::FILE* fp) { absl::FPrintF(fp, fms, std::forward<Args>(args)...); });
+               [&](std::string& out)
+               { absl::StrAppendFormat(&out, fms, std::forward<Args>(args)...); });
     }
 
     LoggingLevel get_level() const noexcept { return m_level; }
     void set_level(LoggingLevel lvl) noexcept { m_level = lvl; }
 
+    /// From now on, lines are queued in a lock-free ring of `capacity` lines, and written out by a
+    /// background thread, so that logging never waits for the file or for other threads. Lines
+    /// that arrive when the ring is full are dropped, and their number is logged later. Errors
+    /// are flushed before the logging call returns.
+    ///
+    /// Must be called before other threads start logging, and after any fork.
+    void start_async(size_t capacity = 8192);
+
+    /// Writes out the lines queued before the call, if any, and flushes the file.
+    void flush() noexcept;
+
     ~Logger();
 };
 
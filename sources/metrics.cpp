@@ -0,0 +1,522 @@
+#include "metrics.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/numeric/bits.h>
+#include <absl/strings/str_format.h>
+#include <absl/synchronization/mutex.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+const char* stringify(FuseOp op)
+{
+#define SECUREFS_FUSE_OP_CASE(name, str)                                                           \
+    case FuseOp::name:                                                                             \
+        return str;
+    switch (op)
+    {
+        SECUREFS_FUSE_OP_CASE(kStatfs, "statfs")
+        SECUREFS_FUSE_OP_CASE(kGetattr, "getattr")
+        SECUREFS_FUSE_OP_CASE(kFgetattr, "fgetattr")
+        SECUREFS_FUSE_OP_CASE(kOpendir, "opendir")
+        SECUREFS_FUSE_OP_CASE(kReleasedir, "releasedir")
+        SECUREFS_FUSE_OP_CASE(kReaddir, "readdir")
+        SECUREFS_FUSE_OP_CASE(kCreate, "create")
+        SECUREFS_FUSE_OP_CASE(kOpen, "open")
+        SECUREFS_FUSE_OP_CASE(kRelease, "release")
+        SECUREFS_FUSE_OP_CASE(kRead, "read")
+        SECUREFS_FUSE_OP_CASE(kWrite, "write")
+        SECUREFS_FUSE_OP_CASE(kFlush, "flush")
+        SECUREFS_FUSE_OP_CASE(kFtruncate, "ftruncate")
+        SECUREFS_FUSE_OP_CASE(kUnlink, "unlink")
+        SECUREFS_FUSE_OP_CASE(kMkdir, "mkdir")
+        SECUREFS_FUSE_OP_CASE(kRmdir, "rmdir")
+        SECUREFS_FUSE_OP_CASE(kChmod, "chmod")
+        SECUREFS_FUSE_OP_CASE(kChown, "chown")
+        SECUREFS_FUSE_OP_CASE(kSymlink, "symlink")
+        SECUREFS_FUSE_OP_CASE(kLink, "link")
+        SECUREFS_FUSE_OP_CASE(kReadlink, "readlink")
+        SECUREFS_FUSE_OP_CASE(kRename, "rename")
+        SECUREFS_FUSE_OP_CASE(kFsync, "fsync")
+        SECUREFS_FUSE_OP_CASE(kTruncate, "truncate")
+        SECUREFS_FUSE_OP_CASE(kUtimens, "utimens")
+        SECUREFS_FUSE_OP_CASE(kListxattr, "listxattr")
+        SECUREFS_FUSE_OP_CASE(kGetxattr, "getxattr")
+        SECUREFS_FUSE_OP_CASE(kSetxattr, "setxattr")
+        SECUREFS_FUSE_OP_CASE(kRemovexattr, "removexattr")
+        SECUREFS_FUSE_OP_CASE(kGetpath, "getpath")
+    }
+#undef SECUREFS_FUSE_OP_CASE
+    return "unknown";
+}
+
+const char* stringify(MetricCounter counter)
+{
+    switch (counter)
+    {
+    case MetricCounter::kBytesEncrypted:
+        return "bytes_encrypted";
+    case MetricCounter::kBytesDecrypted:
+        return "bytes_decrypted";
+    case MetricCounter::kAttrCacheHits:
+        return "attr_cache_hits";
+    case MetricCounter::kAttrCacheMisses:
+        return "attr_cache_misses";
+    case MetricCounter::kKeyCacheHits:
+        return "key_cache_hits";
+    case MetricCounter::kKeyCacheMisses:
+        return "key_cache_misses";
+    case MetricCounter::kFileTableHits:
+        return "file_table_hits";
+    case MetricCounter::kFileTableMisses:
+        return "file_table_misses";
+    }
+    return "unknown";
+}
+
+const char* stringify(MetricGauge gauge)
+{
+    switch (gauge)
+    {
+    case MetricGauge::kFileTableLive:
+        return "file_table_live";
+    case MetricGauge::kFileTableCached:
+        return "file_table_cached";
+    case MetricGauge::kKeyCacheEntries:
+        return "key_cache_entries";
+    case MetricGauge::kOpenFiles:
+        return "open_files";
+    case MetricGauge::kFuseWorkers:
+        return "fuse_workers";
+    case MetricGauge::kFuseWorkersBusy:
+        return "fuse_workers_busy";
+    }
+    return "unknown";
+}
+
+size_t LatencyHistogram::bucket_index(uint64_t value) noexcept
+{
+    value = std::min<uint64_t>(value, (uint64_t(1) << kMaxValueBits) - 1);
+    if (value < (uint64_t(1) << (kSubBucketBits + 1)))
+    {
+        return static_cast<size_t>(value);
+    }
+    // The position of the highest bit selects the power of two; the next `kSubBucketBits` bits
+    // select the sub-bucket within it.
+    unsigned shift = static_cast<unsigned>(absl::bit_width(value)) - 1 - kSubBucketBits;
+    return (static_cast<size_t>(shift) << kSubBucketBits) + static_cast<size_t>(value >> shift);
+}
+
+uint64_t LatencyHistogram::bucket_lower_bound(size_t index) noexcept
+{
+    if (index < (size_t(1) << (kSubBucketBits + 1)))
+    {
+        return index;
+    }
+    unsigned shift = static_cast<unsigned>(index >> kSubBucketBits) - 1;
+    return static_cast<uint64_t>(index - (static_cast<size_t>(shift) << kSubBucketBits)) << shift;
+}
+
+uint64_t LatencyHistogram::bucket_upper_bound(size_t index) noexcept
+{
+    if (index < (size_t(1) << (kSubBucketBits + 1)))
+    {
+        return index;
+    }
+    unsigned shift = static_cast<unsigned>(index >> kSubBucketBits) - 1;
+    return bucket_lower_bound(index) + (uint64_t(1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value, uint64_t count) noexcept
+{
+    m_buckets[bucket_index(value)] += count;
+    m_count += count;
+    m_sum += value * count;
+    m_max = std::max(m_max, value);
+}
+
+void LatencyHistogram::add_recorded(const std::array<uint64_t, kNumBuckets>& buckets,
+                                    uint64_t sum,
+                                    uint64_t max) noexcept
+{
+    for (size_t i = 0; i < kNumBuckets; ++i)
+    {
+        m_buckets[i] += buckets[i];
+        m_count += buckets[i];
+    }
+    m_sum += sum;
+    m_max = std::max(m_max, max);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) noexcept
+{
+    for (size_t i = 0; i < kNumBuckets; ++i)
+    {
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+    m_max = std::max(m_max, other.m_max);
+}
+
+double LatencyHistogram::mean() const noexcept
+{
+    return m_count == 0 ? 0.0 : static_cast<double>(m_sum) / static_cast<double>(m_count);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const noexcept
+{
+    if (m_count == 0)
+    {
+        return 0;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(m_count)));
+    rank = std::clamp<uint64_t>(rank, 1, m_count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i)
+    {
+        seen += m_buckets[i];
+        if (seen >= rank)
+        {
+            return std::min(bucket_upper_bound(i), m_max);
+        }
+    }
+    return m_max;
+}
+
+namespace
+{
+    constexpr double kNanosPerMicro = 1000.0;
+
+    // Written only by the thread that holds it, read by whoever takes a snapshot. The single writer
+    // makes a relaxed load and store enough, which is cheaper than a read-modify-write.
+    struct MetricsShard
+    {
+        std::array<std::atomic<uint64_t>, kNumFuseOps> calls{};
+        std::array<std::atomic<uint64_t>, kNumFuseOps> errors{};
+        std::array<std::array<std::atomic<uint64_t>, LatencyHistogram::kNumBuckets>, kNumFuseOps>
+            latency{};
+        // The exact totals, as the buckets only bound each value.
+        std::array<std::atomic<uint64_t>, kNumFuseOps> latency_sum{};
+        std::array<std::atomic<uint64_t>, kNumFuseOps> latency_max{};
+        std::array<std::atomic<uint64_t>, kNumMetricCounters> counters{};
+        std::array<std::atomic<int64_t>, kNumMetricGauges> gauges{};
+    };
+
+    template <typename T>
+    inline void bump(std::atomic<T>& value, T delta) noexcept
+    {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    // Shards are never freed, so that the counts of exited threads stay in the totals.
+    class MetricsRegistry
+    {
+    public:
+        static MetricsRegistry& get()
+        {
+            // Leaked, because threads may still exit after static destruction begins.
+            static auto* instance = new MetricsRegistry();
+            return *instance;
+        }
+
+        MetricsShard* acquire()
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            if (!free_.empty())
+            {
+                auto* shard = free_.back();
+                free_.pop_back();
+                return shard;
+            }
+            all_.push_back(std::make_unique<MetricsShard>());
+            return all_.back().get();
+        }
+
+        void release(MetricsShard* shard)
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            free_.push_back(shard);
+        }
+
+        MetricsSnapshot snapshot()
+        {
+            MetricsSnapshot result;
+            LockGuard<absl::Mutex> lg(mu_);
+            for (const auto& shard : all_)
+            {
+                for (size_t op = 0; op < kNumFuseOps; ++op)
+                {
+                    FuseOpMetrics& m = result.ops[op];
+                    m.calls += shard->calls[op].load(std::memory_order_relaxed);
+                    m.errors += shard->errors[op].load(std::memory_order_relaxed);
+                    if (shard->calls[op].load(std::memory_order_relaxed) == 0)
+                    {
+                        continue;
+                    }
+                    std::array<uint64_t, LatencyHistogram::kNumBuckets> buckets;
+                    for (size_t i = 0; i < buckets.size(); ++i)
+                    {
+                        buckets[i] = shard->latency[op][i].load(std::memory_order_relaxed);
+                    }
+                    m.latency.add_recorded(buckets,
+                                           shard->latency_sum[op].load(std::memory_order_relaxed),
+                                           shard->latency_max[op].load(std::memory_order_relaxed));
+                }
+                for (size_t i = 0; i < kNumMetricCounters; ++i)
+                {
+                    result.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+                }
+                for (size_t i = 0; i < kNumMetricGauges; ++i)
+                {
+                    result.gauges[i] += shard->gauges[i].load(std::memory_order_relaxed);
+                }
+            }
+            return result;
+        }
+
+    private:
+        absl::Mutex mu_;
+        std::vector<std::unique_ptr<MetricsShard>> all_ ABSL_GUARDED_BY(mu_);
+        std::vector<MetricsShard*> free_ ABSL_GUARDED_BY(mu_);
+
+        MetricsRegistry() = default;
+    };
+
+    // Returns the shard to the registry when the thread exits.
+    class ShardLease
+    {
+    public:
+        ShardLease() : shard_(MetricsRegistry::get().acquire()) {}
+        ~ShardLease() { MetricsRegistry::get().release(shard_); }
+        ShardLease(const ShardLease&) = delete;
+        ShardLease& operator=(const ShardLease&) = delete;
+
+        MetricsShard& shard() noexcept { return *shard_; }
+
+    private:
+        MetricsShard* shard_;
+    };
+
+    MetricsShard& local_shard()
+    {
+        static thread_local ShardLease lease;
+        return lease.shard();
+    }
+}    // namespace
+
+namespace metrics
+{
+    void record_call(FuseOp op, uint64_t latency_ns, bool failed) noexcept
+    {
+        auto& shard = local_shard();
+        auto i = static_cast<size_t>(op);
+        bump<uint64_t>(shard.calls[i], 1);
+        if (failed)
+        {
+            bump<uint64_t>(shard.errors[i], 1);
+        }
+        bump<uint64_t>(shard.latency[i][LatencyHistogram::bucket_index(latency_ns)], 1);
+        bump(shard.latency_sum[i], latency_ns);
+        if (latency_ns > shard.latency_max[i].load(std::memory_order_relaxed))
+        {
+            shard.latency_max[i].store(latency_ns, std::memory_order_relaxed);
+        }
+    }
+
+    void increment(MetricCounter counter, uint64_t delta) noexcept
+    {
+        bump(local_shard().counters[static_cast<size_t>(counter)], delta);
+    }
+
+    void adjust(MetricGauge gauge, int64_t delta) noexcept
+    {
+        bump(local_shard().gauges[static_cast<size_t>(gauge)], delta);
+    }
+
+    MetricsSnapshot snapshot() { return MetricsRegistry::get().snapshot(); }
+}    // namespace metrics
+
+namespace
+{
+    double hit_rate(uint64_t hits, uint64_t misses)
+    {
+        return hits + misses == 0 ? 0.0
+                                  : static_cast<double>(hits) / static_cast<double>(hits + misses);
+    }
+}    // namespace
+
+std::string MetricsSnapshot::to_json() const
+{
+    std::string result = R"({"ops":{)";
+    bool first = true;
+    for (size_t i = 0; i < kNumFuseOps; ++i)
+    {
+        const FuseOpMetrics& m = ops[i];
+        if (m.calls == 0)
+        {
+            continue;
+        }
+        absl::StrAppendFormat(&result,
+                              R"(%s"%s":{"calls":%u,"errors":%u,"latency_us":{"mean":%.1f,)"
+                              R"("p50":%.1f,"p90":%.1f,"p99":%.1f,"p999":%.1f,"max":%.1f}})",
+                              first ? "" : ",",
+                              stringify(static_cast<FuseOp>(i)),
+                              m.calls,
+                              m.errors,
+                              m.latency.mean() / kNanosPerMicro,
+                              m.latency.percentile(50) / kNanosPerMicro,
+                              m.latency.percentile(90) / kNanosPerMicro,
+                              m.latency.percentile(99) / kNanosPerMicro,
+                              m.latency.percentile(99.9) / kNanosPerMicro,
+                              m.latency.max() / kNanosPerMicro);
+        first = false;
+    }
+    result.append(R"(},"counters":{)");
+    for (size_t i = 0; i < kNumMetricCounters; ++i)
+    {
+        absl::StrAppendFormat(&result,
+                              R"(%s"%s":%u)",
+                              i == 0 ? "" : ",",
+                              stringify(static_cast<MetricCounter>(i)),
+                              counters[i]);
+    }
+    result.append(R"(},"gauges":{)");
+    for (size_t i = 0; i < kNumMetricGauges; ++i)
+    {
+        absl::StrAppendFormat(&result,
+                              R"(%s"%s":%d)",
+                              i == 0 ? "" : ",",
+                              stringify(static_cast<MetricGauge>(i)),
+                              gauges[i]);
+    }
+    absl::StrAppendFormat(
+        &result,
+        R"(},"hit_rates":{"attr_cache":%.4f,"key_cache":%.4f,"file_table":%.4f}})"
+        "\n",
+        hit_rate(get(MetricCounter::kAttrCacheHits), get(MetricCounter::kAttrCacheMisses)),
+        hit_rate(get(MetricCounter::kKeyCacheHits), get(MetricCounter::kKeyCacheMisses)),
+        hit_rate(get(MetricCounter::kFileTableHits), get(MetricCounter::kFileTableMisses)));
+    return result;
+}
+
+std::string MetricsSnapshot::to_text() const
+{
+    std::string result = absl::StrFormat("%-12s %10s %8s %10s %10s %10s %10s %10s\n",
+                                         "op",
+                                         "calls",
+                                         "errors",
+                                         "mean(us)",
+                                         "p50(us)",
+                                         "p99(us)",
+                                         "p999(us)",
+                                         "max(us)");
+    for (size_t i = 0; i < kNumFuseOps; ++i)
+    {
+        const FuseOpMetrics& m = ops[i];
+        if (m.calls == 0)
+        {
+            continue;
+        }
+        absl::StrAppendFormat(&result,
+                              "%-12s %10u %8u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                              stringify(static_cast<FuseOp>(i)),
+                              m.calls,
+                              m.errors,
+                              m.latency.mean() / kNanosPerMicro,
+                              m.latency.percentile(50) / kNanosPerMicro,
+                              m.latency.percentile(99) / kNanosPerMicro,
+                              m.latency.percentile(99.9) / kNanosPerMicro,
+                              m.latency.max() / kNanosPerMicro);
+    }
+    for (size_t i = 0; i < kNumMetricCounters; ++i)
+    {
+        absl::StrAppendFormat(
+            &result, "%s: %u\n", stringify(static_cast<MetricCounter>(i)), counters[i]);
+    }
+    for (size_t i = 0; i < kNumMetricGauges; ++i)
+    {
+        absl::StrAppendFormat(
+            &result, "%s: %d\n", stringify(static_cast<MetricGauge>(i)), gauges[i]);
+    }
+    absl::StrAppendFormat(
+        &result,
+        "hit rates: attr cache %.1f%%, key cache %.1f%%, file table %.1f%%\n",
+        100 * hit_rate(get(MetricCounter::kAttrCacheHits), get(MetricCounter::kAttrCacheMisses)),
+        100 * hit_rate(get(MetricCounter::kKeyCacheHits), get(MetricCounter::kKeyCacheMisses)),
+        100 * hit_rate(get(MetricCounter::kFileTableHits), get(MetricCounter::kFileTableMisses)));
+    return result;
+}
+namespace
+{
+    std::atomic<bool> dump_requested{false};
+
+    void request_dump(int) { dump_requested.store(true, std::memory_order_relaxed); }
+}    // namespace
+
+MetricsReporter::MetricsReporter(std::string stats_file, absl::Duration interval)
+    : m_stats_file(std::move(stats_file)), m_interval(interval)
+{
+#ifdef SIGUSR1
+    std::signal(SIGUSR1, &request_dump);
+#endif
+    m_thread = std::thread([this]() { run(); });
+}
+
+MetricsReporter::~MetricsReporter()
+{
+    m_stop.Notify();
+    m_thread.join();
+}
+
+void MetricsReporter::run()
+{
+    // Signal handlers can do little safely, so the flag is polled instead.
+    auto next_write = absl::Now() + m_interval;
+    while (!m_stop.WaitForNotificationWithTimeout(std::min(m_interval, absl::Seconds(1))))
+    {
+        if (dump_requested.exchange(false, std::memory_order_relaxed))
+        {
+            INFO_LOG("Metrics since the start of securefs:\n%s", metrics::snapshot().to_text());
+        }
+        if (!m_stats_file.empty() && absl::Now() >= next_write)
+        {
+            write_stats_file();
+            next_write = absl::Now() + m_interval;
+        }
+    }
+    if (!m_stats_file.empty())
+    {
+        write_stats_file();
+    }
+}
+
+void MetricsReporter::write_stats_file() const
+{
+    // Renamed into place, so that readers never see a partially written file.
+    std::string temp_file = m_stats_file + ".tmp";
+    try
+    {
+        std::string json = metrics::snapshot().to_json();
+        {
+            auto stream = OSService::get_default().open_file_stream(
+                temp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            stream->write(json.data(), 0, json.size());
+        }
+        OSService::get_default().rename(temp_file, m_stats_file);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Failed to write the stats file %s: %s", m_stats_file, e.what());
+    }
+}
+}    // namespace securefs
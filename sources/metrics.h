@@ -0,0 +1,181 @@
+#pragma once
+
+#include "myutils.h"
+
+#include <absl/synchronization/notification.h>
+#include <absl/time/time.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+namespace securefs
+{
+/// The FUSE operations dispatched by `FuseHighLevelOpsBase`.
+enum class FuseOp : unsigned char
+{
+    kStatfs,
+    kGetattr,
+    kFgetattr,
+    kOpendir,
+    kReleasedir,
+    kReaddir,
+    kCreate,
+    kOpen,
+    kRelease,
+    kRead,
+    kWrite,
+    kFlush,
+    kFtruncate,
+    kUnlink,
+    kMkdir,
+    kRmdir,
+    kChmod,
+    kChown,
+    kSymlink,
+    kLink,
+    kReadlink,
+    kRename,
+    kFsync,
+    kTruncate,
+    kUtimens,
+    kListxattr,
+    kGetxattr,
+    kSetxattr,
+    kRemovexattr,
+    kGetpath,
+};
+
+inline constexpr size_t kNumFuseOps = static_cast<size_t>(FuseOp::kGetpath) + 1;
+
+const char* stringify(FuseOp op);
+
+/// Monotonic counters.
+enum class MetricCounter : unsigned char
+{
+    kBytesEncrypted,
+    kBytesDecrypted,
+    kAttrCacheHits,
+    kAttrCacheMisses,
+    kKeyCacheHits,
+    kKeyCacheMisses,
+    // An open that found the file live or among the recently closed ones.
+    kFileTableHits,
+    kFileTableMisses,
+};
+
+inline constexpr size_t kNumMetricCounters
+    = static_cast<size_t>(MetricCounter::kFileTableMisses) + 1;
+
+const char* stringify(MetricCounter counter);
+
+/// Levels that go up and down.
+enum class MetricGauge : unsigned char
+{
+    kFileTableLive,
+    kFileTableCached,
+    kKeyCacheEntries,
+    // Handles of regular files held by the kernel.
+    kOpenFiles,
+    // The threads of `my_fuse_main()` serving requests, and those of them busy with one.
+    kFuseWorkers,
+    kFuseWorkersBusy,
+};
+
+inline constexpr size_t kNumMetricGauges = static_cast<size_t>(MetricGauge::kFuseWorkersBusy) + 1;
+
+const char* stringify(MetricGauge gauge);
+
+/// Log-linear buckets in the manner of HdrHistogram: each power of two is split into 16 linear
+/// sub-buckets, so a recorded value is known within 1/16 of itself. Values are in nanoseconds and
+/// clamped at about 69 seconds.
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned kSubBucketBits = 4;
+    static constexpr unsigned kMaxValueBits = 36;
+    static constexpr size_t kNumBuckets = (kMaxValueBits - kSubBucketBits + 1) << kSubBucketBits;
+
+    static size_t bucket_index(uint64_t value) noexcept;
+    /// The smallest and the largest values that fall into the bucket.
+    static uint64_t bucket_lower_bound(size_t index) noexcept;
+    static uint64_t bucket_upper_bound(size_t index) noexcept;
+
+    void record(uint64_t value, uint64_t count = 1) noexcept;
+    /// Rebuilds a histogram from its parts, where `sum` and `max` are the exact ones of the values
+    /// counted in `buckets`.
+    void add_recorded(const std::array<uint64_t, kNumBuckets>& buckets,
+                      uint64_t sum,
+                      uint64_t max) noexcept;
+    void merge(const LatencyHistogram& other) noexcept;
+
+    uint64_t count() const noexcept { return m_count; }
+    uint64_t max() const noexcept { return m_max; }
+    double mean() const noexcept;
+    /// The upper bound of the bucket holding the `p`-th percentile, capped by the maximum.
+    uint64_t percentile(double p) const noexcept;
+
+private:
+    std::array<uint64_t, kNumBuckets> m_buckets{};
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
+
+struct FuseOpMetrics
+{
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    LatencyHistogram latency;
+};
+
+/// The sum of all the threads' metrics at one point in time. Concurrent updates may be partially
+/// included.
+struct MetricsSnapshot
+{
+    std::array<FuseOpMetrics, kNumFuseOps> ops;
+    std::array<uint64_t, kNumMetricCounters> counters{};
+    std::array<int64_t, kNumMetricGauges> gauges{};
+
+    uint64_t get(MetricCounter c) const noexcept { return counters[static_cast<size_t>(c)]; }
+    int64_t get(MetricGauge g) const noexcept { return gauges[static_cast<size_t>(g)]; }
+    const FuseOpMetrics& get(FuseOp op) const noexcept { return ops[static_cast<size_t>(op)]; }
+
+    /// Latencies are in microseconds. Operations never called are omitted.
+    std::string to_json() const;
+    std::string to_text() const;
+};
+
+/// Process wide metrics, always on. Each thread records into a shard of its own, so recording
+/// takes no lock and contends on no cache line; shards of exited threads are reused by new ones.
+namespace metrics
+{
+    void record_call(FuseOp op, uint64_t latency_ns, bool failed) noexcept;
+    void increment(MetricCounter counter, uint64_t delta = 1) noexcept;
+    void adjust(MetricGauge gauge, int64_t delta) noexcept;
+
+    MetricsSnapshot snapshot();
+}    // namespace metrics
+
+/// Publishes the metrics while a filesystem is mounted: the text form goes to the log whenever the
+/// process receives SIGUSR1, and the JSON form replaces `stats_file` (if not empty) every
+/// `interval`, which must be positive, and once more on destruction.
+class MetricsReporter
+{
+public:
+    MetricsReporter(std::string stats_file, absl::Duration interval);
+    ~MetricsReporter();
+    DISABLE_COPY_MOVE(MetricsReporter)
+
+private:
+    std::string m_stats_file;
+    absl::Duration m_interval;
+    absl::Notification m_stop;
+    std::thread m_thread;
+
+    void run();
+    void write_stats_file() const;
+};
+}    // namespace securefs
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "myutils.h"
+
+#include <absl/numeric/bits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace securefs
+{
+/// A fixed size lock-free queue with any number of producers and a single consumer, after the
+/// bounded queue of Dmitry Vyukov. Producers never wait: pushing fails when the queue is full.
+///
+/// Items are swapped in and out rather than copied, so that the buffers of items like strings are
+/// recycled between the producers and the slots.
+template <class T>
+class BoundedMpscQueue
+{
+public:
+    /// `capacity` is rounded up to a power of two.
+    explicit BoundedMpscQueue(size_t capacity)
+    {
+        capacity = absl::bit_ceil(std::max<size_t>(capacity, 2));
+        m_slots = std::make_unique<Slot[]>(capacity);
+        m_mask = capacity - 1;
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    DISABLE_COPY_MOVE(BoundedMpscQueue)
+
+    size_t capacity() const noexcept { return m_mask + 1; }
+
+    /// Swaps `item` into the queue, leaving in `item` whatever the slot held before. Returns false,
+    /// without touching `item`, if the queue is full. On success, the position of the item is
+    /// stored in `position` if given, and the item is consumed once `popped()` exceeds it.
+    bool try_push(T& item, uint64_t* position = nullptr) noexcept
+    {
+        uint64_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Slot& slot = m_slots[pos & m_mask];
+            auto diff = static_cast<int64_t>(slot.sequence.load(std::memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    using std::swap;
+                    swap(slot.item, item);
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    if (position)
+                    {
+                        *position = pos;
+                    }
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// Calls `consume(T&)` on the oldest item and frees its slot. Returns false if the queue is
+    /// empty, or if the oldest item is still being pushed. Callers must not pop concurrently.
+    template <class Consume>
+    bool try_pop(Consume&& consume)
+    {
+        Slot& slot = m_slots[m_dequeue_pos & m_mask];
+        if (slot.sequence.load(std::memory_order_acquire) != m_dequeue_pos + 1)
+        {
+            return false;
+        }
+        consume(slot.item);
+        slot.sequence.store(m_dequeue_pos + m_mask + 1, std::memory_order_release);
+        ++m_dequeue_pos;
+        return true;
+    }
+
+    /// The number of items whose push has started, some of which may still be in progress.
+    uint64_t pushed() const noexcept { return m_enqueue_pos.load(std::memory_order_acquire); }
+
+    /// The number of items consumed so far. Only for the consumer.
+    uint64_t popped() const noexcept { return m_dequeue_pos; }
+
+private:
+    struct Slot
+    {
+        // Equal to the position of the next push into the slot when it is free, or one past the
+        // position of the last push when it holds an item.
+        std::atomic<uint64_t> sequence;
+        T item{};
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    alignas(64) std::atomic<uint64_t> m_enqueue_pos{0};
+    alignas(64) uint64_t m_dequeue_pos = 0;
+};
+}    // namespace securefs
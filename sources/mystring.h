@@ -33,7 +33,29 @@ inline std::string hexify(const ByteContainer& c)
 void base32_encode(const byte* input, size_t size, std::string& output);
 void base32_decode(const char* input, size_t size, std::string& output);
 
+namespace internal
+{
+    // The implementations behind `base32_encode` and `base32_decode`, which pick the fastest one
+    // the CPU supports. Exposed for cross-checks and benchmarks.
+    enum class Base32Kernel
+    {
+        kReference,
+        kScalar,
+        kSsse3,
+        kAvx2,
+    };
+
+    const char* stringify(Base32Kernel kernel);
+    bool is_base32_kernel_supported(Base32Kernel kernel) noexcept;
+
+    /// Only valid to call with a supported kernel.
+    void base32_encode(Base32Kernel kernel, const byte* input, size_t size, std::string& output);
+    void base32_decode(Base32Kernel kernel, const char* input, size_t size, std::string& output);
+}    // namespace internal
+
 bool is_ascii(std::string_view str);
+/// Lowers the ASCII letters only, which is also the full case folding of an ASCII string.
+std::string to_lower(std::string_view str);
 
 int binary_compare(std::string_view a, std::string_view b);
 int case_insensitive_compare(std::string_view a, std::string_view b);
@@ -0,0 +1,188 @@
+#include "parallel_walk.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <absl/strings/escaping.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <utility>
+
+namespace securefs
+{
+namespace
+{
+    double to_mib(uint64_t bytes) { return bytes / 1048576.0; }
+
+    unsigned num_threads(const WalkOptions& options)
+    {
+        return options.threads > 0 ? options.threads
+                                   : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The walk whose task the current thread is running, if any.
+    thread_local const ParallelWalk* current_walk = nullptr;
+}    // namespace
+
+std::string WalkReport::to_text() const
+{
+    double seconds = absl::ToDoubleSeconds(totals.elapsed);
+    std::string result
+        = absl::StrFormat("%u files, %u directories and %u symlinks, %.1f MiB in %.3f s "
+                          "(%.1f MiB/s), %u problems\n",
+                          totals.files,
+                          totals.directories,
+                          totals.symlinks,
+                          to_mib(totals.bytes),
+                          seconds,
+                          seconds > 0 ? to_mib(totals.bytes) / seconds : 0.0,
+                          totals.problems);
+    for (const std::string& p : problems)
+    {
+        absl::StrAppend(&result, p, "\n");
+    }
+    if (problems.size() < totals.problems)
+    {
+        absl::StrAppendFormat(&result, "... and %u more\n", totals.problems - problems.size());
+    }
+    return result;
+}
+
+std::string WalkReport::to_json() const
+{
+    std::string result = absl::StrFormat(
+        R"({"seconds":%.6f,"files":%u,"directories":%u,"symlinks":%u,"bytes":%u,"problems":%u,)"
+        R"("listed_problems":[)",
+        absl::ToDoubleSeconds(totals.elapsed),
+        totals.files,
+        totals.directories,
+        totals.symlinks,
+        totals.bytes,
+        totals.problems);
+    for (size_t i = 0; i < problems.size(); ++i)
+    {
+        absl::StrAppendFormat(
+            &result, R"(%s"%s")", i == 0 ? "" : ",", absl::Utf8SafeCEscape(problems[i]));
+    }
+    result.append("]}\n");
+    return result;
+}
+
+ParallelWalk::ParallelWalk(const WalkOptions& options)
+    : options_(options)
+    , start_(absl::Now())
+    , max_pending_(num_threads(options) * kMaxPendingPerThread)
+    , pool_(num_threads(options))
+{
+}
+
+std::string ParallelWalk::join(std::string_view dir, std::string_view name)
+{
+    if (dir.empty() || dir == "/")
+    {
+        return absl::StrCat(dir, name);
+    }
+    return absl::StrCat(dir, "/", name);
+}
+
+void ParallelWalk::submit(std::string subject, std::function<void()> task)
+{
+    auto run = [this, subject = std::move(subject), task = std::move(task)]()
+    {
+        // Even if `task` throws something that is not a `std::exception`, or else `wait()` hangs.
+        DEFER({
+            LockGuard<absl::Mutex> lg(mu_);
+            --pending_;
+        });
+        const ParallelWalk* outer = current_walk;
+        current_walk = this;
+        DEFER(current_walk = outer);
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            add_problem(absl::StrCat(subject, ": ", e.what()));
+        }
+    };
+
+    bool run_here = false;
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        if (current_walk == this)
+        {
+            // Waiting for room could deadlock, if every worker waits.
+            run_here = !has_room();
+        }
+        else
+        {
+            mu_.Await(absl::Condition(this, &ParallelWalk::has_room));
+        }
+        ++pending_;
+    }
+    if (run_here)
+    {
+        run();
+    }
+    else
+    {
+        pool_.submit(std::move(run));
+    }
+}
+
+void ParallelWalk::add_problem(std::string description)
+{
+    WARN_LOG("%s", description);
+    LockGuard<absl::Mutex> lg(mu_);
+    ++num_problems_;
+    if (problems_.size() < WalkReport::kMaxListedProblems)
+    {
+        problems_.emplace_back(std::move(description));
+    }
+}
+
+void ParallelWalk::wait()
+{
+    while (true)
+    {
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            if (mu_.AwaitWithTimeout(absl::Condition(this, &ParallelWalk::is_idle),
+                                     options_.progress_interval))
+            {
+                return;
+            }
+        }
+        if (options_.on_progress)
+        {
+            options_.on_progress(progress());
+        }
+    }
+}
+
+WalkProgress ParallelWalk::progress()
+{
+    WalkProgress result;
+    result.files = files.load();
+    result.directories = directories.load();
+    result.symlinks = symlinks.load();
+    result.bytes = bytes.load();
+    result.elapsed = absl::Now() - start_;
+    LockGuard<absl::Mutex> lg(mu_);
+    result.problems = num_problems_;
+    return result;
+}
+
+WalkReport ParallelWalk::report()
+{
+    WalkReport result;
+    result.totals = progress();
+    LockGuard<absl::Mutex> lg(mu_);
+    result.problems = problems_;
+    return result;
+}
+}    // namespace securefs
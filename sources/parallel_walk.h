@@ -0,0 +1,100 @@
+#pragma once
+
+#include "myutils.h"
+#include "thread_pool.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/time/time.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace securefs
+{
+struct WalkProgress
+{
+    uint64_t files = 0;
+    uint64_t directories = 0;
+    uint64_t symlinks = 0;
+    // Bytes of file content processed.
+    uint64_t bytes = 0;
+    uint64_t problems = 0;
+    absl::Duration elapsed;
+};
+
+struct WalkOptions
+{
+    // Zero means the number of hardware threads.
+    unsigned threads = 0;
+    absl::Duration progress_interval = absl::Seconds(10);
+    // Called every `progress_interval` by the thread waiting for the walk.
+    std::function<void(const WalkProgress&)> on_progress;
+};
+
+struct WalkReport
+{
+    static constexpr size_t kMaxListedProblems = 1000;
+
+    WalkProgress totals;
+    // The first problems found, in no particular order. All of them are counted in `totals`.
+    std::vector<std::string> problems;
+
+    bool ok() const noexcept { return totals.problems == 0; }
+
+    std::string to_text() const;
+    std::string to_json() const;
+};
+
+/// Runs the tasks of a walk over a directory tree on a pool of threads, where each task may
+/// submit more tasks for the entries it finds, and collects the counters and the problems.
+class ParallelWalk
+{
+public:
+    static constexpr uint64_t kMaxPendingPerThread = 256;
+
+    explicit ParallelWalk(const WalkOptions& options);
+    DISABLE_COPY_MOVE(ParallelWalk)
+
+    /// Joins a name to a directory, where the root is either empty or "/".
+    static std::string join(std::string_view dir, std::string_view name);
+
+    /// Runs `task` on the pool. An exception escaping from it is a problem with `subject`.
+    ///
+    /// At most `kMaxPendingPerThread` tasks per thread wait for the pool, so that a wide tree is
+    /// not queued whole. Past that, a task of the walk runs the new task itself before returning,
+    /// and other threads wait for room.
+    void submit(std::string subject, std::function<void()> task);
+
+    void add_problem(std::string description);
+
+    /// Waits for all the tasks, including those submitted by other tasks meanwhile, and reports
+    /// the progress periodically.
+    void wait();
+
+    WalkProgress progress();
+    WalkReport report();
+
+    std::atomic<uint64_t> files{0}, directories{0}, symlinks{0}, bytes{0};
+
+private:
+    bool is_idle() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) { return pending_ == 0; }
+    bool has_room() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) { return pending_ < max_pending_; }
+
+private:
+    const WalkOptions& options_;
+    absl::Time start_;
+    uint64_t max_pending_;
+    absl::Mutex mu_;
+    uint64_t pending_ ABSL_GUARDED_BY(mu_) = 0;
+    uint64_t num_problems_ ABSL_GUARDED_BY(mu_) = 0;
+    std::vector<std::string> problems_ ABSL_GUARDED_BY(mu_);
+    // Last, so that the workers are gone before anything they use.
+    ThreadPool pool_;
+};
+}    // namespace securefs
@@ -13,6 +13,10 @@
 
 namespace securefs
 {
+/// The names of the config file at the root of the data dir, and of its legacy version.
+inline constexpr std::string_view kConfigFileName = ".config.pb";
+inline constexpr std::string_view kLegacyConfigFileName = ".securefs.json";
+
 class PasswordOrKeyfileIncorrectException : public std::exception
 {
 public:
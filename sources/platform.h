@@ -109,6 +109,8 @@ class FileStream : public StreamBase
 {
 public:
     virtual void fsync() = 0;
+    // Flushes the content but not necessarily the metadata that is not needed to read it back.
+    virtual void fdatasync() { fsync(); }
     virtual void utimens(const fuse_timespec ts[2]) = 0;
     virtual void fstat(fuse_stat*) const = 0;
     virtual void close() noexcept = 0;
@@ -120,8 +122,17 @@ public:
     virtual void unlock() noexcept = 0;
     virtual length_type sequential_read(void*, length_type) = 0;
     virtual void sequential_write(const void*, length_type) = 0;
+
+    // Hints the OS that the range will be read soon. Failures are ignored.
+    virtual void advise_willneed(offset_type offset, length_type length) noexcept
+    {
+        (void)offset;
+        (void)length;
+    }
 };
 
+class ThreadPool;
+
 class DirectoryTraverser : public Object
 {
 public:
@@ -187,6 +198,8 @@ public:
     open_file_stream(const std::string& path, int flags, unsigned mode) const;
     bool remove_file_nothrow(const std::string& path) const noexcept;
     bool remove_directory_nothrow(const std::string& path) const noexcept;
+    // Removes the directory with everything under it. Returns false if anything is left behind.
+    bool remove_recursively_nothrow(const std::string& dir) const noexcept;
     void remove_file(const std::string& path) const;
     void remove_directory(const std::string& path) const;
 
@@ -195,6 +208,8 @@ public:
     void ensure_directory(const std::string& path, unsigned mode) const;
     void mkdir(const std::string& path, unsigned mode) const;
     void statfs(fuse_statvfs*) const;
+    // Flushes the whole filesystem containing the directory. Returns false when unsupported.
+    bool sync_filesystem() const;
     void utimens(const std::string& path, const fuse_timespec ts[2]) const;
 
     // Returns false when the path does not exist; throw exceptions on other errors
@@ -212,7 +227,11 @@ public:
     void recursive_traverse(const std::string& dir,
                             const recursive_traverse_callback& callback) const;
 
-    std::unique_ptr<DirectoryTraverser> create_traverser(const std::string& dir) const;
+    // With `full_stat`, entries come with complete attributes rather than just the type and
+    // inode number. The pool, if any, may be used to retrieve them in parallel.
+    std::unique_ptr<DirectoryTraverser> create_traverser(const std::string& dir,
+                                                         bool full_stat = false,
+                                                         ThreadPool* pool = nullptr) const;
 
 #ifdef __APPLE__
     // These APIs, unlike all others, report errors through negative error numbers as defined in
@@ -0,0 +1,191 @@
+#include "readahead.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace securefs
+{
+ReadAheadBuffer::ReadAheadBuffer(ThreadPool& pool,
+                                 std::shared_ptr<FileStream> underlying,
+                                 StreamFactory factory,
+                                 Geometry geometry,
+                                 unsigned window_blocks,
+                                 std::shared_ptr<const WriteGeneration> write_generation)
+    : pool_(pool)
+    , underlying_(std::move(underlying))
+    , factory_(std::move(factory))
+    , geometry_(geometry)
+    , window_size_(geometry.block_size * std::max(1u, window_blocks))
+    , write_generation_(std::move(write_generation))
+{
+}
+
+void ReadAheadBuffer::clear_chunks()
+{
+    chunks_.clear();
+    prefetched_end_ = 0;
+}
+
+length_type
+ReadAheadBuffer::serve(void* output, offset_type offset, length_type length, bool* reached_eof)
+{
+    *reached_eof = false;
+    LockGuard<absl::Mutex> lg(mu_);
+    if (chunks_.empty())
+    {
+        return 0;
+    }
+    if (write_generation_->load(std::memory_order_acquire) != chunks_write_generation_)
+    {
+        // Modified through another handle.
+        clear_chunks();
+        return 0;
+    }
+
+    length_type served = 0;
+    for (const Chunk& c : chunks_)
+    {
+        offset_type pos = offset + served;
+        if (served >= length || c.end() < pos)
+        {
+            continue;
+        }
+        if (c.offset > pos)
+        {
+            break;
+        }
+        auto copy_size = std::min<length_type>(length - served, c.end() - pos);
+        if (copy_size > 0)
+        {
+            memcpy(static_cast<byte*>(output) + served, c.data.data() + (pos - c.offset), copy_size);
+            served += copy_size;
+        }
+        if (c.at_eof && offset + served == c.end())
+        {
+            *reached_eof = true;
+            break;
+        }
+    }
+
+    // Data behind the consumer will not be needed again by a sequential reader.
+    while (!chunks_.empty() && chunks_.front().end() <= offset + served && !chunks_.front().at_eof)
+    {
+        chunks_.pop_front();
+    }
+    return served;
+}
+
+void ReadAheadBuffer::record_read(offset_type offset,
+                                  length_type read_length,
+                                  length_type requested_length)
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    if (offset == next_expected_)
+    {
+        ++sequential_runs_;
+    }
+    else
+    {
+        sequential_runs_ = 0;
+        clear_chunks();
+    }
+    next_expected_ = offset + read_length;
+
+    if (read_length < requested_length || sequential_runs_ < kSequentialThreshold || inflight_)
+    {
+        return;
+    }
+    offset_type start = std::max(next_expected_, prefetched_end_);
+    if (!chunks_.empty() && chunks_.back().at_eof)
+    {
+        return;
+    }
+    if (start - next_expected_ >= window_size_ / 2)
+    {
+        // Enough data is already buffered ahead of the reader.
+        return;
+    }
+
+    offset_type first_block = start / geometry_.block_size;
+    offset_type last_block = (start + window_size_) / geometry_.block_size;
+    underlying_->advise_willneed(
+        geometry_.physical_header_size + first_block * geometry_.physical_block_size,
+        (last_block - first_block + 1) * geometry_.physical_block_size);
+
+    inflight_ = true;
+    prefetched_end_ = start;
+    pool_.submit([self = shared_from_this(), start, generation = generation_]()
+                 { self->fetch(start, generation); });
+}
+
+void ReadAheadBuffer::invalidate()
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    ++generation_;
+    stream_stale_ = true;
+    sequential_runs_ = 0;
+    clear_chunks();
+}
+
+void ReadAheadBuffer::fetch(offset_type start, uint64_t generation)
+{
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        if (stream_stale_)
+        {
+            fetch_stream_.reset();
+            stream_stale_ = false;
+        }
+    }
+
+    Chunk chunk{start, {}, false};
+    // Loaded before reading, so that a write racing with the read is caught by `serve()`.
+    uint64_t write_generation = write_generation_->load(std::memory_order_acquire);
+    try
+    {
+        if (!fetch_stream_)
+        {
+            fetch_stream_ = factory_();
+        }
+        chunk.data.resize(window_size_);
+        auto read_length = fetch_stream_->read(chunk.data.data(), start, window_size_);
+        chunk.data.resize(read_length);
+        chunk.at_eof = read_length < window_size_;
+    }
+    catch (const std::exception& e)
+    {
+        // Errors are not fatal here. The foreground read will redo the work and report them.
+        VERBOSE_LOG("Read-ahead at offset %d failed with %s: %s",
+                    start,
+                    get_type_name(e).get(),
+                    e.what());
+        fetch_stream_.reset();
+        LockGuard<absl::Mutex> lg(mu_);
+        inflight_ = false;
+        if (generation == generation_)
+        {
+            prefetched_end_ = chunks_.empty() ? 0 : chunks_.back().end();
+        }
+        return;
+    }
+
+    LockGuard<absl::Mutex> lg(mu_);
+    inflight_ = false;
+    if (generation != generation_)
+    {
+        return;
+    }
+    if (chunks_.empty() || write_generation != chunks_write_generation_)
+    {
+        chunks_.clear();
+        chunks_write_generation_ = write_generation;
+    }
+    prefetched_end_ = chunk.end();
+    chunks_.push_back(std::move(chunk));
+}
+}    // namespace securefs
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "myutils.h"
+#include "object.h"
+#include "platform.h"
+#include "streams.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+class ThreadPool;
+
+/// Per open file read-ahead of decrypted content.
+///
+/// The owner reports every read through `record_read()`. Once a run of sequential reads is seen,
+/// the next window of plaintext is read and decrypted on a background pool by a private stream
+/// instance, so that disk I/O and decryption overlap with the consumer. Later reads are served
+/// from the window through `serve()`.
+///
+/// Any write or resize by the owner must be followed by `invalidate()`. Modifications through
+/// other handles are detected through `write_generation`, a counter shared by all the handles of
+/// the same file, which each of them increments after every write or resize.
+class ReadAheadBuffer final : public Object, public std::enable_shared_from_this<ReadAheadBuffer>
+{
+public:
+    using StreamFactory = std::function<std::unique_ptr<StreamBase>()>;
+    using WriteGeneration = std::atomic<uint64_t>;
+
+    /// Maps plaintext offsets to the underlying file, for the purpose of `advise_willneed`.
+    struct Geometry
+    {
+        length_type block_size;
+        length_type physical_block_size;
+        length_type physical_header_size;
+    };
+
+    /// The number of consecutive sequential reads before prefetching kicks in.
+    static constexpr unsigned kSequentialThreshold = 2;
+
+    ReadAheadBuffer(ThreadPool& pool,
+                    std::shared_ptr<FileStream> underlying,
+                    StreamFactory factory,
+                    Geometry geometry,
+                    unsigned window_blocks,
+                    std::shared_ptr<const WriteGeneration> write_generation);
+
+    /// Copies prefetched plaintext starting at `offset` into `output`.
+    /// @return The number of bytes served, which may be less than `length` (including zero).
+    /// `*reached_eof` is set when the prefetched data proves that the file ends right after the
+    /// bytes served.
+    length_type serve(void* output, offset_type offset, length_type length, bool* reached_eof);
+
+    /// Feeds the sequential detector, and schedules a prefetch when appropriate.
+    void record_read(offset_type offset, length_type read_length, length_type requested_length);
+
+    /// Discards all prefetched data, including any prefetch still in flight.
+    void invalidate();
+
+private:
+    struct Chunk
+    {
+        offset_type offset;
+        std::vector<byte> data;
+        bool at_eof;
+
+        offset_type end() const noexcept { return offset + data.size(); }
+    };
+
+    void fetch(offset_type start, uint64_t generation);
+    void clear_chunks() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+private:
+    ThreadPool& pool_;
+    std::shared_ptr<FileStream> underlying_;
+    StreamFactory factory_;
+    Geometry geometry_;
+    length_type window_size_;
+    std::shared_ptr<const WriteGeneration> write_generation_;
+
+    // Only touched by the single in-flight prefetch task.
+    std::unique_ptr<StreamBase> fetch_stream_;
+
+    absl::Mutex mu_;
+    std::deque<Chunk> chunks_ ABSL_GUARDED_BY(mu_);
+    // The value of `*write_generation_` before the data in `chunks_` was read.
+    uint64_t chunks_write_generation_ ABSL_GUARDED_BY(mu_) = 0;
+    offset_type next_expected_ ABSL_GUARDED_BY(mu_) = 0;
+    offset_type prefetched_end_ ABSL_GUARDED_BY(mu_) = 0;
+    unsigned sequential_runs_ ABSL_GUARDED_BY(mu_) = 0;
+    uint64_t generation_ ABSL_GUARDED_BY(mu_) = 0;
+    bool inflight_ ABSL_GUARDED_BY(mu_) = false;
+    bool stream_stale_ ABSL_GUARDED_BY(mu_) = false;
+};
+}    // namespace securefs
@@ -0,0 +1,363 @@
+#include "repo_verifier.h"
+#include "btree_dir.h"
+#include "exceptions.h"
+#include "full_format.h"
+#include "lite_long_name_lookup_table.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "mystring.h"
+#include "myutils.h"
+#include "params_io.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/synchronization/mutex.h>
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
+#include <unordered_set>
+#include <utility>
+#include <variant>
+
+namespace securefs
+{
+namespace
+{
+    // Files are read back in pieces of at most this many bytes.
+    constexpr length_type kReadChunkSize = 1 << 20;
+
+    template <class Stream>
+    void read_back(ParallelWalk& run, Stream& stream, length_type size)
+    {
+        std::vector<char> buffer(std::min(size, kReadChunkSize));
+        for (length_type off = 0; off < size;)
+        {
+            auto rc = stream.read(buffer.data(), off, std::min(size - off, kReadChunkSize));
+            if (rc == 0)
+            {
+                throw_runtime_error(
+                    absl::StrFormat("Content ends at %d, before the size %d", off, size));
+            }
+            off += rc;
+            run.bytes += rc;
+        }
+    }
+}    // namespace
+
+namespace full_format
+{
+    struct RepoVerifier::Walk
+    {
+        struct Reference
+        {
+            int type = 0;
+            uint32_t count = 0;
+            std::string path;
+        };
+
+        explicit Walk(const WalkOptions& options) : run(options) {}
+
+        absl::Mutex mu;
+        // The objects named by the directory entries, with the number of entries naming them.
+        absl::flat_hash_map<id_type, Reference, id_hash> references ABSL_GUARDED_BY(mu);
+        // The link counts stored in the objects other than directories.
+        absl::flat_hash_map<id_type, uint32_t, id_hash> nlinks ABSL_GUARDED_BY(mu);
+        std::unordered_set<id_type, id_hash> stored_ids ABSL_GUARDED_BY(mu);
+        // Last, so that its workers are gone before the rest.
+        ParallelWalk run;
+    };
+
+    WalkReport RepoVerifier::verify(const WalkOptions& options)
+    {
+        Walk walk(options);
+        {
+            LockGuard<absl::Mutex> lg(walk.mu);
+            walk.references[kRootId] = {Directory::class_type(), 1, "/"};
+        }
+        // Listing the objects on disk takes one thread, so it overlaps with the walk.
+        walk.run.submit("Listing the objects",
+                        [&]()
+                        {
+                            auto ids = find_all_ids(root_.norm_path_narrowed("."));
+                            LockGuard<absl::Mutex> lg(walk.mu);
+                            walk.stored_ids = std::move(ids);
+                        });
+        walk.run.submit("/", [&]() { verify_directory(walk, kRootId, "/"); });
+        walk.run.wait();
+
+        LockGuard<absl::Mutex> lg(walk.mu);
+        for (const auto& [id, ref] : walk.references)
+        {
+            if (ref.type == Directory::class_type())
+            {
+                continue;
+            }
+            auto it = walk.nlinks.find(id);
+            if (it != walk.nlinks.end() && it->second != ref.count)
+            {
+                walk.run.add_problem(absl::StrFormat("%s: the link count is %d, but %d entries "
+                                                     "name the object",
+                                                     ref.path,
+                                                     it->second,
+                                                     ref.count));
+            }
+        }
+        for (const id_type& id : walk.stored_ids)
+        {
+            if (!walk.references.contains(id))
+            {
+                walk.run.add_problem(absl::StrFormat(
+                    "Object %s is not reachable from the root directory", hexify(id)));
+            }
+        }
+        return walk.run.report();
+    }
+
+    void RepoVerifier::verify_directory(Walk& walk, const id_type& id, const std::string& path)
+    {
+        auto [data, meta] = io_.open(id);
+        auto dir = directory_factory_(std::move(data), std::move(meta), id);
+        std::vector<std::tuple<std::string, id_type, int>> entries;
+        {
+            FileLockGuard lg(*dir);
+            if (dir->get_real_type() != Directory::class_type())
+            {
+                walk.run.add_problem(
+                    absl::StrCat(path, ": named as a directory, but the object is not one"));
+                return;
+            }
+            if (auto* btree = dynamic_cast<BtreeDirectory*>(dir.get()))
+            {
+                if (!btree->validate_btree_structure())
+                {
+                    walk.run.add_problem(absl::StrCat(path, ": the btree is malformed"));
+                }
+                if (!btree->validate_free_list())
+                {
+                    walk.run.add_problem(absl::StrCat(path, ": the free page list is malformed"));
+                }
+            }
+            dir->iterate_over_entries([&](const std::string& name, const id_type& child, int type)
+                                      { entries.emplace_back(name, child, type); });
+        }
+        ++walk.run.directories;
+
+        for (auto& [name, child, type] : entries)
+        {
+            std::string child_path = ParallelWalk::join(path, name);
+            {
+                LockGuard<absl::Mutex> lg(walk.mu);
+                auto& ref = walk.references[child];
+                if (ref.count++ > 0)
+                {
+                    // Only regular files and symlinks may have more than one name, and they are
+                    // verified under the first one found.
+                    if (type == Directory::class_type() || ref.type == Directory::class_type())
+                    {
+                        walk.run.add_problem(absl::StrFormat(
+                            "%s: names the same directory as %s", child_path, ref.path));
+                    }
+                    continue;
+                }
+                ref.type = type;
+                ref.path = child_path;
+            }
+            if (type == Directory::class_type())
+            {
+                walk.run.submit(child_path,
+                                [this, &walk, child = child, child_path]()
+                                { verify_directory(walk, child, child_path); });
+            }
+            else
+            {
+                walk.run.submit(child_path,
+                                [this, &walk, child = child, type = type, child_path]()
+                                { verify_file(walk, child, type, child_path); });
+            }
+        }
+    }
+
+    void
+    RepoVerifier::verify_file(Walk& walk, const id_type& id, int type, const std::string& path)
+    {
+        auto [data, meta] = io_.open(id);
+        uint32_t nlink = 0;
+        if (type == RegularFile::class_type())
+        {
+            auto file = regular_file_factory_(std::move(data), std::move(meta), id);
+            FileLockGuard lg(*file);
+            if (file->get_real_type() != type)
+            {
+                walk.run.add_problem(
+                    absl::StrCat(path, ": named as a regular file, but the object is not one"));
+                return;
+            }
+            read_back(walk.run, *file, file->size());
+            nlink = file->get_nlink();
+            ++walk.run.files;
+        }
+        else if (type == Symlink::class_type())
+        {
+            auto link = symlink_factory_(std::move(data), std::move(meta), id);
+            FileLockGuard lg(*link);
+            if (link->get_real_type() != type)
+            {
+                walk.run.add_problem(
+                    absl::StrCat(path, ": named as a symlink, but the object is not one"));
+                return;
+            }
+            link->get();
+            nlink = link->get_nlink();
+            ++walk.run.symlinks;
+        }
+        else
+        {
+            walk.run.add_problem(absl::StrFormat("%s: unknown type %d", path, type));
+            return;
+        }
+        LockGuard<absl::Mutex> lg(walk.mu);
+        walk.nlinks[id] = nlink;
+    }
+}    // namespace full_format
+
+namespace lite_format
+{
+    struct RepoVerifier::Walk
+    {
+        explicit Walk(const WalkOptions& options) : run(options) {}
+
+        ParallelWalk run;
+    };
+
+    WalkReport RepoVerifier::verify(const WalkOptions& options)
+    {
+        Walk walk(options);
+        walk.run.submit("/", [&]() { verify_directory(walk, ""); });
+        walk.run.wait();
+        return walk.run.report();
+    }
+
+    void RepoVerifier::verify_directory(Walk& walk, const std::string& dir)
+    {
+        auto traverser = root_.create_traverser(dir.empty() ? "." : dir);
+        std::string name;
+        fuse_stat st{};
+        std::vector<std::string> long_names;
+        bool has_table = false;
+        while (traverser->next(&name, &st))
+        {
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+            if (name == kLongNameTableFileName)
+            {
+                has_table = true;
+                continue;
+            }
+            // Dot files are hidden from the mount, except with plain text names, where only the
+            // config and the lock at the root are not part of the filesystem.
+            if (name_trans_.is_no_op()
+                    ? dir.empty()
+                        && (name == kConfigFileName || name == kLegacyConfigFileName
+                            || name == full_format::RepoLocker::kLockFileName)
+                    : name[0] == '.')
+            {
+                continue;
+            }
+            std::string path = ParallelWalk::join(dir, name);
+            if (!name_trans_.is_no_op())
+            {
+                std::visit(Overload{[](std::string&&) {},
+                                    [&](const InvalidNameTag&)
+                                    { walk.run.add_problem(path + ": the name fails to decrypt"); },
+                                    [&](const LongNameTag&) { long_names.push_back(name); }},
+                           name_trans_.decrypt_path_component(name));
+            }
+            if ((st.st_mode & S_IFMT) == 0 && !root_.stat(path, &st))
+            {
+                continue;
+            }
+            switch (st.st_mode & S_IFMT)
+            {
+            case S_IFDIR:
+                walk.run.submit(path, [this, &walk, path]() { verify_directory(walk, path); });
+                break;
+            case S_IFREG:
+                walk.run.submit(path, [this, &walk, path]() { verify_file(walk, path); });
+                break;
+            case S_IFLNK:
+                walk.run.submit(path, [this, &walk, path]() { verify_symlink(walk, path); });
+                break;
+            default:
+                break;
+            }
+        }
+        ++walk.run.directories;
+        if (has_table || !long_names.empty())
+        {
+            verify_long_names(walk, dir, long_names, has_table);
+        }
+    }
+
+    void RepoVerifier::verify_long_names(Walk& walk,
+                                         const std::string& dir,
+                                         const std::vector<std::string>& long_names,
+                                         bool has_table)
+    {
+        std::string table_path = ParallelWalk::join(dir, kLongNameTableFileName);
+        if (!has_table)
+        {
+            walk.run.add_problem(absl::StrFormat(
+                "%s: missing, but %d long names need it", table_path, long_names.size()));
+            return;
+        }
+        LongNameLookupTable table(root_.norm_path_narrowed(table_path), true);
+        LockGuard<LongNameLookupTable> lg(table);
+        std::vector<std::string> hashes = table.list_hashes();
+        absl::flat_hash_set<std::string> unused(hashes.begin(), hashes.end());
+        for (const std::string& name : long_names)
+        {
+            unused.erase(name);
+            std::string path = ParallelWalk::join(dir, name);
+            std::string encrypted = table.lookup(name);
+            if (encrypted.empty())
+            {
+                walk.run.add_problem(absl::StrCat(path, ": no entry in ", table_path));
+            }
+            else if (!std::holds_alternative<std::string>(
+                         name_trans_.decrypt_path_component(encrypted)))
+            {
+                walk.run.add_problem(
+                    absl::StrCat(path, ": the entry in ", table_path, " fails to decrypt"));
+            }
+        }
+        for (const std::string& hash : unused)
+        {
+            walk.run.add_problem(
+                absl::StrCat(table_path, ": the entry for ", hash, " names no file"));
+        }
+    }
+
+    void RepoVerifier::verify_file(Walk& walk, const std::string& path)
+    {
+        auto stream = opener_.open(root_.open_file_stream(path, O_RDONLY, 0));
+        read_back(walk.run, *stream, stream->size());
+        ++walk.run.files;
+    }
+
+    void RepoVerifier::verify_symlink(Walk& walk, const std::string& path)
+    {
+        std::string target(4096, '\0');
+        target.resize(root_.readlink(path, target.data(), target.size()));
+        if (!name_trans_.is_no_op())
+        {
+            name_trans_.decrypt_path_from_symlink(target);
+        }
+        ++walk.run.symlinks;
+    }
+}    // namespace lite_format
+}    // namespace securefs
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "file_table_v2.h"
+#include "files.h"
+#include "lite_format.h"
+#include "object.h"
+#include "parallel_walk.h"
+#include "platform.h"
+
+#include <fruit/macro.h>
+
+#include <string>
+#include <vector>
+
+namespace securefs
+{
+/// Checks the integrity of a whole repository without mounting it, by reading back everything
+/// with authentication enabled from a pool of threads. Problems are collected, not thrown.
+class RepoVerifier : public Object
+{
+public:
+    virtual WalkReport verify(const WalkOptions& options) = 0;
+};
+
+namespace full_format
+{
+    /// Walks the directory tree from the root, checking the header and the content of each
+    /// object, and the btree of each directory. The objects not reachable from the root, and the
+    /// link counts that disagree with the directory entries, are reported as well.
+    class RepoVerifier final : public ::securefs::RepoVerifier
+    {
+    public:
+        INJECT(RepoVerifier(OSService& root,
+                            FileTableIO& io,
+                            FileTable::Factory<RegularFile> regular_file_factory,
+                            FileTable::Factory<Directory> directory_factory,
+                            FileTable::Factory<Symlink> symlink_factory))
+            : root_(root)
+            , io_(io)
+            , regular_file_factory_(std::move(regular_file_factory))
+            , directory_factory_(std::move(directory_factory))
+            , symlink_factory_(std::move(symlink_factory))
+        {
+        }
+
+        WalkReport verify(const WalkOptions& options) override;
+
+    private:
+        struct Walk;
+
+        void verify_directory(Walk& walk, const id_type& id, const std::string& path);
+        void verify_file(Walk& walk, const id_type& id, int type, const std::string& path);
+
+    private:
+        OSService& root_;
+        FileTableIO& io_;
+        FileTable::Factory<RegularFile> regular_file_factory_;
+        FileTable::Factory<Directory> directory_factory_;
+        FileTable::Factory<Symlink> symlink_factory_;
+    };
+}    // namespace full_format
+
+namespace lite_format
+{
+    /// Walks the underlying directories, checking every name, every block of every file, every
+    /// symlink target, and that the long name table of each directory matches its entries.
+    class RepoVerifier final : public ::securefs::RepoVerifier
+    {
+    public:
+        INJECT(RepoVerifier(OSService& root, StreamOpener& opener, NameTranslator& name_trans))
+            : root_(root), opener_(opener), name_trans_(name_trans)
+        {
+        }
+
+        WalkReport verify(const WalkOptions& options) override;
+
+    private:
+        struct Walk;
+
+        void verify_directory(Walk& walk, const std::string& dir);
+        void verify_long_names(Walk& walk,
+                               const std::string& dir,
+                               const std::vector<std::string>& long_names,
+                               bool has_table);
+        void verify_file(Walk& walk, const std::string& path);
+        void verify_symlink(Walk& walk, const std::string& path);
+
+    private:
+        OSService& root_;
+        StreamOpener& opener_;
+        NameTranslator& name_trans_;
+    };
+}    // namespace lite_format
+}    // namespace securefs
@@ -0,0 +1,492 @@
+#include "stats_file_ops.h"
+#include "exceptions.h"
+#include "metrics.h"
+#include "stat_workaround.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+#ifdef ENOATTR
+    constexpr int kNoAttr = ENOATTR;
+#else
+    constexpr int kNoAttr = ENODATA;
+#endif
+
+    // Handles of the inner ops are pointers to objects, so they are even, while the made up files
+    // and directories get odd ones. Paths cannot tell them apart, as they are not computed for
+    // operations on handles.
+    struct VirtualHandle
+    {
+        // The snapshot for the stats file, or the listing for a directory.
+        std::string content;
+        std::vector<std::string> names;
+    };
+
+    bool is_virtual(const fuse_file_info* info) { return info && (info->fh & 1); }
+
+    VirtualHandle* get_handle(const fuse_file_info* info)
+    {
+        return reinterpret_cast<VirtualHandle*>(static_cast<uintptr_t>(info->fh & ~uint64_t(1)));
+    }
+
+    void set_handle(fuse_file_info* info, std::unique_ptr<VirtualHandle> handle)
+    {
+        info->fh = reinterpret_cast<uintptr_t>(handle.release()) | 1;
+    }
+}    // namespace
+
+StatsFileOps::StatsFileOps(FuseHighLevelOpsBase& inner, std::string_view stats_path)
+    : inner_(inner)
+{
+    std::vector<std::string_view> components = absl::StrSplit(stats_path, '/', absl::SkipEmpty());
+    if (!absl::StartsWith(stats_path, "/") || components.empty())
+    {
+        throwInvalidArgumentException(
+            "The path of the stats file must be absolute and below the root");
+    }
+    std::string parent = "/";
+    for (std::string_view c : components)
+    {
+        if (c == "." || c == "..")
+        {
+            throwInvalidArgumentException("The path of the stats file must be normalized");
+        }
+        std::string path = absl::StrCat(parent == "/" ? "" : parent, "/", c);
+        if (parent != "/")
+        {
+            directories_.emplace(parent, std::string(c));
+        }
+        parent = std::move(path);
+    }
+    stats_path_ = std::move(parent);
+}
+
+StatsFileOps::PathKind StatsFileOps::classify(const char* c_path) const
+{
+    if (!c_path)
+    {
+        return PathKind::kReal;
+    }
+    std::string_view path = c_path;
+    if (path == stats_path_)
+    {
+        return PathKind::kStatsFile;
+    }
+    if (directories_.contains(path))
+    {
+        return PathKind::kDirectory;
+    }
+    for (const auto& [dir, child] : directories_)
+    {
+        if (path.size() > dir.size() && absl::StartsWith(path, dir) && path[dir.size()] == '/')
+        {
+            return PathKind::kMissing;
+        }
+    }
+    if (path.size() > stats_path_.size() && absl::StartsWith(path, stats_path_)
+        && path[stats_path_.size()] == '/')
+    {
+        return PathKind::kMissing;
+    }
+    return PathKind::kReal;
+}
+
+void StatsFileOps::fill_stat(fuse_stat* st, bool directory)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = directory ? (S_IFDIR | 0555) : (S_IFREG | 0444);
+    st->st_nlink = directory ? 2 : 1;
+    st->st_uid = OSService::getuid();
+    st->st_gid = OSService::getgid();
+    // The size is unknown until the content is taken on open; reads are served with direct I/O.
+    st->st_size = 0;
+    fuse_timespec now;
+    OSService::get_current_time(now);
+    set_atim(*st, now);
+    set_mtim(*st, now);
+    set_ctim(*st, now);
+}
+
+void StatsFileOps::initialize(fuse_conn_info* info) { inner_.initialize(info); }
+
+int StatsFileOps::vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx)
+{
+    return inner_.vstatfs(path, buf, ctx);
+}
+
+int StatsFileOps::vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case PathKind::kStatsFile:
+        fill_stat(st, false);
+        return 0;
+    case PathKind::kDirectory:
+        fill_stat(st, true);
+        return 0;
+    case PathKind::kMissing:
+        return -ENOENT;
+    default:
+        return inner_.vgetattr(path, st, ctx);
+    }
+}
+
+int StatsFileOps::vfgetattr(const char* path,
+                            fuse_stat* st,
+                            fuse_file_info* info,
+                            const fuse_context* ctx)
+{
+    if (!is_virtual(info))
+    {
+        return inner_.vfgetattr(path, st, info, ctx);
+    }
+    const VirtualHandle& handle = *get_handle(info);
+    fill_stat(st, !handle.names.empty());
+    st->st_size = static_cast<fuse_off_t>(handle.content.size());
+    return 0;
+}
+
+int StatsFileOps::vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case PathKind::kStatsFile:
+        return -ENOTDIR;
+    case PathKind::kDirectory:
+    {
+        auto handle = std::make_unique<VirtualHandle>();
+        handle->names = {".", "..", directories_.find(path)->second};
+        set_handle(info, std::move(handle));
+        return 0;
+    }
+    case PathKind::kMissing:
+        return -ENOENT;
+    default:
+        return inner_.vopendir(path, info, ctx);
+    }
+}
+
+int StatsFileOps::vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        delete get_handle(info);
+        info->fh = 0;
+        return 0;
+    }
+    return inner_.vreleasedir(path, info, ctx);
+}
+
+int StatsFileOps::vreaddir(const char* path,
+                           void* buf,
+                           fuse_fill_dir_t filler,
+                           fuse_off_t off,
+                           fuse_file_info* info,
+                           const fuse_context* ctx)
+{
+    if (!is_virtual(info))
+    {
+        return inner_.vreaddir(path, buf, filler, off, info, ctx);
+    }
+    for (const std::string& name : get_handle(info)->names)
+    {
+        if (filler(buf, name.c_str(), nullptr, 0) != 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+int StatsFileOps::vcreate(const char* path,
+                          fuse_mode_t mode,
+                          fuse_file_info* info,
+                          const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vcreate(path, mode, info, ctx);
+}
+
+int StatsFileOps::vopen(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case PathKind::kStatsFile:
+        if ((info->flags & O_ACCMODE) != O_RDONLY)
+        {
+            return -EACCES;
+        }
+    {
+        auto handle = std::make_unique<VirtualHandle>();
+        handle->content = metrics::snapshot().to_json();
+        set_handle(info, std::move(handle));
+        info->direct_io = 1;
+        return 0;
+    }
+    case PathKind::kDirectory:
+        return -EISDIR;
+    case PathKind::kMissing:
+        return -ENOENT;
+    default:
+        return inner_.vopen(path, info, ctx);
+    }
+}
+
+int StatsFileOps::vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        delete get_handle(info);
+        info->fh = 0;
+        return 0;
+    }
+    return inner_.vrelease(path, info, ctx);
+}
+
+int StatsFileOps::vread(const char* path,
+                        char* buf,
+                        size_t size,
+                        fuse_off_t offset,
+                        fuse_file_info* info,
+                        const fuse_context* ctx)
+{
+    if (!is_virtual(info))
+    {
+        return inner_.vread(path, buf, size, offset, info, ctx);
+    }
+    const std::string& content = get_handle(info)->content;
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    if (static_cast<size_t>(offset) >= content.size())
+    {
+        return 0;
+    }
+    size = std::min(size, content.size() - static_cast<size_t>(offset));
+    memcpy(buf, content.data() + offset, size);
+    return static_cast<int>(size);
+}
+
+int StatsFileOps::vwrite(const char* path,
+                         const char* buf,
+                         size_t size,
+                         fuse_off_t offset,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        return -EBADF;
+    }
+    return inner_.vwrite(path, buf, size, offset, info, ctx);
+}
+
+int StatsFileOps::vflush(const char* path, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        return 0;
+    }
+    return inner_.vflush(path, info, ctx);
+}
+
+int StatsFileOps::vftruncate(const char* path,
+                             fuse_off_t len,
+                             fuse_file_info* info,
+                             const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        return -EBADF;
+    }
+    return inner_.vftruncate(path, len, info, ctx);
+}
+
+int StatsFileOps::vunlink(const char* path, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vunlink(path, ctx);
+}
+
+int StatsFileOps::vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vmkdir(path, mode, ctx);
+}
+
+int StatsFileOps::vrmdir(const char* path, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vrmdir(path, ctx);
+}
+
+int StatsFileOps::vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vchmod(path, mode, ctx);
+}
+
+int StatsFileOps::vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vchown(path, uid, gid, ctx);
+}
+
+int StatsFileOps::vsymlink(const char* to, const char* from, const fuse_context* ctx)
+{
+    if (classify(from) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vsymlink(to, from, ctx);
+}
+
+int StatsFileOps::vlink(const char* src, const char* dest, const fuse_context* ctx)
+{
+    if (classify(src) != PathKind::kReal || classify(dest) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vlink(src, dest, ctx);
+}
+
+int StatsFileOps::vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx)
+{
+    switch (classify(path))
+    {
+    case PathKind::kStatsFile:
+    case PathKind::kDirectory:
+        return -EINVAL;
+    case PathKind::kMissing:
+        return -ENOENT;
+    default:
+        return inner_.vreadlink(path, buf, size, ctx);
+    }
+}
+
+int StatsFileOps::vrename(const char* from, const char* to, const fuse_context* ctx)
+{
+    if (classify(from) != PathKind::kReal || classify(to) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vrename(from, to, ctx);
+}
+
+int StatsFileOps::vfsync(const char* path,
+                         int datasync,
+                         fuse_file_info* info,
+                         const fuse_context* ctx)
+{
+    if (is_virtual(info))
+    {
+        return 0;
+    }
+    return inner_.vfsync(path, datasync, info, ctx);
+}
+
+int StatsFileOps::vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vtruncate(path, len, ctx);
+}
+
+int StatsFileOps::vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vutimens(path, ts, ctx);
+}
+
+int StatsFileOps::vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return 0;
+    }
+    return inner_.vlistxattr(path, list, size, ctx);
+}
+
+int StatsFileOps::vgetxattr(const char* path,
+                            const char* name,
+                            char* value,
+                            size_t size,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -kNoAttr;
+    }
+    return inner_.vgetxattr(path, name, value, size, position, ctx);
+}
+
+int StatsFileOps::vsetxattr(const char* path,
+                            const char* name,
+                            const char* value,
+                            size_t size,
+                            int flags,
+                            uint32_t position,
+                            const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vsetxattr(path, name, value, size, flags, position, ctx);
+}
+
+int StatsFileOps::vremovexattr(const char* path, const char* name, const fuse_context* ctx)
+{
+    if (classify(path) != PathKind::kReal)
+    {
+        return -EACCES;
+    }
+    return inner_.vremovexattr(path, name, ctx);
+}
+
+int StatsFileOps::vgetpath(
+    const char* path, char* buf, size_t size, fuse_file_info* info, const fuse_context* ctx)
+{
+    if (is_virtual(info) || classify(path) != PathKind::kReal)
+    {
+        return -ENOSYS;
+    }
+    return inner_.vgetpath(path, buf, size, info, ctx);
+}
+}    // namespace securefs
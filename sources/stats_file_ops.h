@@ -0,0 +1,119 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+
+#include <absl/container/flat_hash_map.h>
+
+#include <string>
+#include <string_view>
+
+namespace securefs
+{
+/// Serves the metrics of the process in JSON as a read-only file at `stats_path` of the mount, and
+/// forwards everything else to `inner`. The directories leading to the file exist only for the
+/// lookups of the path, and are never listed in their parents. Real files at those paths are
+/// shadowed.
+///
+/// The content is taken once when the file is opened, so a reader sees a consistent snapshot.
+class StatsFileOps final : public FuseHighLevelOpsBase
+{
+public:
+    /// `stats_path` must be absolute and must not be the root.
+    StatsFileOps(FuseHighLevelOpsBase& inner, std::string_view stats_path);
+
+    void initialize(fuse_conn_info* info) override;
+    int vstatfs(const char* path, fuse_statvfs* buf, const fuse_context* ctx) override;
+    int vgetattr(const char* path, fuse_stat* st, const fuse_context* ctx) override;
+    int vfgetattr(const char* path,
+                  fuse_stat* st,
+                  fuse_file_info* info,
+                  const fuse_context* ctx) override;
+    int vopendir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreleasedir(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vreaddir(const char* path,
+                 void* buf,
+                 fuse_fill_dir_t filler,
+                 fuse_off_t off,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+    int vcreate(const char* path,
+                fuse_mode_t mode,
+                fuse_file_info* info,
+                const fuse_context* ctx) override;
+    int vopen(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vrelease(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vread(const char* path,
+              char* buf,
+              size_t size,
+              fuse_off_t offset,
+              fuse_file_info* info,
+              const fuse_context* ctx) override;
+    int vwrite(const char* path,
+               const char* buf,
+               size_t size,
+               fuse_off_t offset,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vflush(const char* path, fuse_file_info* info, const fuse_context* ctx) override;
+    int vftruncate(const char* path,
+                   fuse_off_t len,
+                   fuse_file_info* info,
+                   const fuse_context* ctx) override;
+    int vunlink(const char* path, const fuse_context* ctx) override;
+    int vmkdir(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vrmdir(const char* path, const fuse_context* ctx) override;
+    int vchmod(const char* path, fuse_mode_t mode, const fuse_context* ctx) override;
+    int vchown(const char* path, fuse_uid_t uid, fuse_gid_t gid, const fuse_context* ctx) override;
+    int vsymlink(const char* to, const char* from, const fuse_context* ctx) override;
+    int vlink(const char* src, const char* dest, const fuse_context* ctx) override;
+    int vreadlink(const char* path, char* buf, size_t size, const fuse_context* ctx) override;
+    int vrename(const char* from, const char* to, const fuse_context* ctx) override;
+    int vfsync(const char* path,
+               int datasync,
+               fuse_file_info* info,
+               const fuse_context* ctx) override;
+    int vtruncate(const char* path, fuse_off_t len, const fuse_context* ctx) override;
+    int vutimens(const char* path, const fuse_timespec* ts, const fuse_context* ctx) override;
+    int vlistxattr(const char* path, char* list, size_t size, const fuse_context* ctx) override;
+    int vgetxattr(const char* path,
+                  const char* name,
+                  char* value,
+                  size_t size,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vsetxattr(const char* path,
+                  const char* name,
+                  const char* value,
+                  size_t size,
+                  int flags,
+                  uint32_t position,
+                  const fuse_context* ctx) override;
+    int vremovexattr(const char* path, const char* name, const fuse_context* ctx) override;
+    bool has_getpath() const override { return inner_.has_getpath(); }
+    int vgetpath(const char* path,
+                 char* buf,
+                 size_t size,
+                 fuse_file_info* info,
+                 const fuse_context* ctx) override;
+
+private:
+    enum class PathKind
+    {
+        kReal,
+        kStatsFile,
+        kDirectory,
+        // Anything else below a made up directory, which does not exist.
+        kMissing,
+    };
+
+    /// Null paths, which FUSE passes for operations on handles, are real.
+    PathKind classify(const char* path) const;
+    static void fill_stat(fuse_stat* st, bool directory);
+
+private:
+    FuseHighLevelOpsBase& inner_;
+    std::string stats_path_;
+    // Each made up directory and the only name within it.
+    absl::flat_hash_map<std::string, std::string> directories_;
+};
+}    // namespace securefs
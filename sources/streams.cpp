@@ -1,4 +1,5 @@
 #include "streams.h"
+#include "aead_engine.h"
 #include "crypto.h"
 #include "exceptions.h"
 #include "myutils.h"
@@ -318,8 +319,7 @@ namespace internal
         static const int64_t max_block_number = 1 << 30;
 
     private:
-        CryptoPP::GCM<CryptoPP::AES>::Encryption m_enc;
-        CryptoPP::GCM<CryptoPP::AES>::Decryption m_dec;
+        std::shared_ptr<AeadEngine> m_gcm;
         std::shared_ptr<StreamBase> m_stream;
         HMACStream m_metastream;
         id_type m_id;
@@ -350,8 +350,11 @@ namespace internal
                                    bool check,
                                    unsigned block_size,
                                    unsigned iv_size,
-                                   unsigned header_size)
+                                   unsigned header_size,
+                                   std::shared_ptr<AeadEngine> gcm)
             : BlockBasedStream(block_size)
+            , m_gcm(gcm ? std::move(gcm)
+                        : make_aes_gcm_engine(data_key.data(), data_key.size(), iv_size))
             , m_stream(std::move(data_stream))
             , m_metastream(meta_key, id_, std::move(meta_stream), check)
             , m_id(id_)
@@ -359,9 +362,6 @@ namespace internal
             , m_header_size(header_size)
             , m_check(check)
         {
-            const byte null_iv[12] = {};
-            m_enc.SetKeyWithIV(data_key.data(), data_key.size(), null_iv, array_length(null_iv));
-            m_dec.SetKeyWithIV(data_key.data(), data_key.size(), null_iv, array_length(null_iv));
             warn_if_key_not_random(data_key, __FILE__, __LINE__);
             warn_if_key_not_random(meta_key, __FILE__, __LINE__);
         }
@@ -379,6 +379,8 @@ namespace internal
             auto* data_buffer = buffer.data();
             auto data_buffer_size = m_block_size * (end_block - start_block) + end_residue;
             auto* meta_buffer = buffer.data() + data_buffer_size;
+            std::vector<GCMMessage> messages;
+            messages.reserve(end_block - start_block + 1);
             for (length_type i = 0; i < data_buffer_size;)
             {
                 assert(data_buffer <= buffer.data() + data_buffer_size);
@@ -386,25 +388,24 @@ namespace internal
                 assert(meta_buffer <= buffer.data() + buffer.size());
                 do
                 {
-                    generate_random(meta_buffer, get_iv_size());
+                    generate_iv(meta_buffer, get_iv_size());
                 } while (is_all_zeros(meta_buffer, get_iv_size()));
                 auto this_block_size = std::min(m_block_size, data_buffer_size - i);
                 assert(data_buffer + this_block_size <= buffer.data() + buffer.size());
                 assert(meta_buffer + get_meta_size() <= buffer.data() + buffer.size());
-                m_enc.EncryptAndAuthenticate(data_buffer,
-                                             meta_buffer + get_iv_size(),
-                                             get_mac_size(),
-                                             meta_buffer,
-                                             static_cast<int>(get_iv_size()),
-                                             id().data(),
-                                             id().size(),
-                                             static_cast<const byte*>(input),
-                                             this_block_size);
+                messages.push_back(GCMMessage{meta_buffer,
+                                              id().data(),
+                                              id().size(),
+                                              static_cast<const byte*>(input),
+                                              data_buffer,
+                                              this_block_size,
+                                              meta_buffer + get_iv_size()});
                 data_buffer += this_block_size;
                 meta_buffer += get_meta_size();
                 input = static_cast<const byte*>(input) + this_block_size;
                 i += this_block_size;
             }
+            m_gcm->encrypt(messages);
             m_stream->write(buffer.data(), start_block * m_block_size, data_buffer_size);
             m_metastream.write(buffer.data() + data_buffer_size,
                                meta_position_for_iv(start_block),
@@ -437,6 +438,9 @@ namespace internal
             }
             memset(output, 0, data_buffer_size);
 
+            auto* output_start = static_cast<byte*>(output);
+            std::vector<GCMMessage> messages;
+            messages.reserve(end_block - start_block);
             for (length_type i = 0; i < data_read_len;)
             {
                 auto this_block_size = std::min(m_block_size, data_read_len - i);
@@ -451,19 +455,19 @@ namespace internal
                 {
                     continue;
                 }
-                bool success = m_dec.DecryptAndVerify(static_cast<byte*>(output),
-                                                      meta_buffer + get_iv_size(),
-                                                      get_mac_size(),
-                                                      meta_buffer,
-                                                      static_cast<int>(get_iv_size()),
-                                                      id().data(),
-                                                      id().size(),
-                                                      data_buffer,
-                                                      this_block_size);
-                if (!success & m_check)
-                {
-                    throw MessageVerificationException(id(), i + start_block * m_block_size);
-                }
+                messages.push_back(GCMMessage{meta_buffer,
+                                              id().data(),
+                                              id().size(),
+                                              data_buffer,
+                                              static_cast<byte*>(output),
+                                              this_block_size,
+                                              meta_buffer + get_iv_size()});
+            }
+            auto failed = m_gcm->decrypt(messages);
+            if (failed != messages.size() && m_check)
+            {
+                throw MessageVerificationException(
+                    id(), start_block * m_block_size + (messages[failed].output - output_start));
             }
             return data_read_len;
         }
@@ -502,15 +506,14 @@ namespace internal
             byte* iv = buffer.get();
             byte* mac = iv + get_iv_size();
             byte* ciphertext = mac + get_mac_size();
-            m_dec.DecryptAndVerify(static_cast<byte*>(output),
-                                   mac,
-                                   get_mac_size(),
-                                   iv,
-                                   get_iv_size(),
-                                   id().data(),
-                                   id().size(),
-                                   ciphertext,
-                                   get_header_size());
+            GCMMessage message{iv,
+                               id().data(),
+                               id().size(),
+                               ciphertext,
+                               static_cast<byte*>(output),
+                               get_header_size(),
+                               mac};
+            m_gcm->decrypt({&message, 1});
             return get_header_size();
         }
 
@@ -520,17 +523,16 @@ namespace internal
             byte* iv = buffer.get();
             byte* mac = iv + get_iv_size();
             byte* ciphertext = mac + get_mac_size();
-            generate_random(iv, get_iv_size());
-
-            m_enc.EncryptAndAuthenticate(ciphertext,
-                                         mac,
-                                         get_mac_size(),
-                                         iv,
-                                         get_iv_size(),
-                                         id().data(),
-                                         id().size(),
-                                         static_cast<const byte*>(input),
-                                         get_header_size());
+            generate_iv(iv, get_iv_size());
+
+            GCMMessage message{iv,
+                               id().data(),
+                               id().size(),
+                               static_cast<const byte*>(input),
+                               ciphertext,
+                               get_header_size(),
+                               mac};
+            m_gcm->encrypt({&message, 1});
             m_metastream.write(buffer.get(), 0, get_encrypted_header_size());
         }
 
@@ -577,7 +579,8 @@ make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
                          bool check,
                          unsigned block_size,
                          unsigned iv_size,
-                         unsigned header_size)
+                         unsigned header_size,
+                         std::shared_ptr<AeadEngine> gcm)
 {
     auto stream = std::make_shared<internal::AESGCMCryptStream>(std::move(data_stream),
                                                                 std::move(meta_stream),
@@ -587,7 +590,8 @@ make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
                                                                 check,
                                                                 block_size,
                                                                 iv_size,
-                                                                header_size);
+                                                                header_size,
+                                                                std::move(gcm));
     return {stream, stream};
 }
 
@@ -10,6 +10,7 @@
 
 namespace securefs
 {
+class AeadEngine;
 
 /**
  * Base classes for byte streams.
@@ -134,6 +135,9 @@ public:
  *
  * Returns a pair because the client does not need to know whether the two interfaces are
  * implemented by the same class.
+ *
+ * `gcm`, if given, must be keyed with `data_key` and `iv_size`. It saves the key schedule when the
+ * caller keeps contexts around, but must not be used by anyone else while the stream is alive.
  */
 std::pair<std::shared_ptr<StreamBase>, std::shared_ptr<HeaderBase>>
 make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
@@ -144,7 +148,8 @@ make_cryptstream_aes_gcm(std::shared_ptr<StreamBase> data_stream,
                          bool check,
                          unsigned block_size,
                          unsigned iv_size,
-                         unsigned header_size = 32);
+                         unsigned header_size = 32,
+                         std::shared_ptr<AeadEngine> gcm = nullptr);
 
 class PaddedStream final : public StreamBase
 {
@@ -41,4 +41,19 @@ struct tLongNameThreshold
 struct tCaseInsensitive
 {
 };
+struct tReadAheadBlocks
+{
+};
+struct tWriteBehindLimit
+{
+};
+struct tFsyncWindow
+{
+};
+struct tAttrCacheTimeout
+{
+};
+struct tKeepCache
+{
+};
 }    // namespace securefs
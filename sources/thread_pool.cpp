@@ -0,0 +1,69 @@
+#include "thread_pool.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+
+#include <utility>
+
+namespace securefs
+{
+ThreadPool::ThreadPool(unsigned num_threads)
+{
+    if (num_threads <= 0)
+    {
+        num_threads = 1;
+    }
+    workers_.reserve(num_threads);
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        workers_.emplace_back([this]() { worker_loop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        LockGuard<absl::Mutex> lg(mu_);
+        stopping_ = true;
+    }
+    for (auto&& w : workers_)
+    {
+        w.join();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    tasks_.emplace_back(std::move(task));
+}
+
+void ThreadPool::worker_loop()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            mu_.Await(absl::Condition(this, &ThreadPool::has_work_or_stopping));
+            if (tasks_.empty())
+            {
+                // Only reachable when stopping.
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            WARN_LOG("Background task failed with exception %s: %s",
+                     get_type_name(e).get(),
+                     e.what());
+        }
+    }
+}
+}    // namespace securefs
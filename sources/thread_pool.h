@@ -0,0 +1,41 @@
+#pragma once
+
+#include "object.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+
+#include <deque>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+/// A fixed size pool of worker threads for background work such as prefetching.
+///
+/// Tasks must not throw; exceptions escaping from a task are logged and swallowed.
+class ThreadPool final : public Object
+{
+public:
+    explicit ThreadPool(unsigned num_threads);
+    ~ThreadPool() override;
+
+    void submit(std::function<void()> task);
+
+    unsigned num_threads() const noexcept { return static_cast<unsigned>(workers_.size()); }
+
+private:
+    void worker_loop();
+    bool has_work_or_stopping() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    {
+        return stopping_ || !tasks_.empty();
+    }
+
+private:
+    absl::Mutex mu_;
+    std::deque<std::function<void()>> tasks_ ABSL_GUARDED_BY(mu_);
+    bool stopping_ ABSL_GUARDED_BY(mu_) = false;
+    std::vector<std::thread> workers_;
+};
+}    // namespace securefs
@@ -0,0 +1,165 @@
+#include "trace_recorder.h"
+#include "crypto.h"
+#include "exceptions.h"
+#include "logger.h"
+
+#include <absl/time/time.h>
+#include <cryptopp/blake2.h>
+#include <cryptopp/misc.h>
+
+#include <cstring>
+
+namespace securefs::trace
+{
+namespace
+{
+    constexpr char kTraceMagic[8] = {'S', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+    constexpr uint32_t kTraceVersion = 1;
+
+    struct TraceFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+    };
+
+    static_assert(sizeof(TraceFileHeader) == 16);
+
+    // Records are batched into writes of this many.
+    constexpr size_t kDrainBatch = 1024;
+
+    uint32_t current_thread_number()
+    {
+        static std::atomic<uint32_t> next{1};
+        static thread_local uint32_t number = next.fetch_add(1, std::memory_order_relaxed);
+        return number;
+    }
+}    // namespace
+
+TraceRecorder::TraceRecorder(const std::string& path, size_t capacity)
+    : m_queue(capacity), m_start(std::chrono::steady_clock::now())
+{
+    generate_random(m_path_key.data(), m_path_key.size());
+    m_file = OSService::get_default().open_file_stream(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    TraceFileHeader header{};
+    memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.version = kTraceVersion;
+    header.record_size = sizeof(TraceRecord);
+    m_file->write(&header, 0, sizeof(header));
+    m_file_offset = sizeof(header);
+
+    TraceRecorder* expected = nullptr;
+    if (!s_active.compare_exchange_strong(expected, this, std::memory_order_acq_rel))
+    {
+        throw_runtime_error("Only one trace can be recorded at a time");
+    }
+    m_writer = std::thread([this]() { run(); });
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    s_active.store(nullptr, std::memory_order_release);
+    m_stop.Notify();
+    m_writer.join();
+    CryptoPP::SecureWipeBuffer(m_path_key.data(), m_path_key.size());
+    if (auto dropped = this->dropped(); dropped > 0)
+    {
+        WARN_LOG("%d records were dropped from the trace because the disk could not keep up",
+                 dropped);
+    }
+}
+
+uint64_t TraceRecorder::hash_path(std::string_view path) const noexcept
+{
+    if (path == "/")
+    {
+        return kRootPathHash;
+    }
+    // Unkeyed, a hash of a path could be reversed by hashing the likely names.
+    CryptoPP::BLAKE2b blake(
+        m_path_key.data(), m_path_key.size(), nullptr, 0, nullptr, 0, false, sizeof(uint64_t));
+    blake.Update(reinterpret_cast<const byte*>(path.data()), path.size());
+    uint64_t hash;
+    blake.TruncatedFinal(reinterpret_cast<byte*>(&hash), sizeof(hash));
+    return hash <= kRootPathHash ? kRootPathHash + 1 : hash;
+}
+
+void TraceRecorder::record(TraceRecord& record,
+                           std::chrono::steady_clock::time_point start) noexcept
+{
+    record.start_ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_start).count());
+    record.thread = current_thread_number();
+
+    if (!m_queue.try_push(record))
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void TraceRecorder::run()
+{
+    while (!m_stop.WaitForNotificationWithTimeout(absl::Milliseconds(100)))
+    {
+        drain();
+    }
+    drain();
+    m_file->flush();
+}
+
+void TraceRecorder::drain()
+{
+    std::vector<TraceRecord> batch;
+    batch.reserve(kDrainBatch);
+    while (true)
+    {
+        while (batch.size() < kDrainBatch
+               && m_queue.try_pop([&](const TraceRecord& r) { batch.push_back(r); }))
+        {
+        }
+        if (batch.empty())
+        {
+            return;
+        }
+        try
+        {
+            m_file->write(batch.data(), m_file_offset, batch.size() * sizeof(TraceRecord));
+            m_file_offset += batch.size() * sizeof(TraceRecord);
+        }
+        catch (const std::exception& e)
+        {
+            m_dropped.fetch_add(batch.size(), std::memory_order_relaxed);
+            ERROR_LOG("Failed to write the trace: %s", e.what());
+        }
+        bool full_batch = batch.size() == kDrainBatch;
+        batch.clear();
+        if (!full_batch)
+        {
+            return;
+        }
+    }
+}
+
+std::vector<TraceRecord> read_trace_file(const std::string& path)
+{
+    auto stream = OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+    TraceFileHeader header{};
+    if (stream->read(&header, 0, sizeof(header)) != sizeof(header)
+        || memcmp(header.magic, kTraceMagic, sizeof(kTraceMagic)) != 0)
+    {
+        throw_runtime_error(path + " is not a securefs trace");
+    }
+    if (header.version != kTraceVersion || header.record_size != sizeof(TraceRecord))
+    {
+        throw_runtime_error(path + " is a trace of another version or byte order");
+    }
+    auto count = (stream->size() - sizeof(header)) / sizeof(TraceRecord);
+    std::vector<TraceRecord> records(count);
+    if (stream->read(records.data(), sizeof(header), count * sizeof(TraceRecord))
+        != count * sizeof(TraceRecord))
+    {
+        throw_runtime_error(path + " was truncated while being read");
+    }
+    return records;
+}
+}    // namespace securefs::trace
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "metrics.h"
+#include "mpsc_queue.h"
+#include "myutils.h"
+#include "platform.h"
+
+#include <absl/synchronization/notification.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+/// One call into the filesystem in a binary trace. Paths are kept only as hashes, keyed with a
+/// random key that is never written out, so that a trace shows the shape of a workload but not the
+/// names within it, not even to someone who can guess them.
+struct TraceRecord
+{
+    // Since the start of the recording, in nanoseconds.
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    // Zero when there is no path, as for operations on handles.
+    uint64_t path_hash;
+    // The second path of rename, link and symlink (the target), or the name of an xattr.
+    uint64_t path2_hash;
+    // The file handle after the call, which identifies the file of operations without a path.
+    uint64_t handle;
+    int64_t offset;
+    // The size of reads, writes and xattrs, the length of truncations, or the mode of creations.
+    uint64_t size;
+    // Numbered from 1 in the order in which the threads first make a call.
+    uint32_t thread;
+    // The open flags, the flags of setxattr, or the datasync argument of fsync.
+    int32_t flags;
+    int32_t result;
+    uint8_t op;
+    uint8_t reserved[3];
+
+    FuseOp fuse_op() const noexcept { return static_cast<FuseOp>(op); }
+};
+
+static_assert(sizeof(TraceRecord) == 72, "The layout is part of the trace file format");
+
+/// The hash of the root directory, the same in every trace so that replays can tell it apart.
+inline constexpr uint64_t kRootPathHash = 1;
+
+/// Appends records to a trace file. Recording goes through a fixed size lock-free ring, which a
+/// background thread drains to the file, so that the calls being traced never wait for the disk.
+/// Records that arrive while the ring is full are dropped and counted.
+///
+/// While alive, the recorder is the one that `FuseTracer` feeds. It must be destroyed only after
+/// the calls being traced have finished, such as after unmounting.
+///
+/// The file starts with a 16 byte header, followed by the records in native byte order.
+class TraceRecorder
+{
+public:
+    /// `capacity` is rounded up to a power of two.
+    explicit TraceRecorder(const std::string& path, size_t capacity = 1 << 16);
+    ~TraceRecorder();
+    DISABLE_COPY_MOVE(TraceRecorder)
+
+    static TraceRecorder* active() noexcept { return s_active.load(std::memory_order_acquire); }
+
+    /// Fills in the start time and the thread of `record`. Never blocks.
+    void record(TraceRecord& record, std::chrono::steady_clock::time_point start) noexcept;
+
+    uint64_t dropped() const noexcept { return m_dropped.load(std::memory_order_relaxed); }
+
+    /// Keyed with the key of this recording, so equal paths have equal hashes only within one
+    /// trace. Never returns zero, nor `kRootPathHash` for any path but the root.
+    uint64_t hash_path(std::string_view path) const noexcept;
+
+private:
+    static inline std::atomic<TraceRecorder*> s_active{nullptr};
+
+    BoundedMpscQueue<TraceRecord> m_queue;
+    alignas(64) std::atomic<uint64_t> m_dropped{0};
+    // Only touched by the writer thread.
+    offset_type m_file_offset = 0;
+    std::shared_ptr<FileStream> m_file;
+    std::chrono::steady_clock::time_point m_start;
+    std::array<unsigned char, 32> m_path_key;
+    absl::Notification m_stop;
+    std::thread m_writer;
+
+    void run();
+    void drain();
+};
+
+/// Throws if the file is not a trace of the same version.
+std::vector<TraceRecord> read_trace_file(const std::string& path);
+}    // namespace securefs::trace
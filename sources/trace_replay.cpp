@@ -0,0 +1,681 @@
+#include "trace_replay.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/container/flat_hash_set.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/synchronization/mutex.h>
+#include <absl/synchronization/notification.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <map>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace securefs::trace
+{
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    constexpr double kNanosPerMicro = 1000.0;
+
+    // Every call reads and writes at most this many bytes, whatever the trace says.
+    constexpr uint64_t kMaxReplayedSize = 16 << 20;
+
+    std::string replay_path(uint64_t hash)
+    {
+        return hash == kRootPathHash ? "/" : absl::StrFormat("/%016x", hash);
+    }
+
+    std::string replay_xattr_name(uint64_t hash) { return absl::StrFormat("user.%016x", hash); }
+
+    int check(int rc, const char* op_name, const std::string& path)
+    {
+        if (rc < 0)
+        {
+            THROW_POSIX_EXCEPTION(-rc, absl::StrCat(op_name, " ", path));
+        }
+        return rc;
+    }
+
+    bool creates_path(FuseOp op)
+    {
+        return op == FuseOp::kCreate || op == FuseOp::kMkdir || op == FuseOp::kSymlink;
+    }
+
+    // What has to exist before the timed part of the replay, as the trace used it without creating
+    // it first.
+    struct Prerequisites
+    {
+        std::vector<uint64_t> directories;
+        std::vector<uint64_t> symlinks;
+        // With their sizes.
+        std::vector<std::pair<uint64_t, uint64_t>> files;
+    };
+
+    // `records` must be sorted by their start.
+    Prerequisites find_prerequisites(const std::vector<TraceRecord>& records)
+    {
+        absl::flat_hash_map<uint64_t, uint64_t> handle_paths;
+        absl::flat_hash_set<uint64_t> seen, directories, symlinks;
+        std::vector<uint64_t> preexisting;
+        absl::flat_hash_map<uint64_t, uint64_t> extents;
+
+        auto use = [&](uint64_t hash, bool creates, bool succeeded)
+        {
+            if (hash != 0 && seen.insert(hash).second && !creates && succeeded)
+            {
+                preexisting.push_back(hash);
+            }
+        };
+
+        for (const TraceRecord& r : records)
+        {
+            FuseOp op = r.fuse_op();
+            bool succeeded = r.result >= 0;
+            uint64_t path = r.path_hash;
+            if (path == 0)
+            {
+                auto it = handle_paths.find(r.handle);
+                path = it == handle_paths.end() ? 0 : it->second;
+            }
+            use(path, creates_path(op), succeeded);
+            if (op == FuseOp::kRename || op == FuseOp::kLink)
+            {
+                use(r.path2_hash, true, succeeded);
+            }
+            if (path == 0)
+            {
+                continue;
+            }
+            switch (op)
+            {
+            case FuseOp::kOpen:
+            case FuseOp::kCreate:
+                if (succeeded)
+                {
+                    handle_paths[r.handle] = path;
+                }
+                break;
+            case FuseOp::kOpendir:
+                if (succeeded)
+                {
+                    handle_paths[r.handle] = path;
+                }
+                directories.insert(path);
+                break;
+            case FuseOp::kReaddir:
+            case FuseOp::kMkdir:
+            case FuseOp::kRmdir:
+                directories.insert(path);
+                break;
+            case FuseOp::kReadlink:
+                symlinks.insert(path);
+                break;
+            case FuseOp::kRead:
+            case FuseOp::kWrite:
+            {
+                auto end = static_cast<uint64_t>(std::max<int64_t>(r.offset, 0))
+                    + std::min(r.size, kMaxReplayedSize);
+                auto& extent = extents[path];
+                extent = std::max(extent, end);
+                break;
+            }
+            case FuseOp::kTruncate:
+            case FuseOp::kFtruncate:
+            {
+                auto& extent = extents[path];
+                extent = std::max(extent, r.size);
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        Prerequisites result;
+        for (uint64_t hash : preexisting)
+        {
+            if (hash == kRootPathHash)
+            {
+                continue;
+            }
+            if (directories.contains(hash))
+            {
+                result.directories.push_back(hash);
+            }
+            else if (symlinks.contains(hash))
+            {
+                result.symlinks.push_back(hash);
+            }
+            else
+            {
+                auto it = extents.find(hash);
+                result.files.emplace_back(hash, it == extents.end() ? 0 : it->second);
+            }
+        }
+        return result;
+    }
+
+    void create_prerequisites(FuseHighLevelOpsBase& ops,
+                              const Prerequisites& prerequisites,
+                              const fuse_context& ctx)
+    {
+        for (uint64_t hash : prerequisites.directories)
+        {
+            auto path = replay_path(hash);
+            check(ops.vmkdir(path.c_str(), 0755, &ctx), "mkdir", path);
+        }
+        for (uint64_t hash : prerequisites.symlinks)
+        {
+            auto path = replay_path(hash);
+            check(ops.vsymlink("/", path.c_str(), &ctx), "symlink", path);
+        }
+        for (auto [hash, size] : prerequisites.files)
+        {
+            auto path = replay_path(hash);
+            fuse_file_info info{};
+            info.flags = O_RDWR;
+            check(ops.vcreate(path.c_str(), 0644, &info, &ctx), "create", path);
+            if (size > 0)
+            {
+                check(ops.vftruncate(path.c_str(), static_cast<fuse_off_t>(size), &info, &ctx),
+                      "ftruncate",
+                      path);
+            }
+            check(ops.vrelease(path.c_str(), &info, &ctx), "release", path);
+        }
+    }
+
+    // From the handles of the trace to those of the replay, shared by all threads since a handle
+    // may be opened by one thread and used by another. A recorded handle may stand for several
+    // opens at once, as the full format gives every open of a file the same handle, so each keeps
+    // the replayed handles of all its opens that are not yet released.
+    class HandleTable
+    {
+    public:
+        void put(uint64_t recorded, const fuse_file_info& info, bool directory, std::string path)
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            handles_[recorded].push_back(OpenHandle{info, directory, std::move(path)});
+        }
+        // The most recently opened of those under `recorded`.
+        std::optional<fuse_file_info> get(uint64_t recorded)
+        {
+            LockGuard<absl::Mutex> lg(mu_, false);
+            auto it = handles_.find(recorded);
+            if (it == handles_.end())
+            {
+                return std::nullopt;
+            }
+            return it->second.back().info;
+        }
+        // Removes one of the handles under `recorded`, for the caller to release.
+        std::optional<fuse_file_info> take(uint64_t recorded)
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            auto it = handles_.find(recorded);
+            if (it == handles_.end())
+            {
+                return std::nullopt;
+            }
+            auto info = it->second.back().info;
+            it->second.pop_back();
+            if (it->second.empty())
+            {
+                handles_.erase(it);
+            }
+            return info;
+        }
+
+        // Releases the handles that the trace never released, such as those still open when the
+        // recording stopped.
+        void release_all(FuseHighLevelOpsBase& ops, const fuse_context& ctx)
+        {
+            LockGuard<absl::Mutex> lg(mu_);
+            for (auto& [recorded, opens] : handles_)
+            {
+                for (auto& handle : opens)
+                {
+                    const char* path = handle.path.empty() ? nullptr : handle.path.c_str();
+                    int rc = handle.directory ? ops.vreleasedir(path, &handle.info, &ctx)
+                                              : ops.vrelease(path, &handle.info, &ctx);
+                    if (rc < 0)
+                    {
+                        WARN_LOG("Failed to release %s at the end of the replay: %d",
+                                 handle.path,
+                                 rc);
+                    }
+                }
+            }
+            handles_.clear();
+        }
+
+    private:
+        struct OpenHandle
+        {
+            fuse_file_info info;
+            bool directory;
+            std::string path;
+        };
+
+        absl::Mutex mu_;
+        absl::flat_hash_map<uint64_t, std::vector<OpenHandle>> handles_ ABSL_GUARDED_BY(mu_);
+    };
+
+    class ReplayWorker
+    {
+    public:
+        ReplayWorker(FuseHighLevelOpsBase& ops, HandleTable& handles, const fuse_context& ctx)
+            : ops_(ops), handles_(handles), ctx_(ctx)
+        {
+        }
+
+        void add(const TraceRecord& record) { records_.push_back(&record); }
+
+        void run(Clock::time_point start, double speed)
+        {
+            for (const TraceRecord* r : records_)
+            {
+                if (speed > 0)
+                {
+                    auto scheduled = start
+                        + std::chrono::nanoseconds(static_cast<int64_t>(r->start_ns / speed));
+                    std::this_thread::sleep_until(scheduled);
+                    auto late = Clock::now() - scheduled;
+                    lag_.record(static_cast<uint64_t>(std::max<int64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(late).count(), 0)));
+                }
+                auto call_start = Clock::now();
+                std::optional<int> rc;
+                try
+                {
+                    rc = execute(*r);
+                }
+                catch (const ExceptionBase& e)
+                {
+                    rc = -e.error_number();
+                }
+                catch (const std::exception& e)
+                {
+                    WARN_LOG("Replaying %s threw %s", stringify(r->fuse_op()), e.what());
+                    rc = -EIO;
+                }
+                auto elapsed = Clock::now() - call_start;
+                if (!rc.has_value())
+                {
+                    ++skipped_;
+                    continue;
+                }
+                FuseOpMetrics& m = per_op_[r->op];
+                ++m.calls;
+                m.errors += *rc < 0;
+                m.latency.record(static_cast<uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+                mismatched_ += (*rc < 0) != (r->result < 0);
+            }
+        }
+
+        void merge_into(ReplayReport& report) const
+        {
+            report.skipped += skipped_;
+            report.mismatched += mismatched_;
+            report.lag.merge(lag_);
+            for (size_t i = 0; i < kNumFuseOps; ++i)
+            {
+                report.ops += per_op_[i].calls;
+                report.per_op[i].calls += per_op_[i].calls;
+                report.per_op[i].errors += per_op_[i].errors;
+                report.per_op[i].latency.merge(per_op_[i].latency);
+            }
+        }
+
+    private:
+        FuseHighLevelOpsBase& ops_;
+        HandleTable& handles_;
+        fuse_context ctx_;
+        std::vector<const TraceRecord*> records_;
+        std::vector<char> buffer_;
+        uint64_t skipped_ = 0, mismatched_ = 0;
+        LatencyHistogram lag_;
+        std::array<FuseOpMetrics, kNumFuseOps> per_op_;
+
+        char* buffer(uint64_t size)
+        {
+            buffer_.resize(std::max<size_t>(std::min(size, kMaxReplayedSize), 1));
+            return buffer_.data();
+        }
+
+        // Returns nothing if the call is skipped.
+        std::optional<int> execute(const TraceRecord& r)
+        {
+            auto path_str = replay_path(r.path_hash);
+            const char* path = r.path_hash == 0 ? nullptr : path_str.c_str();
+            auto path2 = replay_path(r.path2_hash);
+            auto size = std::min(r.size, kMaxReplayedSize);
+            auto offset = static_cast<fuse_off_t>(r.offset);
+
+            switch (r.fuse_op())
+            {
+            case FuseOp::kStatfs:
+            {
+                fuse_statvfs buf{};
+                return ops_.vstatfs("/", &buf, &ctx_);
+            }
+            case FuseOp::kGetattr:
+            {
+                fuse_stat st{};
+                return ops_.vgetattr(path, &st, &ctx_);
+            }
+            case FuseOp::kOpendir:
+            case FuseOp::kOpen:
+            case FuseOp::kCreate:
+            {
+                fuse_file_info info{};
+                info.flags = r.flags;
+                int rc;
+                if (r.fuse_op() == FuseOp::kOpendir)
+                {
+                    rc = ops_.vopendir(path, &info, &ctx_);
+                }
+                else if (r.fuse_op() == FuseOp::kOpen)
+                {
+                    rc = ops_.vopen(path, &info, &ctx_);
+                }
+                else
+                {
+                    rc = ops_.vcreate(path, static_cast<fuse_mode_t>(r.size), &info, &ctx_);
+                }
+                if (rc == 0 && r.result == 0)
+                {
+                    handles_.put(r.handle,
+                                 info,
+                                 r.fuse_op() == FuseOp::kOpendir,
+                                 path ? path_str : std::string());
+                }
+                else if (rc == 0)
+                {
+                    // Failed in the trace, so nothing later refers to the handle.
+                    r.fuse_op() == FuseOp::kOpendir ? ops_.vreleasedir(path, &info, &ctx_)
+                                                    : ops_.vrelease(path, &info, &ctx_);
+                }
+                return rc;
+            }
+            case FuseOp::kUnlink:
+                return ops_.vunlink(path, &ctx_);
+            case FuseOp::kMkdir:
+                return ops_.vmkdir(path, static_cast<fuse_mode_t>(r.size), &ctx_);
+            case FuseOp::kRmdir:
+                return ops_.vrmdir(path, &ctx_);
+            case FuseOp::kChmod:
+                return ops_.vchmod(path, static_cast<fuse_mode_t>(r.size), &ctx_);
+            case FuseOp::kChown:
+                return ops_.vchown(path, ctx_.uid, ctx_.gid, &ctx_);
+            case FuseOp::kSymlink:
+                return ops_.vsymlink("/", path, &ctx_);
+            case FuseOp::kLink:
+                return ops_.vlink(path, path2.c_str(), &ctx_);
+            case FuseOp::kReadlink:
+                return ops_.vreadlink(path, buffer(4096), 4096, &ctx_);
+            case FuseOp::kRename:
+                return ops_.vrename(path, path2.c_str(), &ctx_);
+            case FuseOp::kTruncate:
+                return ops_.vtruncate(path, static_cast<fuse_off_t>(r.size), &ctx_);
+            case FuseOp::kUtimens:
+            {
+                fuse_timespec ts[2];
+                OSService::get_current_time(ts[0]);
+                ts[1] = ts[0];
+                return ops_.vutimens(path, ts, &ctx_);
+            }
+            case FuseOp::kListxattr:
+                return ops_.vlistxattr(path, size ? buffer(size) : nullptr, size, &ctx_);
+            case FuseOp::kGetxattr:
+            {
+                auto name = replay_xattr_name(r.path2_hash);
+                return ops_.vgetxattr(
+                    path, name.c_str(), size ? buffer(size) : nullptr, size, 0, &ctx_);
+            }
+            case FuseOp::kSetxattr:
+            {
+                auto name = replay_xattr_name(r.path2_hash);
+                return ops_.vsetxattr(path, name.c_str(), buffer(size), size, r.flags, 0, &ctx_);
+            }
+            case FuseOp::kRemovexattr:
+            {
+                auto name = replay_xattr_name(r.path2_hash);
+                return ops_.vremovexattr(path, name.c_str(), &ctx_);
+            }
+            case FuseOp::kGetpath:
+                return std::nullopt;
+            default:
+                break;
+            }
+
+            // The rest operate on a handle.
+            auto info = handles_.get(r.handle);
+            if (!info)
+            {
+                return std::nullopt;
+            }
+            switch (r.fuse_op())
+            {
+            case FuseOp::kFgetattr:
+            {
+                fuse_stat st{};
+                return ops_.vfgetattr(path, &st, &*info, &ctx_);
+            }
+            case FuseOp::kReleasedir:
+            case FuseOp::kRelease:
+            {
+                info = handles_.take(r.handle);
+                if (!info)
+                {
+                    return std::nullopt;
+                }
+                return r.fuse_op() == FuseOp::kReleasedir ? ops_.vreleasedir(path, &*info, &ctx_)
+                                                          : ops_.vrelease(path, &*info, &ctx_);
+            }
+            case FuseOp::kReaddir:
+                return ops_.vreaddir(
+                    path,
+                    nullptr,
+                    [](void*, const char*, const fuse_stat*, fuse_off_t) { return 0; },
+                    offset,
+                    &*info,
+                    &ctx_);
+            case FuseOp::kRead:
+                return ops_.vread(path, buffer(size), size, offset, &*info, &ctx_);
+            case FuseOp::kWrite:
+                return ops_.vwrite(path, buffer(size), size, offset, &*info, &ctx_);
+            case FuseOp::kFlush:
+                return ops_.vflush(path, &*info, &ctx_);
+            case FuseOp::kFtruncate:
+                return ops_.vftruncate(path, static_cast<fuse_off_t>(r.size), &*info, &ctx_);
+            case FuseOp::kFsync:
+                return ops_.vfsync(path, r.flags, &*info, &ctx_);
+            default:
+                return std::nullopt;
+            }
+        }
+    };
+}    // namespace
+
+std::string ReplayReport::to_text() const
+{
+    std::string result = absl::StrFormat(
+        "%u calls in %.3f s (scheduled %.3f s), %u skipped, %u with a different outcome\n"
+        "lag(us): mean %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+        ops,
+        seconds,
+        scheduled_seconds,
+        skipped,
+        mismatched,
+        lag.mean() / kNanosPerMicro,
+        lag.percentile(50) / kNanosPerMicro,
+        lag.percentile(99) / kNanosPerMicro,
+        lag.max() / kNanosPerMicro);
+    absl::StrAppendFormat(&result,
+                          "%-12s %10s %8s %10s %10s %10s %10s\n",
+                          "op",
+                          "calls",
+                          "errors",
+                          "mean(us)",
+                          "p50(us)",
+                          "p99(us)",
+                          "max(us)");
+    for (size_t i = 0; i < kNumFuseOps; ++i)
+    {
+        const FuseOpMetrics& m = per_op[i];
+        if (m.calls == 0)
+        {
+            continue;
+        }
+        absl::StrAppendFormat(&result,
+                              "%-12s %10u %8u %10.1f %10.1f %10.1f %10.1f\n",
+                              stringify(static_cast<FuseOp>(i)),
+                              m.calls,
+                              m.errors,
+                              m.latency.mean() / kNanosPerMicro,
+                              m.latency.percentile(50) / kNanosPerMicro,
+                              m.latency.percentile(99) / kNanosPerMicro,
+                              m.latency.max() / kNanosPerMicro);
+    }
+    return result;
+}
+
+std::string ReplayReport::to_json() const
+{
+    std::string result = absl::StrFormat(
+        R"({"seconds":%.6f,"scheduled_seconds":%.6f,"ops":%u,"skipped":%u,"mismatched":%u,)"
+        R"("lag_us":{"mean":%.1f,"p50":%.1f,"p99":%.1f,"max":%.1f},"per_op":{)",
+        seconds,
+        scheduled_seconds,
+        ops,
+        skipped,
+        mismatched,
+        lag.mean() / kNanosPerMicro,
+        lag.percentile(50) / kNanosPerMicro,
+        lag.percentile(99) / kNanosPerMicro,
+        lag.max() / kNanosPerMicro);
+    bool first = true;
+    for (size_t i = 0; i < kNumFuseOps; ++i)
+    {
+        const FuseOpMetrics& m = per_op[i];
+        if (m.calls == 0)
+        {
+            continue;
+        }
+        absl::StrAppendFormat(&result,
+                              R"(%s"%s":{"calls":%u,"errors":%u,"mean":%.1f,"p50":%.1f,)"
+                              R"("p99":%.1f,"max":%.1f})",
+                              first ? "" : ",",
+                              stringify(static_cast<FuseOp>(i)),
+                              m.calls,
+                              m.errors,
+                              m.latency.mean() / kNanosPerMicro,
+                              m.latency.percentile(50) / kNanosPerMicro,
+                              m.latency.percentile(99) / kNanosPerMicro,
+                              m.latency.max() / kNanosPerMicro);
+        first = false;
+    }
+    result.append("}}\n");
+    return result;
+}
+
+ReplayReport replay_trace(FuseHighLevelOpsBase& ops,
+                          std::vector<TraceRecord> records,
+                          const ReplayOptions& options)
+{
+    if (!(options.speed >= 0))
+    {
+        throwInvalidArgumentException("The speed of a replay must not be negative");
+    }
+    std::stable_sort(records.begin(),
+                     records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b)
+                     { return a.start_ns < b.start_ns; });
+    for (const TraceRecord& r : records)
+    {
+        if (r.op >= kNumFuseOps)
+        {
+            throw_runtime_error("The trace contains an unknown operation");
+        }
+    }
+
+    fuse_context ctx{};
+    ctx.uid = OSService::getuid();
+    ctx.gid = OSService::getgid();
+    create_prerequisites(ops, find_prerequisites(records), ctx);
+
+    HandleTable handles;
+    // Ordered, so that the recorded threads map to the replaying ones in a fixed way.
+    std::map<uint32_t, std::unique_ptr<ReplayWorker>> workers;
+    for (const TraceRecord& r : records)
+    {
+        auto& worker = workers[r.thread];
+        if (!worker)
+        {
+            worker = std::make_unique<ReplayWorker>(ops, handles, ctx);
+        }
+        worker->add(r);
+    }
+
+    absl::Notification start;
+    Clock::time_point start_time;
+    std::vector<std::exception_ptr> errors(workers.size());
+    std::vector<std::thread> threads;
+    for (auto& [thread, worker] : workers)
+    {
+        threads.emplace_back(
+            [&, index = threads.size(), worker = worker.get()]()
+            {
+                start.WaitForNotification();
+                try
+                {
+                    worker->run(start_time, options.speed);
+                }
+                catch (...)
+                {
+                    errors[index] = std::current_exception();
+                }
+            });
+    }
+    start_time = Clock::now();
+    start.Notify();
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+    auto elapsed = Clock::now() - start_time;
+    handles.release_all(ops, ctx);
+    for (const std::exception_ptr& e : errors)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+
+    ReplayReport report;
+    report.seconds = std::chrono::duration<double>(elapsed).count();
+    if (!records.empty() && options.speed > 0)
+    {
+        report.scheduled_seconds = records.back().start_ns / 1e9 / options.speed;
+    }
+    for (const auto& [thread, worker] : workers)
+    {
+        worker->merge_into(report);
+    }
+    return report;
+}
+}    // namespace securefs::trace
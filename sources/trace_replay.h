@@ -0,0 +1,50 @@
+#pragma once
+
+#include "fuse_high_level_ops_base.h"
+#include "metrics.h"
+#include "trace_recorder.h"
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace securefs::trace
+{
+struct ReplayOptions
+{
+    // How many times faster than recorded the calls are issued. Zero issues every call as soon as
+    // its thread has finished the previous one.
+    double speed = 1;
+};
+
+struct ReplayReport
+{
+    double seconds = 0;
+    // The span of the recorded calls, divided by the speed.
+    double scheduled_seconds = 0;
+    uint64_t ops = 0;
+    // Calls on handles whose opening was not replayed, and calls that cannot be replayed at all.
+    uint64_t skipped = 0;
+    // Calls that failed when they had succeeded in the trace, or the other way around.
+    uint64_t mismatched = 0;
+    // How late the calls were issued compared to the schedule, in nanoseconds.
+    LatencyHistogram lag;
+    std::array<FuseOpMetrics, kNumFuseOps> per_op;
+
+    std::string to_text() const;
+    std::string to_json() const;
+};
+
+/// Issues the calls of `records` against `ops`, from as many threads as were recorded and at the
+/// recorded times scaled by `options.speed`. Each thread keeps the order of its calls.
+///
+/// The trace holds only hashes of the paths, so every path is replayed as a distinct name directly
+/// under the root. The files and directories that already existed when they were first used in the
+/// trace are created before the timed part starts, with files as large as the furthest access.
+/// Failures of the replayed calls are counted and do not stop the replay. The handles left open by
+/// the trace are released at its end.
+ReplayReport replay_trace(FuseHighLevelOpsBase& ops,
+                          std::vector<TraceRecord> records,
+                          const ReplayOptions& options);
+}    // namespace securefs::trace
@@ -4,11 +4,14 @@
 #include "lock_enabled.h"
 #include "logger.h"
 #include "platform.h"
+#include "thread_pool.h"
 
 #include <absl/strings/match.h>
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_format.h>
+#include <absl/synchronization/blocking_counter.h>
 
+#include <algorithm>
 #include <cxxabi.h>
 #include <dirent.h>
 #include <fcntl.h>
@@ -25,6 +28,7 @@
 #include <termios.h>
 #include <time.h>
 #include <typeinfo>
+#include <vector>
 #include <unistd.h>
 
 #ifdef __APPLE__
@@ -83,6 +87,17 @@ public:
             THROW_POSIX_EXCEPTION(errno, "fsync");
     }
 
+    void fdatasync() override
+    {
+#ifdef __APPLE__
+        fsync();
+#else
+        int rc = ::fdatasync(m_fd);
+        if (rc < 0)
+            THROW_POSIX_EXCEPTION(errno, "fdatasync");
+#endif
+    }
+
     void fstat(struct stat* out) const override
     {
         if (!out)
@@ -128,6 +143,21 @@ public:
 
     void flush() override {}
 
+    void advise_willneed(offset_type offset, length_type length) noexcept override
+    {
+#if defined(POSIX_FADV_WILLNEED)
+        (void)::posix_fadvise(m_fd, offset, length, POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+        struct radvisory ra;
+        ra.ra_offset = offset;
+        ra.ra_count = static_cast<int>(std::min<length_type>(length, INT_MAX));
+        (void)::fcntl(m_fd, F_RDADVISE, &ra);
+#else
+        (void)offset;
+        (void)length;
+#endif
+    }
+
     void resize(length_type new_length) override
     {
         auto rc = ::ftruncate(m_fd, new_length);
@@ -188,10 +218,104 @@ public:
 class UnixDirectoryTraverser : public DirectoryTraverser
 {
 private:
+    struct Entry
+    {
+        std::string name;
+        fuse_stat st;
+    };
+
+    // Entries are read and stated in batches of this many when full attributes are requested.
+    static constexpr size_t kBatchSize = 128;
+    // Batches at least this large are stated in parallel if a pool is available.
+    static constexpr size_t kParallelThreshold = 32;
+
     DIR* m_dir;
+    bool m_full_stat;
+    ThreadPool* m_pool;
+    std::vector<Entry> m_batch;
+    size_t m_batch_pos = 0;
+
+    static void fill_from_dirent(const struct dirent* entry, fuse_stat* st)
+    {
+        memset(st, 0, sizeof(*st));
+        st->st_ino = entry->d_ino;
+        switch (entry->d_type)
+        {
+        case DT_DIR:
+            st->st_mode = S_IFDIR;
+            break;
+        case DT_LNK:
+            st->st_mode = S_IFLNK;
+            break;
+        case DT_REG:
+            st->st_mode = S_IFREG;
+            break;
+        default:
+            st->st_mode = 0;
+            break;
+        }
+    }
+
+    void stat_entries(size_t begin, size_t end) noexcept
+    {
+        int fd = ::dirfd(m_dir);
+        for (size_t i = begin; i < end; ++i)
+        {
+            fuse_stat st;
+            // On failure, most likely because the entry is removed concurrently, the partial
+            // attributes from the directory entry are retained.
+            if (::fstatat(fd, m_batch[i].name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                m_batch[i].st = st;
+            }
+        }
+    }
+
+    void fill_batch()
+    {
+        m_batch.clear();
+        m_batch_pos = 0;
+        while (m_batch.size() < kBatchSize)
+        {
+            errno = 0;
+            auto entry = ::readdir(m_dir);
+            if (!entry)
+            {
+                if (errno)
+                    THROW_POSIX_EXCEPTION(errno, "readdir");
+                break;
+            }
+            auto& e = m_batch.emplace_back();
+            e.name = entry->d_name;
+            fill_from_dirent(entry, &e.st);
+        }
+
+        if (!m_pool || m_batch.size() < kParallelThreshold)
+        {
+            stat_entries(0, m_batch.size());
+            return;
+        }
+        size_t num_slices = std::min<size_t>(m_pool->num_threads() + 1,
+                                             m_batch.size() / (kParallelThreshold / 2));
+        size_t slice_size = (m_batch.size() + num_slices - 1) / num_slices;
+        absl::BlockingCounter counter(static_cast<int>(num_slices - 1));
+        for (size_t i = 1; i < num_slices; ++i)
+        {
+            size_t begin = i * slice_size, end = std::min(begin + slice_size, m_batch.size());
+            m_pool->submit(
+                [this, begin, end, &counter]()
+                {
+                    stat_entries(begin, end);
+                    counter.DecrementCount();
+                });
+        }
+        stat_entries(0, slice_size);
+        counter.Wait();
+    }
 
 public:
-    explicit UnixDirectoryTraverser(const std::string& path)
+    explicit UnixDirectoryTraverser(const std::string& path, bool full_stat, ThreadPool* pool)
+        : m_full_stat(full_stat), m_pool(pool)
     {
         m_dir = ::opendir(path.c_str());
         if (!m_dir)
@@ -201,6 +325,22 @@ public:
 
     bool next(std::string* name, fuse_stat* st) override
     {
+        if (m_full_stat)
+        {
+            if (m_batch_pos >= m_batch.size())
+            {
+                fill_batch();
+                if (m_batch.empty())
+                    return false;
+            }
+            auto& e = m_batch[m_batch_pos++];
+            if (st)
+                *st = e.st;
+            if (name)
+                name->swap(e.name);
+            return true;
+        }
+
         errno = 0;
         auto entry = ::readdir(m_dir);
         if (!entry)
@@ -211,23 +351,7 @@ public:
         }
         if (st)
         {
-            memset(st, 0, sizeof(*st));
-            st->st_ino = entry->d_ino;
-            switch (entry->d_type)
-            {
-            case DT_DIR:
-                st->st_mode = S_IFDIR;
-                break;
-            case DT_LNK:
-                st->st_mode = S_IFLNK;
-                break;
-            case DT_REG:
-                st->st_mode = S_IFREG;
-                break;
-            default:
-                st->st_mode = 0;
-                break;
-            }
+            fill_from_dirent(entry, st);
         }
         if (name)
         {
@@ -236,7 +360,12 @@ public:
         return true;
     }
 
-    void rewind() override { ::rewinddir(m_dir); }
+    void rewind() override
+    {
+        ::rewinddir(m_dir);
+        m_batch.clear();
+        m_batch_pos = 0;
+    }
 };
 
 bool OSService::is_absolute(std::string_view path) { return path.size() > 0 && path[0] == '/'; }
@@ -366,6 +495,18 @@ void OSService::statfs(fuse_statvfs* fs_info) const
         THROW_POSIX_EXCEPTION(errno, "statvfs");
 }
 
+bool OSService::sync_filesystem() const
+{
+#ifdef __linux__
+    int rc = ::syncfs(m_dir_fd);
+    if (rc < 0)
+        THROW_POSIX_EXCEPTION(errno, "syncfs");
+    return true;
+#else
+    return false;
+#endif
+}
+
 void OSService::rename(const std::string& a, const std::string& b) const
 {
     int rc = ::renameat(m_dir_fd, a.c_str(), m_dir_fd, b.c_str());
@@ -422,9 +563,10 @@ void OSService::utimens(const std::string& path, const fuse_timespec* ts) const
         THROW_POSIX_EXCEPTION(errno, "utimensat");
 }
 
-std::unique_ptr<DirectoryTraverser> OSService::create_traverser(const std::string& dir) const
+std::unique_ptr<DirectoryTraverser>
+OSService::create_traverser(const std::string& dir, bool full_stat, ThreadPool* pool) const
 {
-    return securefs::make_unique<UnixDirectoryTraverser>(norm_path(dir));
+    return securefs::make_unique<UnixDirectoryTraverser>(norm_path(dir), full_stat, pool);
 }
 
 uint32_t OSService::getuid() noexcept { return ::getuid(); }
@@ -886,6 +886,8 @@ void OSService::statfs(fuse_statvfs* fs_info) const
     fs_info->f_namemax = namemax;
 }
 
+bool OSService::sync_filesystem() const { return false; }
+
 void OSService::utimens(const std::string& path, const fuse_timespec ts[2]) const
 {
     FILETIME atime, mtime;
@@ -1050,8 +1052,12 @@ public:
     }
 };
 
-std::unique_ptr<DirectoryTraverser> OSService::create_traverser(const std::string& dir) const
+std::unique_ptr<DirectoryTraverser>
+OSService::create_traverser(const std::string& dir, bool full_stat, ThreadPool* pool) const
 {
+    // The find data already carries the full attributes.
+    (void)full_stat;
+    (void)pool;
     return securefs::make_unique<WindowsDirectoryTraverser>(norm_path(dir) + L"\\*");
 }
 
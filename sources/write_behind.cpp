@@ -0,0 +1,176 @@
+#include "write_behind.h"
+#include "exceptions.h"
+#include "lock_guard.h"
+#include "logger.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+namespace securefs
+{
+WriteBehindBuffer::WriteBehindBuffer(ThreadPool& pool, Writer writer, length_type max_dirty_bytes)
+    : pool_(pool)
+    , writer_(std::move(writer))
+    , max_dirty_bytes_(std::max<length_type>(1, max_dirty_bytes))
+{
+}
+
+int64_t WriteBehindBuffer::add_extent(Extents& extents,
+                                      const void* input,
+                                      offset_type offset,
+                                      length_type length)
+{
+    if (length <= 0)
+    {
+        return 0;
+    }
+    auto data = static_cast<const byte*>(input);
+    int64_t delta = 0;
+
+    // Find the first extent that overlaps or touches [offset, offset + length].
+    auto it = extents.upper_bound(offset);
+    if (it != extents.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev->first + prev->second.size() >= offset)
+        {
+            it = prev;
+        }
+    }
+    if (it == extents.end() || it->first > offset + length)
+    {
+        extents.emplace_hint(it, offset, std::vector<byte>(data, data + length));
+        return static_cast<int64_t>(length);
+    }
+
+    if (it->first > offset)
+    {
+        it = extents.emplace_hint(it, offset, std::vector<byte>(data, data + length));
+        delta += static_cast<int64_t>(length);
+    }
+    else
+    {
+        auto& buffer = it->second;
+        auto relative = offset - it->first;
+        if (buffer.size() < relative + length)
+        {
+            delta += static_cast<int64_t>(relative + length - buffer.size());
+            buffer.resize(relative + length);
+        }
+        memcpy(buffer.data() + relative, data, length);
+    }
+
+    // Absorb the following extents that now overlap or touch the merged one.
+    auto& base = it->second;
+    offset_type base_start = it->first;
+    for (auto next = std::next(it);
+         next != extents.end() && next->first <= base_start + base.size();)
+    {
+        offset_type base_end = base_start + base.size();
+        offset_type next_end = next->first + next->second.size();
+        delta -= static_cast<int64_t>(next->second.size());
+        if (next_end > base_end)
+        {
+            base.insert(base.end(),
+                        next->second.begin() + (base_end - next->first),
+                        next->second.end());
+            delta += static_cast<int64_t>(next_end - base_end);
+        }
+        next = extents.erase(next);
+    }
+    return delta;
+}
+
+void WriteBehindBuffer::enqueue(const void* input, offset_type offset, length_type length)
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    mu_.Await(absl::Condition(this, &WriteBehindBuffer::has_room_or_error));
+    if (deferred_error_)
+    {
+        std::rethrow_exception(deferred_error_);
+    }
+    dirty_bytes_ += add_extent(extents_, input, offset, length);
+    ++enqueued_seq_;
+    if (!scheduled_ && !writing_)
+    {
+        schedule();
+    }
+}
+
+void WriteBehindBuffer::sync()
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    const uint64_t target = enqueued_seq_;
+    while (completed_seq_ < target)
+    {
+        mu_.Await(absl::Condition(this, &WriteBehindBuffer::not_writing));
+        if (completed_seq_ >= target)
+        {
+            break;
+        }
+        // Everything up to `target` is either written or still buffered, so do it ourselves
+        // instead of waiting for a pool thread.
+        write_batch();
+    }
+    if (deferred_error_)
+    {
+        auto error = std::move(deferred_error_);
+        deferred_error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void WriteBehindBuffer::schedule()
+{
+    scheduled_ = true;
+    pool_.submit([self = shared_from_this()]() { self->background_write(); });
+}
+
+void WriteBehindBuffer::background_write()
+{
+    LockGuard<absl::Mutex> lg(mu_);
+    scheduled_ = false;
+    if (writing_ || extents_.empty())
+    {
+        return;
+    }
+    write_batch();
+}
+
+void WriteBehindBuffer::write_batch()
+{
+    Extents batch;
+    batch.swap(extents_);
+    dirty_bytes_ = 0;
+    writing_ = true;
+    const uint64_t seq = enqueued_seq_;
+
+    mu_.Unlock();
+    std::exception_ptr error;
+    try
+    {
+        writer_(batch);
+    }
+    catch (const std::exception& e)
+    {
+        WARN_LOG("Deferred write failed with %s: %s", get_type_name(e).get(), e.what());
+        error = std::current_exception();
+    }
+    batch.clear();
+    mu_.Lock();
+
+    writing_ = false;
+    completed_seq_ = seq;
+    if (error && !deferred_error_)
+    {
+        deferred_error_ = std::move(error);
+    }
+    if (!extents_.empty() && !scheduled_)
+    {
+        schedule();
+    }
+}
+}    // namespace securefs
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "myutils.h"
+#include "object.h"
+
+#include <absl/base/thread_annotations.h>
+#include <absl/synchronization/mutex.h>
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace securefs
+{
+class ThreadPool;
+
+/// Per file write-behind buffer.
+///
+/// Writes are copied into a set of coalesced dirty extents and return immediately. A background
+/// task hands the accumulated extents in batches to the `Writer`, which encrypts and writes them.
+/// While one batch is being encrypted, the next one accumulates, so that the CPU work overlaps
+/// with both the device and the producer.
+///
+/// Neither `enqueue()` nor `sync()` may be called with the owner's lock held, because the writer
+/// needs to take that lock.
+class WriteBehindBuffer final : public Object,
+                                public std::enable_shared_from_this<WriteBehindBuffer>
+{
+public:
+    /// Disjoint, non-adjacent extents, keyed by their starting offset.
+    using Extents = std::map<offset_type, std::vector<byte>>;
+
+    /// Writes out a batch. It is never invoked concurrently with itself, and it is invoked only
+    /// with nonempty batches.
+    using Writer = std::function<void(const Extents&)>;
+
+    WriteBehindBuffer(ThreadPool& pool, Writer writer, length_type max_dirty_bytes);
+
+    /// Buffers the data and schedules a background write out. Blocks while too much data is
+    /// buffered. Throws if an earlier background write has failed.
+    void enqueue(const void* input, offset_type offset, length_type length);
+
+    /// The barrier. Waits until everything enqueued before this call is written, then rethrows
+    /// and clears the first error of the background writes, if any.
+    void sync();
+
+    /// Merges a write into `extents`. Newer data wins where they overlap.
+    /// @return The change in the total number of buffered bytes.
+    static int64_t
+    add_extent(Extents& extents, const void* input, offset_type offset, length_type length);
+
+private:
+    void schedule() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+    void background_write();
+    void write_batch() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+    bool has_room_or_error() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_)
+    {
+        return dirty_bytes_ < max_dirty_bytes_ || deferred_error_;
+    }
+    bool not_writing() const ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_) { return !writing_; }
+
+private:
+    ThreadPool& pool_;
+    Writer writer_;
+    length_type max_dirty_bytes_;
+
+    absl::Mutex mu_;
+    Extents extents_ ABSL_GUARDED_BY(mu_);
+    length_type dirty_bytes_ ABSL_GUARDED_BY(mu_) = 0;
+    uint64_t enqueued_seq_ ABSL_GUARDED_BY(mu_) = 0;
+    uint64_t completed_seq_ ABSL_GUARDED_BY(mu_) = 0;
+    bool writing_ ABSL_GUARDED_BY(mu_) = false;
+    bool scheduled_ ABSL_GUARDED_BY(mu_) = false;
+    std::exception_ptr deferred_error_ ABSL_GUARDED_BY(mu_);
+};
+}    // namespace securefs
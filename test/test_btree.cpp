@@ -134,6 +134,9 @@ namespace
         unsigned rounds = 50;
 #endif
 
+        // Shared by both blocks, so that the second one reopens the directories with the keys
+        // and contexts cached by the first.
+        FileKeyCache key_cache;
         {
             BtreeDirectory dir(cmp,
                                service.open_file_stream(tmp1, flags, 0644),
@@ -144,7 +147,8 @@ namespace
                                8000,
                                12,
                                max_padding_size,
-                               false);
+                               false,
+                               key_cache);
             SimpleDirectory ref_dir(cmp,
                                     service.open_file_stream(tmp3, flags, 0644),
                                     service.open_file_stream(tmp4, flags, 0644),
@@ -154,7 +158,8 @@ namespace
                                     8000,
                                     12,
                                     max_padding_size,
-                                    false);
+                                    false,
+                                    key_cache);
             DoubleFileLockGuard dflg(dir, ref_dir);
             test(dir, ref_dir, rounds, 0.3, 0.5, 0.1, 1);
             test(dir, ref_dir, rounds, 0.3, 0.1, 0.5, 2);
@@ -173,7 +178,8 @@ namespace
                                8000,
                                12,
                                max_padding_size,
-                               false);
+                               false,
+                               key_cache);
             SimpleDirectory ref_dir(cmp,
                                     service.open_file_stream(tmp3, O_RDWR, 0),
                                     service.open_file_stream(tmp4, O_RDWR, 0),
@@ -183,7 +189,8 @@ namespace
                                     8000,
                                     12,
                                     max_padding_size,
-                                    false);
+                                    false,
+                                    key_cache);
             DoubleFileLockGuard dflg(dir, ref_dir);
             test(dir, ref_dir, rounds, 0.3, 0.3, 0.3, 4);
             dir.flush();
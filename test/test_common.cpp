@@ -1,5 +1,6 @@
 #include "test_common.h"
 #include "crypto.h"
+#include "exceptions.h"
 #include "fuse_high_level_ops_base.h"
 #include "lite_format.h"
 #include "lite_long_name_lookup_table.h"
@@ -138,6 +139,8 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
     {
         fuse_file_info info{};
         REQUIRE(ops.vcreate("/hello", 0644, &info, &ctx) == 0);
+        // Both formats are tested with the page cache kept where it is safe.
+        CHECK(info.keep_cache == !case_insensitive);
         REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
 
         fuse_stat st{};
@@ -177,6 +180,9 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         fuse_stat st{};
         CHECK(ops.vfgetattr(nullptr, &st, &write_info, &ctx) == 0);
         CHECK(st.st_size == written.size() + 1);
+        CHECK(ops.vfsync(nullptr, 1, &write_info, &ctx) == 0);
+        CHECK(ops.vfsync(nullptr, 1, &write_info, &ctx) == 0);
+        CHECK(ops.vfsync(nullptr, 0, &write_info, &ctx) == 0);
 
         std::thread concurrent_read_thread(
             [&]()
@@ -196,6 +202,73 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         concurrent_read_thread.join();
 
         REQUIRE(ops.vrelease(nullptr, &write_info, &ctx) == 0);
+
+        // Twice, so that padded repositories go through both the uncached and the cached path.
+        for (int i = 0; i < 2; ++i)
+        {
+            fuse_stat path_st{};
+            REQUIRE(ops.vgetattr(absl::StrCat("/", kLongFileNameExample1).c_str(), &path_st, &ctx)
+                    == 0);
+            CHECK(path_st.st_size == written.size() + 1);
+        }
+    }
+
+    {
+        // An overwrite through one handle must be visible to the reads through another, even
+        // when the size stays the same.
+        std::vector<char> written(4000), read(1000);
+        generate_random(written.data(), written.size());
+        fuse_file_info reader{};
+        REQUIRE(ops.vcreate("/overwritten", 0644, &reader, &ctx) == 0);
+        REQUIRE(ops.vwrite(nullptr, written.data(), written.size(), 0, &reader, &ctx)
+                == written.size());
+        REQUIRE(ops.vflush(nullptr, &reader, &ctx) == 0);
+        for (int i = 0; i < 3; ++i)
+        {
+            REQUIRE(ops.vread(nullptr, read.data(), read.size(), i * 1000, &reader, &ctx)
+                    == read.size());
+        }
+
+        fuse_file_info writer{};
+        writer.flags = O_RDWR;
+        REQUIRE(ops.vopen("/overwritten", &writer, &ctx) == 0);
+        generate_random(written.data(), written.size());
+        REQUIRE(ops.vwrite(nullptr, written.data(), written.size(), 0, &writer, &ctx)
+                == written.size());
+        REQUIRE(ops.vrelease(nullptr, &writer, &ctx) == 0);
+
+        for (int i = 3; i >= 0; --i)
+        {
+            REQUIRE(ops.vread(nullptr, read.data(), read.size(), i * 1000, &reader, &ctx)
+                    == read.size());
+            CHECK(std::string_view(read.data(), read.size())
+                  == std::string_view(written.data() + i * 1000, read.size()));
+        }
+        REQUIRE(ops.vrelease(nullptr, &reader, &ctx) == 0);
+        CHECK(ops.vunlink("/overwritten", &ctx) == 0);
+    }
+
+    {
+        // A read through one handle must see the writes that another handle has yet to flush.
+        std::vector<char> written(3000), read(3000);
+        generate_random(written.data(), written.size());
+        fuse_file_info writer{};
+        writer.flags = O_RDWR;
+        REQUIRE(ops.vcreate("/buffered", 0644, &writer, &ctx) == 0);
+        fuse_file_info reader{};
+        reader.flags = O_RDONLY;
+        REQUIRE(ops.vopen("/buffered", &reader, &ctx) == 0);
+        REQUIRE(ops.vwrite(nullptr, written.data(), written.size(), 0, &writer, &ctx)
+                == written.size());
+
+        fuse_stat st{};
+        REQUIRE(ops.vfgetattr(nullptr, &st, &reader, &ctx) == 0);
+        CHECK(st.st_size == written.size());
+        REQUIRE(ops.vread(nullptr, read.data(), read.size(), 0, &reader, &ctx) == read.size());
+        CHECK(read == written);
+        REQUIRE(ops.vrelease(nullptr, &reader, &ctx) == 0);
+        REQUIRE(ops.vrelease(nullptr, &writer, &ctx) == 0);
+        CHECK(ops.vunlink("/buffered", &ctx) == 0);
     }
 
     CHECK(ops.vunlink("/hello", &ctx) == 0);
@@ -275,11 +348,42 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         REQUIRE(ops.vfgetattr(nullptr, &st, &info, &ctx) == 0);
         CHECK(st.st_nlink == 2);
         CHECK(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        fuse_file_info link_info{};
+        link_info.flags = O_RDONLY;
+        REQUIRE(ops.vopen("/check-mark", &link_info, &ctx) == 0);
+        CHECK(!link_info.keep_cache);
+        CHECK(ops.vrelease(nullptr, &link_info, &ctx) == 0);
         CHECK(ops.vunlink(link_target.c_str(), &ctx) == 0);
         REQUIRE(ops.vgetattr("/check-mark", &st, &ctx) == 0);
         CHECK(st.st_nlink == 1);
     }
 
+    if (!is_windows())
+    {
+        // Once linked, a file keeps no page cache even after going back to a single name, since
+        // the cache of that name may have gone stale while the file was written through another.
+        fuse_file_info info{};
+        REQUIRE(ops.vcreate("/single", 0644, &info, &ctx) == 0);
+        CHECK(info.keep_cache == !case_insensitive);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        REQUIRE(ops.vlink("/single", "/second", &ctx) == 0);
+        fuse_file_info second_info{};
+        second_info.flags = O_RDWR;
+        REQUIRE(ops.vopen("/second", &second_info, &ctx) == 0);
+        CHECK(ops.vwrite(nullptr, "abc", 3, 0, &second_info, &ctx) == 3);
+        REQUIRE(ops.vrelease(nullptr, &second_info, &ctx) == 0);
+        REQUIRE(ops.vunlink("/second", &ctx) == 0);
+
+        info = {};
+        info.flags = O_RDONLY;
+        REQUIRE(ops.vopen("/single", &info, &ctx) == 0);
+        CHECK(!info.keep_cache);
+        REQUIRE(ops.vrelease(nullptr, &info, &ctx) == 0);
+        CHECK(ops.vunlink("/single", &ctx) == 0);
+    }
+
     if (!is_windows())
     {
         CHECK(ops.vchmod("/check-mark", 0600, &ctx) == 0);
@@ -300,4 +404,51 @@ void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_in
         CHECK(getxattr(ops, "/cbd", "org.securefs.test") == "blah");
     }
 }
+
+length_type SyncCountingStream::read(void* output, offset_type offset, length_type length)
+{
+    return delegate_->read(output, offset, length);
+}
+void SyncCountingStream::write(const void* input, offset_type offset, length_type length)
+{
+    delegate_->write(input, offset, length);
+}
+void SyncCountingStream::fsync()
+{
+    ++fsyncs;
+    if (sync_error)
+    {
+        throwVFSException(sync_error);
+    }
+    delegate_->fsync();
+}
+void SyncCountingStream::fdatasync()
+{
+    ++fdatasyncs;
+    if (sync_error)
+    {
+        throwVFSException(sync_error);
+    }
+    delegate_->fdatasync();
+}
+ssize_t SyncCountingStream::listxattr(char* buffer, size_t size)
+{
+    return delegate_->listxattr(buffer, size);
+}
+ssize_t SyncCountingStream::getxattr(const char* name, void* value, size_t size)
+{
+    return delegate_->getxattr(name, value, size);
+}
+void SyncCountingStream::setxattr(const char* name, void* value, size_t size, int flags)
+{
+    delegate_->setxattr(name, value, size, flags);
+}
+length_type SyncCountingStream::sequential_read(void* output, length_type length)
+{
+    return delegate_->sequential_read(output, length);
+}
+void SyncCountingStream::sequential_write(const void* input, length_type length)
+{
+    delegate_->sequential_write(input, length);
+}
 }    // namespace securefs::testing
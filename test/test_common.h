@@ -7,8 +7,11 @@
 #include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
 #include <doctest/doctest.h>
+#include <fruit/fruit.h>
 #include <string_view>
 
+#include <atomic>
+#include <memory>
 #include <random>
 #include <vector>
 
@@ -41,4 +44,47 @@ struct doctest::StringMaker<std::vector<std::string>>
 namespace securefs::testing
 {
 void test_fuse_ops(FuseHighLevelOpsBase& ops, OSService& repo_root, bool case_insensitive = false);
-}
+
+// A full format filesystem over `root` as in test_full_format.cpp, for the tests across formats.
+fruit::Component<FuseHighLevelOpsBase>
+get_full_format_test_component(std::shared_ptr<OSService> root);
+
+// Forwards everything to another stream, while counting the syncs, which fail with `sync_error`
+// when it is nonzero.
+class SyncCountingStream final : public FileStream
+{
+public:
+    explicit SyncCountingStream(std::shared_ptr<FileStream> delegate)
+        : delegate_(std::move(delegate))
+    {
+    }
+
+    std::atomic<int> fsyncs{0}, fdatasyncs{0};
+    std::atomic<int> sync_error{0};
+
+    int syncs() const noexcept { return fsyncs + fdatasyncs; }
+
+    length_type read(void* output, offset_type offset, length_type length) override;
+    void write(const void* input, offset_type offset, length_type length) override;
+    length_type size() const override { return delegate_->size(); }
+    void flush() override { delegate_->flush(); }
+    void resize(length_type len) override { delegate_->resize(len); }
+    bool is_sparse() const noexcept override { return delegate_->is_sparse(); }
+    void fsync() override;
+    void fdatasync() override;
+    void utimens(const fuse_timespec ts[2]) override { delegate_->utimens(ts); }
+    void fstat(fuse_stat* st) const override { delegate_->fstat(st); }
+    void close() noexcept override { delegate_->close(); }
+    ssize_t listxattr(char* buffer, size_t size) override;
+    ssize_t getxattr(const char* name, void* value, size_t size) override;
+    void setxattr(const char* name, void* value, size_t size, int flags) override;
+    void removexattr(const char* name) override { delegate_->removexattr(name); }
+    void lock(bool exclusive) override { delegate_->lock(exclusive); }
+    void unlock() noexcept override { delegate_->unlock(); }
+    length_type sequential_read(void* output, length_type length) override;
+    void sequential_write(const void* input, length_type length) override;
+
+private:
+    std::shared_ptr<FileStream> delegate_;
+};
+}    // namespace securefs::testing
@@ -1,7 +1,14 @@
+#include <cryptopp/gcm.h>
 #include <cryptopp/scrypt.h>
 #include <doctest/doctest.h>
 
+#include "aead_engine.h"
 #include "crypto.h"
+#include "myutils.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <vector>
 
 static void test_siv_encryption(const void* key,
@@ -219,6 +226,34 @@ TEST_CASE("Test SIV other")
                  siv2_iv);
 }
 
+TEST_CASE("Test SIV reuse")
+{
+    // One instance serves every length, so that no state leaks from one message to the next, and
+    // the lengths cover the partial, single and straddled final blocks of CMAC.
+    byte key[64];
+    securefs::generate_random(key, sizeof(key));
+    securefs::AES_SIV aes_siv(key, sizeof(key));
+    const char header[] = "header";
+    for (size_t len = 0; len <= 50; ++len)
+    {
+        CAPTURE(len);
+        std::vector<byte> plaintext(len + 1), ciphertext(len + 1), decrypted(len + 1);
+        securefs::generate_random(plaintext.data(), len);
+        byte siv[16], siv_again[16];
+        aes_siv.encrypt_and_authenticate(
+            plaintext.data(), len, header, sizeof(header), ciphertext.data(), siv);
+        aes_siv.encrypt_and_authenticate(
+            plaintext.data(), len, header, sizeof(header), decrypted.data(), siv_again);
+        CHECK(memcmp(siv, siv_again, sizeof(siv)) == 0);
+        CHECK(aes_siv.decrypt_and_verify(
+            ciphertext.data(), len, header, sizeof(header), decrypted.data(), siv));
+        CHECK(memcmp(plaintext.data(), decrypted.data(), len) == 0);
+        siv[len % 16] ^= 1;
+        CHECK(!aes_siv.decrypt_and_verify(
+            ciphertext.data(), len, header, sizeof(header), decrypted.data(), siv));
+    }
+}
+
 TEST_CASE("Test hkdf")
 {
     const byte key[] = {0x1d,
@@ -274,6 +309,131 @@ TEST_CASE("Test hkdf")
     REQUIRE(memcmp(test_derived, true_derived_key, sizeof(test_derived)) == 0);
 }
 
+TEST_CASE("AEAD engines")
+{
+    // Runs of equal shapes are interleaved by the hardware backends, so mix runs longer than their
+    // lanes with odd ones and partial blocks.
+    const size_t sizes[] = {0, 1, 15, 16, 17, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096, 4096,
+                            100, 100, 100, 4095, 4096};
+    const size_t aad_sizes[]
+        = {0, 8, 8, 33, 33, 32, 32, 32, 32, 32, 32, 32, 32, 32, 0, 0, 0, 16, 32};
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    static_assert(sizeof(aad_sizes) == sizeof(sizes));
+
+    REQUIRE(securefs::parse_aead_backend("vaes") == securefs::AeadBackend::kVaes);
+    REQUIRE(securefs::get_default_aead_backend() == securefs::supported_aead_backends().back());
+
+    for (securefs::AeadBackend backend : securefs::supported_aead_backends())
+    {
+        for (size_t key_size : {16, 24, 32})
+        {
+            for (size_t iv_size : {12, 16, 32})
+            {
+                CAPTURE(securefs::stringify(backend));
+                CAPTURE(key_size);
+                CAPTURE(iv_size);
+                byte key[32];
+                securefs::generate_random(key, key_size);
+                auto engine = securefs::make_aes_gcm_engine(key, key_size, iv_size, backend);
+                REQUIRE(engine->backend() == backend);
+                const byte null_iv[12] = {0};
+                CryptoPP::GCM<CryptoPP::AES>::Encryption reference;
+                reference.SetKeyWithIV(key, key_size, null_iv, sizeof(null_iv));
+
+                std::vector<std::vector<byte>> ivs, aads, plaintexts, ciphertexts, macs, decrypted;
+                std::vector<securefs::GCMMessage> encryptions, decryptions;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    ivs.emplace_back(iv_size);
+                    aads.emplace_back(aad_sizes[i]);
+                    plaintexts.emplace_back(sizes[i]);
+                    securefs::generate_random(ivs.back().data(), iv_size);
+                    securefs::generate_random(aads.back().data(), aad_sizes[i]);
+                    securefs::generate_random(plaintexts.back().data(), sizes[i]);
+                    ciphertexts.emplace_back(sizes[i]);
+                    decrypted.emplace_back(sizes[i]);
+                    macs.emplace_back(securefs::AeadEngine::MAC_SIZE);
+                }
+                for (size_t i = 0; i < count; ++i)
+                {
+                    encryptions.push_back({ivs[i].data(),
+                                           aads[i].data(),
+                                           aad_sizes[i],
+                                           plaintexts[i].data(),
+                                           ciphertexts[i].data(),
+                                           sizes[i],
+                                           macs[i].data()});
+                    decryptions.push_back(encryptions.back());
+                    decryptions.back().input = ciphertexts[i].data();
+                    decryptions.back().output = decrypted[i].data();
+                }
+                engine->encrypt(encryptions);
+
+                for (size_t i = 0; i < count; ++i)
+                {
+                    std::vector<byte> expected(sizes[i]), expected_mac(16);
+                    reference.EncryptAndAuthenticate(expected.data(),
+                                                     expected_mac.data(),
+                                                     expected_mac.size(),
+                                                     ivs[i].data(),
+                                                     static_cast<int>(iv_size),
+                                                     aads[i].data(),
+                                                     aad_sizes[i],
+                                                     plaintexts[i].data(),
+                                                     sizes[i]);
+                    CHECK(expected == ciphertexts[i]);
+                    CHECK(expected_mac == macs[i]);
+                }
+
+                CHECK(engine->decrypt(decryptions) == count);
+                CHECK(decrypted == plaintexts);
+
+                ciphertexts[7][100] ^= 1;
+                macs[17][0] ^= 1;
+                CHECK(engine->decrypt(decryptions) == 7);
+                ciphertexts[7][100] ^= 1;
+                CHECK(engine->decrypt(decryptions) == 17);
+            }
+        }
+    }
+}
+
+TEST_CASE("IV generation")
+{
+    // Spans several reseeds, and mixes request sizes so that some straddle the pool refills.
+    const size_t total = 3 << 20;
+    std::vector<byte> output(total);
+    for (size_t i = 0, step = 0; i < total; ++step)
+    {
+        size_t n = std::min<size_t>(total - i, step % 3 == 0 ? 12 : step % 3 == 1 ? 16 : 1000);
+        securefs::generate_iv(output.data() + i, n);
+        i += n;
+    }
+
+    // Frequency tests on bits and bytes, with bounds about six standard deviations wide.
+    size_t ones = securefs::popcount(output.data(), output.size());
+    size_t byte_counts[256] = {};
+    for (byte b : output)
+    {
+        ++byte_counts[b];
+    }
+    double bits = total * 8.0;
+    CHECK(std::abs(ones - bits / 2) < 6 * std::sqrt(bits) / 2);
+    double expected = total / 256.0, chi_square = 0;
+    for (size_t c : byte_counts)
+    {
+        chi_square += (c - expected) * (c - expected) / expected;
+    }
+    // 255 degrees of freedom, so the mean is 255 and the standard deviation is about 22.6.
+    CHECK(chi_square > 120);
+    CHECK(chi_square < 390);
+
+    std::vector<std::array<byte, 16>> ivs(total / 16);
+    memcpy(ivs.data(), output.data(), ivs.size() * 16);
+    std::sort(ivs.begin(), ivs.end());
+    CHECK(std::adjacent_find(ivs.begin(), ivs.end()) == ivs.end());
+}
+
 static void test_scrypt(const char* password,
                         const char* salt,
                         uint64_t N,
@@ -0,0 +1,80 @@
+#include "aead_engine.h"
+#include "files.h"
+#include "myutils.h"
+
+#include <doctest/doctest.h>
+
+#include <cstring>
+#include <memory>
+
+namespace securefs
+{
+namespace
+{
+    id_type make_id(unsigned i)
+    {
+        id_type id;
+        memcpy(id.data(), &i, sizeof(i));
+        return id;
+    }
+
+    std::unique_ptr<FileKeyCache::Entry> make_entry(byte fill)
+    {
+        auto entry = std::make_unique<FileKeyCache::Entry>();
+        entry->data_key = key_type(fill);
+        entry->meta_key = key_type(fill);
+        entry->padding_size = fill;
+        entry->data_gcm = make_aes_gcm_engine(entry->data_key.data(), entry->data_key.size(), 12);
+        return entry;
+    }
+
+    TEST_CASE("File key cache")
+    {
+        FileKeyCache cache;
+        CHECK(cache.take(make_id(0)) == nullptr);
+
+        cache.put(make_id(0), make_entry(1));
+        auto entry = cache.take(make_id(0));
+        REQUIRE(entry);
+        CHECK(entry->data_key == key_type(1));
+        CHECK(entry->meta_key == key_type(1));
+        CHECK(entry->padding_size == 1);
+        // A taken entry leaves the cache, so that two files never share its contexts.
+        CHECK(cache.take(make_id(0)) == nullptr);
+
+        // An entry is only destroyed, which wipes its keys, when nothing else holds its context.
+        std::weak_ptr<AeadEngine> first_engine = entry->data_gcm;
+        cache.put(make_id(0), std::move(entry));
+        auto second = make_entry(2);
+        std::weak_ptr<AeadEngine> second_engine = second->data_gcm;
+        cache.put(make_id(1), std::move(second));
+        for (unsigned i = 2; i < FileKeyCache::kMaxEntries; ++i)
+        {
+            cache.put(make_id(i), make_entry(3));
+        }
+        CHECK(!first_engine.expired());
+        CHECK(!second_engine.expired());
+
+        // Using the first entry makes the second one the least recently used.
+        cache.put(make_id(0), cache.take(make_id(0)));
+        cache.put(make_id(FileKeyCache::kMaxEntries), make_entry(4));
+        CHECK(second_engine.expired());
+        CHECK(!first_engine.expired());
+        CHECK(cache.take(make_id(1)) == nullptr);
+
+        auto first = cache.take(make_id(0));
+        REQUIRE(first);
+        CHECK(first->data_key == key_type(1));
+        auto last = cache.take(make_id(FileKeyCache::kMaxEntries));
+        REQUIRE(last);
+        CHECK(last->padding_size == 4);
+
+        // Putting an id again replaces its entry.
+        cache.put(make_id(2), make_entry(5));
+        auto replaced = cache.take(make_id(2));
+        REQUIRE(replaced);
+        CHECK(replaced->padding_size == 5);
+        CHECK(cache.take(make_id(2)) == nullptr);
+    }
+}    // namespace
+}    // namespace securefs
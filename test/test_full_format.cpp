@@ -1,11 +1,21 @@
 #include "btree_dir.h"
+#include "bulk_transfer.h"
+#include "files.h"
+#include "fsync_batcher.h"
 #include "full_format.h"
+#include "fuse_bench.h"
 #include "fuse_high_level_ops_base.h"
+#include "fuse_tracer_v2.h"
 #include "mystring.h"
 #include "platform.h"
+#include "repo_verifier.h"
+#include "stat_workaround.h"
 #include "tags.h"
 #include "test_common.h"
+#include "trace_recorder.h"
+#include "trace_replay.h"
 
+#include <absl/strings/str_cat.h>
 #include <doctest/doctest.h>
 #include <fruit/fruit.h>
 #include <memory>
@@ -14,11 +24,15 @@ namespace securefs::full_format
 {
 namespace
 {
-    template <bool CaseInsensitive>
-    fruit::Component<FuseHighLevelOpsBase> get_test_component(std::shared_ptr<OSService> os)
+    using TestInjector = fruit::Injector<FuseHighLevelOpsBase, ::securefs::RepoVerifier>;
+
+    template <bool CaseInsensitive, bool WriteBehind = false>
+    fruit::Component<FuseHighLevelOpsBase, ::securefs::RepoVerifier>
+    get_test_component(std::shared_ptr<OSService> os)
     {
         return fruit::createComponent()
             .bind<FuseHighLevelOpsBase, full_format::FuseHighLevelOps>()
+            .bind<::securefs::RepoVerifier, full_format::RepoVerifier>()
             .install(full_format::get_table_io_component, 2)
             .template registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
             .template registerProvider<fruit::Annotated<tStoreTimeWithinFs, bool>()>(
@@ -26,6 +40,11 @@ namespace
             .template registerProvider<fruit::Annotated<tReadOnly, bool>()>([]() { return false; })
             .template registerProvider<fruit::Annotated<tCaseInsensitive, bool>()>(
                 []() { return CaseInsensitive; })
+            .template registerProvider<fruit::Annotated<tWriteBehindLimit, unsigned>()>(
+                []() { return WriteBehind ? 1u : 0u; })
+            .template registerProvider<fruit::Annotated<tFsyncWindow, unsigned>()>(
+                []() { return 0u; })
+            .template registerProvider<fruit::Annotated<tKeepCache, bool>()>([]() { return true; })
             .template bind<Directory, BtreeDirectory>()
             .template registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>(
                 []() { return 0u; })
@@ -48,7 +67,7 @@ namespace
         auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
         OSService::get_default().ensure_directory(temp_dir_name, 0755);
         auto root = std::make_shared<OSService>(temp_dir_name);
-        fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<false>, root);
+        TestInjector injector(get_test_component<false>, root);
         testing::test_fuse_ops(injector.get<FuseHighLevelOpsBase&>(), *root, false);
     }
     TEST_CASE("Full format test (case insensitive)")
@@ -56,8 +75,455 @@ namespace
         auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
         OSService::get_default().ensure_directory(temp_dir_name, 0755);
         auto root = std::make_shared<OSService>(temp_dir_name);
-        fruit::Injector<FuseHighLevelOpsBase> injector(get_test_component<true>, root);
+        TestInjector injector(get_test_component<true>, root);
         testing::test_fuse_ops(injector.get<FuseHighLevelOpsBase&>(), *root, true);
     }
+
+    TEST_CASE("Full format test (write-behind)")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        TestInjector injector(get_test_component<false, true>, root);
+        testing::test_fuse_ops(injector.get<FuseHighLevelOpsBase&>(), *root, false);
+    }
+
+    TEST_CASE("Sync of unchanged streams is skipped")
+    {
+        auto open_stream = []()
+        {
+            return std::make_shared<testing::SyncCountingStream>(
+                OSService::get_default().open_file_stream(
+                    OSService::temp_name("tmp/sync", ".bin"), O_RDWR | O_CREAT | O_EXCL, 0644));
+        };
+        auto data = open_stream(), meta = open_stream();
+        FileKeyCache key_cache;
+        FsyncBatcher batcher(absl::ZeroDuration());
+        RegularFile file(data, meta, key_type(0x99), id_type{}, true, 60, 12, 0, true, key_cache);
+        FileLockGuard lg(file);
+        file.initialize_empty(0644 | S_IFREG, 0, 0);
+
+        // Everything counts as changed after opening.
+        file.sync(batcher, true);
+        CHECK(meta->fdatasyncs == 1);
+        CHECK(data->fdatasyncs == 1);
+        file.sync(batcher, true);
+        CHECK(meta->syncs() == 1);
+        CHECK(data->syncs() == 1);
+        file.sync(batcher, false);
+        CHECK(meta->fsyncs == 1);
+        CHECK(data->fsyncs == 1);
+        file.sync(batcher, false);
+        CHECK(meta->syncs() == 2);
+        CHECK(data->syncs() == 2);
+
+        // Attributes live in the header, so fdatasync skips them, and fsync skips the data stream.
+        file.set_mode(S_IFREG | 0600);
+        file.sync(batcher, true);
+        CHECK(meta->syncs() == 2);
+        file.sync(batcher, false);
+        CHECK(meta->fsyncs == 2);
+        CHECK(data->syncs() == 2);
+
+        file.write("hello", 0, 5);
+        file.sync(batcher, true);
+        CHECK(meta->fdatasyncs == 2);
+        CHECK(data->fdatasyncs == 2);
+        CHECK(meta->fsyncs == 2);
+        CHECK(data->fsyncs == 1);
+    }
+
+    TEST_CASE("Benchmark workloads")
+    {
+        auto run = [](BenchWorkload workload)
+        {
+            auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+            OSService::get_default().ensure_directory(temp_dir_name, 0755);
+            auto root = std::make_shared<OSService>(temp_dir_name);
+            TestInjector injector(get_test_component<false>, root);
+
+            BenchOptions options;
+            options.workload = workload;
+            options.threads = 2;
+            options.file_size = 10000;
+            options.io_size = 1000;
+            options.files = 40;
+            return run_fuse_bench(injector.get<FuseHighLevelOpsBase&>(), options);
+        };
+
+        auto report = run(BenchWorkload::kSequential);
+        CHECK(report.ops == 2 * (1 + 10 + 1 + 1 + 10 + 1));
+        CHECK(report.bytes == 2 * 2 * 10000);
+        CHECK(report.to_json().find(R"("write":{"count":20,)") != std::string::npos);
+
+        CHECK(run(BenchWorkload::kRandom).ops == 2 * (1 + 10 + 1));
+
+        report = run(BenchWorkload::kSmallFile);
+        CHECK(report.ops == 2 * 40 * 7);
+        CHECK(report.bytes == 2 * 40 * 2 * 1000);
+
+        report = run(BenchWorkload::kMetadata);
+        CHECK(report.ops == 2 * (40 * 5 + 2));
+        CHECK(report.bytes == 0);
+    }
+
+    TEST_CASE("Trace recording and replay")
+    {
+        using trace::FuseTracer;
+        auto trace_file = OSService::temp_name("tmp/trace", ".bin");
+        uint64_t new_hash;
+        {
+            auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+            OSService::get_default().ensure_directory(temp_dir_name, 0755);
+            auto root = std::make_shared<OSService>(temp_dir_name);
+            TestInjector injector(get_test_component<false>, root);
+            auto&& ops = injector.get<FuseHighLevelOpsBase&>();
+            fuse_context ctx{};
+            fuse_file_info info{};
+            fuse_stat st{};
+            std::vector<char> buffer(4096, 'x');
+
+            // Exists before the trace starts, so the replay has to create it.
+            info.flags = O_RDWR;
+            REQUIRE(ops.vcreate("/old", 0644, &info, &ctx) == 0);
+            REQUIRE(ops.vftruncate("/old", 5000, &info, &ctx) == 0);
+            REQUIRE(ops.vrelease("/old", &info, &ctx) == 0);
+
+            trace::TraceRecorder recorder(trace_file);
+            new_hash = recorder.hash_path("/new");
+            CHECK(recorder.hash_path("/") == trace::kRootPathHash);
+            auto call
+                = [](FuseOp op, auto&& func, std::initializer_list<trace::WrappedFuseArg> args)
+            { return FuseTracer::traced_call(func, op, __LINE__, args); };
+
+            // As FUSE passes for operations on handles.
+            const char* no_path = nullptr;
+            const char* path = "/new";
+            fuse_mode_t mode = 0644;
+            info = {};
+            info.flags = O_RDWR | O_CREAT;
+            REQUIRE(call(FuseOp::kCreate,
+                         [&]() { return ops.vcreate(path, mode, &info, &ctx); },
+                         {{"path", {path}}, {"mode", {mode}}, {"info", {&info}}})
+                    == 0);
+            for (fuse_off_t offset : {0, 4096})
+            {
+                size_t size = buffer.size();
+                REQUIRE(call(FuseOp::kWrite,
+                             [&]() {
+                                 return ops.vwrite(
+                                     no_path, buffer.data(), size, offset, &info, &ctx);
+                             },
+                             {{"path", {no_path}},
+                              {"buf", {static_cast<const void*>(buffer.data())}},
+                              {"size", {size}},
+                              {"offset", {offset}},
+                              {"info", {&info}}})
+                        == 4096);
+            }
+            REQUIRE(call(FuseOp::kRelease,
+                         [&]() { return ops.vrelease(no_path, &info, &ctx); },
+                         {{"path", {no_path}}, {"info", {&info}}})
+                    == 0);
+
+            path = "/old";
+            info = {};
+            info.flags = O_RDONLY;
+            REQUIRE(call(FuseOp::kOpen,
+                         [&]() { return ops.vopen(path, &info, &ctx); },
+                         {{"path", {path}}, {"info", {&info}}})
+                    == 0);
+            size_t size = buffer.size();
+            fuse_off_t offset = 1000;
+            REQUIRE(call(FuseOp::kRead,
+                         [&]()
+                         { return ops.vread(no_path, buffer.data(), size, offset, &info, &ctx); },
+                         {{"path", {no_path}},
+                          {"buf", {static_cast<const void*>(buffer.data())}},
+                          {"size", {size}},
+                          {"offset", {offset}},
+                          {"info", {&info}}})
+                    == 4000);
+            REQUIRE(call(FuseOp::kRelease,
+                         [&]() { return ops.vrelease(no_path, &info, &ctx); },
+                         {{"path", {no_path}}, {"info", {&info}}})
+                    == 0);
+
+            path = "/missing";
+            CHECK(call(FuseOp::kGetattr,
+                       [&]() { return ops.vgetattr(path, &st, &ctx); },
+                       {{"path", {path}}, {"st", {&st}}})
+                  == -ENOENT);
+        }
+
+        auto records = trace::read_trace_file(trace_file);
+        REQUIRE(records.size() == 8);
+        CHECK(records[0].fuse_op() == FuseOp::kCreate);
+        CHECK(records[0].path_hash == new_hash);
+        CHECK(records[1].path_hash == 0);
+        CHECK(records[1].handle == records[0].handle);
+        CHECK(records[2].offset == 4096);
+        CHECK(records[5].size == 4096);
+        CHECK(records[5].result == 4000);
+        CHECK(records[7].result == -ENOENT);
+        for (const auto& r : records)
+        {
+            CHECK(r.thread == records[0].thread);
+        }
+
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        TestInjector injector(get_test_component<false>, root);
+        trace::ReplayOptions options;
+        options.speed = 0;
+        auto report
+            = trace::replay_trace(injector.get<FuseHighLevelOpsBase&>(), records, options);
+        CHECK(report.ops == 8);
+        CHECK(report.skipped == 0);
+        CHECK(report.mismatched == 0);
+        CHECK(report.per_op[static_cast<size_t>(FuseOp::kWrite)].calls == 2);
+        CHECK(report.per_op[static_cast<size_t>(FuseOp::kGetattr)].errors == 1);
+    }
+
+    TEST_CASE("Replay of overlapping opens of one file")
+    {
+        using trace::FuseTracer;
+        auto trace_file = OSService::temp_name("tmp/trace", ".bin");
+        {
+            auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+            OSService::get_default().ensure_directory(temp_dir_name, 0755);
+            auto root = std::make_shared<OSService>(temp_dir_name);
+            TestInjector injector(get_test_component<false>, root);
+            auto&& ops = injector.get<FuseHighLevelOpsBase&>();
+            fuse_context ctx{};
+            fuse_file_info first{}, second{};
+            std::vector<char> buffer(100);
+
+            first.flags = O_RDWR;
+            REQUIRE(ops.vcreate("/file", 0644, &first, &ctx) == 0);
+            REQUIRE(ops.vftruncate("/file", 1000, &first, &ctx) == 0);
+            REQUIRE(ops.vrelease("/file", &first, &ctx) == 0);
+
+            trace::TraceRecorder recorder(trace_file);
+            auto call
+                = [](FuseOp op, auto&& func, std::initializer_list<trace::WrappedFuseArg> args)
+            { return FuseTracer::traced_call(func, op, __LINE__, args); };
+            const char* no_path = nullptr;
+            const char* path = "/file";
+            for (fuse_file_info* info : {&first, &second})
+            {
+                *info = {};
+                info->flags = O_RDONLY;
+                REQUIRE(call(FuseOp::kOpen,
+                             [&]() { return ops.vopen(path, info, &ctx); },
+                             {{"path", {path}}, {"info", {info}}})
+                        == 0);
+            }
+            // The full format hands out one handle per file, not per open.
+            REQUIRE(first.fh == second.fh);
+            REQUIRE(call(FuseOp::kRelease,
+                         [&]() { return ops.vrelease(no_path, &first, &ctx); },
+                         {{"path", {no_path}}, {"info", {&first}}})
+                    == 0);
+            size_t size = buffer.size();
+            fuse_off_t offset = 0;
+            REQUIRE(call(FuseOp::kRead,
+                         [&]()
+                         { return ops.vread(no_path, buffer.data(), size, offset, &second, &ctx); },
+                         {{"path", {no_path}},
+                          {"buf", {static_cast<const void*>(buffer.data())}},
+                          {"size", {size}},
+                          {"offset", {offset}},
+                          {"info", {&second}}})
+                    == 100);
+            REQUIRE(call(FuseOp::kRelease,
+                         [&]() { return ops.vrelease(no_path, &second, &ctx); },
+                         {{"path", {no_path}}, {"info", {&second}}})
+                    == 0);
+        }
+
+        auto records = trace::read_trace_file(trace_file);
+        REQUIRE(records.size() == 5);
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        TestInjector injector(get_test_component<false>, root);
+        trace::ReplayOptions options;
+        options.speed = 0;
+        auto report
+            = trace::replay_trace(injector.get<FuseHighLevelOpsBase&>(), records, options);
+        CHECK(report.ops == 5);
+        CHECK(report.skipped == 0);
+        CHECK(report.mismatched == 0);
+        CHECK(report.per_op[static_cast<size_t>(FuseOp::kRelease)].calls == 2);
+    }
+
+    TEST_CASE("Repository verification")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        {
+            TestInjector injector(get_test_component<false>, root);
+            auto&& ops = injector.get<FuseHighLevelOpsBase&>();
+            fuse_context ctx{};
+            fuse_file_info info{};
+            std::vector<char> buffer(5000, 'x');
+            REQUIRE(ops.vmkdir("/dir", 0755, &ctx) == 0);
+            info.flags = O_RDWR;
+            REQUIRE(ops.vcreate("/dir/file", 0644, &info, &ctx) == 0);
+            REQUIRE(ops.vwrite("/dir/file", buffer.data(), buffer.size(), 0, &info, &ctx)
+                    == static_cast<int>(buffer.size()));
+            REQUIRE(ops.vrelease("/dir/file", &info, &ctx) == 0);
+            REQUIRE(ops.vlink("/dir/file", "/link", &ctx) == 0);
+            REQUIRE(ops.vsymlink("/dir/file", "/sym", &ctx) == 0);
+        }
+
+        auto verify = [&]()
+        {
+            TestInjector injector(get_test_component<false>, root);
+            WalkOptions options;
+            options.threads = 2;
+            return injector.get<::securefs::RepoVerifier&>().verify(options);
+        };
+        auto report = verify();
+        CHECK(report.ok());
+        CHECK(report.totals.files == 1);
+        CHECK(report.totals.directories == 2);
+        CHECK(report.totals.symlinks == 1);
+        CHECK(report.totals.bytes == 5000);
+
+        // An object that no directory entry names.
+        std::string orphan = "ab/" + std::string(62, 'c');
+        root->ensure_directory("ab", 0755);
+        root->open_file_stream(orphan, O_RDWR | O_CREAT, 0644);
+        root->open_file_stream(orphan + ".meta", O_RDWR | O_CREAT, 0644);
+        report = verify();
+        REQUIRE(report.totals.problems == 1);
+        CHECK(report.problems[0].find("not reachable") != std::string::npos);
+
+        // Only the content of the regular file has this size.
+        OSService::get_default().recursive_traverse(
+            temp_dir_name,
+            [](const std::string& dir, const std::string& name, int type)
+            {
+                if (type != S_IFREG)
+                {
+                    return;
+                }
+                auto stream = OSService::get_default().open_file_stream(
+                    absl::StrCat(dir, "/", name), O_RDWR, 0);
+                if (stream->size() == 5000)
+                {
+                    char c = 0;
+                    stream->write(&c, 100, 1);
+                }
+            });
+        report = verify();
+        CHECK(report.totals.problems == 2);
+        // The file is verified under the first of its names to be found.
+        CHECK(report.to_text().find("/link: ") != std::string::npos);
+    }
+
+    TEST_CASE("Bulk import and export")
+    {
+        auto source_dir = OSService::temp_name("tmp/import", "dir");
+        auto dest_dir = OSService::temp_name("tmp/export", "dir");
+        std::string content(2500, 'y');
+        fuse_timespec ts[2] = {{1000000000, 0}, {1200000000, 0}};
+        {
+            OSService::get_default().ensure_directory(source_dir, 0755);
+            OSService source(source_dir);
+            source.mkdir("sub", 0750);
+            source.open_file_stream("sub/a", O_RDWR | O_CREAT, 0640)
+                ->write(content.data(), 0, content.size());
+            source.chmod("sub/a", 0640);
+            source.utimens("sub/a", ts);
+            source.open_file_stream("b", O_RDWR | O_CREAT, 0600);
+            source.symlink("sub/a", "s");
+        }
+
+        auto temp_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        auto root = std::make_shared<OSService>(temp_dir_name);
+        TestInjector injector(get_test_component<false>, root);
+        auto&& ops = injector.get<FuseHighLevelOpsBase&>();
+        TransferOptions options;
+        options.walk.threads = 2;
+        // Smaller than the file, so that it takes several writes.
+        options.chunk_size = 1000;
+
+        auto report = import_tree(ops, source_dir, "/in/", options);
+        CHECK(report.ok());
+        CHECK(report.totals.files == 2);
+        CHECK(report.totals.directories == 2);
+        CHECK(report.totals.symlinks == 1);
+        CHECK(report.totals.bytes == content.size());
+
+        fuse_context ctx{};
+        fuse_stat st{};
+        REQUIRE(ops.vgetattr("/in/sub/a", &st, &ctx) == 0);
+        CHECK((st.st_mode & 07777) == 0640);
+        CHECK(st.st_size == static_cast<fuse_off_t>(content.size()));
+        CHECK(get_mtim(st).tv_sec == ts[1].tv_sec);
+        REQUIRE(ops.vgetattr("/in/sub", &st, &ctx) == 0);
+        CHECK((st.st_mode & 07777) == 0750);
+
+        // Nothing is overwritten.
+        report = import_tree(ops, source_dir, "/in", options);
+        CHECK(report.totals.problems == 3);
+
+        // Only what differs from the source is copied again when resuming.
+        options.resume = true;
+        report = import_tree(ops, source_dir, "/in", options);
+        CHECK(report.ok());
+        CHECK(report.totals.files == 2);
+        CHECK(report.totals.bytes == 0);
+        ts[1].tv_sec += 10;
+        OSService(source_dir).utimens("sub/a", ts);
+        report = import_tree(ops, source_dir, "/in", options);
+        CHECK(report.ok());
+        CHECK(report.totals.bytes == content.size());
+        options.resume = false;
+
+        report = export_tree(ops, "/in", dest_dir, options);
+        CHECK(report.ok());
+        CHECK(report.totals.files == 2);
+        OSService dest(dest_dir);
+        CHECK(dest.open_file_stream("sub/a", O_RDONLY, 0)->as_string() == content);
+        REQUIRE(dest.stat("sub/a", &st));
+        CHECK((st.st_mode & 07777) == 0640);
+        CHECK(get_mtim(st).tv_sec == ts[1].tv_sec);
+        REQUIRE(dest.stat("b", &st));
+        CHECK(st.st_size == 0);
+        std::string target(100, '\0');
+        target.resize(dest.readlink("s", target.data(), target.size()));
+        CHECK(target == "sub/a");
+
+        // Between two repositories, as in a conversion.
+        auto other_dir_name = OSService::temp_name("tmp/full", "dir");
+        OSService::get_default().ensure_directory(other_dir_name, 0755);
+        TestInjector other_injector(get_test_component<false>,
+                                    std::make_shared<OSService>(other_dir_name));
+        auto&& other_ops = other_injector.get<FuseHighLevelOpsBase&>();
+        report = copy_tree(ops, "/", other_ops, "/", options);
+        CHECK(report.ok());
+        CHECK(report.totals.directories == 3);
+        CHECK(report.totals.bytes == content.size());
+        REQUIRE(other_ops.vgetattr("/in/sub/a", &st, &ctx) == 0);
+        CHECK(st.st_size == static_cast<fuse_off_t>(content.size()));
+        CHECK(get_mtim(st).tv_sec == ts[1].tv_sec);
+    }
 }    // namespace
 }    // namespace securefs::full_format
+
+namespace securefs::testing
+{
+fruit::Component<FuseHighLevelOpsBase>
+get_full_format_test_component(std::shared_ptr<OSService> root)
+{
+    return fruit::createComponent().install(full_format::get_test_component<false>,
+                                            std::move(root));
+}
+}    // namespace securefs::testing
@@ -0,0 +1,154 @@
+#include "exceptions.h"
+#include "fuse2_workaround.h"
+
+#include <doctest/doctest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Parsing of FUSE thread options")
+    {
+        auto options = parse_thread_options("", 0, 8);
+        CHECK(options.min_threads == 8);
+        CHECK(options.max_threads == 8);
+        CHECK(options.metadata_threads == 0);
+
+        options = parse_thread_options("4", 0, 8);
+        CHECK(options.min_threads == 4);
+        CHECK(options.max_threads == 4);
+
+        options = parse_thread_options("2:8", 3, 4);
+        CHECK(options.min_threads == 2);
+        CHECK(options.max_threads == 8);
+        CHECK(options.metadata_threads == 3);
+
+        // Some systems cannot tell the number of hardware threads.
+        options = parse_thread_options("", 0, 0);
+        CHECK(options.min_threads == 1);
+        CHECK(options.max_threads == 1);
+
+        CHECK_THROWS_AS(parse_thread_options("0:4", 0, 8), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options("8:2", 0, 8), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options("4:", 0, 8), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options(":4", 0, 8), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options("1:2:3", 0, 8), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options("four", 0, 8), InvalidArgumentException);
+
+        // The metadata threads must leave at least one worker to reads and writes.
+        CHECK(parse_thread_options("2:8", 7, 4).metadata_threads == 7);
+        CHECK_THROWS_AS(parse_thread_options("2:8", 8, 4), InvalidArgumentException);
+        CHECK_THROWS_AS(parse_thread_options("4", 5, 8), InvalidArgumentException);
+        // Without --threads, against the number of hardware threads.
+        CHECK(parse_thread_options("", 3, 4).metadata_threads == 3);
+        CHECK_THROWS_AS(parse_thread_options("", 4, 4), InvalidArgumentException);
+    }
+
+    TEST_CASE("FUSE workers grow while saturated and retire while idle")
+    {
+        FuseThreadOptions options;
+        options.min_threads = 2;
+        options.max_threads = 3;
+        FuseWorkerScheduler<int> scheduler(options, 1);
+        scheduler.add_worker();
+        scheduler.add_worker();
+
+        CHECK(!scheduler.begin_request());
+        // The last idle worker takes a request, so another one is started.
+        CHECK(scheduler.begin_request());
+        CHECK(scheduler.live() == 3);
+        // Never beyond the maximum.
+        CHECK(!scheduler.begin_request());
+        CHECK(!scheduler.begin_request());
+        CHECK(scheduler.live() == 3);
+        CHECK(scheduler.busy() == 4);
+
+        CHECK(!scheduler.end_request());
+        CHECK(!scheduler.end_request());
+        CHECK(!scheduler.end_request());
+        // Three idle workers are one more than needed.
+        CHECK(scheduler.end_request());
+        CHECK(scheduler.live() == 2);
+        CHECK(scheduler.busy() == 0);
+        CHECK(!scheduler.begin_request());
+        CHECK(!scheduler.end_request());
+
+        scheduler.stop();
+        CHECK(!scheduler.begin_request());
+        CHECK(!scheduler.begin_request());
+        CHECK(scheduler.live() == 2);
+    }
+
+    TEST_CASE("FUSE data requests beyond their share are deferred")
+    {
+        FuseThreadOptions options;
+        options.min_threads = options.max_threads = 3;
+        options.metadata_threads = 1;
+        FuseWorkerScheduler<int> scheduler(options, 2);
+
+        int request = 1;
+        CHECK(scheduler.begin_data(request));
+        request = 2;
+        CHECK(scheduler.begin_data(request));
+        for (int deferred : {3, 4})
+        {
+            request = deferred;
+            CHECK(!scheduler.begin_data(request));
+        }
+        CHECK(scheduler.deferred() == 2);
+
+        // The queue is full, so the next worker to receive a data request waits for room.
+        std::atomic<bool> returned{false};
+        std::thread blocked(
+            [&]()
+            {
+                int late = 5;
+                CHECK(!scheduler.begin_data(late));
+                returned = true;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(!returned);
+
+        // The workers busy with data requests take the deferred ones in order.
+        CHECK(scheduler.end_data() == 3);
+        blocked.join();
+        CHECK(returned);
+        CHECK(scheduler.end_data() == 4);
+        CHECK(scheduler.end_data() == 5);
+        CHECK(scheduler.end_data() == std::nullopt);
+        CHECK(scheduler.end_data() == std::nullopt);
+        CHECK(scheduler.deferred() == 0);
+
+        request = 6;
+        CHECK(scheduler.begin_data(request));
+        CHECK(scheduler.end_data() == std::nullopt);
+    }
+
+    TEST_CASE("Stopping the FUSE workers wakes those waiting to defer")
+    {
+        FuseThreadOptions options;
+        options.min_threads = options.max_threads = 2;
+        options.metadata_threads = 1;
+        FuseWorkerScheduler<int> scheduler(options, 1);
+
+        int request = 1;
+        CHECK(scheduler.begin_data(request));
+        request = 2;
+        CHECK(!scheduler.begin_data(request));
+        std::thread blocked(
+            [&]()
+            {
+                int late = 3;
+                CHECK(!scheduler.begin_data(late));
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        scheduler.stop();
+        blocked.join();
+        CHECK(scheduler.deferred() == 1);
+    }
+}    // namespace
+}    // namespace securefs
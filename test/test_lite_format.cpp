@@ -1,7 +1,14 @@
+#include "bulk_transfer.h"
 #include "lite_format.h"
+#include "lite_long_name_lookup_table.h"
+#include "lock_guard.h"
 #include "mystring.h"
 #include "myutils.h"
+#include "params_io.h"
 #include "platform.h"
+#include "repo_verifier.h"
+#include "stat_workaround.h"
+#include "stats_file_ops.h"
 #include "tags.h"
 #include "test_common.h"
 
@@ -19,6 +26,7 @@
 #include <array>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace securefs::lite_format
 {
@@ -43,7 +51,14 @@ namespace
         CHECK(NameTranslator::remove_last_component("/cc/abcde") == "/cc/");
     }
 
-    fruit::Component<StreamOpener, XattrCryptor, fruit::Annotated<tNameMasterKey, key_type>>
+    fruit::Component<StreamOpener,
+                     XattrCryptor,
+                     fruit::Annotated<tNameMasterKey, key_type>,
+                     fruit::Annotated<tReadAheadBlocks, unsigned>,
+                     fruit::Annotated<tWriteBehindLimit, unsigned>,
+                     fruit::Annotated<tFsyncWindow, unsigned>,
+                     fruit::Annotated<tAttrCacheTimeout, unsigned>,
+                     fruit::Annotated<tKeepCache, bool>>
     get_test_component()
     {
         return fruit::createComponent()
@@ -58,7 +73,49 @@ namespace
             .registerProvider<fruit::Annotated<tVerify, bool>()>([]() { return true; })
             .registerProvider<fruit::Annotated<tBlockSize, unsigned>()>([]() { return 64u; })
             .registerProvider<fruit::Annotated<tIvSize, unsigned>()>([]() { return 12u; })
-            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>([]() { return 24u; });
+            .registerProvider<fruit::Annotated<tMaxPaddingSize, unsigned>()>([]() { return 24u; })
+            .registerProvider<fruit::Annotated<tReadAheadBlocks, unsigned>()>([]() { return 4u; })
+            .registerProvider<fruit::Annotated<tWriteBehindLimit, unsigned>()>([]() { return 1u; })
+            .registerProvider<fruit::Annotated<tFsyncWindow, unsigned>()>([]() { return 100u; })
+            .registerProvider<fruit::Annotated<tAttrCacheTimeout, unsigned>()>(
+                []() { return 30u; })
+            .registerProvider<fruit::Annotated<tKeepCache, bool>()>([]() { return true; });
+    }
+
+    // Plain text names, or encrypted ones with a long name threshold that the tests can cross.
+    fruit::Component<NameNormalizationFlags> get_test_name_flags_component(bool plain_names)
+    {
+        if (plain_names)
+        {
+            return fruit::createComponent().registerProvider(
+                []()
+                {
+                    NameNormalizationFlags flags{};
+                    flags.no_op = true;
+                    return flags;
+                });
+        }
+        return fruit::createComponent().registerProvider(
+            []()
+            {
+                NameNormalizationFlags flags{};
+                flags.long_name_threshold = 133;
+                return flags;
+            });
+    }
+
+    using WholeTestInjector = fruit::Injector<FuseHighLevelOps, ::securefs::RepoVerifier>;
+
+    // The whole filesystem over `os`, and the verifier of its repository.
+    fruit::Component<FuseHighLevelOps, ::securefs::RepoVerifier>
+    get_whole_test_component(OSService* os, bool plain_names)
+    {
+        return fruit::createComponent()
+            .install(get_test_name_flags_component, plain_names)
+            .install(get_name_translator_component)
+            .install(get_test_component)
+            .bind<::securefs::RepoVerifier, RepoVerifier>()
+            .bindInstance(*os);
     }
 
     TEST_CASE("case folding name translator")
@@ -105,6 +162,34 @@ namespace
                                       nullptr));
     }
 
+    TEST_CASE("Case folding and normalizing name translator")
+    {
+        fruit::Injector<NameTranslator> injector(+[]() -> fruit::Component<NameTranslator>
+                                                 {
+                                                     return fruit::createComponent()
+                                                         .registerProvider(
+                                                             []()
+                                                             {
+                                                                 NameNormalizationFlags flags{};
+                                                                 flags.should_case_fold = true;
+                                                                 flags.should_normalize_nfc = true;
+                                                                 return flags;
+                                                             })
+                                                         .install(get_name_translator_component)
+                                                         .install(get_test_component);
+                                                 });
+        auto t = injector.get<NameTranslator*>();
+
+        CHECK(t->normalize_path("/abCDe/Foo.TXT") == "/abcde/foo.txt");
+        CHECK(t->normalize_path("") == "");
+        // Mixes ASCII components with others, twice so that the second time hits the cache.
+        for (int i = 0; i < 2; ++i)
+        {
+            CHECK(t->normalize_path("/ABC/\xc3\x84X/A\xcc\x88/Stra\xc3\x9f" "e/")
+                  == "/abc/\xc3\xa4x/\xc3\xa4/strasse/");
+        }
+    }
+
     TEST_CASE("Lite FuseHighLevelOps")
     {
         auto whole_component = [](OSService* os) -> fruit::Component<FuseHighLevelOps>
@@ -130,5 +215,272 @@ namespace
         auto& ops = injector.get<FuseHighLevelOps&>();
         testing::test_fuse_ops(ops, root);
     }
+
+    TEST_CASE("Stats file over lite FuseHighLevelOps")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+
+        WholeTestInjector injector(get_whole_test_component, &root, false);
+        StatsFileOps ops(injector.get<FuseHighLevelOps&>(), "/.securefs/stats");
+        // Everything else behaves as without the stats file, which is not listed in the root.
+        testing::test_fuse_ops(ops, root);
+
+        fuse_context ctx{};
+        fuse_stat st{};
+        REQUIRE(ops.vgetattr("/.securefs", &st, &ctx) == 0);
+        CHECK((st.st_mode & S_IFMT) == S_IFDIR);
+        REQUIRE(ops.vgetattr("/.securefs/stats", &st, &ctx) == 0);
+        CHECK((st.st_mode & S_IFMT) == S_IFREG);
+        CHECK(ops.vgetattr("/.securefs/other", &st, &ctx) == -ENOENT);
+
+        fuse_file_info info{};
+        info.flags = O_RDWR;
+        CHECK(ops.vopen("/.securefs/stats", &info, &ctx) == -EACCES);
+        CHECK(ops.vunlink("/.securefs/stats", &ctx) == -EACCES);
+
+        info.flags = O_RDONLY;
+        REQUIRE(ops.vopen("/.securefs/stats", &info, &ctx) == 0);
+        CHECK(info.direct_io);
+        std::string content(1 << 16, '\0');
+        int size = ops.vread(nullptr, content.data(), content.size(), 0, &info, &ctx);
+        REQUIRE(size > 0);
+        content.resize(size);
+        CHECK(absl::StartsWith(content, R"({"ops":{)"));
+        CHECK(ops.vrelease(nullptr, &info, &ctx) == 0);
+
+        fuse_file_info dir_info{};
+        REQUIRE(ops.vopendir("/.securefs", &dir_info, &ctx) == 0);
+        std::vector<std::string> names;
+        REQUIRE(ops.vreaddir(
+                    nullptr,
+                    &names,
+                    [](void* buf, const char* name, const fuse_stat*, fuse_off_t)
+                    {
+                        static_cast<std::vector<std::string>*>(buf)->emplace_back(name);
+                        return 0;
+                    },
+                    0,
+                    &dir_info,
+                    &ctx)
+                == 0);
+        CHECK(names == std::vector<std::string>{".", "..", "stats"});
+        CHECK(ops.vreleasedir(nullptr, &dir_info, &ctx) == 0);
+    }
+
+    TEST_CASE("Conversion between full and lite format")
+    {
+        auto whole_component = [](OSService* os) -> fruit::Component<FuseHighLevelOps>
+        {
+            return fruit::createComponent()
+                .registerProvider(
+                    []()
+                    {
+                        NameNormalizationFlags flags{};
+                        flags.long_name_threshold = 133;
+                        return flags;
+                    })
+                .install(get_name_translator_component)
+                .install(get_test_component)
+                .bindInstance(*os);
+        };
+        auto make_dir = [](const char* prefix)
+        {
+            auto dir = OSService::temp_name(prefix, "dir");
+            OSService::get_default().ensure_directory(dir, 0755);
+            return dir;
+        };
+
+        fruit::Injector<FuseHighLevelOpsBase> full_injector(
+            testing::get_full_format_test_component,
+            std::make_shared<OSService>(make_dir("tmp/full")));
+        auto& full_ops = full_injector.get<FuseHighLevelOpsBase&>();
+        OSService lite_root(make_dir("tmp/lite"));
+        fruit::Injector<FuseHighLevelOps> lite_injector(+whole_component, &lite_root);
+        auto& lite_ops = lite_injector.get<FuseHighLevelOps&>();
+
+        // Several blocks of either format, and a name longer than the long name threshold.
+        std::string content(3000, 'z');
+        std::string long_name = "/d/" + std::string(150, 'n');
+        fuse_timespec ts[2] = {{1000000000, 0}, {1300000000, 500}};
+        fuse_context ctx{};
+        fuse_file_info info{};
+        REQUIRE(full_ops.vmkdir("/d", 0755, &ctx) == 0);
+        for (const std::string& path : {std::string("/d/f"), long_name})
+        {
+            info.flags = O_RDWR;
+            REQUIRE(full_ops.vcreate(path.c_str(), 0644, &info, &ctx) == 0);
+            REQUIRE(full_ops.vwrite(path.c_str(), content.data(), content.size(), 0, &info, &ctx)
+                    == static_cast<int>(content.size()));
+            REQUIRE(full_ops.vrelease(path.c_str(), &info, &ctx) == 0);
+            REQUIRE(full_ops.vchmod(path.c_str(), 0640, &ctx) == 0);
+            REQUIRE(full_ops.vutimens(path.c_str(), ts, &ctx) == 0);
+        }
+        REQUIRE(full_ops.vchmod("/d", 0750, &ctx) == 0);
+        REQUIRE(full_ops.vsymlink("d/f", "/s", &ctx) == 0);
+
+        auto check_copy = [&](FuseHighLevelOpsBase& ops)
+        {
+            fuse_stat st{};
+            REQUIRE(ops.vgetattr("/d", &st, &ctx) == 0);
+            CHECK((st.st_mode & 07777) == 0750);
+            for (const std::string& path : {std::string("/d/f"), long_name})
+            {
+                REQUIRE(ops.vgetattr(path.c_str(), &st, &ctx) == 0);
+                CHECK((st.st_mode & 07777) == 0640);
+                CHECK(st.st_size == static_cast<fuse_off_t>(content.size()));
+                CHECK(get_mtim(st).tv_sec == ts[1].tv_sec);
+                CHECK(get_mtim(st).tv_nsec == ts[1].tv_nsec);
+                std::string read_back(content.size(), '\0');
+                info.flags = O_RDONLY;
+                REQUIRE(ops.vopen(path.c_str(), &info, &ctx) == 0);
+                CHECK(ops.vread(
+                          path.c_str(), read_back.data(), read_back.size(), 0, &info, &ctx)
+                      == static_cast<int>(content.size()));
+                CHECK(ops.vrelease(path.c_str(), &info, &ctx) == 0);
+                CHECK(read_back == content);
+            }
+            char target[100] = {};
+            REQUIRE(ops.vreadlink("/s", target, sizeof(target), &ctx) == 0);
+            CHECK(std::string_view(target) == "d/f");
+        };
+
+        TransferOptions options;
+        options.walk.threads = 2;
+        options.chunk_size = 1000;
+        auto report = copy_tree(full_ops, "/", lite_ops, "/", options);
+        CHECK(report.ok());
+        CHECK(report.totals.files == 2);
+        CHECK(report.totals.symlinks == 1);
+        check_copy(lite_ops);
+
+        // Resuming rewrites the files that changed since, even where an earlier pass has already
+        // left them and their directory without write permission.
+        REQUIRE(lite_ops.vchmod("/d/f", 0444, &ctx) == 0);
+        REQUIRE(lite_ops.vchmod("/d", 0555, &ctx) == 0);
+        ts[1].tv_sec += 10;
+        for (const std::string& path : {std::string("/d/f"), long_name})
+        {
+            REQUIRE(full_ops.vutimens(path.c_str(), ts, &ctx) == 0);
+        }
+        options.resume = true;
+        report = copy_tree(full_ops, "/", lite_ops, "/", options);
+        CHECK(report.ok());
+        CHECK(report.totals.bytes == 2 * content.size());
+        check_copy(lite_ops);
+        options.resume = false;
+
+        // And back into a fresh full format repository.
+        fruit::Injector<FuseHighLevelOpsBase> back_injector(
+            testing::get_full_format_test_component,
+            std::make_shared<OSService>(make_dir("tmp/full")));
+        auto& back_ops = back_injector.get<FuseHighLevelOpsBase&>();
+        report = copy_tree(lite_ops, "/", back_ops, "/", options);
+        CHECK(report.ok());
+        CHECK(report.totals.bytes == 2 * content.size());
+        check_copy(back_ops);
+    }
+
+    TEST_CASE("Repository verification")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        {
+            WholeTestInjector injector(get_whole_test_component, &root, false);
+            auto& ops = injector.get<FuseHighLevelOps&>();
+            fuse_context ctx{};
+            fuse_file_info info{};
+            std::vector<char> buffer(5000, 'x');
+            std::string long_name = "/" + std::string(150, 'n');
+            REQUIRE(ops.vmkdir("/dir", 0755, &ctx) == 0);
+            for (const std::string& path : {std::string("/dir/file"), long_name})
+            {
+                info.flags = O_RDWR;
+                REQUIRE(ops.vcreate(path.c_str(), 0644, &info, &ctx) == 0);
+                size_t size = path == long_name ? 10 : buffer.size();
+                REQUIRE(ops.vwrite(path.c_str(), buffer.data(), size, 0, &info, &ctx)
+                        == static_cast<int>(size));
+                REQUIRE(ops.vrelease(path.c_str(), &info, &ctx) == 0);
+            }
+            REQUIRE(ops.vsymlink("/dir/file", "/sym", &ctx) == 0);
+        }
+
+        auto verify = [&]()
+        {
+            WholeTestInjector injector(get_whole_test_component, &root, false);
+            WalkOptions options;
+            options.threads = 2;
+            return injector.get<::securefs::RepoVerifier&>().verify(options);
+        };
+        auto report = verify();
+        CHECK(report.ok());
+        CHECK(report.totals.files == 2);
+        CHECK(report.totals.directories == 2);
+        CHECK(report.totals.symlinks == 1);
+        CHECK(report.totals.bytes == 5010);
+
+        // An entry of the long name table whose file is gone.
+        {
+            LongNameLookupTable table(
+                root.norm_path_narrowed(std::string(kLongNameTableFileName)), false);
+            LockGuard<LongNameLookupTable> lg(table);
+            table.update_mapping("stale", "whatever");
+        }
+        report = verify();
+        REQUIRE(report.totals.problems == 1);
+        CHECK(report.problems[0].find("stale") != std::string::npos);
+
+        // Only the content of the large file is this long.
+        OSService::get_default().recursive_traverse(
+            temp_dir_name,
+            [](const std::string& dir, const std::string& name, int type)
+            {
+                if (type != S_IFREG || name == kLongNameTableFileName)
+                {
+                    return;
+                }
+                auto stream = OSService::get_default().open_file_stream(
+                    absl::StrCat(dir, "/", name), O_RDWR, 0);
+                if (stream->size() > 5000)
+                {
+                    char c = 0;
+                    REQUIRE(stream->read(&c, 1000, 1) == 1);
+                    c = static_cast<char>(~c);
+                    stream->write(&c, 1000, 1);
+                }
+            });
+        report = verify();
+        CHECK(report.totals.problems == 2);
+        CHECK(report.to_text().find("stale") != std::string::npos);
+    }
+
+    TEST_CASE("Repository verification with plain text names")
+    {
+        auto temp_dir_name = OSService::temp_name("tmp/lite", "dir");
+        OSService::get_default().ensure_directory(temp_dir_name, 0755);
+        OSService root(temp_dir_name);
+        WholeTestInjector injector(get_whole_test_component, &root, true);
+        {
+            // Dot files are part of the filesystem, but not the config next to them.
+            auto& ops = injector.get<FuseHighLevelOps&>();
+            fuse_context ctx{};
+            fuse_file_info info{};
+            info.flags = O_RDWR;
+            REQUIRE(ops.vcreate("/.hidden", 0644, &info, &ctx) == 0);
+            REQUIRE(ops.vwrite("/.hidden", "hidden", 6, 0, &info, &ctx) == 6);
+            REQUIRE(ops.vrelease("/.hidden", &info, &ctx) == 0);
+            root.open_file_stream(std::string(kConfigFileName), O_RDWR | O_CREAT, 0644)
+                ->write("not encrypted", 0, 13);
+        }
+
+        WalkOptions options;
+        options.threads = 2;
+        auto report = injector.get<::securefs::RepoVerifier&>().verify(options);
+        CHECK(report.ok());
+        CHECK(report.totals.files == 1);
+        CHECK(report.totals.bytes == 6);
+    }
 }    // namespace
 }    // namespace securefs::lite_format
@@ -0,0 +1,120 @@
+#include "logger.h"
+#include "mpsc_queue.h"
+#include "platform.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/str_split.h>
+#include <doctest/doctest.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Bounded MPSC queue")
+    {
+        BoundedMpscQueue<std::string> queue(3);
+        CHECK(queue.capacity() == 4);
+        for (int i = 0; i < 4; ++i)
+        {
+            std::string item = std::to_string(i);
+            uint64_t position = 100;
+            CHECK(queue.try_push(item, &position));
+            CHECK(position == static_cast<uint64_t>(i));
+        }
+        std::string extra = "extra";
+        uint64_t position = 100;
+        CHECK(!queue.try_push(extra, &position));
+        CHECK(extra == "extra");
+        CHECK(position == 100);
+        CHECK(queue.pushed() == 4);
+        CHECK(queue.popped() == 0);
+
+        std::vector<std::string> popped;
+        while (queue.try_pop([&](std::string& s) { popped.push_back(s); }))
+        {
+        }
+        CHECK(popped == std::vector<std::string>{"0", "1", "2", "3"});
+        CHECK(queue.popped() == 4);
+        CHECK(queue.try_push(extra, &position));
+        CHECK(position == 4);
+    }
+
+    TEST_CASE("Asynchronous logging keeps every line intact")
+    {
+        auto path = OSService::temp_name("tmp/log", ".txt");
+        {
+            std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+            logger->start_async(1 << 16);
+            std::vector<std::thread> threads;
+            for (int i = 0; i < 4; ++i)
+            {
+                threads.emplace_back(
+                    [&logger, i]()
+                    {
+                        for (int j = 0; j < 1000; ++j)
+                        {
+                            logger->log_v2(LoggingLevel::kLogInfo,
+                                           "test",
+                                           __LINE__,
+                                           "thread %d line %d",
+                                           i,
+                                           j);
+                        }
+                    });
+            }
+            for (auto&& t : threads)
+            {
+                t.join();
+            }
+        }
+
+        std::string content;
+        auto stream = OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+        content.resize(stream->size());
+        content.resize(stream->read(content.data(), 0, content.size()));
+        std::vector<std::string_view> lines = absl::StrSplit(content, '\n', absl::SkipEmpty());
+        CHECK(lines.size() == 4000);
+        for (std::string_view line : lines)
+        {
+            CHECK(absl::StartsWith(line, "[Info] "));
+            CHECK(absl::StrContains(line, "[test:"));
+        }
+    }
+
+    TEST_CASE("Asynchronous logging writes errors before returning")
+    {
+        auto path = OSService::temp_name("tmp/log", ".txt");
+        std::unique_ptr<Logger> logger(Logger::create_file_logger(path));
+        logger->start_async(1 << 10);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+        {
+            threads.emplace_back(
+                [&logger, i]()
+                {
+                    for (int j = 0; j < 100; ++j)
+                    {
+                        logger->log_v2(
+                            LoggingLevel::kLogInfo, "test", __LINE__, "thread %d line %d", i, j);
+                    }
+                });
+        }
+        logger->log_v2(LoggingLevel::kLogError, "test", __LINE__, "the error");
+
+        std::string content;
+        auto stream = OSService::get_default().open_file_stream(path, O_RDONLY, 0);
+        content.resize(stream->size());
+        content.resize(stream->read(content.data(), 0, content.size()));
+        CHECK(absl::StrContains(content, "the error"));
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+    }
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,88 @@
+#include "metrics.h"
+
+#include <doctest/doctest.h>
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Latency histogram buckets")
+    {
+        uint64_t previous_upper = 0;
+        for (size_t i = 0; i < LatencyHistogram::kNumBuckets; ++i)
+        {
+            auto lower = LatencyHistogram::bucket_lower_bound(i);
+            auto upper = LatencyHistogram::bucket_upper_bound(i);
+            CHECK(lower <= upper);
+            if (i > 0)
+            {
+                CHECK(lower == previous_upper + 1);
+            }
+            CHECK(LatencyHistogram::bucket_index(lower) == i);
+            CHECK(LatencyHistogram::bucket_index(upper) == i);
+            // The relative error stays within one sub-bucket.
+            CHECK(upper - lower <= lower / 16);
+            previous_upper = upper;
+        }
+        CHECK(LatencyHistogram::bucket_index(UINT64_MAX) == LatencyHistogram::kNumBuckets - 1);
+    }
+
+    TEST_CASE("Latency histogram percentiles")
+    {
+        LatencyHistogram h;
+        CHECK(h.percentile(50) == 0);
+        for (uint64_t v = 1; v <= 1000; ++v)
+        {
+            h.record(v * 1000);
+        }
+        CHECK(h.count() == 1000);
+        CHECK(h.max() == 1000000);
+        CHECK(h.mean() == 500500.0);
+        CHECK(h.percentile(50) >= 500000);
+        CHECK(h.percentile(50) <= 500000 * 17 / 16);
+        CHECK(h.percentile(99) >= 990000);
+        CHECK(h.percentile(100) == 1000000);
+    }
+
+    TEST_CASE("Metrics of all threads are merged")
+    {
+        auto before = metrics::snapshot();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+        {
+            threads.emplace_back(
+                [i]()
+                {
+                    for (int j = 0; j < 100; ++j)
+                    {
+                        metrics::record_call(FuseOp::kRead, 1000 * (i + 1), j % 10 == 0);
+                        metrics::increment(MetricCounter::kBytesDecrypted, 4096);
+                        metrics::adjust(MetricGauge::kFileTableLive, i % 2 == 0 ? 1 : -1);
+                    }
+                });
+        }
+        for (auto&& t : threads)
+        {
+            t.join();
+        }
+        auto after = metrics::snapshot();
+        CHECK(after.get(FuseOp::kRead).calls - before.get(FuseOp::kRead).calls == 400);
+        CHECK(after.get(FuseOp::kRead).errors - before.get(FuseOp::kRead).errors == 40);
+        CHECK(after.get(MetricCounter::kBytesDecrypted)
+                  - before.get(MetricCounter::kBytesDecrypted)
+              == 400 * 4096);
+        CHECK(after.get(MetricGauge::kFileTableLive) == before.get(MetricGauge::kFileTableLive));
+        CHECK(after.get(FuseOp::kRead).latency.max() >= 4000);
+        // The sums are exact, not estimated from the buckets.
+        auto latency_sum = [](const LatencyHistogram& h) { return h.mean() * h.count(); };
+        CHECK(latency_sum(after.get(FuseOp::kRead).latency)
+                  - latency_sum(before.get(FuseOp::kRead).latency)
+              == doctest::Approx(100 * (1000 + 2000 + 3000 + 4000)));
+        CHECK(after.to_json().find(R"("read":{"calls":)") != std::string::npos);
+    }
+}    // namespace
+}    // namespace securefs
@@ -0,0 +1,48 @@
+#include "parallel_walk.h"
+
+#include <doctest/doctest.h>
+
+#include <stdexcept>
+#include <string>
+
+namespace securefs
+{
+namespace
+{
+    TEST_CASE("Parallel walk with more tasks than may wait")
+    {
+        WalkOptions options;
+        options.threads = 2;
+        ParallelWalk walk(options);
+        uint64_t width = 4 * options.threads * ParallelWalk::kMaxPendingPerThread;
+        // Every worker submits a wide level at once, which cannot all wait for the pool.
+        for (unsigned i = 0; i < options.threads; ++i)
+        {
+            walk.submit("/",
+                        [&walk, width]()
+                        {
+                            ++walk.directories;
+                            for (uint64_t j = 0; j < width; ++j)
+                            {
+                                walk.submit(std::to_string(j),
+                                            [&walk, j]()
+                                            {
+                                                if (j % 1000 == 0)
+                                                {
+                                                    throw std::runtime_error("bad");
+                                                }
+                                                ++walk.files;
+                                            });
+                            }
+                        });
+        }
+        walk.wait();
+        auto report = walk.report();
+        CHECK(report.totals.directories == options.threads);
+        CHECK(report.totals.files + report.totals.problems == options.threads * width);
+        CHECK(report.totals.problems == options.threads * ((width + 999) / 1000));
+        REQUIRE(!report.problems.empty());
+        CHECK(report.problems[0].find(": bad") != std::string::npos);
+    }
+}    // namespace
+}    // namespace securefs
@@ -2,16 +2,23 @@
 #include <doctest/doctest.h>
 
 #include "crypto.h"
+#include "exceptions.h"
+#include "fsync_batcher.h"
 #include "lite_stream.h"
 #include "logger.h"
 #include "myutils.h"
 #include "platform.h"
+#include "readahead.h"
 #include "streams.h"
 #include "test_common.h"
+#include "thread_pool.h"
+#include "write_behind.h"
 
 #include <algorithm>
+#include <atomic>
 #include <random>
 #include <string.h>
+#include <thread>
 #include <vector>
 
 using securefs::OSService;
@@ -320,3 +327,236 @@ TEST_CASE("Test streams")
         REQUIRE(memcmp(ciphertext, second_ciphertext, sizeof(ciphertext)) == 0);
     }
 }
+
+TEST_CASE("Read-ahead buffer")
+{
+    securefs::key_type key(0x3c);
+    auto filename = OSService::temp_name("tmp/", ".readahead");
+    std::shared_ptr<securefs::FileStream> file_stream
+        = OSService::get_default().open_file_stream(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+    auto open_lite = [&]()
+    { return std::make_unique<securefs::lite::AESGCMCryptStream>(file_stream, key, 512, 12, true); };
+    auto lite_stream = open_lite();
+
+    std::vector<byte> data(100000);
+    securefs::generate_random(data.data(), data.size());
+    lite_stream->write(data.data(), 0, data.size());
+    lite_stream->flush();
+
+    securefs::ThreadPool pool(2);
+    auto write_generation = std::make_shared<securefs::ReadAheadBuffer::WriteGeneration>(0);
+    auto readahead = std::make_shared<securefs::ReadAheadBuffer>(
+        pool,
+        file_stream,
+        [&]() -> std::unique_ptr<securefs::StreamBase> { return open_lite(); },
+        securefs::ReadAheadBuffer::Geometry{lite_stream->get_block_size(),
+                                            lite_stream->get_underlying_block_size(),
+                                            lite_stream->get_header_size()},
+        8,
+        write_generation);
+
+    auto read_through = [&](securefs::offset_type off, securefs::length_type len)
+    {
+        std::vector<byte> out(len);
+        bool reached_eof = false;
+        auto n = readahead->serve(out.data(), off, len, &reached_eof);
+        if (n < len && !reached_eof)
+        {
+            n += lite_stream->read(out.data() + n, off + n, len - n);
+        }
+        readahead->record_read(off, n, len);
+        out.resize(n);
+        return out;
+    };
+    auto check_sequential = [&](securefs::length_type chunk)
+    {
+        CAPTURE(chunk);
+        for (securefs::offset_type off = 0; off < data.size() + chunk; off += chunk)
+        {
+            CAPTURE(off);
+            auto out = read_through(off, chunk);
+            auto expected_size = off >= data.size() ? 0 : std::min<size_t>(chunk, data.size() - off);
+            REQUIRE(out.size() == expected_size);
+            REQUIRE(std::equal(out.begin(), out.end(), data.begin() + std::min<size_t>(off, data.size())));
+        }
+    };
+
+    check_sequential(777);
+    check_sequential(4096);
+
+    // Modifications must not leave stale plaintext behind.
+    securefs::generate_random(data.data(), 30000);
+    lite_stream->write(data.data(), 0, 30000);
+    readahead->invalidate();
+    check_sequential(1000);
+
+    data.resize(5000);
+    lite_stream->resize(data.size());
+    readahead->invalidate();
+    check_sequential(333);
+
+    // An overwrite of the same size through another stream is only announced by the counter.
+    read_through(0, 1000);
+    read_through(1000, 1000);
+    read_through(2000, 1000);
+    securefs::generate_random(data.data(), data.size());
+    open_lite()->write(data.data(), 0, data.size());
+    write_generation->fetch_add(1);
+    auto out = read_through(3000, 1000);
+    REQUIRE(std::equal(out.begin(), out.end(), data.begin() + 3000));
+    check_sequential(500);
+}
+
+TEST_CASE("Write-behind buffer")
+{
+    auto& mt = get_random_number_engine();
+    std::uniform_int_distribution<unsigned> offset_dist(0, 100000), length_dist(0, 5000);
+    std::vector<byte> data(5000);
+    securefs::generate_random(data.data(), data.size());
+
+    securefs::MemoryStream expected, actual;
+    securefs::ThreadPool pool(2);
+    auto write_behind = std::make_shared<securefs::WriteBehindBuffer>(
+        pool,
+        [&](const securefs::WriteBehindBuffer::Extents& extents)
+        {
+            for (const auto& [offset, bytes] : extents)
+            {
+                actual.write(bytes.data(), offset, bytes.size());
+            }
+        },
+        20000);
+
+    for (int i = 0; i < 2000; ++i)
+    {
+        auto offset = offset_dist(mt);
+        auto length = length_dist(mt);
+        write_behind->enqueue(data.data(), offset, length);
+        expected.write(data.data(), offset, length);
+        if (i % 100 == 0)
+        {
+            write_behind->sync();
+            REQUIRE(actual.as_string() == expected.as_string());
+        }
+    }
+    write_behind->sync();
+    REQUIRE(actual.as_string() == expected.as_string());
+
+    // Errors are deferred to the barrier.
+    auto failing = std::make_shared<securefs::WriteBehindBuffer>(
+        pool,
+        [](const securefs::WriteBehindBuffer::Extents&) { securefs::throwVFSException(ENOSPC); },
+        20000);
+    failing->enqueue(data.data(), 0, 100);
+    REQUIRE_THROWS_AS(failing->sync(), securefs::VFSException);
+    failing->sync();
+}
+
+TEST_CASE("Fsync batcher")
+{
+    std::vector<std::shared_ptr<securefs::testing::SyncCountingStream>> streams;
+    for (int i = 0; i < 8; ++i)
+    {
+        streams.push_back(std::make_shared<securefs::testing::SyncCountingStream>(
+            OSService::get_default().open_file_stream(
+                OSService::temp_name("tmp/", ".fsync"), O_RDWR | O_CREAT | O_EXCL, 0644)));
+        streams.back()->write("hello", 0, 5);
+    }
+    auto stream_syncs = [&]()
+    {
+        int total = 0;
+        for (const auto& s : streams)
+        {
+            total += s->syncs();
+        }
+        return total;
+    };
+
+    constexpr int kRequests = 40;
+    std::atomic<int> filesystem_syncs{0}, failures{0};
+    auto run = [&](securefs::FsyncBatcher& batcher)
+    {
+        std::vector<std::thread> threads;
+        for (int i = 0; i < kRequests; ++i)
+        {
+            threads.emplace_back(
+                [&, i]()
+                {
+                    // Several requests for the same stream may end up in one batch.
+                    securefs::FileStream* s[] = {streams[i % streams.size()].get()};
+                    try
+                    {
+                        batcher.sync(s, i % 2 == 0);
+                    }
+                    catch (const securefs::ExceptionBase& e)
+                    {
+                        CHECK(e.error_number() == EIO);
+                        CHECK(i % streams.size() == 0);
+                        ++failures;
+                    }
+                });
+        }
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    };
+
+    // The window is long enough for all the requests to queue up behind the first leader.
+    securefs::FsyncBatcher unsupported(absl::Milliseconds(200),
+                                       [&]()
+                                       {
+                                           ++filesystem_syncs;
+                                           return false;
+                                       });
+    run(unsupported);
+    CHECK(filesystem_syncs > 0);
+    CHECK(filesystem_syncs < kRequests);
+    // Without a filesystem wide flush, each batch falls back to flushing every stream once.
+    CHECK(stream_syncs() >= static_cast<int>(streams.size()));
+    CHECK(stream_syncs() < kRequests);
+    CHECK(failures == 0);
+
+    // A failing filesystem wide flush also falls back to the streams, so that the errors reach
+    // exactly the requests for the failing ones.
+    filesystem_syncs = 0;
+    streams[0]->sync_error = EIO;
+    securefs::FsyncBatcher failing(absl::Milliseconds(200),
+                                   [&]() -> bool
+                                   {
+                                       ++filesystem_syncs;
+                                       securefs::throwVFSException(EIO);
+                                   });
+    run(failing);
+    CHECK(filesystem_syncs > 0);
+    CHECK(failures == kRequests / static_cast<int>(streams.size()));
+    streams[0]->sync_error = 0;
+
+    // A successful filesystem wide flush may not report the writeback error of one file, which
+    // the per file flushes that follow still do.
+    failures = 0;
+    filesystem_syncs = 0;
+    streams[0]->sync_error = EIO;
+    securefs::FsyncBatcher supported(absl::Milliseconds(200),
+                                     [&]()
+                                     {
+                                         ++filesystem_syncs;
+                                         return true;
+                                     });
+    run(supported);
+    CHECK(filesystem_syncs > 0);
+    CHECK(failures == kRequests / static_cast<int>(streams.size()));
+    streams[0]->sync_error = 0;
+
+    failures = 0;
+    securefs::FsyncBatcher plain(absl::ZeroDuration());
+    run(plain);
+    CHECK(failures == 0);
+
+    for (auto& s : streams)
+    {
+        char buffer[5];
+        CHECK(s->read(buffer, 0, 5) == 5);
+        CHECK(memcmp(buffer, "hello", 5) == 0);
+    }
+}
@@ -1,10 +1,16 @@
+#include "attr_cache.h"
 #include "crypto.h"
 #include "myutils.h"
+#include "mystring.h"
 #include "platform.h"
+#include "thread_pool.h"
 #include <doctest/doctest.h>
 
 #include <cryptopp/base32.h>
 
+#include <map>
+#include <string>
+
 TEST_CASE("Test endian")
 {
     using namespace securefs;
@@ -88,6 +94,62 @@ TEST_CASE("our base32 against CryptoPP")
     }
 }
 
+TEST_CASE("base32 kernels against the reference")
+{
+    using securefs::internal::Base32Kernel;
+
+    std::string input, expected, expected_decoded, output, decoded;
+    for (size_t i = 0; i < 200; ++i)
+    {
+        input.resize(i);
+        securefs::generate_random((byte*)input.data(), i);
+        securefs::internal::base32_encode(
+            Base32Kernel::kReference, (const byte*)input.data(), i, expected);
+        // Decoding accepts either case, and sometimes garbage in the trailing bits.
+        std::string mixed = expected;
+        for (size_t j = 0; j < mixed.size(); j += 3)
+        {
+            if (mixed[j] >= 'A' && mixed[j] <= 'Z')
+            {
+                mixed[j] += 'a' - 'A';
+            }
+        }
+        if (!mixed.empty() && i % 5 != 0)
+        {
+            mixed.back() = '9';
+        }
+        securefs::internal::base32_decode(
+            Base32Kernel::kReference, mixed.data(), mixed.size(), expected_decoded);
+
+        for (Base32Kernel kernel :
+             {Base32Kernel::kScalar, Base32Kernel::kSsse3, Base32Kernel::kAvx2})
+        {
+            if (!securefs::internal::is_base32_kernel_supported(kernel))
+            {
+                continue;
+            }
+            CAPTURE(securefs::internal::stringify(kernel));
+            CAPTURE(i);
+            securefs::internal::base32_encode(kernel, (const byte*)input.data(), i, output);
+            CHECK(output == expected);
+            securefs::internal::base32_decode(kernel, mixed.data(), mixed.size(), decoded);
+            CHECK(decoded == expected_decoded);
+
+            for (char invalid : {'L', 'o', '0', '1', '=', '\0', '\x80'})
+            {
+                if (mixed.empty())
+                {
+                    break;
+                }
+                std::string corrupted = mixed;
+                corrupted[i * 7 % corrupted.size()] = invalid;
+                CHECK_THROWS(securefs::internal::base32_decode(
+                    kernel, corrupted.data(), corrupted.size(), decoded));
+            }
+        }
+    }
+}
+
 TEST_CASE("is_ascii")
 {
     REQUIRE(securefs::is_ascii(""));
@@ -100,3 +162,90 @@ TEST_CASE("is_ascii")
     REQUIRE(!securefs::is_ascii("\x41\xcc\x88\x66\x66\x69\x6e"));
     REQUIRE(!securefs::is_ascii("\x80"));
 }
+
+TEST_CASE("Directory traverser with full attributes")
+{
+    using securefs::OSService;
+    auto dir = OSService::temp_name("tmp/traverse", "dir");
+    OSService::get_default().ensure_directory(dir, 0755);
+    std::map<std::string, size_t> expected_sizes;
+    for (size_t i = 0; i < 300; ++i)
+    {
+        auto name = std::to_string(i);
+        auto stream = OSService::get_default().open_file_stream(
+            OSService::concat_and_norm_narrowed(dir, name), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        std::string content(i * 7, 'x');
+        stream->write(content.data(), 0, content.size());
+        expected_sizes.emplace(name, content.size());
+    }
+
+    securefs::ThreadPool pool(3);
+    for (securefs::ThreadPool* p : {static_cast<securefs::ThreadPool*>(nullptr), &pool})
+    {
+        auto traverser = OSService::get_default().create_traverser(dir, true, p);
+        std::map<std::string, size_t> actual_sizes;
+        std::string name;
+        fuse_stat st;
+        while (traverser->next(&name, &st))
+        {
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+            CHECK((st.st_mode & S_IFMT) == S_IFREG);
+            actual_sizes.emplace(name, st.st_size);
+        }
+        CHECK(actual_sizes == expected_sizes);
+    }
+}
+
+TEST_CASE("Attribute cache invalidation")
+{
+    securefs::AttrCache cache(absl::Seconds(60));
+    auto make_stat = [](uint64_t ino, fuse_mode_t mode)
+    {
+        fuse_stat st{};
+        st.st_ino = ino;
+        st.st_mode = mode;
+        st.st_nlink = 1;
+        return st;
+    };
+    auto fill = [&](const char* key, uint64_t ino, fuse_mode_t mode = S_IFREG | 0644)
+    { cache.fill(cache.begin_fill(), key, make_stat(ino, mode)); };
+
+    fuse_stat st;
+    fill("/dir", 1, S_IFDIR | 0755);
+    fill("/dir/a", 2);
+    fill("/dir/sub/b", 3);
+    fill("/dirx", 4);
+    REQUIRE(cache.lookup("/dir/a", &st));
+    CHECK(st.st_ino == 2);
+
+    cache.invalidate_ino(2);
+    CHECK(!cache.lookup("/dir/a", &st));
+    CHECK(cache.lookup("/dir", &st));
+
+    cache.invalidate_descendants("/dir");
+    CHECK(cache.lookup("/dir", &st));
+    CHECK(!cache.lookup("/dir/sub/b", &st));
+    CHECK(cache.lookup("/dirx", &st));
+
+    // A fill racing with an invalidation is discarded.
+    auto ticket = cache.begin_fill();
+    cache.invalidate("/unrelated");
+    cache.fill(ticket, "/dir/a", make_stat(2, S_IFREG | 0644));
+    CHECK(!cache.lookup("/dir/a", &st));
+
+    // Hard links are never cached.
+    auto linked = make_stat(5, S_IFREG | 0644);
+    linked.st_nlink = 2;
+    cache.fill(cache.begin_fill(), "/link", linked);
+    CHECK(!cache.lookup("/link", &st));
+
+    cache.clear();
+    CHECK(!cache.lookup("/dir", &st));
+
+    securefs::AttrCache disabled(absl::ZeroDuration());
+    disabled.fill(disabled.begin_fill(), "/dir", make_stat(1, S_IFDIR | 0755));
+    CHECK(!disabled.lookup("/dir", &st));
+}